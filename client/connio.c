@@ -34,13 +34,17 @@
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <openssl/buffer.h>
@@ -56,15 +60,39 @@ WSADATA ws;
 					(((x)&0xff00)<<8)|(((x)&0xff)<<24))
 #define htonl	ntohl
 #define close	closesocket
+#define WOULDBLOCK()	(WSAGetLastError() == WSAEWOULDBLOCK)
 #else
 typedef int SOCKET;
+#define WOULDBLOCK()	(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL	0
 #endif
 
 
 /* Maximum size we allow for a cert chain */
 #define CHAINSIZE	20000
 
-static unsigned char bigbuf[CHAINSIZE];
+/*
+ * Version 2 connection to the server.  See commands.h for the framing.
+ * One is kept open between exchanges; a thread that finds it in use
+ * makes its own for the exchange.
+ */
+struct v2conn {
+	SOCKET				s;
+	char				target[256];
+	int					port;
+	unsigned long		reqid;
+};
+
+static struct v2conn	v2shared = { -1 };
+#if !defined(_WIN32)
+static pthread_mutex_t	v2lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Server knows only the old format; only ever set, so needs no lock */
+static int				v2refused;
 
 /*
  * sha1sum's of the seg 1 ("miniboot", analogous to the bios),
@@ -109,8 +137,21 @@ struct okhash seg3okhash = {1,
 
 
 static int nrecv (int fd, void *buf, unsigned count);
+static int nsend (int fd, void *buf, unsigned count);
+static int v1exchange (unsigned char cmd, unsigned char *req,
+	unsigned long reqlen, unsigned char **reply, unsigned long *replylen,
+	char *target, int port);
+static int v2exchange (struct v2conn *vc, unsigned char cmd, unsigned char **reqs,
+	unsigned long *reqlens, int nreq, int *stats, unsigned char **replies,
+	unsigned long *replylens, char *target, int port);
+static struct v2conn *v2take (struct v2conn *own);
+static void v2give (struct v2conn *vc);
+static void v2close (struct v2conn *vc);
+static int v2recv (SOCKET s, unsigned long *reqid, unsigned *status,
+	unsigned char **reply, unsigned long *replylen);
 static void dumpbuf (FILE *f, unsigned char *buf, int len, int printoff, int breaklines);
 static int doconnect (char *target, int port);
+static RSA *commrsa (void);
 
 
 /*
@@ -136,6 +177,7 @@ getkeys (char *target, int port, int firsttime)
 	RSA					*commkey;
 	RSA					*signkey;
 	pubkey				key;
+	unsigned char		bigbuf[CHAINSIZE];
 	int					i;
 
 	printf ("Retrieving certificate chain from server...\n");
@@ -253,6 +295,9 @@ getkeys (char *target, int port, int firsttime)
 	if (firsttime)
 		unlink (rpowfile);
 
+	/* Pooled stamps name the old card */
+	unlink (poolfile);
+
 	return 0;
 }
 
@@ -286,6 +331,7 @@ getstat (char *target, int port, FILE *fout)
 	int					npkeys;
 	unsigned			off;
 	char				pbuf[128];
+	unsigned char		bigbuf[CHAINSIZE];
 	int					i;
 
 	printf ("Querying server card status...\n");
@@ -301,7 +347,7 @@ getstat (char *target, int port, FILE *fout)
 	gbig_free (&key.n);
 	gbig_free (&key.e);
 	
-	/* Returns a static buffer */
+	/* Returns a buffer in encdata */
 	if ((rc = encryptmaster (&encdata, rsa, &encbuf1, &encbuf1len)) < 0)
 	{
 		printf ("encryptmaster failed, code %d\n", rc);
@@ -497,9 +543,28 @@ getstat (char *target, int port, FILE *fout)
  */
 int
 comm4758 (BIO *bio, char *target, int port, pubkey *signkey)
+{
+	int					stat;
+
+	return comm4758multi (&bio, &stat, 1, target, port, signkey);
+}
+
+/*
+ * As comm4758, but for several BIOs at once.  Using version 2 framing
+ * we send all the requests down one connection, which we keep open for
+ * next time, and then collect the replies.  If the server only knows
+ * the original format we fall back to a connection per request.
+ *
+ * stats[i] is set to 0 on success, to the server's error status, or
+ * to -1 if we could not talk to the server.  Returns the first nonzero
+ * stats[i], or 0 if all succeeded.
+ */
+int
+comm4758multi (BIO **bios, int *stats, int nbio, char *target, int port,
+	pubkey *signkey)
 {
 	long				rc;
-	struct encstate		encdata;
+	struct encstate		*encdata;
 	unsigned char		*msgbuf;
 	long				msgbuflen;
 	unsigned char		*decbuf;
@@ -508,95 +573,727 @@ comm4758 (BIO *bio, char *target, int port, pubkey *signkey)
 	unsigned long		encbuf1len;
 	unsigned char		*encbuf2;
 	unsigned long		encbuf2len;
-	unsigned long		replybuflen;
-    int					s;
-	unsigned char		cmd;
-	unsigned short		cmdbuflen;
-	unsigned char		*cmdbuf;
-	RSA					*rsa = RSA_new();
-	pubkey				key;
-	unsigned			status;
+	unsigned char		**reqs;
+	unsigned long		*reqlens;
+	unsigned char		**replies;
+	unsigned long		*replylens;
+	struct v2conn		v2own;
+	struct v2conn		*vc;
+	RSA					*rsa = commrsa ();
+	int					ret = 0;
+	int					i;
 
-	pubkey_read (&key, commfile);
-	rsa->n = BN_new();
-	rsa->e = BN_new();
-	BN_copy (rsa->n, &key.n);
-	BN_copy (rsa->e, &key.e);
-	gbig_free (&key.n);
-	gbig_free (&key.e);
-	
-	msgbuflen = BIO_get_mem_data (bio, &msgbuf);
-	if (msgbuflen <= 0)
+	encdata = calloc (nbio, sizeof(struct encstate));
+	reqs = calloc (nbio, sizeof(unsigned char *));
+	reqlens = calloc (nbio, sizeof(unsigned long));
+	replies = calloc (nbio, sizeof(unsigned char *));
+	replylens = calloc (nbio, sizeof(unsigned long));
+	if (!encdata || !reqs || !reqlens || !replies || !replylens)
 	{
-		fprintf (stderr, "No data to pass to remote server\n");
+		fprintf (stderr, "Out of memory\n");
 		exit (1);
 	}
 
-	/* Returns a static buffer */
-	if ((rc = encryptmaster (&encdata, rsa, &encbuf1, &encbuf1len)) < 0)
+	/* Each request is the card ID, session key, and encrypted message */
+	for (i=0; i<nbio; i++)
 	{
-		printf ("encryptmaster failed, code %d\n", rc);
-		exit (1);
+		msgbuflen = BIO_get_mem_data (bios[i], &msgbuf);
+		if (msgbuflen <= 0)
+		{
+			fprintf (stderr, "No data to pass to remote server\n");
+			exit (1);
+		}
+
+		/* Returns a buffer in encdata */
+		if ((rc = encryptmaster (&encdata[i], rsa, &encbuf1, &encbuf1len)) < 0)
+		{
+			printf ("encryptmaster failed, code %d\n", rc);
+			exit (1);
+		}
+
+		/* Returns a malloc buffer */
+		if ((rc = encryptoutput (&encdata[i], msgbuf, msgbuflen,
+							&encbuf2, &encbuf2len)) < 0)
+		{
+			printf ("encryptoutput failed, code %d\n", rc);
+			exit (1);
+		}
+
+		reqlens[i] = CARDID_LENGTH + encbuf1len + encbuf2len;
+		if ((reqs[i] = malloc (reqlens[i])) == NULL)
+		{
+			fprintf (stderr, "Out of memory\n");
+			exit (1);
+		}
+		memcpy (reqs[i], signkey->cardid, CARDID_LENGTH);
+		memcpy (reqs[i]+CARDID_LENGTH, encbuf1, encbuf1len);
+		memcpy (reqs[i]+CARDID_LENGTH+encbuf1len, encbuf2, encbuf2len);
+		free (encbuf2);
 	}
-	
-	/* Returns a malloc buffer */
-	if ((rc = encryptoutput (&encdata, msgbuf, msgbuflen,
-						&encbuf2, &encbuf2len)) < 0)
+	RSA_free (rsa);
+
+	rc = 1;
+	if (!v2refused)
 	{
-		printf ("encryptoutput failed, code %d\n", rc);
-		exit (1);
+		vc = v2take (&v2own);
+		rc = v2exchange (vc, CMD_SIGN, reqs, reqlens, nbio, stats,
+							replies, replylens, target, port);
+		v2give (vc);
+	}
+	if (rc > 0)
+	{
+		for (i=0; i<nbio; i++)
+			stats[i] = v1exchange (CMD_SIGN, reqs[i], reqlens[i],
+							&replies[i], &replylens[i], target, port);
 	}
 
-	if ((s = doconnect (target, port)) < 0)
-		return s;
-	cmd = CMD_SIGN;
-	cmdbuflen = htons (CARDID_LENGTH + encbuf1len + encbuf2len);
-	if (send (s, &cmd, 1, 0) != 1
-		|| send (s, &cmdbuflen, 2, 0) != 2)
+	for (i=0; i<nbio; i++)
 	{
-		perror ("send");
+		if (stats[i] < 0 && ret == 0)
+			fprintf (stderr, "Error, remote host closed connection\n");
+		else if (stats[i] > 0)
+			fprintf (stderr, "Server reports error %d, key update may be necessary...\n",
+					stats[i]);
+		else if (stats[i] == 0)
+		{
+			/* Returns a malloc buffer */
+			if ((rc = decryptinput (&decbuf, &decbuflen, &encdata[i],
+						replies[i], replylens[i])) < 0)
+			{
+				printf ("Error, decryption of card message failed, code %d\n", rc);
+				stats[i] = -1;
+			} else {
+				BIO_reset (bios[i]);
+				BIO_write (bios[i], decbuf, decbuflen);
+				free (decbuf);
+			}
+		}
+		if (ret == 0)
+			ret = stats[i];
+		free (reqs[i]);
+		free (replies[i]);
+	}
+
+	memset (encdata, 0, nbio * sizeof(struct encstate));
+	free (encdata);
+	free (reqs);
+	free (reqlens);
+	free (replies);
+	free (replylens);
+	return ret;
+}
+
+/* Close our version 2 connection to the server, if open */
+void
+comm4758close ()
+{
+#if !defined(_WIN32)
+	pthread_mutex_lock (&v2lock);
+#endif
+	v2close (&v2shared);
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&v2lock);
+#endif
+}
+
+/*
+ * Asynchronous requests to the card.  comm4758async_send encrypts a
+ * request and queues it on a non-blocking version 2 connection of its
+ * own, and comm4758async_poll moves bytes both ways and calls each
+ * request's done function as its reply comes in.  send also polls,
+ * without waiting, so the RSA work for one request overlaps the wait
+ * for the replies to the ones before it.  If the server only knows the
+ * original format, queued requests are done one at a time when polled.
+ *
+ * done gets the request's BIO, holding the reply if stat is 0, and the
+ * status as comm4758multi gives it in stats[].  It may send more.
+ */
+struct asyncreq {
+	struct asyncreq		*next;
+	unsigned long		id;
+	struct encstate		encdata;
+	BIO					*bio;
+	unsigned char		*req;		/* Kept for the original format */
+	unsigned long		reqlen;
+	comm4758done		*done;
+	void				*arg;
+};
+
+struct commasync {
+	SOCKET				s;
+	RSA					*rsa;
+	unsigned char		cardid[CARDID_LENGTH];
+	char				target[256];
+	int					port;
+	unsigned long		reqid;		/* Last request id used */
+	int					nreplies;	/* Replies on this connection */
+	int					busy;		/* In comm4758async_poll */
+	unsigned char		*obuf;		/* Framed requests not yet sent */
+	unsigned long		olen, ooff, osize;
+	unsigned char		*ibuf;		/* Reply bytes not yet handled */
+	unsigned long		ilen, isize;
+	struct asyncreq		*reqs;		/* Oldest first */
+	int					nreqs;
+};
+
+commasync *
+comm4758async_open (char *target, int port, pubkey *signkey)
+{
+	commasync			*ca;
+
+	if (strlen (target) >= sizeof(ca->target)
+			|| (ca = calloc (1, sizeof(commasync))) == NULL)
+		return NULL;
+	ca->s = -1;
+	ca->rsa = commrsa ();
+	memcpy (ca->cardid, signkey->cardid, CARDID_LENGTH);
+	strcpy (ca->target, target);
+	ca->port = port;
+	return ca;
+}
+
+/* Take a request off the list, decrypt its reply and tell the caller */
+static void
+asyncfinish (commasync *ca, struct asyncreq *r, int stat,
+	unsigned char *reply, unsigned long replylen)
+{
+	struct asyncreq		**pr;
+	unsigned char		*decbuf;
+	unsigned long		decbuflen;
+	long				rc;
+
+	for (pr=&ca->reqs; *pr!=r; pr=&(*pr)->next)
+		;
+	*pr = r->next;
+	--ca->nreqs;
+
+	if (stat < 0)
+		fprintf (stderr, "Error, remote host closed connection\n");
+	else if (stat > 0)
+		fprintf (stderr, "Server reports error %d, key update may be necessary...\n",
+				stat);
+	else if ((rc = decryptinput (&decbuf, &decbuflen, &r->encdata,
+					reply, replylen)) < 0)
+	{
+		printf ("Error, decryption of card message failed, code %ld\n", rc);
+		stat = -1;
+	} else {
+		BIO_reset (r->bio);
+		BIO_write (r->bio, decbuf, decbuflen);
+		free (decbuf);
+	}
+
+	r->done (r->arg, r->bio, stat);
+	memset (&r->encdata, 0, sizeof(r->encdata));
+	free (r->req);
+	free (r);
+}
+
+/*
+ * The connection failed.  If the server never answered on it, it only
+ * knows the original format and the queued requests go that way;
+ * otherwise we can't tell what it did with them, so they fail.
+ */
+static void
+asyncfail (commasync *ca)
+{
+	close (ca->s);
+	ca->s = -1;
+	ca->olen = ca->ooff = ca->ilen = 0;
+	if (ca->nreplies == 0)
+		v2refused = 1;
+	else while (ca->reqs)
+		asyncfinish (ca, ca->reqs, -1, NULL, 0);
+	ca->nreplies = 0;
+}
+
+/* Handle the complete replies in ibuf; returns -1 on a bad one */
+static int
+asyncreplies (commasync *ca)
+{
+	unsigned char		*hdr;
+	unsigned char		*reply;
+	unsigned long		reqid;
+	unsigned long		replylen;
+	unsigned			status;
+	struct asyncreq		*r;
+
+	while (ca->ilen >= V2_REPLYHDRSIZE)
+	{
+		hdr = ca->ibuf;
+		reqid = ((unsigned long)hdr[0]<<24) | (hdr[1]<<16) | (hdr[2]<<8) | hdr[3];
+		status = ((unsigned)hdr[4]<<24) | (hdr[5]<<16) | (hdr[6]<<8) | hdr[7];
+		replylen = ((unsigned long)hdr[8]<<24) | (hdr[9]<<16)
+						| (hdr[10]<<8) | hdr[11];
+		if (replylen > V2_MAXDATA)
+			return -1;
+		if (ca->ilen < V2_REPLYHDRSIZE + replylen)
+			break;
+		for (r=ca->reqs; r!=NULL; r=r->next)
+			if (r->id == reqid)
+				break;
+		if (r == NULL || (reply = malloc (replylen + 1)) == NULL)
+			return -1;
+
+		/* Take it out of ibuf first, done may send and poll */
+		memcpy (reply, hdr + V2_REPLYHDRSIZE, replylen);
+		ca->ilen -= V2_REPLYHDRSIZE + replylen;
+		memmove (ca->ibuf, ca->ibuf + V2_REPLYHDRSIZE + replylen, ca->ilen);
+		++ca->nreplies;
+		asyncfinish (ca, r, status, reply, replylen);
+		free (reply);
+	}
+	return 0;
+}
+
+static int
+asyncconnect (commasync *ca)
+{
+#if defined(_WIN32)
+	unsigned long		nonblock = 1;
+#endif
+
+	if ((ca->s = doconnect (ca->target, ca->port)) < 0)
+	{
+		ca->s = -1;
 		return -1;
 	}
+#if defined(_WIN32)
+	ioctlsocket (ca->s, FIONBIO, &nonblock);
+#else
+	fcntl (ca->s, F_SETFL, fcntl (ca->s, F_GETFL) | O_NONBLOCK);
+#endif
+	ca->nreplies = 0;
+	return 0;
+}
+
+int
+comm4758async_send (commasync *ca, BIO *bio, comm4758done *done, void *arg)
+{
+	struct asyncreq		*r, **pr;
+	unsigned char		*msgbuf;
+	long				msgbuflen;
+	unsigned char		*encbuf1;
+	unsigned long		encbuf1len;
+	unsigned char		*encbuf2;
+	unsigned long		encbuf2len;
+	unsigned char		*hdr;
+	long				rc;
 
-	if (send (s, signkey->cardid, CARDID_LENGTH, 0) != CARDID_LENGTH
-		|| send (s, encbuf1, encbuf1len, 0) != encbuf1len
-		|| send (s, encbuf2, encbuf2len, 0) != encbuf2len)
+	msgbuflen = BIO_get_mem_data (bio, &msgbuf);
+	if (msgbuflen <= 0 || (r = calloc (1, sizeof(struct asyncreq))) == NULL)
+		return -1;
+
+	/* Returns a buffer in encdata */
+	if ((rc = encryptmaster (&r->encdata, ca->rsa, &encbuf1, &encbuf1len)) < 0)
 	{
-		perror ("send");
+		printf ("encryptmaster failed, code %ld\n", rc);
+		free (r);
 		return -1;
 	}
+	/* Returns a malloc buffer */
+	if ((rc = encryptoutput (&r->encdata, msgbuf, msgbuflen,
+						&encbuf2, &encbuf2len)) < 0)
+	{
+		printf ("encryptoutput failed, code %ld\n", rc);
+		free (r);
+		return -1;
+	}
+	r->reqlen = CARDID_LENGTH + encbuf1len + encbuf2len;
+	if ((r->req = malloc (r->reqlen)) == NULL)
+	{
+		free (encbuf2);
+		free (r);
+		return -1;
+	}
+	memcpy (r->req, ca->cardid, CARDID_LENGTH);
+	memcpy (r->req+CARDID_LENGTH, encbuf1, encbuf1len);
+	memcpy (r->req+CARDID_LENGTH+encbuf1len, encbuf2, encbuf2len);
 	free (encbuf2);
+	r->id = ++ca->reqid;
+	r->bio = bio;
+	r->done = done;
+	r->arg = arg;
 
-	if ((replybuflen = nrecv (s, bigbuf, sizeof(bigbuf))) <= 0)
+	if (!v2refused)
 	{
-		fprintf (stderr, "Error, remote host closed connection\n");
+		if (ca->s < 0 && asyncconnect (ca) < 0)
+		{
+			free (r->req);
+			free (r);
+			return -1;
+		}
+		if (ca->olen + V2_REQHDRSIZE + r->reqlen > ca->osize)
+		{
+			ca->osize = 2 * (ca->olen + V2_REQHDRSIZE + r->reqlen);
+			ca->obuf = realloc (ca->obuf, ca->osize);
+		}
+		hdr = ca->obuf + ca->olen;
+		hdr[0] = V2_FRAME;
+		hdr[1] = CMD_SIGN;
+		hdr[2] = hdr[3] = 0;
+		hdr[4] = r->id >> 24;
+		hdr[5] = r->id >> 16;
+		hdr[6] = r->id >> 8;
+		hdr[7] = r->id;
+		hdr[8] = r->reqlen >> 24;
+		hdr[9] = r->reqlen >> 16;
+		hdr[10] = r->reqlen >> 8;
+		hdr[11] = r->reqlen;
+		memcpy (hdr + V2_REQHDRSIZE, r->req, r->reqlen);
+		ca->olen += V2_REQHDRSIZE + r->reqlen;
+	}
+
+	for (pr=&ca->reqs; *pr!=NULL; pr=&(*pr)->next)
+		;
+	*pr = r;
+	++ca->nreqs;
+
+	if (!ca->busy)
+		comm4758async_poll (ca, 0);
+	return 0;
+}
+
+/*
+ * Send and receive what we can, waiting up to msecs for the first of it,
+ * or indefinitely if msecs is negative.  Returns how many requests are
+ * still waiting for replies.
+ */
+int
+comm4758async_poll (commasync *ca, int msecs)
+{
+	fd_set				rfds, wfds;
+	struct timeval		tv;
+	unsigned char		*reply;
+	unsigned long		replylen;
+	int					n;
+
+	ca->busy = 1;
+	while (ca->nreqs > 0)
+	{
+		if (ca->s < 0)
+		{
+			/* Old server, do the oldest the old way */
+			n = v1exchange (CMD_SIGN, ca->reqs->req, ca->reqs->reqlen,
+							&reply, &replylen, ca->target, ca->port);
+			asyncfinish (ca, ca->reqs, n, reply, replylen);
+			free (reply);
+			msecs = 0;
+			continue;
+		}
+
+		FD_ZERO (&rfds);
+		FD_ZERO (&wfds);
+		FD_SET (ca->s, &rfds);
+		if (ca->ooff < ca->olen)
+			FD_SET (ca->s, &wfds);
+		tv.tv_sec = msecs / 1000;
+		tv.tv_usec = (msecs % 1000) * 1000;
+		n = select (ca->s + 1, &rfds, &wfds, NULL, msecs < 0 ? NULL : &tv);
+		if (n < 0 && WOULDBLOCK())
+			continue;
+		if (n < 0)
+		{
+			asyncfail (ca);
+			continue;
+		}
+		if (n == 0)
+			break;
+		/* After the first wait, just take what is ready */
+		msecs = 0;
+
+		if (FD_ISSET (ca->s, &wfds))
+		{
+			n = send (ca->s, ca->obuf + ca->ooff, ca->olen - ca->ooff,
+					MSG_NOSIGNAL);
+			if (n < 0 && !WOULDBLOCK())
+			{
+				asyncfail (ca);
+				continue;
+			}
+			if (n > 0 && (ca->ooff += n) == ca->olen)
+				ca->ooff = ca->olen = 0;
+		}
+
+		if (FD_ISSET (ca->s, &rfds))
+		{
+			if (ca->isize - ca->ilen < 4096)
+			{
+				ca->isize = 2 * ca->isize + 4096;
+				ca->ibuf = realloc (ca->ibuf, ca->isize);
+			}
+			n = recv (ca->s, ca->ibuf + ca->ilen, ca->isize - ca->ilen, 0);
+			if (n == 0 || (n < 0 && !WOULDBLOCK()))
+			{
+				asyncfail (ca);
+				continue;
+			}
+			if (n > 0)
+			{
+				ca->ilen += n;
+				if (asyncreplies (ca) < 0)
+					asyncfail (ca);
+			}
+		}
+	}
+	ca->busy = 0;
+	return ca->nreqs;
+}
+
+/* Wait for all the requests to finish */
+void
+comm4758async_wait (commasync *ca)
+{
+	while (comm4758async_poll (ca, -1) > 0)
+		;
+}
+
+void
+comm4758async_close (commasync *ca)
+{
+	comm4758async_wait (ca);
+	if (ca->s >= 0)
+		close (ca->s);
+	RSA_free (ca->rsa);
+	free (ca->obuf);
+	free (ca->ibuf);
+	free (ca);
+}
+
+/* The card's communication key, as an RSA key for encryptmaster */
+static RSA *
+commrsa ()
+{
+	RSA					*rsa = RSA_new();
+	pubkey				key;
+
+	pubkey_read (&key, commfile);
+	rsa->n = BN_new();
+	rsa->e = BN_new();
+	BN_copy (rsa->n, &key.n);
+	BN_copy (rsa->e, &key.e);
+	gbig_free (&key.n);
+	gbig_free (&key.e);
+	return rsa;
+}
+
+/*
+ * Send a request in the original format on its own connection and
+ * read the reply.  Returns the server's status, or -1 on failure.
+ */
+static int
+v1exchange (unsigned char cmd, unsigned char *req, unsigned long reqlen,
+	unsigned char **reply, unsigned long *replylen, char *target, int port)
+{
+	SOCKET				s;
+	unsigned short		cmdbuflen;
+	unsigned			status;
+	unsigned char		bigbuf[CHAINSIZE];
+	int					nr;
+
+	*reply = NULL;
+	*replylen = 0;
+	if (reqlen > 0xffff)
+		return -1;
+	if ((s = doconnect (target, port)) < 0)
+		return -1;
+	cmdbuflen = htons ((unsigned short)reqlen);
+	if (send (s, &cmd, 1, 0) != 1
+		|| send (s, &cmdbuflen, 2, 0) != 2
+		|| nsend (s, req, reqlen) != reqlen)
+	{
+		perror ("send");
+		close (s);
 		return -1;
 	}
+
+	nr = nrecv (s, bigbuf, sizeof(bigbuf));
 	close (s);
+	if (nr < sizeof(status))
+		return -1;
 
 	status = *(unsigned *)bigbuf;
 	status = htonl (status);
 	if (status != 0)
-	{
-		fprintf (stderr, "Server reports error %d, key update may be necessary...\n",
-				status);
 		return status;
-	}
+	*replylen = nr - sizeof(status);
+	if ((*reply = malloc (*replylen + 1)) == NULL)
+		return -1;
+	memcpy (*reply, bigbuf+sizeof(status), *replylen);
+	return 0;
+}
 
-	/* Returns a malloc buffer */
-	if ((rc = decryptinput (&decbuf, &decbuflen, &encdata,
-								bigbuf+sizeof(unsigned),
-								replybuflen-sizeof(unsigned))) < 0)
+/*
+ * Take the shared version 2 connection if no other thread has it,
+ * else set up own to be a connection of our own for this exchange.
+ */
+static struct v2conn *
+v2take (struct v2conn *own)
+{
+#if !defined(_WIN32)
+	if (pthread_mutex_trylock (&v2lock) != 0)
 	{
-		printf ("Error, decryption of card message failed, code %d\n", rc);
-		return -1;
+		own->s = -1;
+		own->reqid = 0;
+		return own;
 	}
+#endif
+	return &v2shared;
+}
 
-	BIO_reset (bio);
-	BIO_write (bio, decbuf, decbuflen);
+/* Give back a connection from v2take */
+static void
+v2give (struct v2conn *vc)
+{
+	if (vc != &v2shared)
+		v2close (vc);
+#if !defined(_WIN32)
+	else
+		pthread_mutex_unlock (&v2lock);
+#endif
+}
 
-	free (decbuf);
+static void
+v2close (struct v2conn *vc)
+{
+	if (vc->s >= 0)
+		close (vc->s);
+	vc->s = -1;
+}
+
+/*
+ * Send requests with version 2 framing down vc, opening it if
+ * necessary, and collect the replies.  Fills in stats[]
+ * and replies[] as for comm4758multi.  Returns 0 if we got all the
+ * replies, -1 on failure, or 1 if the server does not understand
+ * version 2 and the caller should use the original format.
+ */
+static int
+v2exchange (struct v2conn *vc, unsigned char cmd, unsigned char **reqs, unsigned long *reqlens,
+	int nreq, int *stats, unsigned char **replies, unsigned long *replylens,
+	char *target, int port)
+{
+	unsigned char		hdr[V2_REQHDRSIZE];
+	unsigned long		*ids;
+	unsigned long		reqid;
+	unsigned			status;
+	unsigned char		*reply;
+	unsigned long		replylen;
+	int					fresh;
+	int					got;
+	int					tries;
+	int					i;
+
+	for (i=0; i<nreq; i++)
+		stats[i] = -1;
+	if ((ids = malloc (nreq * sizeof(unsigned long))) == NULL)
+		return -1;
+
+	for (tries=0; tries<2; tries++)
+	{
+		fresh = (vc->s < 0 || vc->port != port
+					|| strcmp (vc->target, target) != 0);
+		if (fresh)
+		{
+			v2close (vc);
+			if (strlen (target) >= sizeof(vc->target)
+					|| (vc->s = doconnect (target, port)) < 0)
+			{
+				vc->s = -1;
+				break;
+			}
+			strcpy (vc->target, target);
+			vc->port = port;
+		}
 
+		/* Send all the requests before reading any replies */
+		for (i=0; i<nreq; i++)
+		{
+			ids[i] = ++vc->reqid;
+			hdr[0] = V2_FRAME;
+			hdr[1] = cmd;
+			hdr[2] = hdr[3] = 0;
+			hdr[4] = ids[i] >> 24;
+			hdr[5] = ids[i] >> 16;
+			hdr[6] = ids[i] >> 8;
+			hdr[7] = ids[i];
+			hdr[8] = reqlens[i] >> 24;
+			hdr[9] = reqlens[i] >> 16;
+			hdr[10] = reqlens[i] >> 8;
+			hdr[11] = reqlens[i];
+			if (nsend (vc->s, hdr, sizeof(hdr)) != sizeof(hdr)
+				|| nsend (vc->s, reqs[i], reqlens[i]) != reqlens[i])
+				break;
+		}
+
+		/* Replies may come in any order */
+		got = 0;
+		while (i == nreq && got < nreq)
+		{
+			if (v2recv (vc->s, &reqid, &status, &reply, &replylen) < 0)
+				break;
+			for (i=0; i<nreq; i++)
+				if (ids[i] == reqid && stats[i] < 0)
+					break;
+			if (i == nreq)
+			{
+				free (reply);
+				break;
+			}
+			stats[i] = status;
+			replies[i] = reply;
+			replylens[i] = replylen;
+			got++;
+			i = nreq;
+		}
+		if (got == nreq)
+		{
+			free (ids);
+			return 0;
+		}
+		v2close (vc);
+
+		if (got > 0)
+			break;
+
+		/* An old server hangs up on a request it does not recognize */
+		if (fresh)
+		{
+			v2refused = 1;
+			free (ids);
+			return 1;
+		}
+
+		/* Else our saved connection had gone stale; try a new one */
+	}
+	free (ids);
+	return -1;
+}
+
+/* Read a version 2 reply; returns a malloc buffer in *reply */
+static int
+v2recv (SOCKET s, unsigned long *reqid, unsigned *status,
+	unsigned char **reply, unsigned long *replylen)
+{
+	unsigned char		hdr[V2_REPLYHDRSIZE];
+
+	*reply = NULL;
+	if (nrecv (s, hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+	*reqid = ((unsigned long)hdr[0]<<24) | (hdr[1]<<16) | (hdr[2]<<8) | hdr[3];
+	*status = ((unsigned)hdr[4]<<24) | (hdr[5]<<16) | (hdr[6]<<8) | hdr[7];
+	*replylen = ((unsigned long)hdr[8]<<24) | (hdr[9]<<16)
+					| (hdr[10]<<8) | hdr[11];
+	if (*replylen > V2_MAXDATA)
+		return -1;
+	if ((*reply = malloc (*replylen + 1)) == NULL)
+		return -1;
+	if (nrecv (s, *reply, *replylen) != *replylen)
+	{
+		free (*reply);
+		*reply = NULL;
+		return -1;
+	}
 	return 0;
 }
 
@@ -761,3 +1458,20 @@ nrecv (int fd, void *buf, unsigned count)
 	}
 	return nr;
 }
+
+/* Write count bytes to socket, or until error */
+static int
+nsend (int fd, void *buf, unsigned count)
+{
+	unsigned char *cbuf = buf;
+	int err, nw = 0;
+
+	while (nw < count)
+	{
+		err = send (fd, cbuf+nw, count-nw, 0);
+		if (err <= 0)
+			return nw;
+		nw += err;
+	}
+	return nw;
+}
@@ -49,6 +49,7 @@
  * Given an RSA key, create a random master secret, encrypt it using
  * the key, and put it in the output.  Also generate our TDES
  * I/O keys and associated values and return those in encdata.
+ * The output points into encdata, so it lasts as long as that does.
  */
 int
 encryptmaster (struct encstate *encdata, RSA *rsa,
@@ -56,9 +57,9 @@ encryptmaster (struct encstate *encdata, RSA *rsa,
 {
 	unsigned char		masterkeybuf[SHAINTERNALBYTES];
 	unsigned char		mac[SHABYTES];
-	static unsigned char	enckeybuf[RSAKEYBYTES];
 
-	if (RSA_size(rsa) != sizeof(enckeybuf))
+	memset (encdata, 0, sizeof(*encdata));
+	if (RSA_size(rsa) != sizeof(encdata->enckey))
 	{
 		fprintf (stderr, "Key size %d not expected\n", RSA_size(rsa));
 		return -1;
@@ -66,18 +67,17 @@ encryptmaster (struct encstate *encdata, RSA *rsa,
 
 	RAND_bytes (masterkeybuf, sizeof(masterkeybuf));
 
-	if (RSA_public_encrypt (sizeof(masterkeybuf), masterkeybuf, enckeybuf, rsa,
-			RSA_PKCS1_OAEP_PADDING) < 0)
+	if (RSA_public_encrypt (sizeof(masterkeybuf), masterkeybuf,
+			encdata->enckey, rsa, RSA_PKCS1_OAEP_PADDING) < 0)
 	{
 		fprintf (stderr, "RSA encryption failed\n");
 		return -1;
 	}
 
-	*outbuf = enckeybuf;
-	*outbuflen = sizeof(enckeybuf);
+	*outbuf = encdata->enckey;
+	*outbuflen = sizeof(encdata->enckey);
 
 	/* Generate the shared keys */
-	memset (encdata, 0, sizeof(*encdata));
 	HMAC (EVP_sha1(), masterkeybuf, sizeof(masterkeybuf), "EKI1", 4, mac, NULL);
 	memcpy (encdata->tdeskeyin, mac, SHABYTES);
 	HMAC (EVP_sha1(), masterkeybuf, sizeof(masterkeybuf), "EKI2", 4, mac, NULL);
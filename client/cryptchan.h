@@ -48,6 +48,7 @@ struct encstate {
 	unsigned char hmackeyout[SHABYTES];
 	unsigned char seqnoin[SEQNOBYTES];
 	unsigned char seqnoout[SEQNOBYTES];
+	unsigned char enckey[RSAKEYBYTES];	/* Encrypted master secret */
 	int failed;
 };
 
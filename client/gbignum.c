@@ -29,19 +29,109 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+#include <openssl/crypto.h>
 #include "gbignum.h"
 
-BN_CTX *bnctx;
+/*
+ * Scratch context for the bignum macros.  Each thread gets its own so
+ * that the client library can be used from several threads at once.
+ */
+#if !defined(_WIN32)
+static pthread_key_t bnctxkey;
+static pthread_once_t bnctxonce = PTHREAD_ONCE_INIT;
+#else
+static BN_CTX *bnctx;
+#endif
+
+/*
+ * OpenSSL before 1.1 only locks its shared state, such as the random
+ * pool, if the application gives it these callbacks.
+ */
+#if !defined(_WIN32) && OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSLLOCKS	1
+static pthread_mutex_t *ssllocks;
+#endif
 
 BIGNUM gbig_value_zero;
 BIGNUM gbig_value_one;
 BIGNUM gbig_value_two;
 BIGNUM gbig_value_three;
 
+#if !defined(_WIN32)
+static void
+bnctxfree (void *ctx)
+{
+	BN_CTX_free (ctx);
+}
+
+static void
+bnctxinit (void)
+{
+	pthread_key_create (&bnctxkey, bnctxfree);
+}
+#endif
+
+/* Return the calling thread's BN_CTX, creating it on first use */
+BN_CTX *
+gbig_ctx ()
+{
+#if !defined(_WIN32)
+	BN_CTX *ctx;
+
+	pthread_once (&bnctxonce, bnctxinit);
+	if ((ctx = pthread_getspecific (bnctxkey)) == NULL)
+	{
+		ctx = BN_CTX_new();
+		pthread_setspecific (bnctxkey, ctx);
+	}
+	return ctx;
+#else
+	if (bnctx == NULL)
+		bnctx = BN_CTX_new();
+	return bnctx;
+#endif
+}
+
+#ifdef SSLLOCKS
+static void
+ssllock (int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock (&ssllocks[n]);
+	else
+		pthread_mutex_unlock (&ssllocks[n]);
+}
+
+static void
+sslthreadid (CRYPTO_THREADID *id)
+{
+	CRYPTO_THREADID_set_numeric (id, (unsigned long)pthread_self());
+}
+#endif
+
+/* Call once, before any other threads use the library */
 int
 gbig_initialize ()
 {
-	bnctx = BN_CTX_new();
+#ifdef SSLLOCKS
+	int i;
+
+	/* Leave alone any the application has set up itself */
+	if (ssllocks == NULL && CRYPTO_get_locking_callback () == NULL)
+	{
+		ssllocks = malloc (CRYPTO_num_locks () * sizeof(pthread_mutex_t));
+		if (ssllocks == NULL)
+			return -1;
+		for (i=0; i<CRYPTO_num_locks (); i++)
+			pthread_mutex_init (&ssllocks[i], NULL);
+		CRYPTO_THREADID_set_callback (sslthreadid);
+		CRYPTO_set_locking_callback (ssllock);
+	}
+#endif
 	BN_init (&gbig_value_zero);
 	BN_init (&gbig_value_one);
 	BN_init (&gbig_value_two);
@@ -55,12 +145,32 @@ gbig_initialize ()
 int
 gbig_finalize ()
 {
+#if !defined(_WIN32)
+	BN_CTX *ctx;
+
+	pthread_once (&bnctxonce, bnctxinit);
+	if ((ctx = pthread_getspecific (bnctxkey)) != NULL)
+	{
+		BN_CTX_free (ctx);
+		pthread_setspecific (bnctxkey, NULL);
+	}
+#else
 	if (bnctx)
 		BN_CTX_free (bnctx);
+	bnctx = NULL;
+#endif
 	BN_free (&gbig_value_zero);
 	BN_free (&gbig_value_one);
 	BN_free (&gbig_value_two);
 	BN_free (&gbig_value_three);
+#ifdef SSLLOCKS
+	if (ssllocks != NULL)
+	{
+		CRYPTO_set_locking_callback (NULL);
+		free (ssllocks);
+		ssllocks = NULL;
+	}
+#endif
 	return 0;
 }
 
@@ -74,6 +184,21 @@ gbig_rand_bytes (void *buf, unsigned len)
 }
 
 
+/* Return a Montgomery context for odd modulus gbnm, NULL on failure */
+gbig_mont *
+gbig_mont_new (BIGNUM *gbnm)
+{
+	BN_MONT_CTX *mont = BN_MONT_CTX_new();
+
+	if (mont != NULL && !BN_MONT_CTX_set (mont, gbnm, gbig_ctx()))
+	{
+		BN_MONT_CTX_free (mont);
+		mont = NULL;
+	}
+	return mont;
+}
+
+
 /* Return a random in range min to maxp1 - 1 */
 void
 _gbig_rand_range (BIGNUM *gbnr, BIGNUM *gbnmin, BIGNUM *gbnmaxp1)
@@ -34,9 +34,9 @@
 #include <openssl/bn.h>
 #include <openssl/sha.h>
 
-extern BN_CTX	*bnctx;
 typedef BIGNUM	gbignum;
 typedef SHA_CTX	gbig_sha1ctx;
+typedef BN_MONT_CTX	gbig_mont;
 
 #ifndef SHA1_DIGEST_LENGTH
 #define SHA1_DIGEST_LENGTH	20
@@ -44,8 +44,10 @@ typedef SHA_CTX	gbig_sha1ctx;
 
 extern int gbig_initialize(void);
 extern int gbig_finalize(void);
+extern BN_CTX *gbig_ctx(void);
 extern int gbig_rand_bytes(void *,unsigned);
 extern void _gbig_rand_range (BIGNUM *, BIGNUM *, BIGNUM *);
+extern gbig_mont *gbig_mont_new (BIGNUM *);
 extern gbignum gbig_value_zero;
 extern gbignum gbig_value_one;
 extern gbignum gbig_value_two;
@@ -69,25 +71,37 @@ extern gbignum gbig_value_three;
 #define gbig_sub(gbnc,gbna,gbnb) \
 							BN_sub(gbnc,gbna,gbnb)
 #define gbig_mul(gbnc,gbna,gbnb) \
-							BN_mul(gbnc,gbna,gbnb,bnctx)
+							BN_mul(gbnc,gbna,gbnb,gbig_ctx())
 #define gbig_div(gbnc,gbna,gbnb) \
-							BN_div(gbnc,NULL,gbna,gbnb,bnctx)
+							BN_div(gbnc,NULL,gbna,gbnb,gbig_ctx())
 #define gbig_mod(gbnc,gbna,gbnb) \
-							BN_mod(gbnc,gbna,gbnb,bnctx)
+							BN_mod(gbnc,gbna,gbnb,gbig_ctx())
 #define gbig_div_mod(gbnd,gbnr,gbna,gbnb) \
-							BN_div(gbnd,gbnr,gbna,gbnb,bnctx)
+							BN_div(gbnd,gbnr,gbna,gbnb,gbig_ctx())
 #define gbig_mod_add(gbnc,gbna,gbnb,gbnm) \
-							BN_mod_add(gbnc,gbna,gbnb,gbnm,bnctx)
+							BN_mod_add(gbnc,gbna,gbnb,gbnm,gbig_ctx())
 #define gbig_mod_sub(gbnc,gbna,gbnb,gbnm) \
-							BN_mod_sub(gbnc,gbna,gbnb,gbnm,bnctx)
+							BN_mod_sub(gbnc,gbna,gbnb,gbnm,gbig_ctx())
 #define gbig_mod_mul(gbnc,gbna,gbnb,gbnm) \
-							BN_mod_mul(gbnc,gbna,gbnb,gbnm,bnctx)
+							BN_mod_mul(gbnc,gbna,gbnb,gbnm,gbig_ctx())
 #define gbig_mod_exp(gbnc,gbna,gbnb,gbnm) \
-							BN_mod_exp(gbnc,gbna,gbnb,gbnm,bnctx)
+							BN_mod_exp(gbnc,gbna,gbnb,gbnm,gbig_ctx())
 #define gbig_mod_inverse(gbnc,gbna,gbnm) \
-							BN_mod_inverse(gbnc,gbna,gbnm,bnctx)
+							BN_mod_inverse(gbnc,gbna,gbnm,gbig_ctx())
 #define gbig_gcd(gbnc,gbna,gbnb) \
-							BN_gcd(gbnc,gbna,gbnb,bnctx)
+							BN_gcd(gbnc,gbna,gbnb,gbig_ctx())
+
+/* Montgomery arithmetic, for many operations mod one modulus */
+#define gbig_mont_free(mont) \
+							BN_MONT_CTX_free(mont)
+#define gbig_to_mont(gbnb,gbna,mont) \
+							BN_to_montgomery(gbnb,gbna,mont,gbig_ctx())
+#define gbig_from_mont(gbnb,gbna,mont) \
+							BN_from_montgomery(gbnb,gbna,mont,gbig_ctx())
+#define gbig_mont_mul(gbnc,gbna,gbnb,mont) \
+							BN_mod_mul_montgomery(gbnc,gbna,gbnb,mont,gbig_ctx())
+#define gbig_mod_exp_mont(gbnc,gbna,gbnb,gbnm,mont) \
+							BN_mod_exp_mont(gbnc,gbna,gbnb,gbnm,gbig_ctx(),mont)
 
 #define gbig_cmp(gbna,gbnb) \
 							BN_cmp(gbna,gbnb)
@@ -99,6 +113,8 @@ extern gbignum gbig_value_three;
 							BN_set_bit(gbna,bit)
 #define gbig_clear_bit(gbna,bit) \
 							BN_clear_bit(gbna,bit)
+#define gbig_test_bit(gbna,bit) \
+							BN_is_bit_set(gbna,bit)
 #define gbig_shift_left(gbnb,gbna,bit) \
 							BN_lshift(gbnb,gbna,bit)
 #define gbig_shift_right(gbnb,gbna,bit) \
@@ -114,7 +130,7 @@ extern gbignum gbig_value_three;
 #define gbig_rand_range(gbnr,gbna,gbnb) \
 							_gbig_rand_range(gbnr,gbna,gbnb)
 #define gbig_is_prime(gbna) \
-							BN_is_prime(gbna,0,NULL,bnctx,NULL)
+							BN_is_prime(gbna,0,NULL,gbig_ctx(),NULL)
 #define gbig_generate_prime(gbnr,bits) \
 							BN_generate_prime (gbnr,bits,0,NULL,NULL,NULL,NULL)
 
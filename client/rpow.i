@@ -257,12 +257,12 @@ static int dobreakval (int num, int val, int numo, int outval)
 	for (i=0; i<num; i++)
 	{
 		vals[i] = val;
-		rp[i] = rpow_from_store (val);
+		rp[i] = rpow_reserve (val);
 		if (rp[i] == NULL)
 		{
 			/* Error, try to fix it as much as we can */
 			while (--i >= 0)
-				store (rp[i]);
+				rpow_release (rp[i]);
 			return -1;
 		}
 	}
@@ -275,10 +275,12 @@ static int dobreakval (int num, int val, int numo, int outval)
 	if (err != 0)
 	{
 		for (i=0; i<num; i++)
-			store (rp[i]);
+			rpow_release (rp[i]);
 		return err;
 	}
 
+	for (i=0; i<num; i++)
+		rpow_spend (rp[i]);
 	for (i=0; i<numo; i++)
 		store (rpnew[i]);
 	return 0;
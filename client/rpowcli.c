@@ -31,14 +31,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "rpowcli.h"
 
 #define RPOW_VERSION	"RPOW client version 1.1.0"
 
+/* How often mintahead looks at a full pool */
+#define POOL_IDLESECONDS	60
+
 static pubkey signkey;
 
 
+/* Show how fast each thread minted the last rpow */
+static void
+printrates (void)
+{
+	double rates[64];
+	double total = 0;
+	int n, i;
+
+	n = rpow_gen_rates (rates, sizeof(rates)/sizeof(rates[0]));
+	for (i=0; i<n && i<sizeof(rates)/sizeof(rates[0]); i++)
+	{
+		printf ("Thread %d: %.0f hashes/sec\n", i, rates[i]);
+		total += rates[i];
+	}
+	printf ("Total: %.0f hashes/sec on %d threads with the %s SHA-1 core\n",
+		total, n, sha1mint_core ());
+}
+
+
 static int
 dogen (char *target, int port, int value)
 {
@@ -46,11 +73,18 @@ dogen (char *target, int port, int value)
 	rpow *rpnew;
 	int err;
 
-	rp = rpow_gen (value, signkey.cardid);
-	if (rp == NULL)
+	/* Use one minted ahead if there is one */
+	if ((rp = powpool_get (value, signkey.cardid)) != NULL)
+		printf ("Using a pooled rpow of value %d\n", value);
+	else
 	{
-		fprintf (stderr, "Unable to generate an rpow of value %d\n", value);
-		exit (-1);
+		rp = rpow_gen (value, signkey.cardid);
+		if (rp == NULL)
+		{
+			fprintf (stderr, "Unable to generate an rpow of value %d\n", value);
+			exit (-1);
+		}
+		printrates ();
 	}
 
 	err = server_exchange (&rpnew, target, port, 1, &rp, 1, &value, &signkey);
@@ -65,6 +99,56 @@ dogen (char *target, int port, int value)
 }
 
 
+/*
+ * Keep the pool of rpows minted ahead topped up to the sizes in the
+ * config file, until interrupted.  gen takes from the pool.
+ */
+static int
+domintahead (void)
+{
+	int counts[RPOW_VALUE_COUNT];
+	rpow *rp;
+	int i;
+
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+		if (poolsize[i] > 0)
+			break;
+	if (i == RPOW_VALUE_COUNT)
+	{
+		fprintf (stderr, "No pool entries in config file\n");
+		exit (1);
+	}
+
+	for ( ; ; )
+	{
+		/* This also throws out rpows close to expiry */
+		powpool_count (counts, signkey.cardid);
+		for (i=0; i<RPOW_VALUE_COUNT; i++)
+			if (counts[i] < poolsize[i])
+				break;
+		if (i == RPOW_VALUE_COUNT)
+		{
+#if defined(_WIN32)
+			Sleep (POOL_IDLESECONDS * 1000);
+#else
+			sleep (POOL_IDLESECONDS);
+#endif
+			continue;
+		}
+		rp = rpow_gen (i + RPOW_VALUE_MIN, signkey.cardid);
+		if (rp == NULL || powpool_put (rp) < 0)
+		{
+			fprintf (stderr, "Unable to add an rpow of value %d to the pool\n",
+				i + RPOW_VALUE_MIN);
+			exit (2);
+		}
+		rpow_free (rp);
+printf ("Pooled an rpow of value %d, have %d of %d\n", i + RPOW_VALUE_MIN,
+counts[i] + 1, poolsize[i]);
+	}
+}
+
+
 /* Continue to generate rpows until interrupted; consolidate them too */
 static int
 dogencontin (char *target, int port)
@@ -77,12 +161,6 @@ dogencontin (char *target, int port)
 	time_t starttime, endtime;
 	int err;
 
-#ifdef __APPLE__
-if (!hashcash_use_core(7))	// Only appropriate for Mac PPC
-{printf ("Failed to set hashcash minting engine\n"); exit (1);}
-printf ("Using hashcash core %s\n", hashcash_core_name(hashcash_core()));
-#endif
-
 	starttime = time(0);
 	numgen = 0;
 	for ( ; ; )
@@ -94,6 +172,7 @@ printf ("Using hashcash core %s\n", hashcash_core_name(hashcash_core()));
 			exit (2);
 		}
 printf ("Generated an rpow of value %d\n", genval);
+		printrates ();
 
 		if (numgen == 8)
 		{
@@ -128,56 +207,95 @@ printf ("Took %02d mins %02d secs\n", (endtime-starttime)/60, (endtime-starttime
 	}
 }
 
-/* Helper for doconsol - consolidate num items of size val */
-static int doconsolval (char *target, int port, int num, int val, int outval)
-{
+/* An exchange doconsol has in flight */
+struct consolexch {
 	rpow *rp[8];
-	rpow *rpnew;
-	int vals[8];
+	int num;
+	int *perr;
+};
+
+/* Called as each of doconsol's exchanges completes */
+static void consoldone (void *arg, int status, rpow **rpout, int nout)
+{
+	struct consolexch *cx = arg;
 	int i;
-	int err;
 
+	for (i=0; i<cx->num; i++)
+	{
+		if (status == 0)
+			rpow_spend (cx->rp[i]);
+		else if (rpow_release (cx->rp[i]) < 0)
+			fprintf (stderr, "Error, unable to store rpow\n");
+		rpow_free (cx->rp[i]);
+	}
+	if (status == 0)
+	{
+		if (rpow_to_store (rpout[0]) < 0)
+			fprintf (stderr, "Error, unable to store rpow\n");
+		rpow_free (rpout[0]);
+	} else if (*cx->perr == 0)
+		*cx->perr = status;
+	free (cx);
+}
+
+/* Helper for doconsol - start consolidating num items of size val */
+static int doconsolval (commasync *ca, int num, int val, int outval, int *perr)
+{
+	struct consolexch *cx;
+	int i;
+
+	cx = malloc (sizeof(struct consolexch));
+	cx->num = num;
+	cx->perr = perr;
 	for (i=0; i<num; i++)
 	{
-		vals[i] = val;
-		rp[i] = rpow_from_store (val);
-		if (rp[i] == NULL)
+		cx->rp[i] = rpow_reserve (val);
+		if (cx->rp[i] == NULL)
 		{
 			/* Error, try to fix it as much as we can */
 			while (--i >= 0)
 			{
-				if (rpow_to_store (rp[i]) < 0)
+				if (rpow_release (cx->rp[i]) < 0)
 					fprintf (stderr, "Error, unable to store rpow\n");
+				rpow_free (cx->rp[i]);
 			}
+			free (cx);
 			return -1;
 		}
 	}
 
-	err = server_exchange (&rpnew, target, port, num, rp, 1, &outval, &signkey);
-	if (err != 0)
+	if (exchange_start (ca, num, cx->rp, 1, &outval, &signkey,
+			consoldone, cx) < 0)
 	{
 		for (i=0; i<num; i++)
 		{
-			if (rpow_to_store (rp[i]) < 0)
+			if (rpow_release (cx->rp[i]) < 0)
 				fprintf (stderr, "Error, unable to store rpow\n");
+			rpow_free (cx->rp[i]);
 		}
-		return err;
+		free (cx);
+		return -1;
 	}
-
-	if (rpow_to_store (rpnew) < 0)
-		fprintf (stderr, "Error, unable to store rpow\n");
 	return 0;
 }
 
-/* Consolidate rpows into as few as possible */
+/*
+ * Consolidate rpows into as few as possible.  The exchanges for each
+ * value are all in flight at once; we wait for them before going on to
+ * the next value, which they add to.
+ */
 static int doconsol (char *target, int port)
 {
+	commasync *ca;
 	int val;
 	int count;
 	int counts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1];
-	int err;
+	int err = 0;
+
+	if ((ca = comm4758async_open (target, port, &signkey)) == NULL)
+		return -1;
 
-	for (val = RPOW_VALUE_MIN; val <= RPOW_VALUE_MAX; val++)
+	for (val = RPOW_VALUE_MIN; val <= RPOW_VALUE_MAX && err == 0; val++)
 	{
 		/* Count rpows of value */
 		if (rpow_count (counts) < 0)
@@ -187,31 +305,31 @@ static int doconsol (char *target, int port)
 		}
 		count = counts[val - RPOW_VALUE_MIN];
 
-		while (count >= 8 && val+3 <= RPOW_VALUE_MAX)
+		while (count >= 8 && val+3 <= RPOW_VALUE_MAX && err == 0)
 		{
-			err = doconsolval (target, port, 8, val, val+3);
-			if (err != 0)
-				return err;
+			if (doconsolval (ca, 8, val, val+3, &err) != 0)
+				err = -1;
 			count -= 8;
 		}
 
-		if (count >= 4 && val+2 <= RPOW_VALUE_MAX)
+		if (count >= 4 && val+2 <= RPOW_VALUE_MAX && err == 0)
 		{
-			err = doconsolval (target, port, 4, val, val+2);
-			if (err != 0)
-				return err;
+			if (doconsolval (ca, 4, val, val+2, &err) != 0)
+				err = -1;
 			count -= 4;
 		}
 
-		if (count >= 2 && val+1 <= RPOW_VALUE_MAX)
+		if (count >= 2 && val+1 <= RPOW_VALUE_MAX && err == 0)
 		{
-			err = doconsolval (target, port, 2, val, val+1);
-			if (err != 0)
-				return err;
+			if (doconsolval (ca, 2, val, val+1, &err) != 0)
+				err = -1;
 			count -= 2;
 		}
+
+		comm4758async_wait (ca);
 	}
-	return 0;
+	comm4758async_close (ca);
+	return err;
 }
 
 static int doin (char *target, int port)
@@ -288,13 +406,13 @@ static int dobreakval (char *target, int port, int num, int val,
 	for (i=0; i<num; i++)
 	{
 		vals[i] = val;
-		rp[i] = rpow_from_store (val);
+		rp[i] = rpow_reserve (val);
 		if (rp[i] == NULL)
 		{
 			/* Error, try to fix it as much as we can */
 			while (--i >= 0)
 			{
-				if (rpow_to_store (rp[i]) < 0)
+				if (rpow_release (rp[i]) < 0)
 					fprintf (stderr, "Error, unable to store rpow\n");
 			}
 			return -1;
@@ -309,12 +427,14 @@ static int dobreakval (char *target, int port, int num, int val,
 	{
 		for (i=0; i<num; i++)
 		{
-			if (rpow_to_store (rp[i]) < 0)
+			if (rpow_release (rp[i]) < 0)
 				fprintf (stderr, "Error, unable to store rpow\n");
 		}
 		return err;
 	}
 
+	for (i=0; i<num; i++)
+		rpow_spend (rp[i]);
 	for (i=0; i<numo; i++)
 	{
 		if (rpow_to_store (rpnew[i]) < 0)
@@ -413,13 +533,13 @@ static int doexch (char *target, int port, int nin, int *invals,
 
 	for (i=0; i<nin; i++)
 	{
-		rp[i] = rpow_from_store (invals[i]);
+		rp[i] = rpow_reserve (invals[i]);
 		if (rp[i] == NULL)
 		{
 			fprintf (stderr, "Unable to find RPOW with value %d\n", invals[i]);
 			while (i-- > 0)
 			{
-				if (rpow_to_store (rp[i]) < 0)
+				if (rpow_release (rp[i]) < 0)
 					fprintf (stderr, "Error, unable to store rpow\n");
 			}
 			exit (2);
@@ -433,12 +553,14 @@ static int doexch (char *target, int port, int nin, int *invals,
 		/* Try putting the ones back we puled out */
 		for (i=0; i<nin; i++)
 		{
-			if (rpow_to_store (rp[i]) < 0)
+			if (rpow_release (rp[i]) < 0)
 				fprintf (stderr, "Error, unable to store rpow\n");
 		}
 		exit (err);
 	}
 
+	for (i=0; i<nin; i++)
+		rpow_spend (rp[i]);
 	for (i=0; i<nout; i++)
 	{
 		if (rpow_to_store (rpnew[i]) < 0)
@@ -457,6 +579,8 @@ static int doexch (char *target, int port, int nin, int *invals,
 static int docount ()
 {
 	int expcounts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1];
+	double total = 0.;
+	double scale;
 	int count;
 	int exp;
 
@@ -470,30 +594,93 @@ static int docount ()
 
 	printf ("%d rpows in rpow data store:\n", count);
 
+	for (scale=1., exp=0; exp<RPOW_VALUE_MIN; ++exp)
+		scale *= 2.;
 	for (exp=RPOW_VALUE_MIN; exp<=RPOW_VALUE_MAX; ++exp)
 	{
 		if (expcounts[exp-RPOW_VALUE_MIN] > 0)
 			printf ("  value %2d: %d\n", exp, expcounts[exp-RPOW_VALUE_MIN]);
+		total += expcounts[exp-RPOW_VALUE_MIN] * scale;
+		scale *= 2.;
 	}
+	printf ("total value %.0f\n", total);
 	return 0;
 }
 
+/* Seconds proofbench spends on each kind of proof */
+#define PROOFBENCH_SECONDS	3.
+
+/*
+ * Time proofs of possession of an rpow of the given value, and their
+ * checks, with the simple one round at a time code and the fast code
+ */
+static int
+doproofbench (int value, int proofstrength)
+{
+	double rates[4];
+
+	printf ("Timing proofs for value %d at strength %d...\n", value,
+		proofstrength);
+	if (rpow_proof_bench (&signkey, value, proofstrength, PROOFBENCH_SECONDS,
+			rates) < 0)
+	{
+		fprintf (stderr, "Error, a proof failed to verify\n");
+		exit (1);
+	}
+	printf ("prove:  %8.1f/sec before, %8.1f/sec after, %.2fx\n",
+		rates[0], rates[1], rates[1] / rates[0]);
+	printf ("verify: %8.1f/sec before, %8.1f/sec after, %.2fx\n",
+		rates[2], rates[3], rates[3] / rates[2]);
+	return 0;
+}
+
+/* Check the rpow data store and rebuild its index */
+static int doverify ()
+{
+	int expcounts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1];
+	int count;
+	int nbad, nwrong;
+
+	count = rpow_store_verify (expcounts, &nbad, &nwrong);
+
+	if (count < 0)
+	{
+		fprintf (stderr, "Unable to open rpow data store\n");
+		exit (1);
+	}
+
+	if (nbad > 0)
+		printf ("%d damaged records dropped\n", nbad);
+	if (nwrong > 0)
+		printf ("%d counts were wrong and have been fixed\n", nwrong);
+	if (nbad == 0 && nwrong == 0)
+		printf ("rpow data store is good\n");
+	return docount ();
+}
+
 
 static void
 userr (char *pname)
 {
 	fprintf (stderr, "%s\n", RPOW_VERSION);
-	fprintf (stderr, "Usage: %s"
+	fprintf (stderr, "Usage: %s [-t threads]"
 		" getkeys <<<<==== (must be done first, deletes existing rpows)\n"
 		"\trekey\n"
 		"\tstatus\n"
 		"\tgen value\n"
 		"\tgencontin\n"
+		"\tmintahead\n"
 		"\texchange cur_val ... 0 new_val ...\n"
 		"\tconsolidate\n"
 		"\tin < rpowdata\n"
 		"\tout value > rpowdata\n"
-		"\tcount\n",
+		"\tcount\n"
+		"\tverify\n"
+		"\tproofbench [value [strength]]\n"
+		"  -t sets the threads gen and gencontin mint with, and proofs\n"
+		"  use, default one per processor.\n"
+		"  mintahead keeps rpows ready for gen, as many of each value as\n"
+		"  the config file's pool = value:count lines say.\n",
 		pname);
 	exit (1);
 }
@@ -504,34 +691,52 @@ main (int ac, char **av)
 	char *cmd;
 	int nsides;
 	int cmdgen, cmdout, cmdin, cmdcount, cmdexch, cmdkeys, cmdstat,
-		cmdgencontin, cmdconsol;
+		cmdgencontin, cmdconsol, cmdmintahead, cmdverify, cmdproofbench;
 	int cmdrekey;
 	int value;
 
 	if (ac < 2)
 		userr (av[0]);
 
+	if (strcmp (av[1], "-t") == 0)
+	{
+		if (ac < 4 || atoi(av[2]) <= 0)
+			userr (av[0]);
+		rpow_gen_threads (atoi(av[2]));
+		rpow_proof_threads (atoi(av[2]));
+		/* Discard first two arguments */
+		av[2] = av[0];
+		av += 2;
+		ac -= 2;
+	}
+
 	cmd = av[1];
 	cmdkeys = (strcmp (cmd, "getkeys") == 0);
 	cmdgen = (strcmp (cmd, "gen") == 0);
 	cmdgencontin = (strcmp (cmd, "gencontin") == 0);
+	cmdmintahead = (strcmp (cmd, "mintahead") == 0);
 	cmdout = (strcmp (cmd, "out") == 0);
 	cmdin = (strcmp (cmd, "in") == 0);
 	cmdcount = (strcmp (cmd, "count") == 0);
+	cmdverify = (strcmp (cmd, "verify") == 0);
 	cmdexch = (strcmp (cmd, "exchange") == 0);
 	cmdconsol = (strcmp (cmd, "consolidate") == 0);
 	cmdrekey = (strcmp (cmd, "rekey") == 0);
 	cmdstat = (strcmp (cmd, "status") == 0);
+	cmdproofbench = (strcmp (cmd, "proofbench") == 0);
 	if (cmdkeys+cmdgen+cmdout+cmdin+cmdcount+cmdexch+cmdrekey
-			+cmdstat+cmdgencontin+cmdconsol != 1)
+			+cmdstat+cmdgencontin+cmdconsol+cmdmintahead+cmdverify
+			+cmdproofbench != 1)
 		userr(av[0]);
 
 	initfilenames ();
 
 	if ((cmdout || cmdgen) && ac != 3)
 		userr (av[0]);
+	if (cmdproofbench && ac > 4)
+		userr (av[0]);
 	if ((cmdin || cmdcount || cmdkeys || cmdrekey || cmdstat || cmdgencontin
-				|| cmdconsol)
+				|| cmdconsol || cmdmintahead || cmdverify)
 			&& ac != 2)
 		userr (av[0]);
 
@@ -540,6 +745,9 @@ main (int ac, char **av)
 	if (cmdcount)
 		return docount();
 
+	if (cmdverify)
+		return doverify();
+
 	if (cmdstat)
 		return getstat (targethost, targetport, stdout);
 
@@ -555,6 +763,19 @@ main (int ac, char **av)
 
 	pubkey_read (&signkey, signfile);
 
+	if (cmdproofbench)
+	{
+		value = (ac > 2) ? atoi(av[2]) : 20;
+		if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+		{
+			fprintf (stderr, "Illegal work value %d\n", value);
+			exit (1);
+		}
+		if (ac > 3 && atoi(av[3]) <= 0)
+			userr (av[0]);
+		return doproofbench (value, (ac > 3) ? atoi(av[3]) : 80);
+	}
+
 	if (cmdout)
 	{
 		value = atoi(av[2]);
@@ -609,6 +830,9 @@ main (int ac, char **av)
 	if (cmdgencontin)
 		return dogencontin (targethost, targetport);
 
+	if (cmdmintahead)
+		return domintahead ();
+
 	if (cmdconsol)
 		return doconsol (targethost, targetport);
 
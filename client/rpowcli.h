@@ -39,6 +39,8 @@
 #define SIGNFILE	"rpowkey.pub"
 #define COMMFILE	"commkey.pub"
 #define RPOWFILE	"rpows.dat"
+#define POOLFILE	"powpool.dat"
+#define WALLETFILE	"wallet"
 #define CONFIGFILE	"config"
 
 #define DEFAULTPORT	4902
@@ -63,11 +65,18 @@ typedef struct rpowpend {
 /* rpow.c */
 /* rpow functions are declared in rpowclient.h */
 
+#define POW_RESOURCE_LENGTH	(2*CARDID_LENGTH + 2 + sizeof(POW_RESOURCE_TAIL))
+
 char * powresource (unsigned char *cardid);
+char * powresource_r (char *buf, unsigned char *cardid);
 rpowpend *rpowpend_gen (int value, int dohide, pubkey *);
+int rpowpend_gen_batch (rpowpend **rpend, int n, int *values, int dohide,
+	pubkey *);
 int rpowpend_write (rpowpend *, rpowio *rpio);
 rpowpend *rpowpend_read (rpowio *rpio);
 rpow * rpowpend_rpow (rpowpend *, pubkey *, rpowio *rpio);
+int rpowpend_rpow_batch (rpow **rpout, rpowpend **rpend, int n, pubkey *,
+	rpowio *rpio);
 void rpowpend_free (rpowpend *);
 
 int valuetoexp (gbignum *exp, int value, pubkey *pk);
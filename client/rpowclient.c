@@ -58,6 +58,11 @@
 char *rpowfile;
 char *signfile;
 char *commfile;
+char *poolfile;
+char *walletfile;
+
+/* Number of rpows of each value mintahead keeps ready */
+int poolsize[RPOW_VALUE_COUNT];
 
 /* Host and port to use by default */
 char targethost[256];
@@ -68,9 +73,6 @@ int usesocks = 0;
 char sockshost[256];
 int socksport;
 
-/* Temporary, the one public signing key we know about */
-pubkey signpubkey;
-
 char *staterr[] = {
 	"",
 	"Already seen rpow value",
@@ -90,26 +92,14 @@ static void server_write (int npow, rpow **rpows, int npend, rpowpend **rpends,
 	rpowio *rpio, pubkey *signkey);
 
 
-/*
- * Given a set of input rpows, and the desired number and denomination
- * of output rpows, do an exchange at the server and return a status
- * code and, if OK, the output rpows.  Output array *rpout should be
- * pre-allocated as an array of pointers to rpow, nout items long.
- */
-int
-server_exchange (rpow **rpout, char *target, int port, int nin, rpow **rpin,
-			int nout, int *outvals, pubkey *signkey)
+/* Check that an exchange is one the server will take */
+static int
+exchange_check (int nin, rpow **rpin, int nout, int *outvals)
 {
-	BIO *bio = BIO_new(BIO_s_mem());
-	rpowio *rpio = rp_new_from_bio (bio);
-	rpowpend **rpend;
-	uchar stat;
 	unsigned insum = 0;
 	unsigned outsum = 0;
 	int i;
 
-signpubkey = *signkey;
-
 	if (nin > MAXCOUNT || nout > MAXCOUNT)
 	{
 		fprintf (stderr, "Server only accepts %d input or output values in one exchange\n", MAXCOUNT);
@@ -131,17 +121,21 @@ signpubkey = *signkey;
 		fprintf (stderr, "Input RPOW values 0x%x not equal to output values 0x%x\n", insum, outsum);
 		return -1;
 	}
+	return 0;
+}
 
+/*
+ * Given the status of the talk with the card and its reply in rpio,
+ * unblind the output rpows into rpout.  Frees rpend and rpio.
+ */
+static int
+exchange_finish (int commstat, rpowio *rpio, rpowpend **rpend, int nout,
+	rpow **rpout, pubkey *signkey)
+{
+	uchar stat;
+	int i;
 
-	rpend = malloc (nout * sizeof (rpowpend *));
-	for (i=0; i<nout; i++)
-		rpend[i] = rpowpend_gen (outvals[i], 0, signkey);
-
-	/* Output formatted request to bio buffer via rpio */
-	server_write (nin, rpin, nout, rpend, rpio, signkey);
-
-	/* Do the exchange with the IBM4758 */
-	if (comm4758 (bio, target, port, signkey) != 0)
+	if (commstat != 0)
 	{
 		fprintf (stderr, "Unable to communicate with remote server\n");
 		for (i=0; i<nout; i++)
@@ -163,11 +157,9 @@ signpubkey = *signkey;
 		return -100-stat;
 	}
 
+	rpowpend_rpow_batch (rpout, rpend, nout, signkey, rpio);
 	for (i=0; i<nout; i++)
-	{
-		rpout[i] = rpowpend_rpow (rpend[i], signkey, rpio);
 		rpowpend_free (rpend[i]);
-	}
 	free (rpend);
 	rp_free (rpio);
 
@@ -183,6 +175,115 @@ signpubkey = *signkey;
 	return 0;
 }
 
+/*
+ * Given a set of input rpows, and the desired number and denomination
+ * of output rpows, do an exchange at the server and return a status
+ * code and, if OK, the output rpows.  Output array *rpout should be
+ * pre-allocated as an array of pointers to rpow, nout items long.
+ */
+int
+server_exchange (rpow **rpout, char *target, int port, int nin, rpow **rpin,
+			int nout, int *outvals, pubkey *signkey)
+{
+	BIO *bio;
+	rpowio *rpio;
+	rpowpend **rpend;
+
+	if (exchange_check (nin, rpin, nout, outvals) < 0)
+		return -1;
+
+	rpend = malloc (nout * sizeof (rpowpend *));
+	if (rpowpend_gen_batch (rpend, nout, outvals, 0, signkey) < 0)
+	{
+		free (rpend);
+		return -1;
+	}
+	bio = BIO_new(BIO_s_mem());
+	rpio = rp_new_from_bio (bio);
+
+	/* Output formatted request to bio buffer via rpio */
+	server_write (nin, rpin, nout, rpend, rpio, signkey);
+
+	/* Do the exchange with the IBM4758 */
+	return exchange_finish (comm4758 (bio, target, port, signkey), rpio,
+		rpend, nout, rpout, signkey);
+}
+
+
+/*
+ * Asynchronous exchanges, many at once on one connection.  exchange_start
+ * does the blinding and encryption for an exchange and sends it on ca,
+ * from comm4758async_open, and done is called from comm4758async_poll
+ * when it completes.  done gets what server_exchange would return and,
+ * if that is 0, the nout output rpows, which are done's to keep.  The
+ * caller must keep signkey until then.  Returns -1 if the exchange is
+ * not valid or could not be sent, in which case done is not called.
+ */
+struct pendexch {
+	rpowio *rpio;
+	rpowpend **rpend;
+	int nout;
+	pubkey *signkey;
+	exchange_done *done;
+	void *arg;
+};
+
+static void
+exchange_reply (void *arg, BIO *bio, int commstat)
+{
+	struct pendexch *pe = arg;
+	rpow **rpout;
+	int status;
+
+	rpout = calloc (pe->nout, sizeof(rpow *));
+	status = exchange_finish (commstat, pe->rpio, pe->rpend, pe->nout,
+		rpout, pe->signkey);
+	pe->done (pe->arg, status, rpout, pe->nout);
+	free (rpout);
+	free (pe);
+}
+
+int
+exchange_start (commasync *ca, int nin, rpow **rpin, int nout, int *outvals,
+	pubkey *signkey, exchange_done *done, void *arg)
+{
+	struct pendexch *pe;
+	BIO *bio;
+	int i;
+
+	if (exchange_check (nin, rpin, nout, outvals) < 0)
+		return -1;
+
+	pe = malloc (sizeof(struct pendexch));
+	pe->rpend = malloc (nout * sizeof (rpowpend *));
+	if (rpowpend_gen_batch (pe->rpend, nout, outvals, 0, signkey) < 0)
+	{
+		free (pe->rpend);
+		free (pe);
+		return -1;
+	}
+	bio = BIO_new(BIO_s_mem());
+	pe->rpio = rp_new_from_bio (bio);
+	pe->nout = nout;
+	pe->signkey = signkey;
+	pe->done = done;
+	pe->arg = arg;
+
+	server_write (nin, rpin, nout, pe->rpend, pe->rpio, signkey);
+
+	if (comm4758async_send (ca, bio, exchange_reply, pe) < 0)
+	{
+		fprintf (stderr, "Unable to communicate with remote server\n");
+		for (i=0; i<nout; i++)
+			rpowpend_free (pe->rpend[i]);
+		free (pe->rpend);
+		rp_free (pe->rpio);
+		free (pe);
+		return -1;
+	}
+	return 0;
+}
+
 
 static void
 server_write (int npow, rpow **rpows, int npend, rpowpend **rpends,
@@ -322,6 +423,20 @@ readconfig (char *fname)
 			strcpy (sockshost, host);
 			usesocks = 1;
 		}
+		else if (strcasecmp (key, "pool") == 0)
+		{
+			/* pool = value:count */
+			int value = atoi (val);
+			pport = strchr (val, ':');
+			if (pport == NULL || value < RPOW_VALUE_MIN
+					|| value > RPOW_VALUE_MAX || atoi(pport+1) < 0)
+			{
+				fprintf (stderr, "Bad pool entry %s in config file %s\n",
+						val, fname);
+				exit (1);
+			}
+			poolsize[value - RPOW_VALUE_MIN] = atoi(pport+1);
+		}
 		else
 		{
 			fprintf (stderr, "Unrecognized keyword %s in config file %s\n",
@@ -387,6 +502,18 @@ initfilenames ()
 		strcat (commfile, "/");
 	strcat (commfile, COMMFILE);
 
+	poolfile = malloc (strlen(rpowdir) + 1 + strlen (POOLFILE) + 1);
+	strcpy (poolfile, rpowdir);
+	if (poolfile[strlen(poolfile)-1] != '/')
+		strcat (poolfile, "/");
+	strcat (poolfile, POOLFILE);
+
+	walletfile = malloc (strlen(rpowdir) + 1 + strlen (WALLETFILE) + 1);
+	strcpy (walletfile, rpowdir);
+	if (walletfile[strlen(walletfile)-1] != '/')
+		strcat (walletfile, "/");
+	strcat (walletfile, WALLETFILE);
+
 	/* Now read config file */
 	configfile = malloc (strlen(rpowdir) + 1 + strlen (CONFIGFILE) + 1);
 	strcpy (configfile, rpowdir);
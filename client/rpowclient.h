@@ -76,6 +76,11 @@ typedef struct rpowio {
 extern char *rpowfile;
 extern char *signfile;
 extern char *commfile;
+extern char *poolfile;
+extern char *walletfile;
+
+/* Number of rpows of each value mintahead keeps ready, from config file */
+extern int poolsize[];
 
 /* Host and port for server */
 extern char targethost[256];
@@ -87,10 +92,21 @@ extern char sockshost[256];
 extern int socksport;
 
 
+/*
+ * Once gbig_initialize and initfilenames have been called, the exchange,
+ * rpow and rpowpend functions may be used from several threads at once.
+ * With OpenSSL before 1.1, gbig_initialize installs the locking and
+ * thread id callbacks that needs, unless the application has its own.
+ */
+
 /* rpowclient.c */
 
 int server_exchange (rpow **rpout, char *target, int port, int nin, rpow **rpin,
 	int nout, int *outvals, pubkey *signkey);
+typedef struct commasync commasync;
+typedef void exchange_done (void *arg, int status, rpow **rpout, int nout);
+int exchange_start (commasync *ca, int nin, rpow **rpin, int nout,
+	int *outvals, pubkey *signkey, exchange_done *done, void *arg);
 void initfilenames (void);
 
 /* connio.c */
@@ -98,6 +114,20 @@ void initfilenames (void);
 int getkeys (char *target, int port, int firsttime);
 int getstat (char *target, int port, FILE *fout);
 int comm4758 (BIO *bio, char *target, int port, pubkey *signkey);
+int comm4758multi (BIO **bios, int *stats, int nbio, char *target, int port,
+	pubkey *signkey);
+void comm4758close (void);
+typedef void comm4758done (void *arg, BIO *bio, int stat);
+commasync *comm4758async_open (char *target, int port, pubkey *signkey);
+int comm4758async_send (commasync *ca, BIO *bio, comm4758done *done, void *arg);
+int comm4758async_poll (commasync *ca, int msecs);
+void comm4758async_wait (commasync *ca);
+void comm4758async_close (commasync *ca);
+
+/* b64.c */
+
+int enc64 (char *out, unsigned char *in, int inlen);
+int dec64 (unsigned char *out, char *in, int inlen);
 
 /* rpio.c */
 
@@ -120,6 +150,11 @@ void pubkey_write (pubkey *key, char *file);
 /* rpowutil.c */
 
 rpow *rpow_gen (int value, unsigned char *cardid);
+void rpow_gen_threads (int nthreads);
+int rpow_gen_rates (double *rates, int max);
+void rpow_proof_threads (int nthreads);
+int rpow_proof_bench (pubkey *pk, int value, int proofstrength, double secs,
+	double rates[4]);
 int rpow_write(rpow *, rpowio *);
 rpow *rpow_read (rpowio *rpio);
 void rpow_free (rpow *);
@@ -130,7 +165,31 @@ char *rpow_to_string (rpow *rp);
 rpow * rpow_from_store (int value);
 int rpow_to_store (rpow *rp);
 int rpow_count (int counts[]);
+int rpow_store_verify (int counts[], int *pbad, int *pwrong);
+rpow *rpow_reserve (int value);
+int rpow_spend (rpow *rp);
+int rpow_release (rpow *rp);
+typedef struct rpowstore rpowstore;
+rpowstore *rpowstore_open (void (*fn)(void *arg, unsigned off, int value,
+	unsigned char *buf, unsigned len), void *arg);
+int rpowstore_add (rpowstore *st, unsigned char *buf, unsigned len, int value,
+	unsigned *poff);
+int rpowstore_kill (rpowstore *st, unsigned off);
+int rpowstore_sync (rpowstore *st);
+void rpowstore_close (rpowstore *st);
+int powpool_put (rpow *rp);
+rpow *powpool_get (int value, unsigned char *cardid);
+int powpool_count (int counts[], unsigned char *cardid);
 
 unsigned char * hc_to_buffer (char *buf, int *pbuflen);
 
+/* sha1mint.c */
+
+#define SHA1MINT_LANES		16
+#define SHA1MINT_LANEBYTE	54
+
+char *sha1mint_core (void);
+void sha1mint_midstate (unsigned *mid, unsigned char *buf, unsigned nblocks);
+int sha1mint_search (unsigned *mid, unsigned char *block, int value);
+
 #endif /* RPOWCLIENT_H */
@@ -31,8 +31,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include "rpowcli.h"
 #include "hashcash.h"
@@ -96,8 +106,14 @@ int
 valuetoexp (gbignum *exp, int value, pubkey *pk)
 {
 	static int exptab[RPOW_VALUE_MAX-RPOW_VALUE_MIN+1];
+#if !defined(_WIN32)
+	static pthread_mutex_t explock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 	int i;
 
+#if !defined(_WIN32)
+	pthread_mutex_lock (&explock);
+#endif
 	if (exptab[0] == 0)
 	{
 		/* First time; fill exptab with consecutive primes */
@@ -111,6 +127,9 @@ valuetoexp (gbignum *exp, int value, pubkey *pk)
 			}
 		}
 	}
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&explock);
+#endif
 	if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
 		return -1;
 	gbig_from_word (exp, exptab[value-RPOW_VALUE_MIN]);
@@ -258,7 +277,7 @@ rpow_to_buf (unsigned *outlen, rpow *rp)
 	rp_free (rpioout);
 	if (outlen)
 		*outlen = buflen;
-	return buf;
+	return outbuf;
 }
 
 
@@ -344,9 +363,14 @@ rpow_proof_rounds (gbignum *exp, int proofstrength)
 	gbig_free (&t);
 	return (proofstrength + bit - 1) / bit;
 }
-	
+
+/*
+ * The straightforward proof and check, a round at a time.  These are
+ * kept as the reference that rpow_proof_bench times and checks the
+ * faster rpow_sig_prove and rpow_sig_verify below against.
+ */
 static int
-rpow_sig_prove (gbignum *sig, int value, int proofstrength,
+rpow_sig_prove1 (gbignum *sig, int value, int proofstrength,
 	pubkey *pk, rpowio *rpio)
 {
 	gbignum exp;
@@ -411,7 +435,7 @@ rpow_sig_prove (gbignum *sig, int value, int proofstrength,
 
 /* Verify a proof written by the proof function; return 0 if OK */
 static int
-rpow_sig_verify (gbignum *rp, int value, int proofstrength,
+rpow_sig_verify1 (gbignum *rp, int value, int proofstrength,
 	pubkey *pk, rpowio *rpio)
 {
 	gbignum exp;
@@ -488,533 +512,2427 @@ error:
 }
 
 
-/* Free an rpow */
+/*
+ * The same proofs, faster.  Everything is mod pk->n, so it is done in
+ * Montgomery form.  Every round raises the one base, sig or rp, to a
+ * 160 bit challenge and multiplies by rnd or rn, so when there are
+ * enough rounds to pay for it we build a table of the base to each
+ * digit times each power of 2^w.  Then base^c * x costs one multiply
+ * per w bits of challenge, the last of which also takes in x.  The
+ * rounds are independent apart from the hash, so they are spread over
+ * threads.
+ */
+
+#define PROOFMAXTHREADS	64
+#define PROOFMAXWINDOW	8
+#define PROOFCHALBITS	(8*SHA1_DIGEST_LENGTH)
+
+/* Rough cost of an exponentiation by a challenge, in multiplies */
+#define PROOFEXPCOST	(PROOFCHALBITS + PROOFCHALBITS/4)
+
+/* Threads for the proofs, 0 for one per processor */
+static int proofthreads;
+
+static double mintclock (void);
+
+/* Powers of one base; tab[(i<<w)+d] is base^(d<<(w*i)) in Montgomery form */
+typedef struct prooftab {
+	int w;
+	int nwin;
+	gbignum *tab;
+} prooftab;
+
+#define PROOF_COMMIT	1		/* rn = rnd^exp */
+#define PROOF_RESPOND	2		/* v = sig^c * rnd */
+#define PROOF_CHECK		3		/* Check rp^c * rn == v^exp */
+
+typedef struct proofjob {
+	int step;
+	int rounds;
+	int nthreads;
+	pubkey *pk;
+	gbignum *exp;
+	gbig_mont *mont;
+	gbignum *base;		/* sig or rp */
+	prooftab *tab;		/* NULL if it would not pay */
+	gbignum *rnd;
+	gbignum *rn;
+	gbignum *c;
+	gbignum *v;
+	char *ok;
+} proofjob;
+
+typedef struct proofthread {
+	proofjob *job;
+	int num;
+#if !defined(_WIN32)
+	pthread_t tid;
+#endif
+} proofthread;
+
+/* Set the number of threads proofs use, 0 for one per processor */
 void
-rpow_free (rpow *rp)
+rpow_proof_threads (int nthreads)
 {
-	if (rp->id)
-		free (rp->id);
-	gbig_free (&rp->bn);
-	free (rp);
+	proofthreads = nthreads;
 }
 
-/* Return the POW resource name in a static buffer */
-char *
-powresource (unsigned char *cardid)
+/* Choose the table window for rounds uses of it, 0 if a table won't pay */
+static int
+prooftab_window (int rounds)
 {
-	static char resource[2*CARDID_LENGTH + 4 + sizeof(POW_RESOURCE_TAIL)];
-	int i;
+	int bestw = 0;
+	long bestcost = (long)rounds * PROOFEXPCOST;
+	long cost;
+	int nwin;
+	int w;
 
-	resource[0] = 0;
-	for (i=0; i<8; i++)
-		sprintf (resource+strlen(resource), "%02x", cardid[i]);
-	strcat (resource, "-");
-	for (; i<12; i++)
-		sprintf (resource+strlen(resource), "%02x", cardid[i]);
-	strcat (resource, "-");
-	for (; i<CARDID_LENGTH; i++)
-		sprintf (resource+strlen(resource), "%02x", cardid[i]);
-	strcat (resource, POW_RESOURCE_TAIL);
-	return resource;
+	for (w=1; w<=PROOFMAXWINDOW; w++)
+	{
+		nwin = (PROOFCHALBITS + w - 1) / w;
+		cost = (long)nwin * ((1 << w) - 1 + rounds);
+		if (cost < bestcost)
+		{
+			bestw = w;
+			bestcost = cost;
+		}
+	}
+	return bestw;
 }
 
-/* Generate a "hashcash" type of proof of work token */
-rpow *
-rpow_gen (int value, unsigned char *cardid)
+static int
+prooftab_init (prooftab *pt, gbignum *base, int w, gbig_mont *mont)
 {
-	rpow *rp = calloc (sizeof(rpow), 1);
-	char *resource = powresource(cardid);
-	double tries;
-	int ok;
-
-	gbig_init (&rp->bn);
+	gbignum *row;
+	int n;
+	int i, d;
+
+	pt->w = w;
+	pt->nwin = (PROOFCHALBITS + w - 1) / w;
+	n = pt->nwin << w;
+	if ((pt->tab = malloc (n * sizeof(gbignum))) == NULL)
+		return -1;
+	for (i=0; i<n; i++)
+		gbig_init (&pt->tab[i]);
 
-	if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+	/* Row i is base^(2^(w*i)) to the 1st through 2^w-1th power */
+	gbig_to_mont (&pt->tab[1], base, mont);
+	for (i=0; i<pt->nwin; i++)
 	{
-		free (rp);
-		return NULL;
+		row = pt->tab + (i << w);
+		if (i > 0)
+			gbig_mont_mul (&row[1], &row[-1], &row[1 - (1 << w)], mont);
+		for (d=2; d<(1<<w); d++)
+			gbig_mont_mul (&row[d], &row[d-1], &row[1], mont);
 	}
+	return 0;
+}
 
-	rp->value = value;
-
-	ok = hashcash_mint (time(0), 0, resource, value, 0,
-			(char **)&rp->id, NULL, &tries, NULL, 0,
-			NULL, NULL);
-	assert (ok == 1);
+static void
+prooftab_free (prooftab *pt)
+{
+	int i;
 
-	/* rp->id holds a malloc buffer with the token */
-	rp->idlen = strlen(rp->id);
-	rp->type = RPOW_TYPE_HASHCASH;
-	return rp;
+	for (i=0; i<(pt->nwin << pt->w); i++)
+		gbig_free (&pt->tab[i]);
+	free (pt->tab);
 }
 
-
-/* Generate the rpow field of an rpowpend */
+/* r = base^c * x, where x is not in Montgomery form and nor is r */
 static void
-rpowpend_bn_gen (gbignum *bn, uchar *id, unsigned idlen, pubkey *pk)
+prooftab_expmul (gbignum *r, prooftab *pt, gbignum *c, gbignum *x,
+	gbig_mont *mont)
 {
-	uchar md[SHA_DIGEST_LENGTH];
-	uchar *buf;
-	int nlen = gbig_buflen (&pk->n);
-	int off;
+	gbignum acc;
+	int i, b, d;
+	int first = 1;
 
-	buf = malloc (nlen);
-	SHA1 (id, idlen, buf);
-	buf[SHA_DIGEST_LENGTH] = RPOW_PK_VAL;
-	off = SHA_DIGEST_LENGTH + 1;
-	while (off < nlen)
+	gbig_init (&acc);
+	for (i=0; i<pt->nwin; i++)
 	{
-		SHA1 (buf, off, md);
-		memcpy (buf+off, md, MIN(SHA_DIGEST_LENGTH, nlen-off));
-		off += SHA_DIGEST_LENGTH;
+		d = 0;
+		for (b=pt->w-1; b>=0; b--)
+			d = (d << 1) | (gbig_test_bit (c, i*pt->w + b) ? 1 : 0);
+		if (d == 0)
+			continue;
+		if (first)
+			gbig_copy (&acc, &pt->tab[(i << pt->w) + d]);
+		else
+			gbig_mont_mul (&acc, &acc, &pt->tab[(i << pt->w) + d], mont);
+		first = 0;
 	}
-	gbig_from_buf (bn, buf, nlen);
-	gbig_mod (bn, bn, &pk->n);
-	free (buf);
+	/* A Montgomery multiply by a plain x leaves a plain result */
+	if (first)
+		gbig_copy (r, x);
+	else
+		gbig_mont_mul (r, &acc, x, mont);
+	gbig_free (&acc);
 }
 
-
-/* Generate an rpowpend of the specified value */
-/* dohide means to hide the value to be signed, used for splitting rpows */
-rpowpend *
-rpowpend_gen (int value, int dohide, pubkey *pk)
+/* r = base^c * x for job's base, by table if it has one */
+static void
+proofexpmul (gbignum *r, proofjob *job, gbignum *c, gbignum *x)
 {
-	rpowpend *rpend = calloc (sizeof(rpowpend), 1);
-	gbignum hider;
-	gbignum ehider;
-	gbignum exp;
-
-	gbig_init (&hider);
-	gbig_init (&ehider);
-	gbig_init (&exp);
-	gbig_init (&rpend->rpow);
-	gbig_init (&rpend->rpowhidden);
-	gbig_init (&rpend->invhider);
-
-	if (valuetoexp (&exp, value, pk) < 0)
-		return NULL;
-
-	rpend->value = value;
-	rpend->idlen = RPOW_ID_LENGTH;
-	gbig_rand_bytes (rpend->id, rpend->idlen - CARDID_LENGTH);
-	memcpy (rpend->id + rpend->idlen - CARDID_LENGTH, pk->cardid,
-			CARDID_LENGTH);
-	rpowpend_bn_gen (&rpend->rpow, rpend->id, rpend->idlen, pk);
-	if (dohide)
-	{
-		gbig_rand_range (&hider, &gbig_value_zero, &pk->n);
-		gbig_mod_inverse (&rpend->invhider, &hider, &pk->n);
-		gbig_mod_exp (&ehider, &hider, &exp, &pk->n);
-		gbig_mod_mul (&rpend->rpowhidden, &rpend->rpow, &ehider, &pk->n);
-	}
+	if (job->tab)
+		prooftab_expmul (r, job->tab, c, x, job->mont);
 	else
 	{
-		gbig_copy (&rpend->rpowhidden, &rpend->rpow);
-		gbig_from_word (&rpend->invhider, 1);
+		gbig_mod_exp_mont (r, job->base, c, &job->pk->n, job->mont);
+		gbig_mod_mul (r, r, x, &job->pk->n);
 	}
-	gbig_free (&exp);
-	gbig_free (&hider);
-	gbig_free (&ehider);
-	return rpend;
 }
 
-/* Read an rpowpend written by rpowpend_write */
-rpowpend *
-rpowpend_read (rpowio *rpio)
+static void
+proofstep (proofjob *job, int r)
 {
-	rpowpend *rpend = calloc (sizeof(rpowpend), 1);
-	int value;
+	gbignum t1;
+	gbignum t2;
+	gbignum *n = &job->pk->n;
 
-	gbig_init (&rpend->rpow);
-	gbig_init (&rpend->rpowhidden);
-	gbig_init (&rpend->invhider);
+	gbig_init (&t1);
+	gbig_init (&t2);
+	switch (job->step)
+	{
+	case PROOF_COMMIT:
+		gbig_mod_exp_mont (&job->rn[r], &job->rnd[r], job->exp, n, job->mont);
+		break;
+	case PROOF_RESPOND:
+		proofexpmul (&job->v[r], job, &job->c[r], &job->rnd[r]);
+		break;
+	case PROOF_CHECK:
+		proofexpmul (&t1, job, &job->c[r], &job->rn[r]);
+		gbig_mod_exp_mont (&t2, &job->v[r], job->exp, n, job->mont);
+		job->ok[r] = (gbig_cmp (&t1, &t2) == 0);
+		break;
+	}
+	gbig_free (&t1);
+	gbig_free (&t2);
+}
 
-	rp_read (rpio, &value, sizeof(value));
-	rpend->value = ntohl(value);
-	if (rpend->value < RPOW_VALUE_MIN || rpend->value > RPOW_VALUE_MAX)
-		goto error;
-	if (bnread (&rpend->rpow, rpio) < 0)
-		goto error;
-	gbig_copy (&rpend->rpowhidden, &rpend->rpow);
-	gbig_from_word (&rpend->invhider, 1);
-	return rpend;
-error:
-	gbig_free (&rpend->rpow);
-	gbig_free (&rpend->rpowhidden);
-	gbig_free (&rpend->invhider);
-	free (rpend);
+static void *
+proofworker (void *arg)
+{
+	proofthread *pt = arg;
+	proofjob *job = pt->job;
+	int r;
+
+	for (r=pt->num; r<job->rounds; r+=job->nthreads)
+		proofstep (job, r);
 	return NULL;
 }
 
-/* Write out an rpowpend */
-int
-rpowpend_write (rpowpend *rpend, rpowio *rpio)
+/* Do one step for all the rounds, each thread taking every nthreads'th */
+static void
+proofrun (proofjob *job, int step)
 {
-	int value = htonl(rpend->value);
-	if (rp_write (rpio, &value, sizeof(value)) != sizeof(value))
+	proofthread pt[PROOFMAXTHREADS];
+	int nstarted;
+	int i;
+
+	job->step = step;
+	for (i=0; i<job->nthreads; i++)
+	{
+		pt[i].job = job;
+		pt[i].num = i;
+	}
+#if !defined(_WIN32)
+	for (nstarted=1; nstarted<job->nthreads; nstarted++)
+		if (pthread_create (&pt[nstarted].tid, NULL, proofworker,
+				&pt[nstarted]) != 0)
+			break;
+#else
+	nstarted = 1;
+#endif
+	/* We do the first share, and any we could not start a thread for */
+	proofworker (&pt[0]);
+	for (i=nstarted; i<job->nthreads; i++)
+		proofworker (&pt[i]);
+#if !defined(_WIN32)
+	for (i=1; i<nstarted; i++)
+		pthread_join (pt[i].tid, NULL);
+#endif
+}
+
+/* Set up job for rounds rounds of proving or checking with base */
+static int
+proofjob_init (proofjob *job, gbignum *base, gbignum *exp, int rounds,
+	pubkey *pk)
+{
+	int nthreads = proofthreads;
+	int w;
+	int r;
+
+	memset (job, 0, sizeof(*job));
+#if !defined(_WIN32)
+	if (nthreads <= 0)
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > PROOFMAXTHREADS)
+		nthreads = PROOFMAXTHREADS;
+	if (nthreads > rounds)
+		nthreads = rounds;
+	job->nthreads = nthreads;
+	job->rounds = rounds;
+	job->pk = pk;
+	job->exp = exp;
+	job->base = base;
+	if ((job->mont = gbig_mont_new (&pk->n)) == NULL)
 		return -1;
-	if (bnwrite (&rpend->rpowhidden, rpio) < 0)
+
+	job->rnd = malloc (rounds * sizeof(gbignum));
+	job->rn = malloc (rounds * sizeof(gbignum));
+	job->c = malloc (rounds * sizeof(gbignum));
+	job->v = malloc (rounds * sizeof(gbignum));
+	job->ok = calloc (rounds, 1);
+	if (!job->rnd || !job->rn || !job->c || !job->v || !job->ok)
 		return -1;
+	for (r=0; r<rounds; r++)
+	{
+		gbig_init (&job->rnd[r]);
+		gbig_init (&job->rn[r]);
+		gbig_init (&job->c[r]);
+		gbig_init (&job->v[r]);
+	}
+
+	if ((w = prooftab_window (rounds)) > 0)
+	{
+		if ((job->tab = calloc (1, sizeof(prooftab))) == NULL
+				|| prooftab_init (job->tab, base, w, job->mont) < 0)
+			return -1;
+	}
 	return 0;
 }
 
-/* Read and validate a signed rpowpend from the server, producing a new rpow */
-rpow *
-rpowpend_rpow (rpowpend *rpend, pubkey *pk, rpowio *rpio)
+static void
+proofjob_free (proofjob *job)
 {
-	rpow *rp = calloc (sizeof(rpow), 1);
-	gbignum tmp1;
-	gbignum exp;
+	int r;
 
-	gbig_init (&tmp1);
-	gbig_init (&exp);
-	gbig_init (&rp->bn);
+	if (job->rnd && job->rn && job->c && job->v)
+	{
+		for (r=0; r<job->rounds; r++)
+		{
+			gbig_free (&job->rnd[r]);
+			gbig_free (&job->rn[r]);
+			gbig_free (&job->c[r]);
+			gbig_free (&job->v[r]);
+		}
+	}
+	free (job->rnd);
+	free (job->rn);
+	free (job->c);
+	free (job->v);
+	free (job->ok);
+	if (job->tab)
+	{
+		if (job->tab->tab)
+			prooftab_free (job->tab);
+		free (job->tab);
+	}
+	if (job->mont)
+		gbig_mont_free (job->mont);
+}
 
-	if (valuetoexp (&exp, rpend->value, pk) < 0)
-		goto error;
+/* Hash the commitments and derive each round's challenge from that */
+static void
+proofchallenges (proofjob *job)
+{
+	uchar chalbuf[SHA1_DIGEST_LENGTH];
+	uchar *rnp;
+	unsigned rnlen, rnlen1;
+	gbig_sha1ctx ctx;
+	int r;
 
-	if (bnread (&rp->bn, rpio) < 0)
-		goto error;
-	gbig_mod_mul (&rp->bn, &rp->bn, &rpend->invhider, &pk->n);
+	gbig_sha1_init (&ctx);
+	for (r=0; r<job->rounds; r++)
+	{
+		rnlen = gbig_buflen (&job->rn[r]);
+		rnp = malloc (rnlen);
+		gbig_to_buf (rnp, &job->rn[r]);
+		rnlen1 = htonl(rnlen);
+		gbig_sha1_update (&ctx, &rnlen1, sizeof(rnlen1));
+		gbig_sha1_update (&ctx, rnp, rnlen);
+		free (rnp);
+	}
+	gbig_sha1_final (chalbuf, &ctx);
 
-	/* Validate signature */
-	gbig_mod_exp (&tmp1, &rp->bn, &exp, &pk->n);
-	if (gbig_cmp (&tmp1, &rpend->rpow) != 0)
-		goto error;
+	for (r=0; r<job->rounds; r++)
+	{
+		gbig_sha1_buf (chalbuf, chalbuf, sizeof(chalbuf));
+		gbig_from_buf (&job->c[r], chalbuf, sizeof(chalbuf));
+	}
+}
 
-	rp->idlen = rpend->idlen;
-	rp->id = malloc (rp->idlen);
-	memcpy (rp->id, rpend->id, rpend->idlen);
-	rp->type = RPOW_TYPE_RPOW;
-	rp->value = rpend->value;
-	memcpy (rp->keyid, pk->keyid, sizeof(rp->keyid));
-	gbig_free (&tmp1);
-	gbig_free (&exp);
-	return rp;
-error:
-	gbig_free (&rp->bn);
-	free (rp);
-	gbig_free (&tmp1);
+/* As rpow_sig_prove1, and writes the same proof */
+static int
+rpow_sig_prove (gbignum *sig, int value, int proofstrength,
+	pubkey *pk, rpowio *rpio)
+{
+	proofjob job;
+	gbignum exp;
+	int err = -1;
+	int r;
+
+	gbig_init (&exp);
+	if (valuetoexp (&exp, value, pk) < 0)
+		goto done;
+	if (proofjob_init (&job, sig, &exp,
+			rpow_proof_rounds (&exp, proofstrength), pk) < 0)
+		goto free;
+
+	/*
+	 * Draw the rnds here, not on the workers.  Two rounds with the same
+	 * one would give away sig, so they must not depend on the random
+	 * source being safe to share between threads.
+	 */
+	for (r=0; r<job.rounds; r++)
+		gbig_rand_range (&job.rnd[r], &gbig_value_zero, &pk->n);
+	proofrun (&job, PROOF_COMMIT);
+	proofchallenges (&job);
+	proofrun (&job, PROOF_RESPOND);
+
+	for (r=0; r<job.rounds; r++)
+		if (bnwrite (&job.rn[r], rpio) < 0)
+			goto free;
+	for (r=0; r<job.rounds; r++)
+		if (bnwrite (&job.v[r], rpio) < 0)
+			goto free;
+	err = 0;
+free:
+	proofjob_free (&job);
+done:
 	gbig_free (&exp);
-	return NULL;
+	return err;
 }
 
-/* Free an rpowpend */
-void
-rpowpend_free (rpowpend *rpend)
+/* As rpow_sig_verify1; return 0 if OK */
+static int
+rpow_sig_verify (gbignum *rp, int value, int proofstrength,
+	pubkey *pk, rpowio *rpio)
 {
-	gbig_free (&rpend->rpow);
-	gbig_free (&rpend->rpowhidden);
-	gbig_free (&rpend->invhider);
-	free (rpend);
-}
+	proofjob job;
+	gbignum exp;
+	int err = -1;
+	int r;
 
+	gbig_init (&exp);
+	if (valuetoexp (&exp, value, pk) < 0)
+		goto done;
+	if (proofjob_init (&job, rp, &exp,
+			rpow_proof_rounds (&exp, proofstrength), pk) < 0)
+		goto free;
+
+	/* Honest proofs have everything reduced mod n */
+	for (r=0; r<job.rounds; r++)
+		if (bnread (&job.rn[r], rpio) < 0
+				|| gbig_cmp (&job.rn[r], &pk->n) >= 0)
+			goto free;
+	for (r=0; r<job.rounds; r++)
+		if (bnread (&job.v[r], rpio) < 0
+				|| gbig_cmp (&job.v[r], &pk->n) >= 0)
+			goto free;
+	proofchallenges (&job);
+	proofrun (&job, PROOF_CHECK);
+
+	for (r=0; r<job.rounds; r++)
+		if (!job.ok[r])
+			goto free;
+	err = 0;
+free:
+	proofjob_free (&job);
+done:
+	gbig_free (&exp);
+	return err;
+}
 
-#if 0
-/* Validate an rpow token, return 0 if OK, error code if bad */
+/*
+ * Time proofs with the reference and the fast code, about secs seconds
+ * of each, using a made up signature under pk.  rates[] gets proofs per
+ * second for prove1, prove, verify1 and verify in that order.  Each
+ * side's proof is checked by the other side's verifier too.  Returns 0,
+ * or -1 if a proof fails to check.
+ */
 int
-rpow_validate (rpow *rp)
+rpow_proof_bench (pubkey *pk, int value, int proofstrength, double secs,
+	double rates[4])
+{
+	gbignum sig;
+	gbignum rp;
+	gbignum exp;
+	rpowio *rpio;
+	BIO *bio;
+	uchar *proof[2];
+	long prooflen[2];
+	char *p;
+	double start, t;
+	int n;
+	int i;
+	int err = 0;
+
+	gbig_init (&sig);
+	gbig_init (&rp);
+	gbig_init (&exp);
+	if (valuetoexp (&exp, value, pk) < 0)
+		return -1;
+	gbig_rand_range (&sig, &gbig_value_zero, &pk->n);
+	gbig_mod_exp (&rp, &sig, &exp, &pk->n);
+
+	for (i=0; i<4; i++)
+	{
+		start = mintclock ();
+		n = 0;
+		do {
+			if (i < 2)
+			{
+				bio = BIO_new (BIO_s_mem());
+				rpio = rp_new_from_bio (bio);
+				if ((i == 0 ? rpow_sig_prove1 : rpow_sig_prove) (&sig, value,
+						proofstrength, pk, rpio) < 0)
+					err = -1;
+				/* Keep the first of each for the verifiers */
+				if (n == 0)
+				{
+					prooflen[i] = BIO_get_mem_data (bio, &p);
+					proof[i] = malloc (prooflen[i]);
+					memcpy (proof[i], p, prooflen[i]);
+				}
+			}
+			else
+			{
+				/* Each verifier checks the other side's proof */
+				rpio = rp_new_from_buf (proof[3-i], prooflen[3-i]);
+				if ((i == 2 ? rpow_sig_verify1 : rpow_sig_verify) (&rp, value,
+						proofstrength, pk, rpio) != 0)
+					err = -1;
+			}
+			rp_free (rpio);
+			++n;
+		} while ((t = mintclock () - start) < secs);
+		rates[i] = n / t;
+	}
+
+	free (proof[0]);
+	free (proof[1]);
+	gbig_free (&sig);
+	gbig_free (&rp);
+	gbig_free (&exp);
+	return err;
+}
+
+
+/* Free an rpow */
+void
+rpow_free (rpow *rp)
+{
+	if (rp->id)
+		free (rp->id);
+	gbig_free (&rp->bn);
+	free (rp);
+}
+
+/* Put the POW resource name in buf, which holds POW_RESOURCE_LENGTH */
+char *
+powresource_r (char *buf, unsigned char *cardid)
+{
+	int i;
+
+	buf[0] = 0;
+	for (i=0; i<8; i++)
+		sprintf (buf+strlen(buf), "%02x", cardid[i]);
+	strcat (buf, "-");
+	for (; i<12; i++)
+		sprintf (buf+strlen(buf), "%02x", cardid[i]);
+	strcat (buf, "-");
+	for (; i<CARDID_LENGTH; i++)
+		sprintf (buf+strlen(buf), "%02x", cardid[i]);
+	strcat (buf, POW_RESOURCE_TAIL);
+	return buf;
+}
+
+/* Return the POW resource name in a static buffer */
+char *
+powresource (unsigned char *cardid)
+{
+	static char resource[POW_RESOURCE_LENGTH];
+
+	return powresource_r (resource, cardid);
+}
+
+/*
+ * Parallel hashcash minting.  A stamp is 1:value:YYMMDD:resource::rand:counter
+ * and only the counter changes as we search, so each thread takes its own
+ * part of the counter space: its counters are its thread number as two hex
+ * digits followed by MINTDIGITS more, which it counts up in place.  The rand
+ * field is made long enough that the counter ends just where SHA-1 padding
+ * fits in the same block, so sha1mint can hash everything before that block
+ * once and try SHA1MINT_LANES counters per call.  The first thread to find
+ * a stamp with value leading zero bits tells the others to stop.
+ */
+
+#define MINTMAXTHREADS	64
+#define MINTDIGITS		14		/* 56 bits of counter per thread */
+#define MINTCOUNTERLEN	(2 + MINTDIGITS)
+#define MINTCOUNTERPOS	(SHA1MINT_LANEBYTE + 1 - MINTCOUNTERLEN)
+#define MINTCHECK		256		/* Calls between looking for a winner */
+
+typedef struct mintjob {
+	unsigned mid[5];			/* SHA-1 state before the last block */
+	uchar block[64];			/* Last block, counter all zeros */
+	char *prefix;				/* Stamp up to the counter */
+	int prefixlen;
+	int value;
+	int done;					/* Protected by lock */
+	char *stamp;				/* Malloc'd winning stamp */
+#if !defined(_WIN32)
+	pthread_mutex_t lock;
+#endif
+} mintjob;
+
+typedef struct mintthread {
+	mintjob *job;
+	int num;
+	double tries;
+	double secs;
+#if !defined(_WIN32)
+	pthread_t tid;
+#endif
+} mintthread;
+
+static const char mintdigits[] = "0123456789abcdef";
+
+/* Threads for rpow_gen, 0 for one per processor */
+static int mintthreads;
+
+/* Hashes per second of each thread in the last rpow_gen */
+static double mintrates[MINTMAXTHREADS];
+static int nmintrates;
+#if !defined(_WIN32)
+static pthread_mutex_t mintratelock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static double
+mintclock (void)
+{
+#if !defined(_WIN32)
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+#else
+	return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Set the winning stamp unless another thread got there first */
+static void
+mintwin (mintjob *job, char *counter, int counterlen)
+{
+#if !defined(_WIN32)
+	pthread_mutex_lock (&job->lock);
+#endif
+	if (!job->done)
+	{
+		job->done = 1;
+		job->stamp = malloc (job->prefixlen + counterlen + 1);
+		memcpy (job->stamp, job->prefix, job->prefixlen);
+		memcpy (job->stamp + job->prefixlen, counter, counterlen);
+		job->stamp[job->prefixlen + counterlen] = '\0';
+	}
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&job->lock);
+#endif
+}
+
+/* Search one thread's part of the counter space until someone wins */
+static void *
+mintworker (void *arg)
+{
+	mintthread *mt = arg;
+	mintjob *job = mt->job;
+	uchar block[64];
+	uchar *counter = block + MINTCOUNTERPOS;
+	double start = mintclock ();
+	int done = 0;
+	int i, j, n;
+
+	memcpy (block, job->block, sizeof(block));
+	counter[0] = mintdigits[mt->num >> 4];
+	counter[1] = mintdigits[mt->num & 0xf];
+	while (!done)
+	{
+		for (n=0; n<MINTCHECK; n++)
+		{
+			if ((j = sha1mint_search (job->mid, block, job->value)) >= 0)
+			{
+				counter[MINTCOUNTERLEN-1] = mintdigits[j];
+				mintwin (job, (char *)counter, MINTCOUNTERLEN);
+				mt->tries += j + 1;
+				break;
+			}
+			/* Count up in hex, sha1mint_search does the last digit */
+			for (i=MINTCOUNTERLEN-2; i>=2; i--)
+			{
+				if (counter[i] == '9')
+				{
+					counter[i] = 'a';
+					break;
+				}
+				if (counter[i] != 'f')
+				{
+					++counter[i];
+					break;
+				}
+				counter[i] = '0';
+			}
+		}
+		mt->tries += (double) n * SHA1MINT_LANES;
+#if !defined(_WIN32)
+		pthread_mutex_lock (&job->lock);
+#endif
+		done = job->done;
+#if !defined(_WIN32)
+		pthread_mutex_unlock (&job->lock);
+#endif
+	}
+	mt->secs = mintclock () - start;
+	return NULL;
+}
+
+/* Return a malloc'd hashcash stamp with value bits of work */
+static char *
+powmint (int value, char *resource)
+{
+	mintthread mt[MINTMAXTHREADS];
+	mintjob job;
+	uchar rnd[80];
+	struct tm *tm;
+	time_t now;
+	unsigned bits;
+	int nthreads = mintthreads;
+	int nstarted;
+	int nrand;
+	int len;
+	int i;
+
+#if !defined(_WIN32)
+	if (nthreads <= 0)
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > MINTMAXTHREADS)
+		nthreads = MINTMAXTHREADS;
+
+	memset (&job, 0, sizeof(job));
+	job.value = value;
+	job.prefix = malloc (strlen(resource) + sizeof(rnd) + 32);
+	now = time(0);
+	tm = gmtime (&now);
+	sprintf (job.prefix, "1:%d:%02d%02d%02d:%s::", value, tm->tm_year % 100,
+			tm->tm_mon + 1, tm->tm_mday, resource);
+
+	/* At least 16 hex digits of rand, then enough to line up the counter */
+	len = strlen (job.prefix);
+	nrand = 16 + (MINTCOUNTERPOS - (len + 16 + 1) % 64 + 64) % 64;
+	gbig_rand_bytes (rnd, sizeof(rnd));
+	for (i=0; i<nrand; i++)
+		job.prefix[len++] = mintdigits[rnd[i] & 0xf];
+	job.prefix[len++] = ':';
+	job.prefix[len] = '\0';
+	job.prefixlen = len;
+
+	sha1mint_midstate (job.mid, (uchar *)job.prefix, len / 64);
+	memcpy (job.block, job.prefix + len - MINTCOUNTERPOS, MINTCOUNTERPOS);
+	memset (job.block + MINTCOUNTERPOS, '0', MINTCOUNTERLEN);
+	job.block[MINTCOUNTERPOS + MINTCOUNTERLEN] = 0x80;
+	bits = (len + MINTCOUNTERLEN) * 8;
+	job.block[60] = bits >> 24;
+	job.block[61] = bits >> 16;
+	job.block[62] = bits >> 8;
+	job.block[63] = bits;
+
+	/* Choose the SHA-1 core before the threads use it */
+	sha1mint_core ();
+
+	for (i=0; i<nthreads; i++)
+	{
+		mt[i].job = &job;
+		mt[i].num = i;
+		mt[i].tries = 0;
+		mt[i].secs = 0;
+	}
+#if !defined(_WIN32)
+	pthread_mutex_init (&job.lock, NULL);
+	for (nstarted=0; nstarted<nthreads; nstarted++)
+		if (pthread_create (&mt[nstarted].tid, NULL, mintworker,
+				&mt[nstarted]) != 0)
+			break;
+	if (nstarted == 0)
+	{
+		mintworker (&mt[0]);
+		nstarted = 1;
+	}
+	else
+	{
+		for (i=0; i<nstarted; i++)
+			pthread_join (mt[i].tid, NULL);
+	}
+	pthread_mutex_destroy (&job.lock);
+#else
+	mintworker (&mt[0]);
+	nstarted = 1;
+#endif
+
+#if !defined(_WIN32)
+	pthread_mutex_lock (&mintratelock);
+#endif
+	for (i=0; i<nstarted; i++)
+		mintrates[i] = mt[i].secs > 0 ? mt[i].tries / mt[i].secs : 0;
+	nmintrates = nstarted;
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&mintratelock);
+#endif
+	free (job.prefix);
+	return job.stamp;
+}
+
+/* Set the number of threads rpow_gen uses, 0 for one per processor */
+void
+rpow_gen_threads (int nthreads)
+{
+	mintthreads = nthreads;
+}
+
+/*
+ * Fill in the hashes per second of each thread in the last rpow_gen,
+ * up to max of them, and return how many threads there were.
+ */
+int
+rpow_gen_rates (double *rates, int max)
+{
+	int n;
+	int i;
+
+#if !defined(_WIN32)
+	pthread_mutex_lock (&mintratelock);
+#endif
+	for (i=0; i<nmintrates && i<max; i++)
+		rates[i] = mintrates[i];
+	n = nmintrates;
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&mintratelock);
+#endif
+	return n;
+}
+
+/* Generate a "hashcash" type of proof of work token */
+rpow *
+rpow_gen (int value, unsigned char *cardid)
+{
+	rpow *rp = calloc (sizeof(rpow), 1);
+	char resource[POW_RESOURCE_LENGTH];
+
+	gbig_init (&rp->bn);
+
+	if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+	{
+		free (rp);
+		return NULL;
+	}
+
+	rp->value = value;
+
+	rp->id = (uchar *) powmint (value, powresource_r (resource, cardid));
+	assert (rp->id != NULL);
+
+	/* rp->id holds a malloc buffer with the token */
+	rp->idlen = strlen(rp->id);
+	rp->type = RPOW_TYPE_HASHCASH;
+	return rp;
+}
+
+
+/* Generate the rpow field of an rpowpend */
+static void
+rpowpend_bn_gen (gbignum *bn, uchar *id, unsigned idlen, pubkey *pk)
+{
+	uchar md[SHA_DIGEST_LENGTH];
+	uchar *buf;
+	int nlen = gbig_buflen (&pk->n);
+	int off;
+
+	buf = malloc (nlen);
+	SHA1 (id, idlen, buf);
+	buf[SHA_DIGEST_LENGTH] = RPOW_PK_VAL;
+	off = SHA_DIGEST_LENGTH + 1;
+	while (off < nlen)
+	{
+		SHA1 (buf, off, md);
+		memcpy (buf+off, md, MIN(SHA_DIGEST_LENGTH, nlen-off));
+		off += SHA_DIGEST_LENGTH;
+	}
+	gbig_from_buf (bn, buf, nlen);
+	gbig_mod (bn, bn, &pk->n);
+	free (buf);
+}
+
+
+/* Generate an rpowpend of the specified value */
+/* dohide means to hide the value to be signed, used for splitting rpows */
+rpowpend *
+rpowpend_gen (int value, int dohide, pubkey *pk)
+{
+	rpowpend *rpend;
+
+	if (rpowpend_gen_batch (&rpend, 1, &value, dohide, pk) < 0)
+		return NULL;
+	return rpend;
+}
+
+/*
+ * Generate n rpowpends at once, of values[i], into rpend[].  The hiders
+ * are inverted together by Montgomery's trick: we invert the product
+ * of them all and get each inverse from that with three multiplies.
+ * Returns 0, or -1 with no rpowpends made.
+ */
+int
+rpowpend_gen_batch (rpowpend **rpend, int n, int *values, int dohide,
+	pubkey *pk)
+{
+	gbignum *hider = NULL;
+	gbignum *prod = NULL;		/* prod[i] is hider[0] * ... * hider[i] */
+	gbignum inv;
+	gbignum exp;
+	gbignum ehider;
+	gbig_mont *mont = NULL;
+	int err = -1;
+	int i;
+
+	gbig_init (&inv);
+	gbig_init (&exp);
+	gbig_init (&ehider);
+	for (i=0; i<n; i++)
+		rpend[i] = NULL;
+	for (i=0; i<n; i++)
+		if (valuetoexp (&exp, values[i], pk) < 0)
+			goto done;
+
+	for (i=0; i<n; i++)
+	{
+		if ((rpend[i] = calloc (sizeof(rpowpend), 1)) == NULL)
+			goto done;
+		gbig_init (&rpend[i]->rpow);
+		gbig_init (&rpend[i]->rpowhidden);
+		gbig_init (&rpend[i]->invhider);
+		rpend[i]->value = values[i];
+		rpend[i]->idlen = RPOW_ID_LENGTH;
+		gbig_rand_bytes (rpend[i]->id, rpend[i]->idlen - CARDID_LENGTH);
+		memcpy (rpend[i]->id + rpend[i]->idlen - CARDID_LENGTH, pk->cardid,
+				CARDID_LENGTH);
+		rpowpend_bn_gen (&rpend[i]->rpow, rpend[i]->id, rpend[i]->idlen, pk);
+		if (!dohide)
+		{
+			gbig_copy (&rpend[i]->rpowhidden, &rpend[i]->rpow);
+			gbig_from_word (&rpend[i]->invhider, 1);
+		}
+	}
+	if (!dohide || n == 0)
+	{
+		err = 0;
+		goto done;
+	}
+
+	hider = malloc (n * sizeof(gbignum));
+	prod = malloc (n * sizeof(gbignum));
+	if (hider == NULL || prod == NULL
+			|| (mont = gbig_mont_new (&pk->n)) == NULL)
+		goto done;
+	for (i=0; i<n; i++)
+	{
+		gbig_init (&hider[i]);
+		gbig_init (&prod[i]);
+		gbig_rand_range (&hider[i], &gbig_value_one, &pk->n);
+		if (i == 0)
+			gbig_copy (&prod[i], &hider[i]);
+		else
+			gbig_mod_mul (&prod[i], &prod[i-1], &hider[i], &pk->n);
+	}
+	if (gbig_mod_inverse (&inv, &prod[n-1], &pk->n) != NULL)
+	{
+		/* inv is 1/prod[i] going down; times prod[i-1] it is 1/hider[i] */
+		for (i=n-1; i>0; i--)
+		{
+			gbig_mod_mul (&rpend[i]->invhider, &inv, &prod[i-1], &pk->n);
+			gbig_mod_mul (&inv, &inv, &hider[i], &pk->n);
+		}
+		gbig_copy (&rpend[0]->invhider, &inv);
+
+		for (i=0; i<n; i++)
+		{
+			valuetoexp (&exp, values[i], pk);
+			gbig_mod_exp_mont (&ehider, &hider[i], &exp, &pk->n, mont);
+			gbig_mod_mul (&rpend[i]->rpowhidden, &rpend[i]->rpow, &ehider,
+				&pk->n);
+		}
+		err = 0;
+	}
+	for (i=0; i<n; i++)
+	{
+		gbig_free (&hider[i]);
+		gbig_free (&prod[i]);
+	}
+
+done:
+	if (err < 0)
+	{
+		for (i=0; i<n; i++)
+			if (rpend[i] != NULL)
+			{
+				rpowpend_free (rpend[i]);
+				rpend[i] = NULL;
+			}
+	}
+	if (mont)
+		gbig_mont_free (mont);
+	free (hider);
+	free (prod);
+	gbig_free (&inv);
+	gbig_free (&exp);
+	gbig_free (&ehider);
+	return err;
+}
+
+/* Read an rpowpend written by rpowpend_write */
+rpowpend *
+rpowpend_read (rpowio *rpio)
+{
+	rpowpend *rpend = calloc (sizeof(rpowpend), 1);
+	int value;
+
+	gbig_init (&rpend->rpow);
+	gbig_init (&rpend->rpowhidden);
+	gbig_init (&rpend->invhider);
+
+	rp_read (rpio, &value, sizeof(value));
+	rpend->value = ntohl(value);
+	if (rpend->value < RPOW_VALUE_MIN || rpend->value > RPOW_VALUE_MAX)
+		goto error;
+	if (bnread (&rpend->rpow, rpio) < 0)
+		goto error;
+	gbig_copy (&rpend->rpowhidden, &rpend->rpow);
+	gbig_from_word (&rpend->invhider, 1);
+	return rpend;
+error:
+	gbig_free (&rpend->rpow);
+	gbig_free (&rpend->rpowhidden);
+	gbig_free (&rpend->invhider);
+	free (rpend);
+	return NULL;
+}
+
+/* Write out an rpowpend */
+int
+rpowpend_write (rpowpend *rpend, rpowio *rpio)
+{
+	int value = htonl(rpend->value);
+	if (rp_write (rpio, &value, sizeof(value)) != sizeof(value))
+		return -1;
+	if (bnwrite (&rpend->rpowhidden, rpio) < 0)
+		return -1;
+	return 0;
+}
+
+/* Read and validate a signed rpowpend from the server, producing a new rpow */
+rpow *
+rpowpend_rpow (rpowpend *rpend, pubkey *pk, rpowio *rpio)
+{
+	rpow *rp;
+
+	rpowpend_rpow_batch (&rp, &rpend, 1, pk, rpio);
+	return rp;
+}
+
+/*
+ * Read and validate n signed rpowpends in a row from the server, putting
+ * the new rpows in rpout[], or NULL for any that are bad.  The checks all
+ * share one Montgomery context for pk.  Returns 0 if all are good, else
+ * -1.
+ */
+int
+rpowpend_rpow_batch (rpow **rpout, rpowpend **rpend, int n, pubkey *pk,
+	rpowio *rpio)
+{
+	rpow *rp;
+	gbignum tmp1;
+	gbignum exp;
+	gbig_mont *mont;
+	int err = 0;
+	int i;
+
+	for (i=0; i<n; i++)
+		rpout[i] = NULL;
+	if ((mont = gbig_mont_new (&pk->n)) == NULL)
+		return -1;
+	gbig_init (&tmp1);
+	gbig_init (&exp);
+
+	for (i=0; i<n; i++)
+	{
+		rp = calloc (sizeof(rpow), 1);
+		gbig_init (&rp->bn);
+
+		if (valuetoexp (&exp, rpend[i]->value, pk) < 0)
+			goto bad;
+
+		if (bnread (&rp->bn, rpio) < 0)
+			goto bad;
+		/* Unhidden ones have an invhider of one */
+		if (gbig_cmp (&rpend[i]->invhider, &gbig_value_one) != 0)
+			gbig_mod_mul (&rp->bn, &rp->bn, &rpend[i]->invhider, &pk->n);
+
+		/* Validate signature */
+		gbig_mod_exp_mont (&tmp1, &rp->bn, &exp, &pk->n, mont);
+		if (gbig_cmp (&tmp1, &rpend[i]->rpow) != 0)
+			goto bad;
+
+		rp->idlen = rpend[i]->idlen;
+		rp->id = malloc (rp->idlen);
+		memcpy (rp->id, rpend[i]->id, rpend[i]->idlen);
+		rp->type = RPOW_TYPE_RPOW;
+		rp->value = rpend[i]->value;
+		memcpy (rp->keyid, pk->keyid, sizeof(rp->keyid));
+		rpout[i] = rp;
+		continue;
+bad:
+		gbig_free (&rp->bn);
+		free (rp);
+		err = -1;
+	}
+
+	gbig_mont_free (mont);
+	gbig_free (&tmp1);
+	gbig_free (&exp);
+	return err;
+}
+
+/* Free an rpowpend */
+void
+rpowpend_free (rpowpend *rpend)
+{
+	gbig_free (&rpend->rpow);
+	gbig_free (&rpend->rpowhidden);
+	gbig_free (&rpend->invhider);
+	free (rpend);
+}
+
+
+#if 0
+/* Validate an rpow token, return 0 if OK, error code if bad */
+int
+rpow_validate (rpow *rp)
 {
 	if (rp->type == RPOW_TYPE_HASHCASH)
 		return rpow_valid_pow (rp);
 	else
-		return rpow_valid_pk (rp);
+		return rpow_valid_pk (rp);
+}
+
+/* Given a POW token (hashcash version 1), parse out the fields */
+/* Example:  1:15:040719:rpow.net::9e6c82f8e4727a6d:1ec4 */
+/* The pointers returned are pointers into the input str */
+/* str does not have to be null terminated */
+/* Return error if no good */
+#define MAXFIELDS	6
+static int
+pow_parse (const char *str, int len, int *pvalue, time_t *ptime,
+		char **presource, char **pparams)
+{
+	static char str2[MAX_TOK];
+	char *pstr = str2;
+	char *field[MAXFIELDS];
+	int nfields = 0;
+	int timelen;
+	struct tm powtm;
+	char *powtime;
+	char tbuf[3];
+
+	if (len > MAX_TOK || len < MAXFIELDS
+				|| str[0] != '1' || str[1] != ':')
+		return RPOW_STAT_INVALID;
+
+	strncpy (str2, str, len);
+
+	while (len--)
+	{
+		if (*pstr == '\0')
+			return RPOW_STAT_INVALID;
+		if (*pstr == ':')
+		{
+			if (nfields+1 > MAXFIELDS)
+				return RPOW_STAT_INVALID;
+			field[nfields++] = pstr+1;
+			*pstr = '\0';
+		}
+		++pstr;
+	}
+
+	if (nfields != MAXFIELDS)
+		return RPOW_STAT_INVALID;
+
+	powtime = field[1];
+	timelen = strlen (powtime);
+	if (timelen < 6)
+		return RPOW_STAT_INVALID;
+
+	if (pvalue)
+		*pvalue = atoi(field[0]);
+	if (presource)
+		*presource = field[2];
+	if (pparams)
+		*pparams = field[3];
+	if (ptime)
+	{
+		memset (&powtm, 0, sizeof(powtm));
+		memset (tbuf, 0, sizeof(tbuf));
+		strncpy (tbuf, powtime, 2);
+		powtm.tm_year = atoi(tbuf) + 100;
+		strncpy (tbuf, powtime+2, 2);
+		powtm.tm_mon = atoi(tbuf) - 1;
+		strncpy (tbuf, powtime+4, 2);
+		powtm.tm_mday = atoi(tbuf);
+		*ptime = mktime(&powtm);
+	}
+	return RPOW_STAT_OK;
+}
+
+int
+rpow_valid_pow (rpow *rp)
+{
+	int rslt;
+	time_t nowtime, powtime;
+	int powvalue;
+	char *powresource1;
+	uchar md[SHA1_DIGEST_LENGTH];
+	int i;
+
+	if (rp->value < RPOW_VALUE_MIN || rp->value > RPOW_VALUE_MAX)
+		return RPOW_STAT_INVALID;
+
+	/* Parse the POW and see if its fields are legal */
+	rslt = pow_parse (rp->id, rp->idlen, &powvalue, &powtime,
+				&powresource, NULL);
+	if (rslt < 0)
+		return rslt;
+	if (powvalue != rp->value)
+		return RPOW_STAT_INVALID;
+	if (strcmp (powresource1, powresource) != 0)
+		return RPOW_STAT_BADRESOURCE;
+	nowtime = time(0);
+	if (powtime > nowtime + POW_GRACESECONDS ||
+			powtime < nowtime - POW_EXPIRYSECONDS)
+		return RPOW_STAT_BADTIME;
+
+	/* Now test the hash to see if it has the right number of high 0's */
+	gbig_sha1_buf (md, rp->id, rp->idlen);
+	for (i=0; (i+1)*8<powvalue; i++)
+		if (md[i] != 0)
+			return RPOW_STAT_INVALID;
+	if (md[i] & ~(0xff >> (powvalue&7)))
+		return RPOW_STAT_INVALID;
+
+	return RPOW_STAT_OK;
+}
+
+/* Temporary version of this, return the one public key we know about */
+static struct pubkey *
+pk_from_keyid (unsigned char *keyid)
+{
+	extern pubkey signpubkey;
+	if (memcmp (signpubkey.keyid, keyid, KEYID_LENGTH) != 0)
+		return NULL;
+	return &signpubkey;
+}
+
+int
+rpow_valid_pk (rpow *rp)
+{
+	pubkey *pk;
+	gbignum paddedid;
+	gbignum pow;
+	gbignum exp;
+	int stat = RPOW_STAT_OK;
+
+	if ((pk = pk_from_keyid (rp->keyid)) == NULL)
+		return RPOW_STAT_WRONGKEY;
+
+	gbig_init (&paddedid);
+	gbig_init (&pow);
+	gbig_init (&exp);
+
+	if (valuetoexp (&exp, rp->value, pk) < 0)
+	{
+		stat = RPOW_STAT_INVALID;
+		goto done;
+	}
+	gbig_mod_exp (&pow, &rp->bn, &exp, &pk->n);
+	rpowpend_bn_gen (&paddedid, rp->id, rp->idlen, pk);
+	if (gbig_cmp (&pow, &paddedid) != 0)
+		stat = RPOW_STAT_INVALID;
+done:
+	gbig_free (&exp);
+	gbig_free (&pow);
+	gbig_free (&paddedid);
+	return stat;
+}
+#endif
+
+
+
+static void
+dolock (FILE *f)
+{
+#ifndef _WIN32
+	struct flock l;
+	l.l_start = l.l_len = 0;
+	l.l_pid = 0;
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+	while (fcntl (fileno(f), F_SETLKW, &l) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+/* As dolock, but return -1 at once if someone else has the lock */
+static int
+dotrylock (FILE *f)
+{
+#ifndef _WIN32
+	struct flock l;
+	int rc;
+	l.l_start = l.l_len = 0;
+	l.l_pid = 0;
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+	while ((rc = fcntl (fileno(f), F_SETLK, &l)) < 0 && errno == EINTR)
+		;
+	return rc < 0 ? -1 : 0;
+#else
+	return 0;
+#endif
+}
+
+static void
+dounlock (FILE *f)
+{
+#ifndef _WIN32
+	struct flock l;
+	l.l_start = l.l_len = 0;
+	l.l_pid = 0;
+	l.l_type = F_UNLCK;
+	l.l_whence = SEEK_SET;
+	fcntl (fileno(f), F_SETLK, &l);
+#endif
+}
+
+/* Append an rpow to the file fname */
+static int
+rpow_append (char *fname, rpow *rp)
+{
+	FILE *fout;
+	rpowio *rpout;
+
+	fout = fopen (fname, "ab");
+	if (fout == NULL)
+	{
+		return -1;
+	}
+	dolock (fout);
+	fseek (fout, 0, SEEK_END);
+	rpout = rp_new_from_file (fout);
+	rpow_write (rp, rpout);
+	dounlock (fout);
+	fclose (fout);
+	rp_free (rpout);
+	return 0;
+}
+
+/*
+ * The rpow store.  rpowfile starts with a header which has, for each
+ * value, the offset of the newest rpow of that value and how many there
+ * are.  Each record links to the next older one of its value, so taking
+ * or adding an rpow reads or writes one record and the header however
+ * big the store is.  A record which has been taken stays in the file,
+ * marked dead, until dead records are more than half the file and more
+ * than STORE_COMPACTBYTES; then the live ones are copied to a new file
+ * which replaces the old one.
+ *
+ * New records go past the end the header gives, and are synced before
+ * the header is updated to include them.  If we crash in between, the
+ * next open links in any complete records past the end and drops the
+ * rest.  Taking an rpow marks its record dead and syncs before the
+ * header unlinks it, so the flags are always right even when the header
+ * is not, and rpow_store_verify can rebuild the header from them, as
+ * the next open does if the file is shorter than the header says.  A
+ * store in the old format, just rpows one after another, is converted
+ * the first time it is opened.
+ *
+ * While rpowwallet has the store open the header has STORE_DIRTYMAGIC
+ * and only the flags and the records are kept up to date, so if it dies
+ * the next open rebuilds the header from them.
+ *
+ * Numbers are 4 bytes in network order.  The header is STORE_MAGIC, the
+ * end of the records, the bytes in live and in dead records, then the
+ * offset of the newest record of each value, 0 if none, then the counts.
+ * A record is the length of the rpow, its value, 1 if live or 0 if dead,
+ * two zeros, the offset of the next older record of the value, a check
+ * on the rpow, then the rpow as rpow_write writes it.
+ */
+#define STORE_MAGIC			0x52505331		/* "RPS1" */
+#define STORE_DIRTYMAGIC	0x52505357		/* "RPSW" */
+#define STORE_HDRWORDS		(4 + 2*RPOW_VALUE_COUNT)
+#define STORE_HDRSIZE		(4*STORE_HDRWORDS)
+#define STORE_RECSIZE		16
+#define STORE_COMPACTBYTES	65536
+
+#if defined(_WIN32)
+#define STORE_OPENFLAGS		(O_RDWR | O_CREAT | O_BINARY)
+#else
+#define STORE_OPENFLAGS		(O_RDWR | O_CREAT)
+#endif
+
+typedef struct storehdr {
+	int dirty;
+	unsigned end;
+	unsigned live;
+	unsigned dead;
+	unsigned head[RPOW_VALUE_COUNT];
+	unsigned count[RPOW_VALUE_COUNT];
+} storehdr;
+
+static unsigned
+getword (uchar *p)
+{
+	return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+putword (uchar *p, unsigned val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* Read or write len bytes at offset off */
+static int
+storeio (FILE *f, unsigned off, void *buf, unsigned len, int write)
+{
+	if (fseek (f, (long)off, SEEK_SET) != 0)
+		return -1;
+	if (write)
+		return fwrite (buf, 1, len, f) == len ? 0 : -1;
+	return fread (buf, 1, len, f) == len ? 0 : -1;
+}
+
+/* Get what we have written onto the disk */
+static void
+storesync (FILE *f)
+{
+	fflush (f);
+#if !defined(_WIN32)
+	fsync (fileno (f));
+#endif
+}
+
+static unsigned
+storecheck (uchar *buf, unsigned len)
+{
+	uchar md[SHA1_DIGEST_LENGTH];
+
+	gbig_sha1_buf (md, buf, len);
+	return getword (md);
+}
+
+static int
+storehdr_read (FILE *f, storehdr *h)
+{
+	uchar buf[STORE_HDRSIZE];
+	int i;
+
+	if (storeio (f, 0, buf, sizeof(buf), 0) < 0)
+		return -1;
+	if (getword (buf) == STORE_MAGIC)
+		h->dirty = 0;
+	else if (getword (buf) == STORE_DIRTYMAGIC)
+		h->dirty = 1;
+	else
+		return -1;
+	h->end = getword (buf + 4);
+	h->live = getword (buf + 8);
+	h->dead = getword (buf + 12);
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+	{
+		h->head[i] = getword (buf + 16 + 4*i);
+		h->count[i] = getword (buf + 16 + 4*RPOW_VALUE_COUNT + 4*i);
+	}
+	return 0;
 }
 
-/* Given a POW token (hashcash version 1), parse out the fields */
-/* Example:  1:15:040719:rpow.net::9e6c82f8e4727a6d:1ec4 */
-/* The pointers returned are pointers into the input str */
-/* str does not have to be null terminated */
-/* Return error if no good */
-#define MAXFIELDS	6
 static int
-pow_parse (const char *str, int len, int *pvalue, time_t *ptime,
-		char **presource, char **pparams)
+storehdr_write (FILE *f, storehdr *h)
 {
-	static char str2[MAX_TOK];
-	char *pstr = str2;
-	char *field[MAXFIELDS];
-	int nfields = 0;
-	int timelen;
-	struct tm powtm;
-	char *powtime;
-	char tbuf[3];
+	uchar buf[STORE_HDRSIZE];
+	int i;
 
-	if (len > MAX_TOK || len < MAXFIELDS
-				|| str[0] != '1' || str[1] != ':')
-		return RPOW_STAT_INVALID;
+	putword (buf, h->dirty ? STORE_DIRTYMAGIC : STORE_MAGIC);
+	putword (buf + 4, h->end);
+	putword (buf + 8, h->live);
+	putword (buf + 12, h->dead);
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+	{
+		putword (buf + 16 + 4*i, h->head[i]);
+		putword (buf + 16 + 4*RPOW_VALUE_COUNT + 4*i, h->count[i]);
+	}
+	return storeio (f, 0, buf, sizeof(buf), 1);
+}
 
-	strncpy (str2, str, len);
+/*
+ * Write a record for an rpow at the end of the store and link it in, in
+ * h only.  The caller syncs before writing the header.
+ */
+static int
+storeadd (FILE *f, storehdr *h, uchar *buf, unsigned len, int value)
+{
+	uchar rec[STORE_RECSIZE];
+	int v = value - RPOW_VALUE_MIN;
+
+	putword (rec, len);
+	rec[4] = value;
+	rec[5] = 1;
+	rec[6] = rec[7] = 0;
+	putword (rec + 8, h->head[v]);
+	putword (rec + 12, storecheck (buf, len));
+	if (storeio (f, h->end, rec, STORE_RECSIZE, 1) < 0
+			|| fwrite (buf, 1, len, f) != len)
+		return -1;
+	h->head[v] = h->end;
+	++h->count[v];
+	h->live += STORE_RECSIZE + len;
+	h->end += STORE_RECSIZE + len;
+	return 0;
+}
 
-	while (len--)
+/* Read the record at off, returning a malloc'd copy of its rpow */
+static uchar *
+storeget (FILE *f, unsigned off, uchar *rec, unsigned *plen)
+{
+	uchar *buf;
+	unsigned len;
+
+	if (storeio (f, off, rec, STORE_RECSIZE, 0) < 0)
+		return NULL;
+	len = getword (rec);
+	if ((buf = malloc (len)) == NULL)
+		return NULL;
+	if (fread (buf, 1, len, f) != len)
 	{
-		if (*pstr == '\0')
-			return RPOW_STAT_INVALID;
-		if (*pstr == ':')
+		free (buf);
+		return NULL;
+	}
+	*plen = len;
+	return buf;
+}
+
+/* Start an empty store in a temporary file, to replace rpowfile */
+static FILE *
+storetmp (char **ptmpname, storehdr *h)
+{
+	FILE *fnew;
+
+	*ptmpname = malloc (strlen(rpowfile) + 5);
+	strcpy (*ptmpname, rpowfile);
+	strcat (*ptmpname, ".new");
+	if ((fnew = fopen (*ptmpname, "w+b")) == NULL)
+	{
+		free (*ptmpname);
+		return NULL;
+	}
+	memset (h, 0, sizeof(*h));
+	h->end = STORE_HDRSIZE;
+	storehdr_write (fnew, h);
+	return fnew;
+}
+
+/* Finish the temporary store and put it in place of rpowfile */
+static int
+storeinstall (FILE *fnew, char *tmpname, storehdr *h)
+{
+	int err;
+
+	storesync (fnew);
+	err = storehdr_write (fnew, h);
+	storesync (fnew);
+	if (fclose (fnew) != 0)
+		err = -1;
+#if defined(_WIN32)
+	if (err == 0)
+		unlink (rpowfile);
+#endif
+	if (err == 0 && rename (tmpname, rpowfile) != 0)
+		err = -1;
+	if (err != 0)
+		unlink (tmpname);
+	free (tmpname);
+	return err;
+}
+
+/* Convert a store of rpows one after another to the indexed format */
+static int
+storemigrate (FILE *f)
+{
+	FILE *fnew;
+	char *tmpname;
+	storehdr h;
+	rpowio *rpio;
+	rpow *rp;
+	uchar *buf;
+	unsigned len;
+	int err = 0;
+
+	if ((fnew = storetmp (&tmpname, &h)) == NULL)
+		return -1;
+	fseek (f, 0, SEEK_SET);
+	rpio = rp_new_from_file (f);
+	while ((rp = rpow_read (rpio)) != NULL)
+	{
+		if (rp->value >= RPOW_VALUE_MIN && rp->value <= RPOW_VALUE_MAX)
 		{
-			if (nfields+1 > MAXFIELDS)
-				return RPOW_STAT_INVALID;
-			field[nfields++] = pstr+1;
-			*pstr = '\0';
+			buf = rpow_to_buf (&len, rp);
+			if (storeadd (fnew, &h, buf, len, rp->value) < 0)
+				err = -1;
+			free (buf);
 		}
-		++pstr;
+		rpow_free (rp);
+	}
+	rp_free (rpio);
+	if (err != 0)
+	{
+		fclose (fnew);
+		unlink (tmpname);
+		free (tmpname);
+		return -1;
 	}
+	return storeinstall (fnew, tmpname, &h);
+}
 
-	if (nfields != MAXFIELDS)
-		return RPOW_STAT_INVALID;
+/* Copy the live records to a new store which replaces this one */
+static int
+storecompact (FILE *f, storehdr *h)
+{
+	FILE *fnew;
+	char *tmpname;
+	storehdr hnew;
+	uchar rec[STORE_RECSIZE];
+	uchar *buf;
+	unsigned *offs;
+	unsigned off, len;
+	int i, n;
 
-	powtime = field[1];
-	timelen = strlen (powtime);
-	if (timelen < 6)
-		return RPOW_STAT_INVALID;
+	if ((fnew = storetmp (&tmpname, &hnew)) == NULL)
+		return -1;
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+	{
+		/* Oldest first, so they keep their order */
+		offs = malloc ((h->count[i] + 1) * sizeof(unsigned));
+		for (n=0, off=h->head[i]; off!=0 && n<h->count[i]; n++)
+		{
+			offs[n] = off;
+			if (storeio (f, off, rec, STORE_RECSIZE, 0) < 0)
+				break;
+			off = getword (rec + 8);
+		}
+		while (n-- > 0)
+		{
+			if ((buf = storeget (f, offs[n], rec, &len)) == NULL
+					|| storeadd (fnew, &hnew, buf, len, i + RPOW_VALUE_MIN) < 0)
+			{
+				free (buf);
+				free (offs);
+				fclose (fnew);
+				unlink (tmpname);
+				free (tmpname);
+				return -1;
+			}
+			free (buf);
+		}
+		free (offs);
+	}
+	return storeinstall (fnew, tmpname, &hnew);
+}
 
-	if (pvalue)
-		*pvalue = atoi(field[0]);
-	if (presource)
-		*presource = field[2];
-	if (pparams)
-		*pparams = field[3];
-	if (ptime)
+/* Link in complete records past the end, left by a crash */
+static void
+storerecover (FILE *f, storehdr *h, unsigned size)
+{
+	uchar rec[STORE_RECSIZE];
+	uchar *buf;
+	unsigned off = h->end;
+	unsigned len;
+	int v;
+
+	while (off + STORE_RECSIZE <= size)
 	{
-		memset (&powtm, 0, sizeof(powtm));
-		memset (tbuf, 0, sizeof(tbuf));
-		strncpy (tbuf, powtime, 2);
-		powtm.tm_year = atoi(tbuf) + 100;
-		strncpy (tbuf, powtime+2, 2);
-		powtm.tm_mon = atoi(tbuf) - 1;
-		strncpy (tbuf, powtime+4, 2);
-		powtm.tm_mday = atoi(tbuf);
-		*ptime = mktime(&powtm);
+		if (storeio (f, off, rec, STORE_RECSIZE, 0) < 0)
+			break;
+		len = getword (rec);
+		v = rec[4] - RPOW_VALUE_MIN;
+		if (len > size - off - STORE_RECSIZE
+				|| v < 0 || v >= RPOW_VALUE_COUNT
+				|| (buf = storeget (f, off, rec, &len)) == NULL)
+			break;
+		if (storecheck (buf, len) != getword (rec + 12))
+		{
+			free (buf);
+			break;
+		}
+		free (buf);
+		rec[5] = 1;
+		putword (rec + 8, h->head[v]);
+		if (storeio (f, off, rec, STORE_RECSIZE, 1) < 0)
+			break;
+		h->head[v] = off;
+		++h->count[v];
+		h->live += STORE_RECSIZE + len;
+		off += STORE_RECSIZE + len;
 	}
-	return RPOW_STAT_OK;
+	h->end = off;
+	storesync (f);
+	ftruncate (fileno(f), (off_t)h->end);
+	storehdr_write (f, h);
+	storesync (f);
 }
 
-int
-rpow_valid_pow (rpow *rp)
+/*
+ * Rebuild the header from the records up to h->end, relinking the live
+ * ones.  A live record whose rpow is damaged is marked dead, and anything
+ * past a record too broken to skip is cut off.  Return how many records
+ * were dropped.
+ */
+static int
+storerebuild (FILE *f, storehdr *h)
 {
-	int rslt;
-	time_t nowtime, powtime;
-	int powvalue;
-	char *powresource1;
-	uchar md[SHA1_DIGEST_LENGTH];
-	int i;
+	storehdr hnew;
+	rpow *rp;
+	uchar rec[STORE_RECSIZE];
+	uchar *buf;
+	unsigned off, len;
+	int nbad = 0;
+	int v, ok;
 
-	if (rp->value < RPOW_VALUE_MIN || rp->value > RPOW_VALUE_MAX)
-		return RPOW_STAT_INVALID;
+	memset (&hnew, 0, sizeof(hnew));
+	off = STORE_HDRSIZE;
+	while (off + STORE_RECSIZE <= h->end)
+	{
+		if (storeio (f, off, rec, STORE_RECSIZE, 0) < 0)
+			break;
+		len = getword (rec);
+		v = rec[4] - RPOW_VALUE_MIN;
+		if (len > h->end - off - STORE_RECSIZE
+				|| v < 0 || v >= RPOW_VALUE_COUNT
+				|| (buf = storeget (f, off, rec, &len)) == NULL)
+			break;
+		if (rec[5])
+		{
+			ok = 0;
+			if (storecheck (buf, len) == getword (rec + 12)
+				&& (rp = rpow_from_buf (NULL, buf, len)) != NULL)
+			{
+				ok = (rp->value == rec[4]);
+				rpow_free (rp);
+			}
+			if (ok)
+			{
+				/* Oldest first, so relinking gives the same chains */
+				putword (rec + 8, hnew.head[v]);
+				hnew.head[v] = off;
+				++hnew.count[v];
+				hnew.live += STORE_RECSIZE + len;
+			} else {
+				rec[5] = 0;
+				++nbad;
+			}
+			storeio (f, off, rec, STORE_RECSIZE, 1);
+		}
+		free (buf);
+		off += STORE_RECSIZE + len;
+	}
+	if (off < h->end)
+		++nbad;
+	hnew.end = off;
+	hnew.dead = hnew.end - STORE_HDRSIZE - hnew.live;
+	*h = hnew;
+
+	storesync (f);
+	ftruncate (fileno(f), (off_t)h->end);
+	storehdr_write (f, h);
+	storesync (f);
+	return nbad;
+}
 
-	/* Parse the POW and see if its fields are legal */
-	rslt = pow_parse (rp->id, rp->idlen, &powvalue, &powtime,
-				&powresource, NULL);
-	if (rslt < 0)
-		return rslt;
-	if (powvalue != rp->value)
-		return RPOW_STAT_INVALID;
-	if (strcmp (powresource1, powresource) != 0)
-		return RPOW_STAT_BADRESOURCE;
-	nowtime = time(0);
-	if (powtime > nowtime + POW_GRACESECONDS ||
-			powtime < nowtime - POW_EXPIRYSECONDS)
-		return RPOW_STAT_BADTIME;
+/*
+ * Open and lock the store and read its header, converting or recovering
+ * it first if need be.  If create, make an empty store if there is none.
+ * Return NULL if there is no store or it is unusable, or if nowait and
+ * someone else has it locked.
+ */
+static FILE *
+storeopen (storehdr *h, int create, int nowait)
+{
+	FILE *f;
+	long size;
+	int fd;
+#if !defined(_WIN32)
+	struct stat st1, st2;
+#endif
+
+	for ( ; ; )
+	{
+		if ((fd = open (rpowfile, create ? STORE_OPENFLAGS
+				: STORE_OPENFLAGS & ~O_CREAT, 0600)) < 0)
+			return NULL;
+		if ((f = fdopen (fd, "r+b")) == NULL)
+		{
+			close (fd);
+			return NULL;
+		}
+		if (nowait)
+		{
+			if (dotrylock (f) < 0)
+			{
+				fclose (f);
+				return NULL;
+			}
+		} else
+			dolock (f);
+
+#if !defined(_WIN32)
+		/* Start again if it was replaced while we waited for the lock */
+		if (fstat (fd, &st1) != 0 || stat (rpowfile, &st2) != 0
+				|| st1.st_ino != st2.st_ino || st1.st_dev != st2.st_dev)
+		{
+			dounlock (f);
+			fclose (f);
+			continue;
+		}
+#endif
+
+		fseek (f, 0, SEEK_END);
+		size = ftell (f);
+		if (size == 0)
+		{
+			memset (h, 0, sizeof(*h));
+			h->end = STORE_HDRSIZE;
+			storehdr_write (f, h);
+			storesync (f);
+			return f;
+		}
+		if (storehdr_read (f, h) < 0)
+		{
+			/* Old format, convert it and open the new file */
+			if (storemigrate (f) < 0)
+			{
+				dounlock (f);
+				fclose (f);
+				return NULL;
+			}
+			dounlock (f);
+			fclose (f);
+			continue;
+		}
+		if (h->dirty || size < h->end)
+		{
+			/*
+			 * rpowwallet died, the flags are right but not the header,
+			 * or the file lost its tail and the chains may point past it
+			 */
+			h->end = (unsigned)size;
+			storerebuild (f, h);
+		} else if (size != h->end)
+			storerecover (f, h, (unsigned)size);
+		return f;
+	}
+}
+
+static void
+storeclose (FILE *f)
+{
+	dounlock (f);
+	fclose (f);
+}
+
+/*
+ * The store as rpowwallet uses it.  rpowstore_open keeps rpowfile open
+ * and locked until rpowstore_close, and calls fn for each live record,
+ * oldest first.  It fails rather than wait if another process has the
+ * store locked.  Records are then added and killed by offset, which
+ * leaves the chains out of order, so the header is marked dirty until
+ * rpowstore_close rebuilds it.  The caller must not add or kill from two
+ * threads at once, and must rpowstore_sync before relying on a change.
+ */
+struct rpowstore {
+	FILE *f;
+	storehdr h;
+};
+
+rpowstore *
+rpowstore_open (void (*fn)(void *arg, unsigned off, int value,
+	unsigned char *buf, unsigned len), void *arg)
+{
+	rpowstore *st;
+	FILE *f;
+	storehdr h;
+	uchar rec[STORE_RECSIZE];
+	uchar *buf;
+	unsigned off, len;
 
-	/* Now test the hash to see if it has the right number of high 0's */
-	gbig_sha1_buf (md, rp->id, rp->idlen);
-	for (i=0; (i+1)*8<powvalue; i++)
-		if (md[i] != 0)
-			return RPOW_STAT_INVALID;
-	if (md[i] & ~(0xff >> (powvalue&7)))
-		return RPOW_STAT_INVALID;
+	if ((f = storeopen (&h, 1, 1)) == NULL)
+		return NULL;
+	if (h.dead > h.live && h.dead > STORE_COMPACTBYTES)
+	{
+		/* Offsets have to stay put once we start, so compact now */
+		storecompact (f, &h);
+		storeclose (f);
+		if ((f = storeopen (&h, 1, 1)) == NULL)
+			return NULL;
+	}
 
-	return RPOW_STAT_OK;
+	for (off=STORE_HDRSIZE; off<h.end; off+=STORE_RECSIZE+len)
+	{
+		if ((buf = storeget (f, off, rec, &len)) == NULL)
+		{
+			storeclose (f);
+			return NULL;
+		}
+		if (rec[5])
+			fn (arg, off, rec[4], buf, len);
+		free (buf);
+	}
+
+	h.dirty = 1;
+	storehdr_write (f, &h);
+	storesync (f);
+	st = malloc (sizeof(rpowstore));
+	st->f = f;
+	st->h = h;
+	return st;
 }
 
-/* Temporary version of this, return the one public key we know about */
-static struct pubkey *
-pk_from_keyid (unsigned char *keyid)
+/* Write a record for an rpow, setting *poff to where it went */
+int
+rpowstore_add (rpowstore *st, unsigned char *buf, unsigned len, int value,
+	unsigned *poff)
 {
-	extern pubkey signpubkey;
-	if (memcmp (signpubkey.keyid, keyid, KEYID_LENGTH) != 0)
-		return NULL;
-	return &signpubkey;
+	if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+		return -1;
+	*poff = st->h.end;
+	if (storeadd (st->f, &st->h, buf, len, value) < 0)
+		return -1;
+	return fflush (st->f) == 0 ? 0 : -1;
 }
 
+/* Mark the record at off dead */
 int
-rpow_valid_pk (rpow *rp)
+rpowstore_kill (rpowstore *st, unsigned off)
 {
-	pubkey *pk;
-	gbignum paddedid;
-	gbignum pow;
-	gbignum exp;
-	int stat = RPOW_STAT_OK;
+	uchar dead = 0;
 
-	if ((pk = pk_from_keyid (rp->keyid)) == NULL)
-		return RPOW_STAT_WRONGKEY;
+	if (storeio (st->f, off + 5, &dead, 1, 1) < 0)
+		return -1;
+	return fflush (st->f) == 0 ? 0 : -1;
+}
 
-	gbig_init (&paddedid);
-	gbig_init (&pow);
-	gbig_init (&exp);
+/* Get the adds and kills so far onto the disk, safe to call unlocked */
+int
+rpowstore_sync (rpowstore *st)
+{
+#if !defined(_WIN32)
+	return fsync (fileno (st->f));
+#else
+	return 0;
+#endif
+}
 
-	if (valuetoexp (&exp, rp->value, pk) < 0)
+void
+rpowstore_close (rpowstore *st)
+{
+	storerebuild (st->f, &st->h);
+	storeclose (st->f);
+	free (st);
+}
+
+
+/*
+ * When rpowwallet is running, the functions below ask it over the socket
+ * walletfile rather than opening rpowfile themselves.  walletcall sends
+ * the request line and returns the reply line, malloc'd, or NULL if no
+ * wallet is listening.  A wallet which fails partway gives "err".
+ */
+#if !defined(_WIN32)
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL	0
+#endif
+
+static char *
+walletcall (char *cmd, char *arg)
+{
+	struct sockaddr_un sun;
+	char *req, *reply;
+	unsigned reqlen, len, size;
+	int fd, n;
+
+	if (walletfile == NULL || strlen (walletfile) >= sizeof(sun.sun_path))
+		return NULL;
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return NULL;
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, walletfile);
+	if (connect (fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
 	{
-		stat = RPOW_STAT_INVALID;
-		goto done;
+		close (fd);
+		return NULL;
 	}
-	gbig_mod_exp (&pow, &rp->bn, &exp, &pk->n);
-	rpowpend_bn_gen (&paddedid, rp->id, rp->idlen, pk);
-	if (gbig_cmp (&pow, &paddedid) != 0)
-		stat = RPOW_STAT_INVALID;
-done:
-	gbig_free (&exp);
-	gbig_free (&pow);
-	gbig_free (&paddedid);
-	return stat;
+
+	req = malloc (strlen(cmd) + (arg ? strlen(arg) + 1 : 0) + 2);
+	strcpy (req, cmd);
+	if (arg)
+	{
+		strcat (req, " ");
+		strcat (req, arg);
+	}
+	strcat (req, "\n");
+	reqlen = strlen (req);
+	for (len=0; len<reqlen; len+=n)
+	{
+		if ((n = send (fd, req + len, reqlen - len, MSG_NOSIGNAL)) <= 0
+				&& errno != EINTR)
+			break;
+		if (n < 0)
+			n = 0;
+	}
+	free (req);
+
+	size = 256;
+	reply = malloc (size);
+	len = 0;
+	for ( ; ; )
+	{
+		if (len + 1 == size)
+			reply = realloc (reply, size *= 2);
+		if ((n = read (fd, reply + len, size - len - 1)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			strcpy (reply, "err");
+			break;
+		}
+		len += n;
+		reply[len] = '\0';
+		if (strchr (reply, '\n'))
+		{
+			*strchr (reply, '\n') = '\0';
+			break;
+		}
+	}
+	close (fd);
+	return reply;
 }
+#else
+#define walletcall(cmd,arg)		NULL
 #endif
 
+/* Send an rpow to the wallet, return 0 if it took it, 1 if no wallet */
+static int
+walletsend (char *cmd, rpow *rp)
+{
+	char *str, *reply;
+	int err;
+
+	str = rpow_to_string (rp);
+	reply = walletcall (cmd, str);
+	free (str);
+	if (reply == NULL)
+		return 1;
+	err = (strcmp (reply, "ok") == 0) ? 0 : -1;
+	free (reply);
+	return err;
+}
 
-
-static void
-dolock (FILE *f)
+/* Ask the wallet for an rpow; *prp is NULL if it has none */
+static int
+walletget (char *cmd, int value, rpow **prp)
 {
-#ifndef _WIN32
-	struct flock l;
-	l.l_start = l.l_len = 0;
-	l.l_pid = 0;
-	l.l_type = F_WRLCK;
-	l.l_whence = SEEK_SET;
-	while (fcntl (fileno(f), F_SETLKW, &l) < 0 && errno == EINTR)
-		;
-#endif
+	char valstr[16];
+	char *reply;
+
+	sprintf (valstr, "%d", value);
+	if ((reply = walletcall (cmd, valstr)) == NULL)
+		return 1;
+	*prp = NULL;
+	if (strncmp (reply, "ok ", 3) == 0)
+		*prp = rpow_from_string (reply + 3);
+	free (reply);
+	return 0;
 }
 
-static void
-dounlock (FILE *f)
+/* Get the counts from the wallet, *pcount is -1 if it failed */
+static int
+walletcount (int counts[], int *pcount)
 {
-#ifndef _WIN32
-	struct flock l;
-	l.l_start = l.l_len = 0;
-	l.l_pid = 0;
-	l.l_type = F_UNLCK;
-	l.l_whence = SEEK_SET;
-	fcntl (fileno(f), F_SETLK, &l);
-#endif
+	char *reply, *p;
+	int i, n;
+
+	if ((reply = walletcall ("count", NULL)) == NULL)
+		return 1;
+	*pcount = -1;
+	if (strncmp (reply, "ok", 2) == 0)
+	{
+		*pcount = 0;
+		p = reply + 2;
+		for (i=0; i<RPOW_VALUE_COUNT; i++)
+		{
+			if (sscanf (p, "%d%n", &counts[i], &n) != 1)
+			{
+				*pcount = -1;
+				break;
+			}
+			*pcount += counts[i];
+			p += n;
+		}
+	}
+	free (reply);
+	return 0;
 }
 
+/* Add an rpow to the store */
 int
 rpow_to_store (rpow *rp)
 {
-	FILE *fout;
-	rpowio *rpout;
+	FILE *f;
+	storehdr h;
+	uchar *buf;
+	unsigned len;
+	int err;
 
-	fout = fopen (rpowfile, "ab");
-	if (fout == NULL)
-	{
+	if (rp->value < RPOW_VALUE_MIN || rp->value > RPOW_VALUE_MAX)
+		return -1;
+	if ((err = walletsend ("put", rp)) <= 0)
+		return err;
+	if ((f = storeopen (&h, 1, 0)) == NULL)
 		return -1;
+	buf = rpow_to_buf (&len, rp);
+	err = storeadd (f, &h, buf, len, rp->value);
+	free (buf);
+	if (err == 0)
+	{
+		/* The record must be on disk before the header points to it */
+		storesync (f);
+		err = storehdr_write (f, &h);
+		storesync (f);
 	}
-	dolock (fout);
-	fseek (fout, 0, SEEK_END);
-	rpout = rp_new_from_file (fout);
-	rpow_write (rp, rpout);
-	dounlock (fout);
-	fclose (fout);
-	rp_free (rpout);
-	return 0;
+	storeclose (f);
+	return err;
 }
 
-
+/* Take an rpow of the given value out of the store, NULL if none */
 rpow *
 rpow_from_store (int value)
 {
-	FILE *fin;
-	rpowio *rpio;
-	rpow *rp = NULL;
+	FILE *f;
+	storehdr h;
+	rpow *rp;
+	uchar rec[STORE_RECSIZE];
 	uchar *buf;
-	long fpos = 0;
-	long fposprev = 0;
-	int bufsize = 1000;
-	int nr;
+	unsigned off, len;
+	int v = value - RPOW_VALUE_MIN;
 
-	fin = fopen (rpowfile, "r+b");
-	if (fin == NULL)
-	{
+	if (v < 0 || v >= RPOW_VALUE_COUNT)
 		return NULL;
-	}
-	dolock (fin);
-	rpio = rp_new_from_file (fin);
-
-	for ( ; ; )
+	if (walletget ("take", value, &rp) == 0)
+		return rp;
+	if ((f = storeopen (&h, 0, 0)) == NULL)
+		return NULL;
+	/*
+	 * Mark the record dead and sync before unlinking it, so a crash in
+	 * between leaves a dead record at the head rather than an rpow we
+	 * have handed out.  Skip any such record.
+	 */
+	rp = NULL;
+	while (rp == NULL)
 	{
-		rp = rpow_read (rpio);
-		fposprev = fpos;
-		fpos = ftell (fin);
-		if (rp == NULL || rp->value == value)
+		if ((off = h.head[v]) == 0
+				|| (buf = storeget (f, off, rec, &len)) == NULL)
 			break;
-		rpow_free (rp);
+		if (rec[5])
+		{
+			rp = rpow_from_buf (NULL, buf, len);
+			rec[5] = 0;
+			storeio (f, off + 5, rec + 5, 1, 1);
+			storesync (f);
+		}
+		free (buf);
+		h.head[v] = getword (rec + 8);
+		--h.count[v];
+		h.live -= STORE_RECSIZE + len;
+		h.dead += STORE_RECSIZE + len;
 	}
+	storehdr_write (f, &h);
+	storesync (f);
 
-	if (rp == NULL)
-	{
-		dounlock (fin);
-		return NULL;
-	}
+	if (h.dead > h.live && h.dead > STORE_COMPACTBYTES)
+		storecompact (f, &h);
+	storeclose (f);
+	return rp;
+}
 
-	/* Delete entry from file */
-	buf = malloc (bufsize);
-	for ( ; ; )
+/* Fill in the counts array with how many rpows in the store of each value */
+int
+rpow_count (int counts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1])
+{
+	FILE *f;
+	storehdr h;
+	int rcount = 0;
+	int i;
+
+	memset (counts, 0, (RPOW_VALUE_MAX-RPOW_VALUE_MIN+1)*sizeof(int));
+
+	if (walletcount (counts, &rcount) == 0)
+		return rcount;
+	if ((f = storeopen (&h, 0, 0)) == NULL)
+		return -1;
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
 	{
-		fseek (fin, fpos, SEEK_SET);
-		nr = fread (buf, 1, bufsize, fin);
-		if (nr == 0)
-			break;
-		fseek (fin, fposprev, SEEK_SET);
-		fwrite (buf, 1, nr, fin);
-		fpos += nr;
-		fposprev += nr;
+		counts[i] = h.count[i];
+		rcount += h.count[i];
 	}
-	free (buf);
+	storeclose (f);
+	return rcount;
+}
 
-	ftruncate (fileno(fin), (off_t)fposprev);
-	dounlock (fin);
-	fclose (fin);
-	rp_free (rpio);
 
-	return rp;
+/*
+ * Take an rpow to spend in an exchange.  The wallet holds on to it until
+ * rpow_spend says it is gone or rpow_release gives it back; without the
+ * wallet these are rpow_from_store and rpow_to_store.
+ */
+rpow *
+rpow_reserve (int value)
+{
+	rpow *rp;
+
+	if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+		return NULL;
+	if (walletget ("reserve", value, &rp) == 0)
+		return rp;
+	return rpow_from_store (value);
 }
 
-/* Fill in the counts array with how many rpows in the store of each value */
 int
-rpow_count (int counts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1])
+rpow_spend (rpow *rp)
 {
-	FILE *fin = fopen (rpowfile, "r+b");
-	rpowio *rpio;
-	rpow *rp = NULL;
-	int nexps = RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1;
-	int exp;
+	int err;
+
+	if ((err = walletsend ("spend", rp)) <= 0)
+		return err;
+	return 0;
+}
+
+int
+rpow_release (rpow *rp)
+{
+	int err;
+
+	if ((err = walletsend ("release", rp)) <= 0)
+		return err;
+	return rpow_to_store (rp);
+}
+
+
+/*
+ * Check every record in the store and rebuild the header from the live
+ * ones, for rpowcli verify.  *pbad gets how many damaged records were
+ * dropped and *pwrong how many of the header's counts were wrong.  Fill
+ * in counts as rpow_count does and return the total, or -1 if the store
+ * can't be opened.
+ */
+int
+rpow_store_verify (int counts[RPOW_VALUE_MAX - RPOW_VALUE_MIN + 1],
+	int *pbad, int *pwrong)
+{
+	FILE *f;
+	storehdr h, hold;
 	int rcount = 0;
+	int i;
 
+	*pbad = *pwrong = 0;
 	memset (counts, 0, (RPOW_VALUE_MAX-RPOW_VALUE_MIN+1)*sizeof(int));
 
-	if (fin == NULL)
+	if (walletcount (counts, &rcount) == 0)
+	{
+		/* The wallet has it open, and checked it when it did */
+		return rcount;
+	}
+	if ((f = storeopen (&h, 0, 0)) == NULL)
 		return -1;
+	hold = h;
+	*pbad = storerebuild (f, &h);
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+	{
+		if (h.count[i] != hold.count[i])
+			++*pwrong;
+		counts[i] = h.count[i];
+		rcount += h.count[i];
+	}
+	storeclose (f);
+	return rcount;
+}
 
-	dolock (fin);
-	rpio = rp_new_from_file (fin);
 
-	for ( ; ; )
+/*
+ * Pool of hashcash rpows minted ahead of time by rpowcli mintahead, kept
+ * in poolfile in the same format as the rpow store.  The card takes a
+ * stamp from midnight of its date until POW_EXPIRYSECONDS later, which
+ * also keeps it out of the month's DB being reset, so we throw away any
+ * within POOL_MARGINSECONDS of that rather than have the exchange fail.
+ * Stamps for some other card are thrown away too.
+ */
+#define POOL_MARGINSECONDS	86400
+
+/* True if a pooled rpow is still good to exchange with the card */
+static int
+powpool_fresh (rpow *rp, time_t nowtime, char *resource)
+{
+	char stamp[256];
+	char *date, *res, *end;
+	struct tm powtm;
+	time_t powtime;
+	int yy, mm, dd;
+
+	if (rp->type != RPOW_TYPE_HASHCASH
+			|| rp->value < RPOW_VALUE_MIN || rp->value > RPOW_VALUE_MAX
+			|| rp->idlen < 2 || rp->idlen >= sizeof(stamp))
+		return 0;
+
+	/* 1:value:YYMMDD:resource::rand:counter */
+	memcpy (stamp, rp->id, rp->idlen);
+	stamp[rp->idlen] = '\0';
+	if ((date = strchr (stamp+2, ':')) == NULL
+			|| (res = strchr (++date, ':')) == NULL
+			|| (end = strchr (++res, ':')) == NULL)
+		return 0;
+	*end = '\0';
+	if (strcmp (res, resource) != 0
+			|| sscanf (date, "%2d%2d%2d", &yy, &mm, &dd) != 3)
+		return 0;
+	memset (&powtm, 0, sizeof(powtm));
+	powtm.tm_year = yy + 100;
+	powtm.tm_mon = mm - 1;
+	powtm.tm_mday = dd;
+	powtime = mktime (&powtm);
+	return powtime >= nowtime - POW_EXPIRYSECONDS + POOL_MARGINSECONDS
+			&& powtime <= nowtime + POW_GRACESECONDS;
+}
+
+/*
+ * Rewrite the pool without the stale rpows in it.  If prp is not NULL,
+ * take out the first rpow of the given value and return it there.  If
+ * counts is not NULL, count the rpows left of each value.  Return how
+ * many are left, or -1 if there is no pool.
+ */
+static int
+powpool_scan (int value, rpow **prp, int *counts, uchar *cardid)
+{
+	FILE *f;
+	rpowio *rpio;
+	rpow *rp;
+	rpow **keep = NULL;
+	char resource[POW_RESOURCE_LENGTH];
+	time_t nowtime = time(0);
+	int nkeep = 0;
+	int maxkeep = 0;
+	int i;
+
+	if (prp)
+		*prp = NULL;
+	if (counts)
+		memset (counts, 0, RPOW_VALUE_COUNT * sizeof(int));
+	powresource_r (resource, cardid);
+
+	f = fopen (poolfile, "r+b");
+	if (f == NULL)
+		return -1;
+	dolock (f);
+	rpio = rp_new_from_file (f);
+
+	while ((rp = rpow_read (rpio)) != NULL)
 	{
-		rp = rpow_read (rpio);
-		if (rp == NULL)
-			break;
-		if (rp->value < RPOW_VALUE_MIN || rp->value > RPOW_VALUE_MAX)
+		if (!powpool_fresh (rp, nowtime, resource))
+		{
+			rpow_free (rp);
+			continue;
+		}
+		if (prp && *prp == NULL && rp->value == value)
 		{
-			/* Skip invalid rpow */
-		} else {
-			++counts[rp->value - RPOW_VALUE_MIN];
-			++rcount;
+			*prp = rp;
+			continue;
 		}
+		if (nkeep == maxkeep)
+		{
+			maxkeep = 2*maxkeep + 16;
+			keep = realloc (keep, maxkeep * sizeof(rpow *));
+		}
+		keep[nkeep++] = rp;
 	}
 
-	dounlock (fin);
-	fclose (fin);
+	fseek (f, 0, SEEK_SET);
+	for (i=0; i<nkeep; i++)
+	{
+		rpow_write (keep[i], rpio);
+		if (counts)
+			++counts[keep[i]->value - RPOW_VALUE_MIN];
+		rpow_free (keep[i]);
+	}
+	fflush (f);
+	ftruncate (fileno(f), (off_t)ftell(f));
+	dounlock (f);
+	fclose (f);
 	rp_free (rpio);
-	return rcount;
+	free (keep);
+	return nkeep;
+}
+
+/* Add a newly minted rpow to the pool */
+int
+powpool_put (rpow *rp)
+{
+	return rpow_append (poolfile, rp);
+}
+
+/* Take a fresh rpow of the given value for the card from the pool */
+rpow *
+powpool_get (int value, uchar *cardid)
+{
+	rpow *rp;
+
+	powpool_scan (value, &rp, NULL, cardid);
+	return rp;
+}
+
+/* Count the fresh rpows of each value in the pool */
+int
+powpool_count (int counts[], uchar *cardid)
+{
+	return powpool_scan (0, NULL, counts, cardid);
 }
@@ -0,0 +1,525 @@
+/*
+ * rpowwallet.c
+ *	Daemon which holds the rpow store for the local rpow processes.
+ *
+ *	Without it, each count, take and put opens rpowfile and locks the
+ *	whole of it, so processes paying at once wait on each other.  The
+ *	wallet opens the store once, keeps the live rpows in memory with a
+ *	lock per value, and answers requests on the socket walletfile.  The
+ *	store functions in rpowutil.c use the socket whenever a wallet is
+ *	listening, so rpowcli and the rpow.i bindings need no changes.
+ *
+ *	The store file is the wallet's log: a put appends a record and a
+ *	take or spend marks one dead, and either is synced before we answer.
+ *	Changes from many connections are synced together.  A reserved rpow
+ *	is out of the counts but still live on disk until it is spent, so
+ *	if the wallet dies it is back in the store when it restarts.
+ *
+ *	Requests are one line each, and so are the replies:
+ *		count			ok n20 n21 ... n50
+ *		take value		ok rpow, or none
+ *		reserve value	ok rpow, or none
+ *		spend rpow		ok, for a reserved rpow gone in an exchange
+ *		release rpow	ok, to put a reserved rpow back
+ *		put rpow		ok
+ *	where rpow is base64, as rpow_to_string gives it.  Failures are "err".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rpowcli.h"
+
+/* Longest request line we will take */
+#define MAXREQ		65536
+
+/* An rpow in the store, at offset off in rpowfile */
+typedef struct walletrec {
+	struct walletrec *next;
+	unsigned off;
+	unsigned len;
+	uchar *buf;
+} walletrec;
+
+/* The rpows of one value, newest first */
+static struct denom {
+	pthread_mutex_t lock;
+	walletrec *avail;
+	walletrec *reserved;
+	int count;
+} denoms[RPOW_VALUE_COUNT];
+
+static rpowstore *store;
+
+/* Serializes adds and kills; writeseq counts them, syncseq is synced */
+static pthread_mutex_t storelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t synclock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned writeseq, syncseq;
+
+static volatile int interruptflag;
+
+/* Our socket, so we only ever remove that one */
+static struct stat sockst;
+
+
+/* Called by rpowstore_open for each live rpow, oldest first */
+static void
+loadrec (void *arg, unsigned off, int value, uchar *buf, unsigned len)
+{
+	struct denom *d = &denoms[value - RPOW_VALUE_MIN];
+	walletrec *wr = malloc (sizeof(walletrec));
+
+	wr->off = off;
+	wr->len = len;
+	wr->buf = malloc (len);
+	memcpy (wr->buf, buf, len);
+	wr->next = d->avail;
+	d->avail = wr;
+	++d->count;
+}
+
+static void
+freerec (walletrec *wr)
+{
+	free (wr->buf);
+	free (wr);
+}
+
+/*
+ * Wait until change number seq is on the disk.  Whoever gets synclock
+ * first syncs everything written so far, so the others mostly find
+ * their change already done.
+ */
+static int
+walletsync (unsigned seq)
+{
+	unsigned upto;
+	int err = 0;
+
+	pthread_mutex_lock (&synclock);
+	if (syncseq < seq)
+	{
+		pthread_mutex_lock (&storelock);
+		upto = writeseq;
+		pthread_mutex_unlock (&storelock);
+		if ((err = rpowstore_sync (store)) == 0)
+			syncseq = upto;
+	}
+	pthread_mutex_unlock (&synclock);
+	return err;
+}
+
+/* Mark an rpow dead in the store, durably */
+static int
+walletkill (walletrec *wr)
+{
+	unsigned seq;
+	int err;
+
+	pthread_mutex_lock (&storelock);
+	err = rpowstore_kill (store, wr->off);
+	seq = ++writeseq;
+	pthread_mutex_unlock (&storelock);
+	if (err == 0)
+		err = walletsync (seq);
+	return err;
+}
+
+/* Add an rpow to the store, durably, and make it available */
+static int
+walletput (uchar *buf, unsigned len, int value)
+{
+	struct denom *d = &denoms[value - RPOW_VALUE_MIN];
+	walletrec *wr;
+	unsigned off, seq;
+	int err;
+
+	pthread_mutex_lock (&storelock);
+	err = rpowstore_add (store, buf, len, value, &off);
+	seq = ++writeseq;
+	pthread_mutex_unlock (&storelock);
+	if (err == 0)
+		err = walletsync (seq);
+	if (err != 0)
+		return -1;
+
+	wr = malloc (sizeof(walletrec));
+	wr->off = off;
+	wr->len = len;
+	wr->buf = malloc (len);
+	memcpy (wr->buf, buf, len);
+	pthread_mutex_lock (&d->lock);
+	wr->next = d->avail;
+	d->avail = wr;
+	++d->count;
+	pthread_mutex_unlock (&d->lock);
+	return 0;
+}
+
+/* Take the newest available rpow of a value, NULL if none */
+static walletrec *
+walletpop (int value)
+{
+	struct denom *d = &denoms[value - RPOW_VALUE_MIN];
+	walletrec *wr;
+
+	pthread_mutex_lock (&d->lock);
+	if ((wr = d->avail) != NULL)
+	{
+		d->avail = wr->next;
+		--d->count;
+	}
+	pthread_mutex_unlock (&d->lock);
+	return wr;
+}
+
+/* Find a reserved rpow and take it off the reserved list */
+static walletrec *
+walletunreserve (uchar *buf, unsigned len, int value)
+{
+	struct denom *d = &denoms[value - RPOW_VALUE_MIN];
+	walletrec *wr, **pwr;
+
+	pthread_mutex_lock (&d->lock);
+	for (pwr=&d->reserved; (wr=*pwr)!=NULL; pwr=&wr->next)
+	{
+		if (wr->len == len && memcmp (wr->buf, buf, len) == 0)
+		{
+			*pwr = wr->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&d->lock);
+	return wr;
+}
+
+/* Decode an rpow from a request, returning its bytes and value */
+static uchar *
+reqrpow (char *str, unsigned *plen, int *pvalue)
+{
+	rpow *rp;
+	uchar *buf;
+	unsigned len;
+
+	buf = malloc (strlen(str) + 1);
+	len = dec64 (buf, str, strlen(str));
+	if ((rp = rpow_from_buf (NULL, buf, len)) == NULL)
+	{
+		free (buf);
+		return NULL;
+	}
+	*pvalue = rp->value;
+	rpow_free (rp);
+	if (*pvalue < RPOW_VALUE_MIN || *pvalue > RPOW_VALUE_MAX)
+	{
+		free (buf);
+		return NULL;
+	}
+	*plen = len;
+	return buf;
+}
+
+/* Reply "ok" and the rpow in base64 */
+static char *
+replyrpow (walletrec *wr)
+{
+	char *reply = malloc (3 + 2*wr->len + 4);
+	int n;
+
+	strcpy (reply, "ok ");
+	n = enc64 (reply + 3, wr->buf, wr->len);
+	reply[3+n] = '\0';
+	return reply;
+}
+
+/* Carry out one request, returning the malloc'd reply */
+static char *
+dorequest (char *req)
+{
+	struct denom *d;
+	walletrec *wr;
+	char *reply;
+	uchar *buf;
+	unsigned len;
+	int value, i, n;
+
+	if (strcmp (req, "count") == 0)
+	{
+		reply = malloc (3 + 12*RPOW_VALUE_COUNT + 1);
+		strcpy (reply, "ok");
+		for (i=0, n=2; i<RPOW_VALUE_COUNT; i++)
+		{
+			pthread_mutex_lock (&denoms[i].lock);
+			n += sprintf (reply + n, " %d", denoms[i].count);
+			pthread_mutex_unlock (&denoms[i].lock);
+		}
+		return reply;
+	}
+
+	if (sscanf (req, "take %d", &value) == 1)
+	{
+		if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+			return strdup ("err");
+		if ((wr = walletpop (value)) == NULL)
+			return strdup ("none");
+		if (walletkill (wr) < 0)
+		{
+			/* Don't hand it out unless it is gone from the store */
+			d = &denoms[value - RPOW_VALUE_MIN];
+			pthread_mutex_lock (&d->lock);
+			wr->next = d->avail;
+			d->avail = wr;
+			++d->count;
+			pthread_mutex_unlock (&d->lock);
+			return strdup ("err");
+		}
+		reply = replyrpow (wr);
+		freerec (wr);
+		return reply;
+	}
+
+	if (sscanf (req, "reserve %d", &value) == 1)
+	{
+		if (value < RPOW_VALUE_MIN || value > RPOW_VALUE_MAX)
+			return strdup ("err");
+		if ((wr = walletpop (value)) == NULL)
+			return strdup ("none");
+		/* Once it is on the list another request could spend it */
+		reply = replyrpow (wr);
+		d = &denoms[value - RPOW_VALUE_MIN];
+		pthread_mutex_lock (&d->lock);
+		wr->next = d->reserved;
+		d->reserved = wr;
+		pthread_mutex_unlock (&d->lock);
+		return reply;
+	}
+
+	if (strncmp (req, "spend ", 6) == 0)
+	{
+		if ((buf = reqrpow (req + 6, &len, &value)) == NULL)
+			return strdup ("err");
+		wr = walletunreserve (buf, len, value);
+		free (buf);
+		if (wr == NULL)
+			return strdup ("err");
+		if (walletkill (wr) < 0)
+		{
+			/* Keep it reserved, it may be spent again */
+			d = &denoms[value - RPOW_VALUE_MIN];
+			pthread_mutex_lock (&d->lock);
+			wr->next = d->reserved;
+			d->reserved = wr;
+			pthread_mutex_unlock (&d->lock);
+			return strdup ("err");
+		}
+		freerec (wr);
+		return strdup ("ok");
+	}
+
+	if (strncmp (req, "release ", 8) == 0)
+	{
+		if ((buf = reqrpow (req + 8, &len, &value)) == NULL)
+			return strdup ("err");
+		wr = walletunreserve (buf, len, value);
+		free (buf);
+		if (wr == NULL)
+			return strdup ("err");
+		d = &denoms[value - RPOW_VALUE_MIN];
+		pthread_mutex_lock (&d->lock);
+		wr->next = d->avail;
+		d->avail = wr;
+		++d->count;
+		pthread_mutex_unlock (&d->lock);
+		return strdup ("ok");
+	}
+
+	if (strncmp (req, "put ", 4) == 0)
+	{
+		if ((buf = reqrpow (req + 4, &len, &value)) == NULL)
+			return strdup ("err");
+		n = walletput (buf, len, value);
+		free (buf);
+		return strdup (n == 0 ? "ok" : "err");
+	}
+
+	return strdup ("err");
+}
+
+/* Serve requests on one connection until it closes */
+static void *
+connthread (void *arg)
+{
+	int fd = (int)(long)arg;
+	char *req, *reply, *nl;
+	unsigned len = 0, size = 256;
+	int n;
+
+	req = malloc (size);
+	for ( ; ; )
+	{
+		if ((nl = memchr (req, '\n', len)) == NULL)
+		{
+			if (len + 1 >= size)
+			{
+				if (size >= MAXREQ)
+					break;
+				req = realloc (req, size *= 2);
+			}
+			if ((n = read (fd, req + len, size - len - 1)) < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			len += n;
+			continue;
+		}
+
+		*nl = '\0';
+		if (nl > req && nl[-1] == '\r')
+			nl[-1] = '\0';
+		reply = dorequest (req);
+		n = strlen (reply);
+		reply[n++] = '\n';
+		if (write (fd, reply, n) != n)
+		{
+			free (reply);
+			break;
+		}
+		free (reply);
+		len -= nl + 1 - req;
+		memmove (req, nl + 1, len);
+	}
+	free (req);
+	close (fd);
+	return NULL;
+}
+
+/* Remove the wallet socket if it is still ours */
+static void
+sockunlink ()
+{
+	struct stat st;
+
+	if (stat (walletfile, &st) == 0 && st.st_ino == sockst.st_ino
+			&& st.st_dev == sockst.st_dev)
+		unlink (walletfile);
+}
+
+static void
+inthandler (int signum)
+{
+	signal (signum, SIG_IGN);
+	interruptflag = 1;
+}
+
+int
+main (int ac, char **av)
+{
+	struct sockaddr_un sun;
+	struct pollfd pfd;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int s, fd, i;
+
+	if (ac != 1)
+	{
+		fprintf (stderr, "Usage: %s\n", av[0]);
+		exit (1);
+	}
+
+	gbig_initialize ();
+	initfilenames ();
+	if (strlen (walletfile) >= sizeof(sun.sun_path))
+	{
+		fprintf (stderr, "Wallet socket name %s is too long\n", walletfile);
+		exit (1);
+	}
+
+	for (i=0; i<RPOW_VALUE_COUNT; i++)
+		pthread_mutex_init (&denoms[i].lock, NULL);
+
+	if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror ("socket");
+		exit (2);
+	}
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, walletfile);
+
+	/* Leave alone the socket of a wallet which is already running */
+	if (connect (s, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+	{
+		fprintf (stderr, "rpowwallet is already running on %s\n",
+				walletfile);
+		exit (1);
+	}
+	close (s);
+
+	/*
+	 * Listen before loading the store, so clients which start meanwhile
+	 * wait for us on the socket, not for the store lock we are holding
+	 */
+	if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror ("socket");
+		exit (2);
+	}
+	unlink (walletfile);
+	umask (077);
+	if (bind (s, (struct sockaddr *)&sun, sizeof(sun)) < 0
+			|| listen (s, SOMAXCONN) < 0 || stat (walletfile, &sockst) < 0)
+	{
+		perror ("bind");
+		exit (2);
+	}
+
+	/*
+	 * The store stays locked while we run.  If someone else has it,
+	 * another wallet got there first or a client is using the file,
+	 * and we must not wait with clients queued on our socket.
+	 */
+	if ((store = rpowstore_open (loadrec, NULL)) == NULL)
+	{
+		fprintf (stderr, "Unable to open rpow data store %s, "
+				"or it is in use\n", rpowfile);
+		sockunlink ();
+		exit (1);
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+	signal (SIGINT, inthandler);
+	signal (SIGTERM, inthandler);
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (!interruptflag)
+	{
+		/* Wake up now and then to see if we were told to stop */
+		if (poll (&pfd, 1, 1000) <= 0)
+			continue;
+		if ((fd = accept (s, NULL, NULL)) < 0)
+			continue;
+		if (pthread_create (&tid, &attr, connthread, (void *)(long)fd) != 0)
+			close (fd);
+	}
+
+	/* New clients go back to the file; finish with the store and leave */
+	sockunlink ();
+	close (s);
+	pthread_mutex_lock (&synclock);
+	pthread_mutex_lock (&storelock);
+	rpowstore_close (store);
+	return 0;
+}
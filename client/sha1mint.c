@@ -0,0 +1,457 @@
+/*
+ * sha1mint.c
+ *	SHA-1 for hashcash minting, many stamps at a time.
+ *
+ *	The caller hashes the fixed start of the stamp once, with
+ *	sha1mint_midstate, and lays out the rest as one final block whose
+ *	byte SHA1MINT_LANEBYTE is the last hex digit of the counter.
+ *	sha1mint_search then tries the SHA1MINT_LANES stamps which differ
+ *	only in that digit.  Rounds 0 to 12 do not see it, so they are done
+ *	once for all of them.
+ *
+ *	There are cores for plain C, SSE2, AVX2, AVX-512 and the SHA
+ *	extensions.  The first time through we check each one the CPU has
+ *	against gbig_sha1_buf, time them briefly, and use the fastest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <sys/time.h>
+#endif
+
+#include "rpowcli.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMDCORES
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+/* How long to time each core for */
+#define BENCHSECS	0.02
+
+typedef void corefn (const unsigned *mid, const unsigned *ws,
+	unsigned *h0, unsigned *h1);
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* Word 13 of the block for lane j, byte 54 being its third byte */
+#define LANEWORD(w13,j)	(((w13) & ~0xff00u) | (unsigned)hexdigits[j] << 8)
+
+
+/*
+ * The rounds are macros so the same code works on unsigned and on the
+ * gcc vector types.  R is round t, with a to e being the variables which
+ * hold A to E for that round; they rotate one place each round.
+ */
+#define ROL(x,n)		(((x) << (n)) | ((x) >> (32 - (n))))
+#define F1(b,c,d)		((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b,c,d)		((b) ^ (c) ^ (d))
+#define F3(b,c,d)		(((b) & (c)) | ((d) & ((b) | (c))))
+#define F(t,b,c,d)		((t) < 20 ? F1(b,c,d) + 0x5a827999 :	\
+						 (t) < 40 ? F2(b,c,d) + 0x6ed9eba1 :	\
+						 (t) < 60 ? F3(b,c,d) + 0x8f1bbcdc :	\
+									F2(b,c,d) + 0xca62c1d6)
+#define W(t)			(w[(t)&15] = ROL(w[((t)-3)&15] ^ w[((t)-8)&15]	\
+							^ w[((t)-14)&15] ^ w[(t)&15], 1))
+#define X(t)			((t) < 16 ? w[(t)&15] : W(t))
+#define R(t,a,b,c,d,e)	e += ROL(a,5) + F(t,b,c,d) + X(t); b = ROL(b,30);
+#define R5(t)			R(t,a,b,c,d,e) R(t+1,e,a,b,c,d) R(t+2,d,e,a,b,c)	\
+						R(t+3,c,d,e,a,b) R(t+4,b,c,d,e,a)
+
+/*
+ * Rounds 13 to 79, starting with A to E in a to e.  At the end A is in
+ * d and B in e, C in a, D in b and E in c.
+ */
+#define ROUNDS13TO79	\
+	R5(13) R5(18) R5(23) R5(28) R5(33) R5(38) R5(43) R5(48) R5(53)	\
+	R5(58) R5(63) R5(68) R5(73) R(78,a,b,c,d,e) R(79,e,a,b,c,d)
+
+/* Rounds 0 to 12, leaving A to E in st */
+static void
+rounds0to12 (unsigned *st, const unsigned *mid, const unsigned *ws)
+{
+	unsigned w[16];
+	unsigned a = mid[0], b = mid[1], c = mid[2], d = mid[3], e = mid[4];
+
+	memcpy (w, ws, sizeof(w));
+	R5(0) R5(5) R(10,a,b,c,d,e) R(11,e,a,b,c,d) R(12,d,e,a,b,c)
+	st[0] = c;
+	st[1] = d;
+	st[2] = e;
+	st[3] = a;
+	st[4] = b;
+}
+
+/* Hash one block into h */
+static void
+compress (unsigned *h, const uchar *p)
+{
+	unsigned w[16], st[5];
+	unsigned a, b, c, d, e;
+	int i;
+
+	for (i=0; i<16; i++)
+		w[i] = ((unsigned)p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8)
+				| p[4*i+3];
+	rounds0to12 (st, h, w);
+	a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+	ROUNDS13TO79
+	h[0] += d;
+	h[1] += e;
+	h[2] += a;
+	h[3] += b;
+	h[4] += c;
+}
+
+
+static void
+core_c (const unsigned *mid, const unsigned *ws, unsigned *h0, unsigned *h1)
+{
+	unsigned w[16], st[5];
+	unsigned a, b, c, d, e;
+	int j;
+
+	rounds0to12 (st, mid, ws);
+	for (j=0; j<SHA1MINT_LANES; j++)
+	{
+		memcpy (w, ws, sizeof(w));
+		w[13] = LANEWORD(ws[13], j);
+		a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+		ROUNDS13TO79
+		h0[j] = d + mid[0];
+		h1[j] = e + mid[1];
+	}
+}
+
+#if defined(SIMDCORES)
+
+/* The body of a core doing n lanes at a time in vectors of type vec */
+#define LANECORE(vec, n)	\
+	vec w[16];	\
+	vec a, b, c, d, e;	\
+	unsigned st[5];	\
+	int i, j, k;	\
+	rounds0to12 (st, mid, ws);	\
+	for (j=0; j<SHA1MINT_LANES; j+=n)	\
+	{	\
+		for (i=0; i<16; i++)	\
+			w[i] = (vec){0} + ws[i];	\
+		for (k=0; k<n; k++)	\
+			w[13][k] = LANEWORD(ws[13], j+k);	\
+		a = (vec){0} + st[0];	\
+		b = (vec){0} + st[1];	\
+		c = (vec){0} + st[2];	\
+		d = (vec){0} + st[3];	\
+		e = (vec){0} + st[4];	\
+		ROUNDS13TO79	\
+		for (k=0; k<n; k++)	\
+		{	\
+			h0[j+k] = d[k] + mid[0];	\
+			h1[j+k] = e[k] + mid[1];	\
+		}	\
+	}
+
+static void __attribute__ ((target ("sse2")))
+core_sse2 (const unsigned *mid, const unsigned *ws, unsigned *h0, unsigned *h1)
+{
+	typedef unsigned vec __attribute__ ((vector_size (16)));
+	LANECORE (vec, 4)
+}
+
+static void __attribute__ ((target ("avx2")))
+core_avx2 (const unsigned *mid, const unsigned *ws, unsigned *h0, unsigned *h1)
+{
+	typedef unsigned vec __attribute__ ((vector_size (32)));
+	LANECORE (vec, 8)
+}
+
+static void __attribute__ ((target ("avx512f")))
+core_avx512 (const unsigned *mid, const unsigned *ws, unsigned *h0,
+	unsigned *h1)
+{
+	typedef unsigned vec __attribute__ ((vector_size (64)));
+	LANECORE (vec, 16)
+}
+
+/*
+ * Four rounds with the SHA extensions, which keep A to D in one register
+ * and work E out from the A of four rounds back, in ea or eb.  m0 holds
+ * the message words for these rounds, m1 to m3 are being expanded.
+ */
+#define SHANI4(ea,eb,m0,m1,m2,m3,f)	\
+	ea = _mm_sha1nexte_epu32 (ea, m0);	\
+	eb = abcd;	\
+	m1 = _mm_sha1msg2_epu32 (m1, m0);	\
+	abcd = _mm_sha1rnds4_epu32 (abcd, ea, f);	\
+	m3 = _mm_sha1msg1_epu32 (m3, m0);	\
+	m2 = _mm_xor_si128 (m2, m0);
+
+static void __attribute__ ((target ("sha,sse4.1")))
+core_shani (const unsigned *mid, const unsigned *ws, unsigned *h0,
+	unsigned *h1)
+{
+	__m128i abcd, save, e0, e1, m0, m1, m2, m3;
+	__m128i abcd12, e12, m012, m112, m212;
+	int j;
+
+	/* Rounds 0 to 11 are the same for all lanes */
+	abcd = save = _mm_set_epi32 (mid[0], mid[1], mid[2], mid[3]);
+	e0 = _mm_set_epi32 (mid[4], 0, 0, 0);
+	m0 = _mm_set_epi32 (ws[0], ws[1], ws[2], ws[3]);
+	m1 = _mm_set_epi32 (ws[4], ws[5], ws[6], ws[7]);
+	m2 = _mm_set_epi32 (ws[8], ws[9], ws[10], ws[11]);
+	e0 = _mm_add_epi32 (e0, m0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+	e1 = _mm_sha1nexte_epu32 (e1, m1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+	m0 = _mm_sha1msg1_epu32 (m0, m1);
+	e0 = _mm_sha1nexte_epu32 (e0, m2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+	m1 = _mm_sha1msg1_epu32 (m1, m2);
+	m0 = _mm_xor_si128 (m0, m2);
+	abcd12 = abcd;
+	e12 = e1;
+	m012 = m0;
+	m112 = m1;
+	m212 = m2;
+
+	for (j=0; j<SHA1MINT_LANES; j++)
+	{
+		abcd = abcd12;
+		e1 = e12;
+		m0 = m012;
+		m1 = m112;
+		m2 = m212;
+		m3 = _mm_set_epi32 (ws[12], LANEWORD(ws[13], j), ws[14], ws[15]);
+		SHANI4 (e1, e0, m3, m0, m1, m2, 0)
+		SHANI4 (e0, e1, m0, m1, m2, m3, 0)
+		SHANI4 (e1, e0, m1, m2, m3, m0, 1)
+		SHANI4 (e0, e1, m2, m3, m0, m1, 1)
+		SHANI4 (e1, e0, m3, m0, m1, m2, 1)
+		SHANI4 (e0, e1, m0, m1, m2, m3, 1)
+		SHANI4 (e1, e0, m1, m2, m3, m0, 1)
+		SHANI4 (e0, e1, m2, m3, m0, m1, 2)
+		SHANI4 (e1, e0, m3, m0, m1, m2, 2)
+		SHANI4 (e0, e1, m0, m1, m2, m3, 2)
+		SHANI4 (e1, e0, m1, m2, m3, m0, 2)
+		SHANI4 (e0, e1, m2, m3, m0, m1, 2)
+		SHANI4 (e1, e0, m3, m0, m1, m2, 3)
+		SHANI4 (e0, e1, m0, m1, m2, m3, 3)
+		SHANI4 (e1, e0, m1, m2, m3, m0, 3)
+		SHANI4 (e0, e1, m2, m3, m0, m1, 3)
+		SHANI4 (e1, e0, m3, m0, m1, m2, 3)
+		abcd = _mm_add_epi32 (abcd, save);
+		h0[j] = _mm_extract_epi32 (abcd, 3);
+		h1[j] = _mm_extract_epi32 (abcd, 2);
+	}
+}
+
+static int
+have_sse2 (void)
+{
+	__builtin_cpu_init ();
+	return __builtin_cpu_supports ("sse2");
+}
+
+static int
+have_avx2 (void)
+{
+	__builtin_cpu_init ();
+	return __builtin_cpu_supports ("avx2");
+}
+
+static int
+have_avx512 (void)
+{
+	__builtin_cpu_init ();
+	return __builtin_cpu_supports ("avx512f");
+}
+
+static int
+have_shani (void)
+{
+	unsigned a, b, c, d;
+
+	__builtin_cpu_init ();
+	if (!__builtin_cpu_supports ("sse4.1"))
+		return 0;
+	if (!__get_cpuid_count (7, 0, &a, &b, &c, &d))
+		return 0;
+	return (b >> 29) & 1;
+}
+
+#endif /* SIMDCORES */
+
+static int
+have_c (void)
+{
+	return 1;
+}
+
+static struct mintcore {
+	char *name;
+	corefn *fn;
+	int (*have) (void);
+} cores[] = {
+	{ "C", core_c, have_c },
+#if defined(SIMDCORES)
+	{ "SSE2", core_sse2, have_sse2 },
+	{ "AVX2", core_avx2, have_avx2 },
+	{ "AVX-512", core_avx512, have_avx512 },
+	{ "SHA-NI", core_shani, have_shani },
+#endif
+};
+#define NCORES	(sizeof(cores)/sizeof(cores[0]))
+
+static struct mintcore *mintcore;
+
+
+static double
+benchclock (void)
+{
+#if !defined(_WIN32)
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+#else
+	return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Convert a final block to words */
+static void
+blockwords (unsigned *ws, const uchar *block)
+{
+	int i;
+
+	for (i=0; i<16; i++)
+		ws[i] = ((unsigned)block[4*i] << 24) | (block[4*i+1] << 16)
+				| (block[4*i+2] << 8) | block[4*i+3];
+}
+
+/*
+ * Check a core against gbig_sha1_buf, on a 119 byte message whose
+ * second block is the one whose last digit changes.
+ */
+static int
+corecheck (struct mintcore *core)
+{
+	uchar msg[128];
+	uchar md[SHA1_DIGEST_LENGTH];
+	unsigned mid[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+						0x10325476, 0xc3d2e1f0 };
+	unsigned ws[16];
+	unsigned h0[SHA1MINT_LANES], h1[SHA1MINT_LANES];
+	int i, j;
+
+	for (i=0; i<119; i++)
+		msg[i] = rand ();
+	msg[119] = 0x80;
+	memset (msg+120, 0, 6);
+	msg[126] = (119*8) >> 8;
+	msg[127] = (119*8) & 0xff;
+	compress (mid, msg);
+	blockwords (ws, msg+64);
+	core->fn (mid, ws, h0, h1);
+	for (j=0; j<SHA1MINT_LANES; j++)
+	{
+		msg[64 + SHA1MINT_LANEBYTE] = hexdigits[j];
+		gbig_sha1_buf (md, msg, 119);
+		if (h0[j] != (((unsigned)md[0]<<24) | (md[1]<<16) | (md[2]<<8) | md[3])
+				|| h1[j] != (((unsigned)md[4]<<24) | (md[5]<<16) | (md[6]<<8)
+					| md[7]))
+			return -1;
+	}
+	return 0;
+}
+
+/* Return the name of the core we use, choosing it if we haven't yet */
+char *
+sha1mint_core (void)
+{
+	unsigned mid[5] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+						0x10325476, 0xc3d2e1f0 };
+	unsigned ws[16];
+	unsigned h0[SHA1MINT_LANES], h1[SHA1MINT_LANES];
+	double start, secs;
+	double rate, bestrate = 0;
+	long calls;
+	int i;
+
+	if (mintcore)
+		return mintcore->name;
+
+	memset (ws, 0x5a, sizeof(ws));
+	mintcore = &cores[0];
+	for (i=0; i<NCORES; i++)
+	{
+		if (!cores[i].have () || corecheck (&cores[i]) < 0)
+			continue;
+		calls = 0;
+		start = benchclock ();
+		do {
+			cores[i].fn (mid, ws, h0, h1);
+			++calls;
+		} while ((secs = benchclock () - start) < BENCHSECS);
+		rate = calls / secs;
+		if (rate > bestrate)
+		{
+			bestrate = rate;
+			mintcore = &cores[i];
+		}
+	}
+	return mintcore->name;
+}
+
+/* Start SHA-1 and hash nblocks blocks of buf into mid */
+void
+sha1mint_midstate (unsigned *mid, uchar *buf, unsigned nblocks)
+{
+	mid[0] = 0x67452301;
+	mid[1] = 0xefcdab89;
+	mid[2] = 0x98badcfe;
+	mid[3] = 0x10325476;
+	mid[4] = 0xc3d2e1f0;
+	while (nblocks--)
+	{
+		compress (mid, buf);
+		buf += 64;
+	}
+}
+
+/*
+ * Try SHA1MINT_LANES final blocks, with byte SHA1MINT_LANEBYTE of block
+ * set to each hex digit in turn.  Return the first digit whose hash
+ * starts with value zero bits, or -1 if none does.  Call sha1mint_core
+ * before using this from more than one thread.
+ */
+int
+sha1mint_search (unsigned *mid, uchar *block, int value)
+{
+	unsigned ws[16];
+	unsigned h0[SHA1MINT_LANES], h1[SHA1MINT_LANES];
+	int j;
+
+	if (mintcore == NULL)
+		sha1mint_core ();
+	blockwords (ws, block);
+	mintcore->fn (mid, ws, h0, h1);
+	for (j=0; j<SHA1MINT_LANES; j++)
+	{
+		if (value <= 32)
+		{
+			if ((h0[j] >> (32 - value)) == 0)
+				return j;
+		}
+		else if (h0[j] == 0 && (h1[j] >> (64 - value)) == 0)
+			return j;
+	}
+	return -1;
+}
@@ -51,10 +51,41 @@
 /* Provide database authentication message as node checks for re-use */
 #define CMD_DBAUTH			7
 
+/* Most hashes the card asks about in one batched database query */
+#define DBBATCHMAX			10
+
 /* Return general node status information, memory usage, etc. */
 #define CMD_STAT			8
 
 /* Clear the low battery latche */
 #define CMD_CLEARLOWBATT	9
 
+/*
+ * Network framing between client and host.  The original format is
+ * one request per connection: a command byte, a 2 byte length, and
+ * the data.  The host closes the connection after its reply.
+ *
+ * A connection whose first byte is V2_FRAME instead carries any
+ * number of requests, each with a 12 byte header:
+ *   V2_FRAME, command byte, 2 zero bytes, 4 byte request ID,
+ *   4 byte data length
+ * followed by the data.  The client may send more requests before
+ * reading replies.  Each reply has a 12 byte header:
+ *   4 byte request ID, 4 byte status, 4 byte data length
+ * followed by the data, which is present only when status is zero.
+ * Replies may come back in a different order than the requests.
+ * Multi-byte fields are big-endian.
+ *
+ * A host may serve several cards.  CMD_GETCHAIN data is then empty
+ * for the first card's chain, or a 4 byte big-endian card index.
+ * CMD_SIGN goes to the card named by the cardid at its front, and
+ * CMD_STAT data may likewise be preceded by a cardid.
+ */
+#define V2_FRAME			0x82
+#define V2_REQHDRSIZE		12
+#define V2_REPLYHDRSIZE		12
+
+/* Largest data length accepted in a version 2 request */
+#define V2_MAXDATA			(1024*1024)
+
 #endif
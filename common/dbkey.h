@@ -0,0 +1,77 @@
+/*
+ * dbkey.h
+ *	Comparing and searching the keys of spent list DB nodes, shared by
+ *	the host which keeps the DB and the card which checks its proofs.
+ *	HASHSIZE must be defined first.
+ */
+
+#ifndef DBKEY_H
+#define DBKEY_H
+
+/*
+ * Keys are SHA-1 outputs and so evenly spread, and nearly every
+ * comparison is settled by the first four bytes.  We compare those as
+ * one big-endian word and only look at the rest of the keys on a tie.
+ */
+#define KEYPREFIX(k)	(((unsigned long)(k)[0] << 24) | \
+							((unsigned long)(k)[1] << 16) | \
+							((unsigned long)(k)[2] << 8) | (unsigned long)(k)[3])
+
+/* Return <0, 0, or >0 as key1 is <, ==, or > key2 */
+static int
+keycomp (unsigned char *key1, unsigned char *key2)
+{
+	unsigned long p1 = KEYPREFIX(key1);
+	unsigned long p2 = KEYPREFIX(key2);
+	int comp;
+
+	if (p1 != p2)
+		return (p1 > p2) ? 1 : -1;
+	comp = memcmp (key1+4, key2+4, HASHSIZE-4);
+	return (comp > 0) - (comp < 0);
+}
+
+/*
+ * Look for key among nkeys sorted keys.  Return true if it is there and
+ * set *keyind to its index.  Return false if it is not, and set *keyind
+ * to the index of the first key above it, where it would go.
+ *
+ * The search halves the range each step, on the prefixes alone, without
+ * a branch on the outcome; the compiler makes the choice a conditional
+ * move.  Only keys with the same prefix as key need the full compare.
+ */
+static int
+keysearch (unsigned char (*keys)[HASHSIZE], int nkeys, unsigned char *key,
+	int *keyind)
+{
+	unsigned long prefix = KEYPREFIX(key);
+	int base = 0;
+	int n = nkeys;
+	int half;
+	int comp;
+
+	/* First key whose prefix is not below key's */
+	if (n > 0)
+	{
+		while (n > 1)
+		{
+			half = n / 2;
+			base = (KEYPREFIX(keys[base+half]) < prefix) ? base+half : base;
+			n -= half;
+		}
+		base += (KEYPREFIX(keys[base]) < prefix);
+	}
+	/* Then past any with the same prefix which are below key */
+	for ( ; base < nkeys && KEYPREFIX(keys[base]) == prefix; base++)
+	{
+		if ((comp = keycomp (keys[base], key)) >= 0)
+		{
+			*keyind = base;
+			return comp == 0;
+		}
+	}
+	*keyind = base;
+	return 0;
+}
+
+#endif /* DBKEY_H */
@@ -55,4 +55,7 @@
 /* Not an error, but a database query */
 #define ERR_DBQUERY				(-100)
 
+/* Likewise, a query for several hashes at once */
+#define ERR_DBBATCHQUERY		(-101)
+
 #endif
@@ -0,0 +1,659 @@
+/*
+ * cardemu.c
+ *	Card side of the software 4758 emulator: host requests, persistent
+ *	data, configuration, clock and random numbers.
+ *
+ *	Only one host may have the card open at a time, as with the real
+ *	device.  A request is read in full when it arrives and the reply
+ *	is sent in full by sccEndRequest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <openssl/rand.h>
+#include "scc_int.h"
+#include "scc_oa.h"
+#include "scc_err.h"
+#include "qsvccnst.h"
+#include "cpqlib.h"
+#include "rslbswap.h"
+#include "sccemu.h"
+
+/* Space we pretend to have for persistent data */
+#define PPDFLASHSIZE		(512*1024)
+#define PPDBBRAMSIZE		(32*1024)
+
+#define PPDDIR				"ppd"
+#define CARDSTATEFILE		"card.dat"
+
+/* Saved across restarts of the emulator */
+struct cardstate {
+	unsigned char	adapterid[8];
+	uint32_t		bootcount;
+	uint32_t		oaindex;
+};
+
+char			emu_carddir[1024];
+unsigned long	emu_bootcount;
+unsigned char	emu_adapterid[8];
+
+static struct cardstate	cstate;
+static int				listenfd = -1;
+static int				hostfd = -1;
+
+/* The request in progress */
+static struct {
+	unsigned long	id;
+	int				active;
+	uint32_t		outlen[SCC_NBUFS];
+	unsigned char	*outbuf[SCC_NBUFS];
+	uint32_t		inmax[SCC_NBUFS];
+	uint32_t		inlen[SCC_NBUFS];
+	unsigned char	*inbuf[SCC_NBUFS];
+} cur;
+
+
+static int
+savestate ()
+{
+	char	path[1100];
+	int		fd;
+
+	sprintf (path, "%s/%s", emu_carddir, CARDSTATEFILE);
+	if ((fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+		return -1;
+	if (write (fd, &cstate, sizeof(cstate)) != sizeof(cstate))
+	{
+		close (fd);
+		return -1;
+	}
+	close (fd);
+	return 0;
+}
+
+/*
+ * Set up the card directory and the socket the host connects to.
+ * Every call counts as a boot of the card.
+ */
+int
+emu_cardinit (char *basedir, int cardnum)
+{
+	struct sockaddr_un	sun;
+	char				name[32];
+	char				path[1100];
+	int					fd;
+
+	sprintf (name, SCCEMU_CARDNAME, cardnum);
+	if (strlen(basedir) + strlen(name) + 2 > sizeof(emu_carddir))
+		return -1;
+	sprintf (emu_carddir, "%s/%s", basedir, name);
+	mkdir (basedir, 0700);
+	mkdir (emu_carddir, 0700);
+	sprintf (path, "%s/%s", emu_carddir, PPDDIR);
+	mkdir (path, 0700);
+
+	/* A card with no state file is fresh from the factory */
+	sprintf (path, "%s/%s", emu_carddir, CARDSTATEFILE);
+	if ((fd = open (path, O_RDONLY)) >= 0)
+	{
+		if (read (fd, &cstate, sizeof(cstate)) != sizeof(cstate))
+		{
+			close (fd);
+			fprintf (stderr, "Corrupt card state file %s\n", path);
+			return -1;
+		}
+		close (fd);
+	} else {
+		memset (&cstate, 0, sizeof(cstate));
+		RAND_bytes (cstate.adapterid, sizeof(cstate.adapterid));
+	}
+	cstate.bootcount++;
+	if (savestate () < 0)
+		return -1;
+	emu_bootcount = cstate.bootcount;
+	memcpy (emu_adapterid, cstate.adapterid, sizeof(emu_adapterid));
+
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	sprintf (name, SCCEMU_SOCKNAME, cardnum);
+	if (strlen(basedir) + strlen(name) + 2 > sizeof(sun.sun_path))
+		return -1;
+	sprintf (sun.sun_path, "%s/%s", basedir, name);
+	unlink (sun.sun_path);
+	if ((listenfd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (bind (listenfd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+			|| listen (listenfd, 5) < 0)
+	{
+		perror (sun.sun_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Hand out OA name index values, unique over the life of the card */
+unsigned short
+emu_nextindex ()
+{
+	cstate.oaindex++;
+	savestate ();
+	return (unsigned short)cstate.oaindex;
+}
+
+
+/*
+ * Requests from the host
+ */
+
+static void
+endcur ()
+{
+	int i;
+
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		free (cur.outbuf[i]);
+		free (cur.inbuf[i]);
+	}
+	memset (&cur, 0, sizeof(cur));
+}
+
+static void
+drophost ()
+{
+	if (hostfd >= 0)
+		close (hostfd);
+	hostfd = -1;
+	endcur ();
+}
+
+/* Read a request from the host into cur; -1 if the host went away */
+static int
+readrequest (sccRequestHeader_t *req)
+{
+	static unsigned long	lastid;
+	struct emureq			ereq;
+	int						i;
+
+	endcur ();
+	if (emu_readall (hostfd, &ereq, sizeof(ereq)) < 0)
+		return -1;
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		if (ereq.outlen[i] > SCCEMU_MAXBUF || ereq.inlen[i] > SCCEMU_MAXBUF)
+			return -1;
+		cur.outlen[i] = ereq.outlen[i];
+		cur.inmax[i] = ereq.inlen[i];
+		if (cur.outlen[i] == 0)
+			continue;
+		if ((cur.outbuf[i] = malloc (cur.outlen[i])) == NULL
+				|| emu_readall (hostfd, cur.outbuf[i], cur.outlen[i]) < 0)
+			return -1;
+	}
+	cur.id = ++lastid;
+	cur.active = 1;
+
+	memset (req, 0, sizeof(*req));
+	req->RequestID = cur.id;
+	req->UserDefined = ereq.userdefined;
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		req->OutBufferLength[i] = cur.outlen[i];
+		req->InBufferLength[i] = cur.inmax[i];
+	}
+	return 0;
+}
+
+long
+sccSignOn (sccAgentID_t *agent, void *reserved)
+{
+	(void) agent;
+	(void) reserved;
+	return 0;
+}
+
+/* Wait for the next request, timeout is in microseconds */
+long
+sccGetNextHeader (sccRequestHeader_t *req, unsigned long flags,
+	unsigned long timeout)
+{
+	struct pollfd	pfd[2];
+	struct timeval	now, end;
+	uint32_t		hello;
+	long			ms;
+	int				fd;
+	int				n;
+
+	(void) flags;
+	gettimeofday (&end, NULL);
+	end.tv_sec += timeout / 1000000;
+	end.tv_usec += timeout % 1000000;
+	if (end.tv_usec >= 1000000)
+	{
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
+
+	for ( ; ; )
+	{
+		ms = -1;
+		if (timeout != SVCWAITFOREVER)
+		{
+			gettimeofday (&now, NULL);
+			ms = (end.tv_sec - now.tv_sec) * 1000
+					+ (end.tv_usec - now.tv_usec) / 1000;
+			if (ms < 0)
+				ms = 0;
+		}
+
+		pfd[0].fd = listenfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = hostfd;
+		pfd[1].events = POLLIN;
+		n = poll (pfd, (hostfd >= 0) ? 2 : 1, (int)ms);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return SCCEMU_ERR_IO;
+		if (n == 0)
+			return QSVCtimedout;
+
+		if (pfd[0].revents & POLLIN)
+		{
+			if ((fd = accept (listenfd, NULL, NULL)) >= 0)
+			{
+				/* Turn away a second host */
+				hello = (hostfd >= 0) ? HDDDeviceBusy : 0;
+				if (emu_writeall (fd, &hello, sizeof(hello)) < 0 || hello)
+					close (fd);
+				else
+					hostfd = fd;
+			}
+			continue;
+		}
+
+		if (hostfd >= 0 && pfd[1].revents)
+		{
+			if (readrequest (req) < 0)
+			{
+				drophost ();
+				continue;
+			}
+			return 0;
+		}
+	}
+}
+
+/* Copy host data in; short buffers are zero filled to the length asked */
+long
+sccGetBufferData (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len)
+{
+	unsigned long n;
+
+	if (!cur.active || reqid != cur.id || bufidx >= SCC_NBUFS)
+		return SCCEMU_ERR_PARM;
+	n = (len < cur.outlen[bufidx]) ? len : cur.outlen[bufidx];
+	memcpy (buf, cur.outbuf[bufidx], n);
+	memset ((unsigned char *)buf + n, 0, len - n);
+	return 0;
+}
+
+long
+sccPutBufferData (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len)
+{
+	if (!cur.active || reqid != cur.id || bufidx >= SCC_NBUFS)
+		return SCCEMU_ERR_PARM;
+	if (len > cur.inmax[bufidx])
+		return SCCEMU_ERR_SPACE;
+	free (cur.inbuf[bufidx]);
+	cur.inbuf[bufidx] = NULL;
+	if (len != 0 && (cur.inbuf[bufidx] = malloc (len)) == NULL)
+		return SCCEMU_ERR_NOMEM;
+	memcpy (cur.inbuf[bufidx], buf, len);
+	cur.inlen[bufidx] = len;
+	return 0;
+}
+
+/* Optionally return one more buffer, then send the reply to the host */
+long
+sccEndRequest (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len, long status)
+{
+	struct emureply	reply;
+	long			rc;
+	int				i;
+
+	if (!cur.active || reqid != cur.id)
+		return SCCEMU_ERR_PARM;
+	if (buf != NULL && len != 0
+			&& (rc = sccPutBufferData (reqid, bufidx, buf, len)) != 0)
+		return rc;
+
+	memset (&reply, 0, sizeof(reply));
+	reply.status = status;
+	for (i=0; i<SCC_NBUFS; i++)
+		reply.inlen[i] = cur.inlen[i];
+	if (emu_writeall (hostfd, &reply, sizeof(reply)) < 0)
+	{
+		drophost ();
+		return 0;
+	}
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		if (cur.inlen[i] != 0
+				&& emu_writeall (hostfd, cur.inbuf[i], cur.inlen[i]) < 0)
+		{
+			drophost ();
+			return 0;
+		}
+	}
+	endcur ();
+	return 0;
+}
+
+
+/*
+ * Persistent data.  Each item is a file named by the hex of its
+ * eight byte name, with a suffix for the kind of memory it is in.
+ */
+
+static void
+ppdpath (char *path, ppd_name_t name, unsigned long type)
+{
+	int i;
+
+	sprintf (path, "%s/%s/", emu_carddir, PPDDIR);
+	for (i=0; i<sizeof(ppd_name_t); i++)
+		sprintf (path+strlen(path), "%02x", (unsigned char)name[i]);
+	strcat (path, (type == PPD_BBRAM) ? ".bbram" : ".flash");
+}
+
+/* Find which memory holds the item; 0 if none */
+static unsigned long
+ppdfind (char *path, ppd_name_t name)
+{
+	struct stat s;
+
+	ppdpath (path, name, PPD_BBRAM);
+	if (stat (path, &s) == 0)
+		return PPD_BBRAM;
+	ppdpath (path, name, PPD_FLASH);
+	if (stat (path, &s) == 0)
+		return PPD_FLASH;
+	return 0;
+}
+
+/* Total bytes in use in one kind of memory */
+static unsigned long
+ppdused (unsigned long type)
+{
+	char			dir[1100];
+	char			path[1400];
+	char			*suffix = (type == PPD_BBRAM) ? ".bbram" : ".flash";
+	DIR				*d;
+	struct dirent	*de;
+	struct stat		s;
+	unsigned long	used = 0;
+	int				len;
+
+	sprintf (dir, "%s/%s", emu_carddir, PPDDIR);
+	if ((d = opendir (dir)) == NULL)
+		return 0;
+	while ((de = readdir (d)) != NULL)
+	{
+		len = strlen (de->d_name);
+		if (len < 6 || strcmp (de->d_name + len - 6, suffix) != 0)
+			continue;
+		sprintf (path, "%s/%s", dir, de->d_name);
+		if (stat (path, &s) == 0)
+			used += s.st_size;
+	}
+	closedir (d);
+	return used;
+}
+
+static long
+ppdwrite (ppd_name_t name, void *buf, unsigned long len, unsigned long type)
+{
+	char			path[1400];
+	char			oldpath[1400];
+	unsigned long	oldtype;
+	struct stat		s;
+	unsigned long	oldlen = 0;
+	unsigned long	limit = (type == PPD_BBRAM) ? PPDBBRAMSIZE : PPDFLASHSIZE;
+	int				fd;
+
+	if ((oldtype = ppdfind (oldpath, name)) != 0)
+	{
+		if (oldtype == type && stat (oldpath, &s) == 0)
+			oldlen = s.st_size;
+	}
+	if (ppdused (type) - oldlen + len > limit)
+		return SCCEMU_ERR_SPACE;
+	if (oldtype != 0)
+		unlink (oldpath);
+
+	ppdpath (path, name, type);
+	if ((fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+		return SCCEMU_ERR_IO;
+	if (write (fd, buf, len) != (long)len)
+	{
+		close (fd);
+		return SCCEMU_ERR_IO;
+	}
+	close (fd);
+	return 0;
+}
+
+long
+sccSavePPD (ppd_name_t name, void *buf, unsigned long len,
+	unsigned long type)
+{
+	if (type != PPD_FLASH && type != PPD_BBRAM)
+		return SCCEMU_ERR_PARM;
+	return ppdwrite (name, buf, len, type);
+}
+
+/* Items which will be updated in place go in BBRAM */
+long
+sccCreate4UpdatePPD (ppd_name_t name, void *buf, unsigned long len)
+{
+	return ppdwrite (name, buf, len, PPD_BBRAM);
+}
+
+long
+sccUpdatePPD (ppd_name_t name, void *buf, unsigned long len,
+	unsigned long offset)
+{
+	char		path[1400];
+	struct stat	s;
+	int			fd;
+
+	if (ppdfind (path, name) != PPD_BBRAM)
+		return SCCEMU_ERR_NOTFOUND;
+	if (stat (path, &s) != 0 || offset + len > (unsigned long)s.st_size)
+		return SCCEMU_ERR_PARM;
+	if ((fd = open (path, O_WRONLY)) < 0)
+		return SCCEMU_ERR_IO;
+	if (pwrite (fd, buf, len, offset) != (long)len)
+	{
+		close (fd);
+		return SCCEMU_ERR_IO;
+	}
+	close (fd);
+	return 0;
+}
+
+long
+sccGetPPDLen (ppd_name_t name, unsigned long *len)
+{
+	char		path[1400];
+	struct stat	s;
+
+	if (ppdfind (path, name) == 0 || stat (path, &s) != 0)
+		return SCCEMU_ERR_NOTFOUND;
+	*len = s.st_size;
+	return 0;
+}
+
+long
+sccGetPPD (ppd_name_t name, void *buf, unsigned long len)
+{
+	char	path[1400];
+	long	nr;
+	int		fd;
+
+	if (ppdfind (path, name) == 0)
+		return SCCEMU_ERR_NOTFOUND;
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return SCCEMU_ERR_IO;
+	nr = read (fd, buf, len);
+	close (fd);
+	if (nr < 0)
+		return SCCEMU_ERR_IO;
+	return 0;
+}
+
+long
+sccDeleteAllPPD ()
+{
+	char			dir[1100];
+	char			path[1400];
+	DIR				*d;
+	struct dirent	*de;
+
+	sprintf (dir, "%s/%s", emu_carddir, PPDDIR);
+	if ((d = opendir (dir)) == NULL)
+		return SCCEMU_ERR_IO;
+	while ((de = readdir (d)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		sprintf (path, "%s/%s", dir, de->d_name);
+		unlink (path);
+	}
+	closedir (d);
+	return 0;
+}
+
+long
+sccQueryPPDSpace (unsigned long *space, unsigned long type)
+{
+	unsigned long limit;
+
+	if (type != PPD_FLASH && type != PPD_BBRAM)
+		return SCCEMU_ERR_PARM;
+	limit = (type == PPD_BBRAM) ? PPDBBRAMSIZE : PPDFLASHSIZE;
+	*space = limit - ppdused (type);
+	return 0;
+}
+
+
+/*
+ * Configuration, clock, random numbers
+ */
+
+long
+sccGetConfig (sccAdapterInfo_t *info, unsigned long *size)
+{
+	if (info == NULL)
+	{
+		*size = sizeof(*info);
+		return 0;
+	}
+	if (*size < sizeof(*info))
+		return SCCEMU_ERR_SPACE;
+	memset (info, 0, sizeof(*info));
+	info->id = 0x4758;
+	info->length = sizeof(*info);
+	memcpy (info->VPD.signature, "VPD", 4);
+	memcpy (info->VPD.pn_tag, "PN", 3);
+	info->VPD.pn_length = sizeof(info->VPD.pn);
+	memcpy (info->VPD.pn, "SCCEMU  ", sizeof(info->VPD.pn));
+	memcpy (info->VPD.ds_tag, "DS", 3);
+	info->VPD.ds_length = sizeof(info->VPD.ds);
+	strncpy (info->VPD.ds, "Software 4758 emulator", sizeof(info->VPD.ds));
+	memcpy (info->OS_Name, "CPQ++", 6);
+	memcpy (info->AdapterID, emu_adapterid, sizeof(info->AdapterID));
+	*size = sizeof(*info);
+	return 0;
+}
+
+long
+sccClearLowBatt ()
+{
+	return 0;
+}
+
+long
+CPGetTime (void *buf)
+{
+	TIME_BLOCK		*tb = buf;
+	struct timeval	tv;
+	struct tm		*tm;
+
+	gettimeofday (&tv, NULL);
+	tm = gmtime (&tv.tv_sec);
+	memset (tb, 0, sizeof(*tb));
+	tb->ticksperday = 86400 * 100;
+	tb->totalticks = (tm->tm_hour*3600 + tm->tm_min*60 + tm->tm_sec) * 100
+						+ tv.tv_usec / 10000;
+	tb->hundredths = tv.tv_usec / 10000;
+	tb->second = tm->tm_sec;
+	tb->minute = tm->tm_min;
+	tb->hour = tm->tm_hour;
+	tb->year = tm->tm_year + 1900;
+	tb->month = tm->tm_mon + 1;
+	tb->day = tm->tm_mday;
+	tb->tickhertz = 100;
+	tb->daynumber = tm->tm_yday;
+	tb->weekday = tm->tm_wday;
+	return 0;
+}
+
+long
+CPRecvMsg (QMSGHDR *msg, unsigned long *count, unsigned long flags,
+	unsigned long timeout)
+{
+	(void) msg;
+	(void) flags;
+	usleep (timeout);
+	*count = 0;
+	return QSVCtimedout;
+}
+
+long
+sccGetRandomNumber (void *buf, unsigned long options)
+{
+	(void) options;
+	if (RAND_bytes (buf, 8) != 1)
+		return SCCEMU_ERR_CRYPTO;
+	return 0;
+}
+
+unsigned long
+rswapl (unsigned long x)
+{
+	return ((x>>24)&0xff) | ((x>>8)&0xff00) | ((x&0xff00)<<8)
+			| ((x&0xff)<<24);
+}
+
+unsigned short
+rswaps (unsigned short x)
+{
+	return ((x>>8)&0xff) | ((x&0xff)<<8);
+}
@@ -0,0 +1,40 @@
+/*
+ * cpqlib.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	CP/Q operating system calls.
+ */
+
+#ifndef CPQLIB_H
+#define CPQLIB_H
+
+#include "scctypes.h"
+
+/* Same layout as the card's real time clock block */
+typedef struct
+{	unsigned long		ticksperday;
+	unsigned long		totalticks;
+	unsigned char		hundredths;
+	unsigned char		second;
+	unsigned char		minute;
+	unsigned char		hour;
+	unsigned short		year;
+	unsigned char		month;
+	unsigned char		day;
+	unsigned short		tick;
+	unsigned short		tickhertz;
+	unsigned short		daynumber;
+	unsigned char		weekday;
+	unsigned char		tickrate;
+} PACK_DATA TIME_BLOCK;
+
+typedef struct
+{	unsigned long		sender;
+	unsigned long		type;
+	unsigned long		data[4];
+} QMSGHDR;
+
+long CPGetTime (void *tb);
+long CPRecvMsg (QMSGHDR *msg, unsigned long *count, unsigned long flags,
+	unsigned long timeout);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ * cryptemu.c
+ *	Crypto engines of the software 4758 emulator, done with OpenSSL:
+ *	modular math, SHA-1, triple DES, and RSA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/bn.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "scc_int.h"
+#include "sccemu.h"
+
+#define RSAEXP		65537
+
+
+/* Convert between byte strings and BIGNUMs, either byte order */
+static BIGNUM *
+bnfrom (unsigned char *buf, unsigned long len, int little)
+{
+	unsigned char	*tmp;
+	BIGNUM			*bn;
+	unsigned long	i;
+
+	if (!little || len == 0)
+		return BN_bin2bn (buf, len, NULL);
+	if ((tmp = malloc (len)) == NULL)
+		return NULL;
+	for (i=0; i<len; i++)
+		tmp[i] = buf[len-1-i];
+	bn = BN_bin2bn (tmp, len, NULL);
+	free (tmp);
+	return bn;
+}
+
+/* Store bn in exactly len bytes, zero padded; -1 if it will not fit */
+static int
+bnto (unsigned char *buf, unsigned long len, BIGNUM *bn, int little)
+{
+	unsigned long	n = BN_num_bytes (bn);
+	unsigned long	i;
+	unsigned char	t;
+
+	if (n > len)
+		return -1;
+	memset (buf, 0, len - n);
+	BN_bn2bin (bn, buf + len - n);
+	if (little)
+	{
+		for (i=0; i<len/2; i++)
+		{
+			t = buf[i];
+			buf[i] = buf[len-1-i];
+			buf[len-1-i] = t;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Modular math
+ */
+
+long
+sccModMath (unsigned long cmd, unsigned long nbufs, sccModMath_Int_t *bn)
+{
+	int		little = (cmd & MODM_LITTLE) != 0;
+	BN_CTX	*ctx = NULL;
+	BIGNUM	*r = NULL, *m = NULL, *a = NULL, *b = NULL;
+	long	rc = SCCEMU_ERR_CRYPTO;
+	int		ok = 0;
+
+	if (nbufs < 3 || nbufs > 4)
+		return SCCEMU_ERR_PARM;
+	if ((cmd & 0xff) != MODM_MOD && nbufs != 4)
+		return SCCEMU_ERR_PARM;
+
+	ctx = BN_CTX_new ();
+	r = BN_new ();
+	m = bnfrom (bn[1].buffer, bn[1].bytesize, little);
+	a = bnfrom (bn[2].buffer, bn[2].bytesize, little);
+	if (nbufs == 4)
+		b = bnfrom (bn[3].buffer, bn[3].bytesize, little);
+	if (ctx == NULL || r == NULL || m == NULL || a == NULL
+			|| (nbufs == 4 && b == NULL))
+		goto done;
+	if (BN_is_zero (m))
+	{
+		rc = SCCEMU_ERR_PARM;
+		goto done;
+	}
+
+	switch (cmd & 0xff)
+	{
+	case MODM_MOD:
+		ok = BN_nnmod (r, a, m, ctx);
+		break;
+	case MODM_MULT:
+		ok = BN_mod_mul (r, a, b, m, ctx);
+		break;
+	case MODM_EXP:
+		ok = BN_mod_exp (r, a, b, m, ctx);
+		break;
+	default:
+		rc = SCCEMU_ERR_PARM;
+		goto done;
+	}
+	if (!ok)
+		goto done;
+
+	if (bnto (bn[0].buffer, bn[0].bytesize, r, little) < 0)
+	{
+		rc = SCCEMU_ERR_SPACE;
+		goto done;
+	}
+	bn[0].bitsize = BN_num_bits (r);
+	rc = 0;
+
+done:
+	BN_free (r);
+	BN_free (m);
+	BN_free (a);
+	BN_free (b);
+	if (ctx)
+		BN_CTX_free (ctx);
+	return rc;
+}
+
+
+/*
+ * SHA-1.  Between message parts the chaining value is kept in
+ * hash_value and the byte count in running_length.
+ */
+
+long
+sccSHA1 (sccSHA_RB_t *rb)
+{
+	unsigned long	part = rb->options & SHA_MSGPART_MASK;
+	unsigned long	count = rb->source.internal.count;
+	unsigned char	*h = rb->hash_value;
+	SHA_CTX			c;
+	SHA_LONG		*hv[5];
+	int				i;
+
+	if (!(rb->options & SHA_INTERNAL_INPUT))
+		return SCCEMU_ERR_PARM;
+	if ((part == SHA_MSGPART_FIRST || part == SHA_MSGPART_MIDDLE)
+			&& count % SHA_CBLOCK != 0)
+		return SCCEMU_ERR_PARM;
+
+	SHA1_Init (&c);
+	hv[0] = &c.h0; hv[1] = &c.h1; hv[2] = &c.h2; hv[3] = &c.h3; hv[4] = &c.h4;
+	if (part == SHA_MSGPART_MIDDLE || part == SHA_MSGPART_FINAL)
+	{
+		if (rb->running_length % SHA_CBLOCK != 0)
+			return SCCEMU_ERR_PARM;
+		for (i=0; i<5; i++)
+			*hv[i] = ((SHA_LONG)h[4*i]<<24) | ((SHA_LONG)h[4*i+1]<<16)
+					| ((SHA_LONG)h[4*i+2]<<8) | (SHA_LONG)h[4*i+3];
+		c.Nl = (SHA_LONG)(rb->running_length << 3);
+		c.Nh = (SHA_LONG)((unsigned long long)rb->running_length >> 29);
+	} else
+		rb->running_length = 0;
+
+	SHA1_Update (&c, rb->source.internal.buffer, count);
+
+	if (part == SHA_MSGPART_FIRST || part == SHA_MSGPART_MIDDLE)
+	{
+		for (i=0; i<5; i++)
+		{
+			h[4*i] = *hv[i] >> 24;
+			h[4*i+1] = *hv[i] >> 16;
+			h[4*i+2] = *hv[i] >> 8;
+			h[4*i+3] = *hv[i];
+		}
+		rb->running_length += count;
+	} else
+		SHA1_Final (h, &c);
+	return 0;
+}
+
+
+/*
+ * Triple DES, no padding
+ */
+
+long
+sccTDES (sccTDES_RB_t *rb)
+{
+	EVP_CIPHER_CTX		*ctx;
+	const EVP_CIPHER	*cipher;
+	unsigned char		key[24];
+	unsigned long		count = rb->source.internal.count;
+	int					enc = !(rb->options & DES_DECRYPT);
+	int					outl, finl;
+	long				rc = SCCEMU_ERR_CRYPTO;
+
+	if (!(rb->options & DES_TRIPLE_DES)
+			|| !(rb->options & DES_INTERNAL_INPUT)
+			|| !(rb->options & DES_INTERNAL_OUTPUT))
+		return SCCEMU_ERR_PARM;
+	if (count % 8 != 0 || rb->destination.internal.count < count)
+		return SCCEMU_ERR_PARM;
+
+	cipher = (rb->options & DES_CBC_MODE) ? EVP_des_ede3_cbc()
+											: EVP_des_ede3_ecb();
+	memcpy (key, rb->key1, 8);
+	memcpy (key+8, rb->key2, 8);
+	memcpy (key+16, rb->key3, 8);
+
+	if ((ctx = EVP_CIPHER_CTX_new ()) == NULL)
+		return SCCEMU_ERR_NOMEM;
+	if (EVP_CipherInit_ex (ctx, cipher, NULL, key, rb->init_v, enc)
+			&& EVP_CIPHER_CTX_set_padding (ctx, 0)
+			&& EVP_CipherUpdate (ctx, rb->destination.internal.buffer, &outl,
+					rb->source.internal.buffer, (int)count)
+			&& EVP_CipherFinal_ex (ctx,
+					rb->destination.internal.buffer + outl, &finl))
+		rc = 0;
+	EVP_CIPHER_CTX_free (ctx);
+	memset (key, 0, sizeof(key));
+	return rc;
+}
+
+
+/*
+ * RSA
+ */
+
+#define TOKFIELD(key,off)	((unsigned char *)(key) + (key)->off)
+
+/* Raw public key operation, in and out are n_Length bytes */
+int
+emu_rsapublic (sccRSAKeyToken_t *key, unsigned char *out, unsigned char *in)
+{
+	BN_CTX	*ctx = BN_CTX_new ();
+	BIGNUM	*n = BN_bin2bn (TOKFIELD(key,n_Offset), key->n_Length, NULL);
+	BIGNUM	*e = BN_bin2bn (TOKFIELD(key,e_Offset), key->e_Length, NULL);
+	BIGNUM	*x = BN_bin2bn (in, key->n_Length, NULL);
+	int		rc = -1;
+
+	if (ctx && n && e && x && BN_cmp (x, n) < 0
+			&& BN_mod_exp (x, x, e, n, ctx)
+			&& bnto (out, key->n_Length, x, 0) == 0)
+		rc = 0;
+	BN_free (n);
+	BN_free (e);
+	BN_free (x);
+	if (ctx)
+		BN_CTX_free (ctx);
+	return rc;
+}
+
+/*
+ * Raw private key operation using the CRT values in the token.
+ * Unless RSA_DONT_BLIND is given, the input is blinded with r and the
+ * output unblinded with r1, and both are then squared in the token so
+ * the next use gets a fresh pair.  Squaring keeps r = b^e valid for
+ * whatever e the caller has put dp and dq in for, which is how the
+ * rpow signing key uses several exponents with one token.
+ */
+int
+emu_rsaprivate (sccRSAKeyToken_t *key, unsigned char *out, unsigned char *in,
+	unsigned long options)
+{
+	int		blind = !(options & RSA_DONT_BLIND);
+	BN_CTX	*ctx = BN_CTX_new ();
+	BIGNUM	*n, *p, *q, *dp, *dq, *ap, *bp, *r = NULL, *r1 = NULL;
+	BIGNUM	*x, *mp, *mq;
+	int		rc = -1;
+
+	n = BN_bin2bn (TOKFIELD(key,n_Offset), key->n_Length, NULL);
+	p = BN_bin2bn (TOKFIELD(key,y.p_Offset), key->x.p_Length, NULL);
+	q = BN_bin2bn (TOKFIELD(key,q_Offset), key->q_Length, NULL);
+	dp = BN_bin2bn (TOKFIELD(key,dpOffset), key->dpLength, NULL);
+	dq = BN_bin2bn (TOKFIELD(key,dqOffset), key->dqLength, NULL);
+	ap = BN_bin2bn (TOKFIELD(key,apOffset), key->apLength, NULL);
+	bp = BN_bin2bn (TOKFIELD(key,bpOffset), key->bpLength, NULL);
+	if (blind)
+	{
+		r = BN_bin2bn (TOKFIELD(key,r_Offset), key->r_Length, NULL);
+		r1 = BN_bin2bn (TOKFIELD(key,r1Offset), key->r1Length, NULL);
+	}
+	x = BN_bin2bn (in, key->n_Length, NULL);
+	mp = BN_new ();
+	mq = BN_new ();
+
+	if (ctx == NULL || !n || !p || !q || !dp || !dq || !ap || !bp || !x
+			|| !mp || !mq || (blind && (!r || !r1)))
+		goto done;
+	if (key->type != RSA_PRIVATE_CHINESE_REMAINDER || BN_cmp (x, n) >= 0)
+		goto done;
+
+	if (blind && !BN_mod_mul (x, x, r, n, ctx))
+		goto done;
+	if (!BN_mod_exp (mp, x, dp, p, ctx)
+			|| !BN_mod_exp (mq, x, dq, q, ctx)
+			|| !BN_mul (mp, mp, ap, ctx)
+			|| !BN_mul (mq, mq, bp, ctx)
+			|| !BN_mod_add (x, mp, mq, n, ctx))
+		goto done;
+	if (blind)
+	{
+		if (!BN_mod_mul (x, x, r1, n, ctx)
+				|| !BN_mod_sqr (r, r, n, ctx)
+				|| !BN_mod_sqr (r1, r1, n, ctx)
+				|| bnto (TOKFIELD(key,r_Offset), key->r_Length, r, 0) < 0
+				|| bnto (TOKFIELD(key,r1Offset), key->r1Length, r1, 0) < 0)
+			goto done;
+	}
+	if (bnto (out, key->n_Length, x, 0) < 0)
+		goto done;
+	rc = 0;
+
+done:
+	BN_free (n); BN_free (p); BN_free (q);
+	BN_free (dp); BN_free (dq); BN_free (ap); BN_free (bp);
+	BN_free (r); BN_free (r1);
+	BN_free (x); BN_free (mp); BN_free (mq);
+	if (ctx)
+		BN_CTX_free (ctx);
+	return rc;
+}
+
+long
+sccRSA (sccRSA_RB_t *rb)
+{
+	sccRSAKeyToken_t	*key = rb->key_token;
+	int					rc;
+
+	if (key == NULL || rb->data_size != key->n_BitLength)
+		return SCCEMU_ERR_PARM;
+	if (rb->options & RSA_PUBLIC)
+		rc = emu_rsapublic (key, rb->data_out, rb->data_in);
+	else if (rb->options & RSA_PRIVATE)
+		rc = emu_rsaprivate (key, rb->data_out, rb->data_in, rb->options);
+	else
+		return SCCEMU_ERR_PARM;
+	return (rc == 0) ? 0 : SCCEMU_ERR_CRYPTO;
+}
+
+/* Generate a prime of the given size with gcd(p-1, e) == 1 */
+static int
+genprime (BIGNUM *p, int bits, BIGNUM *e, BN_CTX *ctx)
+{
+	BIGNUM *pm1 = BN_new ();
+	BIGNUM *g = BN_new ();
+	int ok = 0;
+
+	while (pm1 && g)
+	{
+		if (!BN_generate_prime_ex (p, bits, 0, NULL, NULL, NULL)
+				|| !BN_sub (pm1, p, BN_value_one ())
+				|| !BN_gcd (g, pm1, e, ctx))
+			break;
+		if (BN_is_one (g))
+		{
+			ok = 1;
+			break;
+		}
+	}
+	BN_free (pm1);
+	BN_free (g);
+	return ok;
+}
+
+/* Lay out a token header for a modulus of nlen bytes */
+static unsigned long
+tokenlayout (sccRSAKeyToken_t *key, unsigned long nlen, int private)
+{
+	unsigned long off = sizeof(*key);
+
+	memset (key, 0, sizeof(*key));
+	key->n_Length = nlen;
+	key->n_Offset = off;		off += nlen;
+	key->e_Length = 3;
+	key->e_Offset = off;		off += 3;
+	if (!private)
+	{
+		key->type = RSA_PUBLIC_KEY;
+		return off;
+	}
+	key->type = RSA_PRIVATE_CHINESE_REMAINDER;
+	key->x.p_Length = key->q_Length = nlen/2;
+	key->dpLength = key->dqLength = nlen/2;
+	key->apLength = key->bpLength = nlen;
+	key->r_Length = key->r1Length = nlen;
+	key->y.p_Offset = off;		off += nlen/2;
+	key->q_Offset = off;		off += nlen/2;
+	key->dpOffset = off;		off += nlen/2;
+	key->dqOffset = off;		off += nlen/2;
+	key->apOffset = off;		off += nlen;
+	key->bpOffset = off;		off += nlen;
+	key->r_Offset = off;		off += nlen;
+	key->r1Offset = off;		off += nlen;
+	return off;
+}
+
+/* Generate a CRT private key token; *keylen is room in, size used out */
+int
+emu_rsakeygen (sccRSAKeyToken_t *key, unsigned long *keylen,
+	unsigned long bits)
+{
+	sccRSAKeyToken_t	hdr;
+	unsigned long		nlen = bits / 8;
+	unsigned long		toklen;
+	BN_CTX				*ctx = BN_CTX_new ();
+	BIGNUM				*e = BN_new (), *p = BN_new (), *q = BN_new ();
+	BIGNUM				*n = BN_new (), *t = BN_new (), *u = BN_new ();
+	BIGNUM				*b = BN_new ();
+	int					rc = -1;
+
+	if (bits % 16 != 0 || bits < 512)
+		goto done;
+	toklen = tokenlayout (&hdr, nlen, 1);
+	if (toklen > *keylen)
+		goto done;
+	if (!ctx || !e || !p || !q || !n || !t || !u || !b
+			|| !BN_set_word (e, RSAEXP))
+		goto done;
+
+	/* Insist on a modulus of exactly the size asked for */
+	do {
+		if (!genprime (p, bits/2, e, ctx) || !genprime (q, bits/2, e, ctx)
+				|| !BN_mul (n, p, q, ctx))
+			goto done;
+	} while (BN_num_bits (n) != bits || BN_cmp (p, q) == 0);
+
+	memcpy (key, &hdr, sizeof(hdr));
+	key->tokenLength = toklen;
+	key->n_BitLength = bits;
+	if (bnto (TOKFIELD(key,n_Offset), nlen, n, 0) < 0
+			|| bnto (TOKFIELD(key,e_Offset), 3, e, 0) < 0
+			|| bnto (TOKFIELD(key,y.p_Offset), nlen/2, p, 0) < 0
+			|| bnto (TOKFIELD(key,q_Offset), nlen/2, q, 0) < 0)
+		goto done;
+
+	/* dp = e^-1 mod p-1, dq = e^-1 mod q-1 */
+	if (!BN_sub (t, p, BN_value_one ()) || !BN_mod_inverse (u, e, t, ctx)
+			|| bnto (TOKFIELD(key,dpOffset), nlen/2, u, 0) < 0)
+		goto done;
+	if (!BN_sub (t, q, BN_value_one ()) || !BN_mod_inverse (u, e, t, ctx)
+			|| bnto (TOKFIELD(key,dqOffset), nlen/2, u, 0) < 0)
+		goto done;
+
+	/* ap = q * (q^-1 mod p), bp = p * (p^-1 mod q) */
+	if (!BN_mod_inverse (u, q, p, ctx) || !BN_mul (t, u, q, ctx)
+			|| bnto (TOKFIELD(key,apOffset), nlen, t, 0) < 0)
+		goto done;
+	if (!BN_mod_inverse (u, p, q, ctx) || !BN_mul (t, u, p, ctx)
+			|| bnto (TOKFIELD(key,bpOffset), nlen, t, 0) < 0)
+		goto done;
+
+	/* Initial blinding pair */
+	do {
+		if (!BN_rand_range (b, n))
+			goto done;
+	} while (BN_is_zero (b) || !BN_mod_inverse (u, b, n, ctx));
+	if (!BN_mod_exp (t, b, e, n, ctx)
+			|| bnto (TOKFIELD(key,r_Offset), nlen, t, 0) < 0
+			|| bnto (TOKFIELD(key,r1Offset), nlen, u, 0) < 0)
+		goto done;
+
+	*keylen = toklen;
+	rc = 0;
+
+done:
+	BN_free (e); BN_free (p); BN_free (q); BN_free (n);
+	BN_clear_free (t); BN_clear_free (u); BN_clear_free (b);
+	if (ctx)
+		BN_CTX_free (ctx);
+	return rc;
+}
+
+/* Make a public key token from a private one */
+int
+emu_rsapubtoken (sccRSAKeyToken_t *pub, unsigned long *publen,
+	sccRSAKeyToken_t *priv)
+{
+	sccRSAKeyToken_t	hdr;
+	unsigned long		toklen;
+
+	toklen = tokenlayout (&hdr, priv->n_Length, 0);
+	if (toklen > *publen || priv->e_Length != hdr.e_Length)
+		return -1;
+	memcpy (pub, &hdr, sizeof(hdr));
+	pub->tokenLength = toklen;
+	pub->n_BitLength = priv->n_BitLength;
+	memcpy (TOKFIELD(pub,n_Offset), TOKFIELD(priv,n_Offset), priv->n_Length);
+	memcpy (TOKFIELD(pub,e_Offset), TOKFIELD(priv,e_Offset), priv->e_Length);
+	*publen = toklen;
+	return 0;
+}
+
+long
+sccRSAKeyGenerate (sccRSAKeyGen_RB_t *rb)
+{
+	if (rb->key_type != RSA_PRIVATE_CHINESE_REMAINDER
+			|| rb->public_exp != RSA_EXPONENT_65537
+			|| rb->key_token == NULL || rb->key_size == NULL)
+		return SCCEMU_ERR_PARM;
+	if (emu_rsakeygen (rb->key_token, rb->key_size, rb->mod_size) < 0)
+		return SCCEMU_ERR_CRYPTO;
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * emuio.c
+ *	Socket helpers shared by the host and card halves of the emulator
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "sccemu.h"
+
+/* Read exactly len bytes; return 0 on success, -1 on error or EOF */
+int
+emu_readall (int fd, void *buf, unsigned long len)
+{
+	unsigned char *cbuf = buf;
+	long nr;
+
+	while (len > 0)
+	{
+		nr = recv (fd, cbuf, len, 0);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0)
+			return -1;
+		cbuf += nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+/* Write exactly len bytes; return 0 on success, -1 on error */
+int
+emu_writeall (int fd, void *buf, unsigned long len)
+{
+	unsigned char *cbuf = buf;
+	long nw;
+
+	while (len > 0)
+	{
+		/* A vanished peer must not kill us with SIGPIPE */
+		nw = send (fd, cbuf, len, MSG_NOSIGNAL);
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw <= 0)
+			return -1;
+		cbuf += nw;
+		len -= nw;
+	}
+	return 0;
+}
+
+/* Directory holding the card sockets and card state */
+char *
+emu_basedir ()
+{
+	char *dir = getenv (SCCEMU_DIRENV);
+
+	return (dir && *dir) ? dir : SCCEMU_DEFDIR;
+}
@@ -0,0 +1,146 @@
+/*
+ * hostemu.c
+ *	Host side of the software 4758 card emulator
+ *
+ *	Replaces the IBM host library.  Each adapter is an sccemu process
+ *	listening on a Unix socket; see sccemu.h for the wire format.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scc_host.h"
+#include "scc_err.h"
+#include "sccemu.h"
+
+
+static int
+sockpath (char *buf, unsigned buflen, int n)
+{
+	char name[32];
+
+	sprintf (name, SCCEMU_SOCKNAME, n);
+	if (strlen (emu_basedir()) + 1 + strlen(name) + 1 > buflen)
+		return -1;
+	sprintf (buf, "%s/%s", emu_basedir(), name);
+	return 0;
+}
+
+/* Cards are numbered consecutively from 0 */
+long SCC_CALL
+sccAdapterCount (sccAdapterNumber_t *count)
+{
+	struct sockaddr_un	sun;
+	struct stat			s;
+	int					n;
+
+	for (n=0; ; n++)
+	{
+		if (sockpath (sun.sun_path, sizeof(sun.sun_path), n) < 0)
+			break;
+		if (stat (sun.sun_path, &s) != 0 || !S_ISSOCK(s.st_mode))
+			break;
+	}
+	*count = n;
+	return 0;
+}
+
+long SCC_CALL
+sccOpenAdapter (sccAdapterNumber_t n, sccAdapterHandle_t *handle)
+{
+	struct sockaddr_un	sun;
+	uint32_t			hello;
+	int					fd;
+
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (sockpath (sun.sun_path, sizeof(sun.sun_path), (int)n) < 0)
+		return HDDBadParm;
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return HDDCommError;
+	if (connect (fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+	{
+		close (fd);
+		return HDDNoAdapter;
+	}
+
+	/* Card tells us whether another host already has it open */
+	if (emu_readall (fd, &hello, sizeof(hello)) < 0)
+	{
+		close (fd);
+		return HDDCommError;
+	}
+	if (hello != 0)
+	{
+		close (fd);
+		return (long)hello;
+	}
+
+	*handle = fd;
+	return 0;
+}
+
+long SCC_CALL
+sccRequest (sccAdapterHandle_t handle, sccRB_t *rb)
+{
+	struct emureq		req;
+	struct emureply		reply;
+	int					fd = (int)handle;
+	int					i;
+
+	if (fd < 0)
+		return HDDInvalidHandle;
+
+	memset (&req, 0, sizeof(req));
+	req.userdefined = rb->UserDefined;
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		if (rb->OutBufferLength[i] > SCCEMU_MAXBUF
+				|| rb->InBufferLength[i] > SCCEMU_MAXBUF)
+			return HDDBadParm;
+		if (rb->pOutBuffer[i] == NULL)
+			rb->OutBufferLength[i] = 0;
+		if (rb->pInBuffer[i] == NULL)
+			rb->InBufferLength[i] = 0;
+		req.outlen[i] = rb->OutBufferLength[i];
+		req.inlen[i] = rb->InBufferLength[i];
+	}
+
+	if (emu_writeall (fd, &req, sizeof(req)) < 0)
+		return HDDCommError;
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		if (req.outlen[i] != 0
+				&& emu_writeall (fd, rb->pOutBuffer[i], req.outlen[i]) < 0)
+			return HDDCommError;
+	}
+
+	if (emu_readall (fd, &reply, sizeof(reply)) < 0)
+		return HDDCommError;
+	for (i=0; i<SCC_NBUFS; i++)
+	{
+		/* The card never returns more than we made room for */
+		if (reply.inlen[i] > req.inlen[i])
+			return HDDCommError;
+		if (reply.inlen[i] != 0
+				&& emu_readall (fd, rb->pInBuffer[i], reply.inlen[i]) < 0)
+			return HDDCommError;
+		rb->InBufferLength[i] = reply.inlen[i];
+	}
+	rb->Status = reply.status;
+	return 0;
+}
+
+long SCC_CALL
+sccCloseAdapter (sccAdapterHandle_t handle)
+{
+	if (handle < 0)
+		return HDDInvalidHandle;
+	close ((int)handle);
+	return 0;
+}
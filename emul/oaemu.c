@@ -0,0 +1,783 @@
+/*
+ * oaemu.c
+ *	Outbound Authentication for the software 4758 emulator
+ *
+ *	We keep a certificate chain shaped like a real card's: a class
+ *	root, a miniboot (device) key, an OS key which certifies the
+ *	application, and whatever keys the application generates.  Each
+ *	certificate and its private key is kept in a file in the card's
+ *	"oa" directory.  Signatures use the same ISO 9796 padding as the
+ *	IBM chain so the host side checker in client/certvalid.c can parse
+ *	them, but the class root is our own, shared by all emulated cards
+ *	under one SCCEMU_DIR, so of course the IBM root will not verify it.
+ *
+ *	As on the real card, replacing the application image (here, the
+ *	sccemu binary) counts as a reload: the OS key is recertified for
+ *	the new image hash and the application's keys are deleted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <openssl/bn.h>
+#include <openssl/sha.h>
+#include "scc_int.h"
+#include "scc_oa.h"
+#include "sccemu.h"
+
+#define OADIR			"oa"
+#define CLASSROOTFILE	"classroot.oa"
+#define OAKEYBITS		1024
+#define OAKEYTOKSIZE	4096
+
+#define UP4(n)			(((n)+3) & ~3)
+
+/* Miniboot image, and the OS image: "2.41 CP/Q++" as certvalid.c wants */
+static char mbimage[] = "sccemu miniboot";
+static unsigned char oshash[] = {
+	0x4d, 0xb7, 0x7c, 0x4e, 0x47, 0x92, 0xe3, 0xd5,
+	0xbc, 0x4a, 0x48, 0xed, 0x0f, 0x40, 0xde, 0x42,
+	0x69, 0x8e, 0xbb, 0x30
+};
+#define OSOWNER		2
+
+/* Used for ISO 9796 padding */
+static unsigned char perm9796[] = {
+	14, 3, 5, 8, 9, 4, 2, 15, 0, 13, 11, 6, 7, 10, 12, 1
+};
+
+/* File header for a certificate with its private key */
+struct oarec {
+	uint32_t	status;
+	uint32_t	type;
+	uint32_t	certlen;
+	uint32_t	keylen;
+};
+
+/* In memory form */
+typedef struct oaent {
+	struct oarec		rec;
+	unsigned char		*cert;
+	sccRSAKeyToken_t	*key;
+} oaent;
+
+
+static void
+oaentfree (oaent *ent)
+{
+	if (ent->key)
+	{
+		memset (ent->key, 0, ent->rec.keylen);
+		free (ent->key);
+	}
+	free (ent->cert);
+	memset (ent, 0, sizeof(*ent));
+}
+
+static void
+oapath (char *path, sccOA_CKO_Name_t *name)
+{
+	sprintf (path, "%s/%s/%08lx%04x%04x", emu_carddir, OADIR,
+			(unsigned long)name->creation_boot, name->name_type, name->index);
+}
+
+static int
+oaread (char *path, oaent *ent)
+{
+	int fd;
+
+	memset (ent, 0, sizeof(*ent));
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return -1;
+	if (read (fd, &ent->rec, sizeof(ent->rec)) != sizeof(ent->rec)
+			|| ent->rec.certlen > SCCEMU_MAXBUF
+			|| ent->rec.keylen > SCCEMU_MAXBUF
+			|| (ent->cert = malloc (ent->rec.certlen)) == NULL
+			|| (ent->key = malloc (ent->rec.keylen)) == NULL
+			|| read (fd, ent->cert, ent->rec.certlen) != ent->rec.certlen
+			|| read (fd, ent->key, ent->rec.keylen) != ent->rec.keylen)
+	{
+		close (fd);
+		oaentfree (ent);
+		return -1;
+	}
+	close (fd);
+	return 0;
+}
+
+/* Write atomically; with excl, fail if the file already exists */
+static int
+oawrite (char *path, oaent *ent, int excl)
+{
+	char	tmp[1200];
+	int		fd;
+	int		rc;
+
+	sprintf (tmp, "%s.%d", path, (int)getpid());
+	if ((fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+		return -1;
+	if (write (fd, &ent->rec, sizeof(ent->rec)) != sizeof(ent->rec)
+			|| write (fd, ent->cert, ent->rec.certlen) != ent->rec.certlen
+			|| write (fd, ent->key, ent->rec.keylen) != ent->rec.keylen
+			|| fsync (fd) != 0)
+	{
+		close (fd);
+		unlink (tmp);
+		return -1;
+	}
+	close (fd);
+	rc = excl ? link (tmp, path) : rename (tmp, path);
+	unlink (tmp);
+	return rc;
+}
+
+static int
+oaload (sccOA_CKO_Name_t *name, oaent *ent)
+{
+	char path[1200];
+
+	oapath (path, name);
+	return oaread (path, ent);
+}
+
+static int
+oasave (oaent *ent)
+{
+	char path[1200];
+
+	oapath (path, &((sccOA_CKO_Head_t *)ent->cert)->cko_name);
+	return oawrite (path, ent, 0);
+}
+
+/*
+ * Call fn for every certificate on the card, stopping early if it
+ * returns nonzero.  Returns the number of certificates visited.
+ */
+static int
+oaforeach (int (*fn)(oaent *ent, void *arg), void *arg)
+{
+	char			dir[1100];
+	char			path[1400];
+	DIR				*d;
+	struct dirent	*de;
+	oaent			ent;
+	int				n = 0;
+	int				stop = 0;
+
+	sprintf (dir, "%s/%s", emu_carddir, OADIR);
+	if ((d = opendir (dir)) == NULL)
+		return 0;
+	while (!stop && (de = readdir (d)) != NULL)
+	{
+		if (strlen (de->d_name) != 16)
+			continue;
+		sprintf (path, "%s/%s", dir, de->d_name);
+		if (oaread (path, &ent) < 0)
+			continue;
+		n++;
+		stop = fn (&ent, arg);
+		oaentfree (&ent);
+	}
+	closedir (d);
+	return n;
+}
+
+
+/*
+ * Signatures
+ */
+
+static void
+pad9796 (unsigned char *padbuf, unsigned modlen, unsigned char *md)
+{
+	int mdoff;
+	int i;
+
+	for (i=0; i<modlen; i+=2)
+	{
+		mdoff = SHA_DIGEST_LENGTH - ((modlen/2) % SHA_DIGEST_LENGTH);
+		mdoff = (mdoff + i/2) % SHA_DIGEST_LENGTH;
+		padbuf[i] = (perm9796[md[mdoff]>>4]<<4) | perm9796[md[mdoff]&0xf];
+		padbuf[i+1] = md[mdoff];
+	}
+	padbuf[0] = 0x40 | (padbuf[0] & 0x3f);
+	padbuf[modlen-2*SHA_DIGEST_LENGTH] ^= 0x01;
+	padbuf[modlen-1] = 0x06 | ((padbuf[modlen-1] & 0xf) << 4);
+}
+
+static int
+sign9796 (unsigned char *sig, sccRSAKeyToken_t *key,
+	unsigned char *data, unsigned long datalen)
+{
+	unsigned char	md[SHA_DIGEST_LENGTH];
+	unsigned char	*padbuf;
+	int				rc;
+
+	if (key->n_Length % 4 != 0 || (padbuf = malloc (key->n_Length)) == NULL)
+		return -1;
+	SHA1 (data, datalen, md);
+	pad9796 (padbuf, key->n_Length, md);
+	rc = emu_rsaprivate (key, sig, padbuf, RSA_DONT_BLIND);
+	free (padbuf);
+	return rc;
+}
+
+/* The signature may come out as the padded hash or its negative mod n */
+static int
+verify9796 (sccRSAKeyToken_t *key, unsigned char *data,
+	unsigned long datalen, unsigned char *sig, unsigned long siglen)
+{
+	unsigned char	md[SHA_DIGEST_LENGTH];
+	unsigned char	*padbuf;
+	unsigned char	*sigexp;
+	BIGNUM			*n, *v;
+	int				ok = 0;
+
+	if (siglen != key->n_Length || key->n_Length % 4 != 0)
+		return -1;
+	padbuf = malloc (key->n_Length);
+	sigexp = malloc (key->n_Length);
+	if (padbuf && sigexp && emu_rsapublic (key, sigexp, sig) == 0)
+	{
+		SHA1 (data, datalen, md);
+		pad9796 (padbuf, key->n_Length, md);
+		ok = (memcmp (padbuf, sigexp, key->n_Length) == 0);
+		if (!ok)
+		{
+			n = BN_bin2bn ((unsigned char *)key + key->n_Offset,
+					key->n_Length, NULL);
+			v = BN_bin2bn (sigexp, key->n_Length, NULL);
+			if (n && v && BN_sub (v, n, v)
+					&& BN_num_bytes (v) <= key->n_Length)
+			{
+				memset (sigexp, 0, key->n_Length);
+				BN_bn2bin (v, sigexp + key->n_Length - BN_num_bytes (v));
+				ok = (memcmp (padbuf, sigexp, key->n_Length) == 0);
+			}
+			BN_free (n);
+			BN_free (v);
+		}
+	}
+	free (padbuf);
+	free (sigexp);
+	return ok ? 0 : -1;
+}
+
+
+/*
+ * Certificates
+ */
+
+static void
+fillvar (var_t *var, unsigned char *data, unsigned long len)
+{
+	var->offset = data - (unsigned char *)var;
+	var->len = len;
+}
+
+static void
+layerdesc (sccOALayerDesc_t *ld, int layer, unsigned long owner,
+	char *imagename, unsigned char *hash)
+{
+	memset (ld, 0, sizeof(*ld));
+	ld->struct_id.name = SCCOALAYERDESC_T;
+	ld->struct_id.version = SCCOALAYERDESC_VER;
+	ld->layer_number = layer;
+	ld->ownerID = owner;
+	strncpy ((char *)ld->image_name, imagename, sizeof(ld->image_name));
+	ld->image_revision = 1;
+	memcpy (ld->image_hash, hash, sizeof(ld->image_hash));
+	ld->layer_name.struct_id.name = SCCOALAYERDESC_T;
+	ld->layer_name.epoch_start = emu_bootcount;
+	ld->layer_name.config_start = emu_bootcount;
+}
+
+/*
+ * Generate a key and its certificate, signed by signer, or self
+ * signed if signer is NULL.  Layout is head, body, public key token,
+ * the two descriptor fields, then the signature over the body and
+ * what follows it.
+ */
+static int
+makecert (oaent *ent, unsigned long type, sccOA_CKO_Name_t *name,
+	unsigned long bits, oaent *signer, void *descA, unsigned long descAlen,
+	void *descB, unsigned long descBlen)
+{
+	sccOA_CKO_Head_t	*head;
+	sccOA_CKO_Body_t	*body;
+	sccRSAKeyToken_t	*signkey;
+	sccRSAKeyToken_t	*pubkey;
+	unsigned char		pubbuf[OAKEYTOKSIZE];
+	unsigned long		publen = sizeof(pubbuf);
+	unsigned long		keylen = OAKEYTOKSIZE;
+	unsigned long		datalen, siglen, off;
+	unsigned char		*p;
+	struct tm			*tm;
+	time_t				now = time (NULL);
+
+	memset (ent, 0, sizeof(*ent));
+	if ((ent->key = malloc (keylen)) == NULL)
+		return -1;
+	if (emu_rsakeygen (ent->key, &keylen, bits) < 0
+			|| emu_rsapubtoken ((sccRSAKeyToken_t *)pubbuf, &publen,
+					ent->key) < 0)
+	{
+		oaentfree (ent);
+		return -1;
+	}
+	pubkey = (sccRSAKeyToken_t *)pubbuf;
+	signkey = signer ? signer->key : ent->key;
+
+	datalen = UP4(sizeof(*body)) + UP4(publen) + UP4(descAlen)
+				+ UP4(descBlen);
+	siglen = signkey->n_Length;
+	ent->rec.certlen = UP4(sizeof(*head)) + datalen + siglen;
+	ent->rec.keylen = keylen;
+	ent->rec.type = type;
+	ent->rec.status = OA_CKO_ACTIVE;
+	if ((ent->cert = calloc (ent->rec.certlen, 1)) == NULL)
+	{
+		oaentfree (ent);
+		return -1;
+	}
+
+	head = (sccOA_CKO_Head_t *)ent->cert;
+	body = (sccOA_CKO_Body_t *)(ent->cert + UP4(sizeof(*head)));
+	head->struct_id.name = SCCOA_CKO_HEAD_T;
+	head->struct_id.version = SCCOA_CKO_HEAD_VER;
+	head->cko_name = *name;
+	head->cko_type = type;
+	head->cko_status = OA_CKO_ACTIVE;
+	if (signer)
+		head->parent_name = ((sccOA_CKO_Head_t *)signer->cert)->cko_name;
+	else
+		head->parent_name.name_type = OA_IBM_ROOT;
+	/* Same as the IBM chain; certvalid.c must clear it to verify */
+	head->tSig = 1;
+
+	body->struct_id.name = SCCOA_CKO_BODY_T;
+	body->struct_id.version = SCCOA_CKO_BODY_VER;
+	body->tPublic = OA_RSA;
+	body->cko_name = head->cko_name;
+	body->cko_type = type;
+	body->parent_name = head->parent_name;
+	body->device_name.struct_id.name = SCCOA_CKO_BODY_T;
+	memcpy (body->device_name.adapterID, emu_adapterid,
+			sizeof(body->device_name.adapterID));
+	tm = gmtime (&now);
+	body->device_name.when_certified.year = tm->tm_year + 1900;
+	body->device_name.when_certified.month = tm->tm_mon + 1;
+	body->device_name.when_certified.day = tm->tm_mday;
+	body->device_name.when_certified.hour = tm->tm_hour;
+	body->device_name.when_certified.minute = tm->tm_min;
+
+	p = (unsigned char *)body + UP4(sizeof(*body));
+	memcpy (p, pubkey, publen);
+	fillvar (&body->vPublic, p, publen);
+	p += UP4(publen);
+	memcpy (p, descA, descAlen);
+	fillvar (&body->vDescA, p, descAlen);
+	p += UP4(descAlen);
+	memcpy (p, descB, descBlen);
+	fillvar (&body->vDescB, p, descBlen);
+	p += UP4(descBlen);
+
+	off = (unsigned char *)body - (unsigned char *)&head->vData;
+	head->vData.offset = off;
+	head->vData.len = datalen;
+	fillvar (&head->vSig, p, siglen);
+
+	if (sign9796 (p, signkey, (unsigned char *)body, datalen) < 0)
+	{
+		oaentfree (ent);
+		return -1;
+	}
+	return 0;
+}
+
+/* Locate the pieces of a certificate; -1 if it is malformed */
+static int
+certparts (unsigned char *cert, unsigned long certlen,
+	sccOA_CKO_Body_t **pbody, unsigned long *pbodylen,
+	unsigned char **psig, unsigned long *psiglen)
+{
+	sccOA_CKO_Head_t	*head = (sccOA_CKO_Head_t *)cert;
+	unsigned char		*body, *sig;
+
+	if (certlen < sizeof(*head))
+		return -1;
+	body = (unsigned char *)&head->vData + head->vData.offset;
+	sig = (unsigned char *)&head->vSig + head->vSig.offset;
+	if (body < cert || body + sizeof(sccOA_CKO_Body_t) > cert + certlen
+			|| head->vData.len > certlen
+			|| body + head->vData.len > cert + certlen
+			|| sig < cert || head->vSig.len > certlen
+			|| sig + head->vSig.len > cert + certlen)
+		return -1;
+	*pbody = (sccOA_CKO_Body_t *)body;
+	*pbodylen = head->vData.len;
+	*psig = sig;
+	*psiglen = head->vSig.len;
+	return 0;
+}
+
+
+/*
+ * Card setup
+ */
+
+struct findarg {
+	unsigned long		type;
+	sccOA_CKO_Name_t	name;
+	int					found;
+};
+
+static int
+findtype (oaent *ent, void *arg)
+{
+	struct findarg *fa = arg;
+
+	if (ent->rec.type != fa->type || ent->rec.status != OA_CKO_ACTIVE)
+		return 0;
+	fa->name = ((sccOA_CKO_Head_t *)ent->cert)->cko_name;
+	fa->found = 1;
+	return 1;
+}
+
+static int
+findcert (unsigned long type, oaent *ent)
+{
+	struct findarg fa;
+
+	memset (&fa, 0, sizeof(fa));
+	fa.type = type;
+	oaforeach (findtype, &fa);
+	if (!fa.found)
+		return -1;
+	return oaload (&fa.name, ent);
+}
+
+/* Delete the OS and application certificates */
+static int
+deleteseg (oaent *ent, void *arg)
+{
+	char path[1200];
+
+	(void) arg;
+	if (ent->rec.type == OA_CKO_SEG2_SEG3
+			|| ent->rec.type == OA_CKO_SEG3_CONFIG
+			|| ent->rec.type == OA_CKO_SEG3_EPOCH)
+	{
+		oapath (path, &((sccOA_CKO_Head_t *)ent->cert)->cko_name);
+		unlink (path);
+	}
+	return 0;
+}
+
+/* The class root is made once and shared by every card in basedir */
+static int
+getclassroot (char *basedir, oaent *ent)
+{
+	char				path[1200];
+	sccOA_CKO_Name_t	name;
+
+	sprintf (path, "%s/%s", basedir, CLASSROOTFILE);
+	if (oaread (path, ent) == 0)
+		return 0;
+
+	memset (&name, 0, sizeof(name));
+	name.name_type = OA_CKO_IBM_ROOT;
+	if (makecert (ent, OA_CKO_IBM_ROOT, &name, OAKEYBITS, NULL,
+			NULL, 0, NULL, 0) < 0)
+		return -1;
+	if (oawrite (path, ent, 1) == 0)
+		return 0;
+
+	/* Another card got there first; use its root */
+	oaentfree (ent);
+	return oaread (path, ent);
+}
+
+/*
+ * Called on every boot.  On the first boot, give the card a device
+ * certificate.  Certify the OS and application if that has not been
+ * done or the application image has changed.
+ */
+int
+emu_oainit (char *basedir, unsigned char *apphash, int reload)
+{
+	char				path[1200];
+	oaent				root, mb, os;
+	sccOALayerDesc_t	lda, ldb;
+	sccOA_CKO_Body_t	*body;
+	sccOALayerDesc_t	*curapp;
+	unsigned long		bodylen, siglen;
+	unsigned char		*sig;
+	unsigned char		mbhash[SHA_DIGEST_LENGTH];
+	sccOA_CKO_Name_t	name;
+	int					rc = -1;
+
+	memset (&root, 0, sizeof(root));
+	memset (&mb, 0, sizeof(mb));
+	memset (&os, 0, sizeof(os));
+	sprintf (path, "%s/%s", emu_carddir, OADIR);
+	mkdir (path, 0700);
+
+	if (findcert (OA_CKO_MB, &mb) < 0)
+	{
+		if (getclassroot (basedir, &root) < 0 || oasave (&root) < 0)
+			goto done;
+		SHA1 ((unsigned char *)mbimage, strlen(mbimage), mbhash);
+		layerdesc (&ldb, 1, 0, mbimage, mbhash);
+		name.creation_boot = emu_bootcount;
+		name.name_type = OA_CKO_MB;
+		name.index = emu_nextindex ();
+		if (makecert (&mb, OA_CKO_MB, &name, OAKEYBITS, &root, NULL, 0,
+				&ldb, sizeof(ldb)) < 0 || oasave (&mb) < 0)
+			goto done;
+	}
+
+	/* See whether the current OS certificate covers this image */
+	if (!reload && findcert (OA_CKO_SEG2_SEG3, &os) == 0)
+	{
+		if (certparts (os.cert, os.rec.certlen, &body, &bodylen,
+				&sig, &siglen) == 0 && body->vDescB.len == sizeof(ldb))
+		{
+			curapp = (sccOALayerDesc_t *)
+				((unsigned char *)&body->vDescB + body->vDescB.offset);
+			if (memcmp (curapp->image_hash, apphash,
+					sizeof(curapp->image_hash)) == 0)
+			{
+				rc = 0;
+				goto done;
+			}
+		}
+		oaentfree (&os);
+	}
+
+	/* A reload wipes out the application's keys */
+	oaforeach (deleteseg, NULL);
+	layerdesc (&lda, 2, OSOWNER, "2.41 CP/Q++", oshash);
+	layerdesc (&ldb, 3, 0, "sccemu", apphash);
+	name.creation_boot = emu_bootcount;
+	name.name_type = OA_CKO_SEG2_SEG3;
+	name.index = emu_nextindex ();
+	if (makecert (&os, OA_CKO_SEG2_SEG3, &name, OAKEYBITS, &mb,
+			&lda, sizeof(lda), &ldb, sizeof(ldb)) < 0 || oasave (&os) < 0)
+		goto done;
+	rc = 0;
+
+done:
+	oaentfree (&root);
+	oaentfree (&mb);
+	oaentfree (&os);
+	return rc;
+}
+
+
+/*
+ * The card's OA calls
+ */
+
+struct dirarg {
+	sccOA_DirItem_t		*dir;
+	unsigned long		room;
+	unsigned long		count;
+};
+
+static int
+diritem (oaent *ent, void *arg)
+{
+	struct dirarg *da = arg;
+
+	if (da->dir != NULL && da->count < da->room)
+	{
+		da->dir[da->count].cko_status = ent->rec.status;
+		da->dir[da->count].cko_type = ent->rec.type;
+		da->dir[da->count].cko_name =
+				((sccOA_CKO_Head_t *)ent->cert)->cko_name;
+	}
+	da->count++;
+	return 0;
+}
+
+long
+sccOAGetDir (unsigned long *count, sccOA_DirItem_t *dir, unsigned long *len)
+{
+	struct dirarg da;
+
+	memset (&da, 0, sizeof(da));
+	da.dir = dir;
+	da.room = (dir != NULL) ? *len / sizeof(sccOA_DirItem_t) : 0;
+	oaforeach (diritem, &da);
+	if (dir != NULL && da.count > da.room)
+		return SCCEMU_ERR_SPACE;
+	*count = da.count;
+	*len = da.count * sizeof(sccOA_DirItem_t);
+	return 0;
+}
+
+long
+sccOAGetCert (sccOA_CKO_Name_t *name, void *buf, unsigned long *len)
+{
+	oaent ent;
+
+	if (oaload (name, &ent) < 0)
+		return SCCEMU_ERR_NOTFOUND;
+	if (buf != NULL)
+	{
+		if (*len < ent.rec.certlen)
+		{
+			oaentfree (&ent);
+			return SCCEMU_ERR_SPACE;
+		}
+		memcpy (buf, ent.cert, ent.rec.certlen);
+	}
+	*len = ent.rec.certlen;
+	oaentfree (&ent);
+	return 0;
+}
+
+/* Make an application key, certified by the OS key */
+long
+sccOAGenerate (sccOAGen_RB_t *rb, unsigned long rblen,
+	void *keyrb, unsigned long keyrblen)
+{
+	sccRSAKeyGen_RB_t	*krb = keyrb;
+	oaent				os, ent;
+	unsigned char		*seg3;
+	sccOA_CKO_Name_t	name;
+	long				rc = SCCEMU_ERR_CRYPTO;
+
+	if (rblen < sizeof(*rb) || keyrblen < sizeof(*krb)
+			|| rb->struct_id.name != SCCOAGEN_RB_T
+			|| rb->algorithm != OA_RSA
+			|| (rb->cko_type != OA_CKO_SEG3_CONFIG
+				&& rb->cko_type != OA_CKO_SEG3_EPOCH)
+			|| krb->mod_size < 512 || krb->mod_size > 2048)
+		return SCCEMU_ERR_PARM;
+	seg3 = (unsigned char *)&rb->vSeg3Field + rb->vSeg3Field.offset;
+	if (rb->vSeg3Field.len != 0
+			&& (seg3 < (unsigned char *)rb
+				|| seg3 + rb->vSeg3Field.len > (unsigned char *)rb + rblen))
+		return SCCEMU_ERR_PARM;
+
+	if (findcert (OA_CKO_SEG2_SEG3, &os) < 0)
+		return SCCEMU_ERR_NOTFOUND;
+	name.creation_boot = emu_bootcount;
+	name.name_type = (unsigned short)rb->cko_type;
+	name.index = emu_nextindex ();
+	if (makecert (&ent, rb->cko_type, &name, krb->mod_size, &os,
+			NULL, 0, seg3, rb->vSeg3Field.len) == 0)
+	{
+		if (oasave (&ent) == 0)
+		{
+			*rb->pCKO_name = name;
+			rc = 0;
+		} else
+			rc = SCCEMU_ERR_IO;
+		oaentfree (&ent);
+	}
+	oaentfree (&os);
+	return rc;
+}
+
+long
+sccOADelete (sccOA_CKO_Name_t *name)
+{
+	char path[1200];
+
+	oapath (path, name);
+	if (unlink (path) != 0)
+		return SCCEMU_ERR_NOTFOUND;
+	return 0;
+}
+
+/* Private key operation with an application's OA key */
+long
+sccOAPrivOp (sccOA_CKO_Name_t *name, sccRSA_RB_t *rb, unsigned long rblen)
+{
+	oaent	ent;
+	long	rc = 0;
+
+	if (rblen < sizeof(*rb) || !(rb->options & RSA_PRIVATE))
+		return SCCEMU_ERR_PARM;
+	if (oaload (name, &ent) < 0)
+		return SCCEMU_ERR_NOTFOUND;
+	if (ent.rec.type != OA_CKO_SEG3_CONFIG && ent.rec.type != OA_CKO_SEG3_EPOCH)
+		rc = SCCEMU_ERR_PARM;
+	else if (rb->data_size != ent.key->n_BitLength)
+		rc = SCCEMU_ERR_PARM;
+	else if (emu_rsaprivate (ent.key, rb->data_out, rb->data_in,
+			rb->options) < 0)
+		rc = SCCEMU_ERR_CRYPTO;
+	else if (!(rb->options & RSA_DONT_BLIND) && oasave (&ent) < 0)
+		rc = SCCEMU_ERR_IO;
+	oaentfree (&ent);
+	return rc;
+}
+
+/* Check the signature on cert using the key certified by parentcert */
+long
+sccOAVerify (void *parentcert, unsigned long parentlen,
+	void *cert, unsigned long certlen)
+{
+	sccOA_CKO_Body_t	*pbody, *body;
+	unsigned long		pbodylen, bodylen, siglen;
+	unsigned char		*sig;
+	sccRSAKeyToken_t	*key;
+
+	if (certparts (parentcert, parentlen, &pbody, &pbodylen, &sig,
+			&siglen) < 0
+			|| pbody->tPublic != OA_RSA
+			|| pbody->vPublic.len < sizeof(sccRSAKeyToken_t)
+			|| pbody->vPublic.len > pbodylen)
+		return SCCEMU_ERR_PARM;
+	key = (sccRSAKeyToken_t *)
+			((unsigned char *)&pbody->vPublic + pbody->vPublic.offset);
+	if (key->n_Offset + key->n_Length > pbody->vPublic.len
+			|| key->e_Offset + key->e_Length > pbody->vPublic.len)
+		return SCCEMU_ERR_PARM;
+
+	if (certparts (cert, certlen, &body, &bodylen, &sig, &siglen) < 0)
+		return SCCEMU_ERR_PARM;
+	if (verify9796 (key, (unsigned char *)body, bodylen, sig, siglen) < 0)
+		return SCCEMU_ERR_CRYPTO;
+	return 0;
+}
+
+long
+sccOAStatus (void *buf, unsigned long *len)
+{
+	sccOAStatus_t *st = buf;
+
+	if (buf == NULL)
+	{
+		*len = sizeof(*st);
+		return 0;
+	}
+	if (*len < sizeof(*st))
+		return SCCEMU_ERR_SPACE;
+	memset (st, 0, sizeof(*st));
+	st->struct_id.name = SCCOASTATUS_T;
+	st->struct_id.version = SCCOASTATUS_VER;
+	st->rom_status.page1_certified = 1;
+	st->rom_status.boot_count_right = emu_bootcount;
+	memcpy (st->rom_status.adapterID, emu_adapterid,
+			sizeof(st->rom_status.adapterID));
+	st->rom_status.init_state = 1;
+	st->rom_status.seg2_state = 1;
+	st->rom_status.seg3_state = 1;
+	st->rom_status.owner2 = OSOWNER;
+	st->device_name.struct_id.name = SCCOA_CKO_BODY_T;
+	memcpy (st->device_name.adapterID, emu_adapterid,
+			sizeof(st->device_name.adapterID));
+	*len = sizeof(*st);
+	return 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * qsvccnst.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	Operating system service return codes and constants.
+ */
+
+#ifndef QSVCCNST_H
+#define QSVCCNST_H
+
+/* Timeout value which never expires */
+#define SVCWAITFOREVER		0xffffffffUL
+
+#define QSVCtimedout		0x0000000aL
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * rslbswap.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	Byte order reversal; the card is little-endian, so these convert
+ *	to and from network byte order.
+ */
+
+#ifndef RSLBSWAP_H
+#define RSLBSWAP_H
+
+unsigned long rswapl (unsigned long x);
+unsigned short rswaps (unsigned short x);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * scc_err.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	Error codes returned by the host library.  The values are the
+ *	emulator's own.
+ */
+
+#ifndef SCC_ERR_H
+#define SCC_ERR_H
+
+#define HDDBadParm			0x80400001L
+#define HDDInvalidHandle	0x80400002L
+#define HDDNoAdapter		0x80400003L
+#define HDDDeviceBusy		0x8040000eL
+#define HDDCommError		0x80400010L
+#define HDDBufferTooSmall	0x80400011L
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * scc_host.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	Host side interface for sending requests to a card.
+ *
+ *	In the emulator each card is a separate sccemu process, reached
+ *	through a Unix socket named cardN.sock in the directory given by
+ *	the SCCEMU_DIR environment variable.
+ */
+
+#ifndef SCC_HOST_H
+#define SCC_HOST_H
+
+#include "scctypes.h"
+
+typedef unsigned long	sccAdapterNumber_t;
+typedef long			sccAdapterHandle_t;
+
+/* Out buffers go to the card, In buffers come back from it */
+typedef struct
+{	sccAgentID_t		AgentID;
+	unsigned long		UserDefined;
+	long				Status;
+	unsigned long		OutBufferLength[SCC_NBUFS];
+	void				*pOutBuffer[SCC_NBUFS];
+	unsigned long		InBufferLength[SCC_NBUFS];
+	void				*pInBuffer[SCC_NBUFS];
+} sccRB_t;
+
+long SCC_CALL sccAdapterCount (sccAdapterNumber_t *count);
+long SCC_CALL sccOpenAdapter (sccAdapterNumber_t n, sccAdapterHandle_t *handle);
+long SCC_CALL sccRequest (sccAdapterHandle_t handle, sccRB_t *rb);
+long SCC_CALL sccCloseAdapter (sccAdapterHandle_t handle);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * scc_int.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *
+ *	Card side interface: request handling, persistent data (PPD),
+ *	configuration, and the crypto engines.  Layouts follow the real
+ *	card, which is a 32 bit little-endian machine; the card programs
+ *	must be built with -m32 for them to line up.
+ */
+
+#ifndef SCC_INT_H
+#define SCC_INT_H
+
+#include "scctypes.h"
+
+
+/*
+ * Requests from the host
+ */
+
+/* Out buffers carry data from the host, In buffers carry it back */
+typedef struct
+{	unsigned long		RequestID;
+	sccAgentID_t		AgentID;
+	unsigned long		UserDefined;
+	unsigned long		OutBufferLength[SCC_NBUFS];
+	unsigned long		InBufferLength[SCC_NBUFS];
+} sccRequestHeader_t;
+
+long sccSignOn (sccAgentID_t *agent, void *reserved);
+long sccGetNextHeader (sccRequestHeader_t *req, unsigned long flags,
+	unsigned long timeout);
+long sccGetBufferData (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len);
+long sccPutBufferData (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len);
+long sccEndRequest (unsigned long reqid, unsigned long bufidx,
+	void *buf, unsigned long len, long status);
+
+
+/*
+ * Random numbers, always returned eight bytes at a time
+ */
+
+#define RANDOM_HW			0x01
+#define RANDOM_SW			0x02
+#define RANDOM_RANDOM		0x04
+
+long sccGetRandomNumber (void *buf, unsigned long options);
+
+
+/*
+ * Persistent data, kept by name in flash or battery backed RAM
+ */
+
+#define PPD_FLASH			0x01
+#define PPD_BBRAM			0x02
+
+typedef char ppd_name_t[8];
+
+long sccSavePPD (ppd_name_t name, void *buf, unsigned long len,
+	unsigned long type);
+long sccCreate4UpdatePPD (ppd_name_t name, void *buf, unsigned long len);
+long sccUpdatePPD (ppd_name_t name, void *buf, unsigned long len,
+	unsigned long offset);
+long sccGetPPDLen (ppd_name_t name, unsigned long *len);
+long sccGetPPD (ppd_name_t name, void *buf, unsigned long len);
+long sccDeleteAllPPD (void);
+long sccQueryPPDSpace (unsigned long *space, unsigned long type);
+
+
+/*
+ * Adapter configuration
+ */
+
+typedef struct
+{	char		   signature[4];
+	unsigned char  vpd_length;
+	unsigned short crc;
+	char		   pn_tag[3];
+	unsigned char  pn_length;
+	char		   pn[8];
+	char		   ec_tag[3];
+	unsigned char  ec_length;
+	char		   ec[8];
+	char		   sn_tag[3];
+	unsigned char  sn_length;
+	char		   sn[8];
+	char		   fn_tag[3];
+	unsigned char  fn_length;
+	char		   fn[8];
+	char		   mf_tag[3];
+	unsigned char  mf_length;
+	char		   mf[6];
+	char		   ds_tag[3];
+	unsigned char  ds_length;
+	char		   ds[42];
+	char		   reserved[17];
+} PACK_DATA vpd_t;
+
+typedef struct
+{	unsigned short	id;
+	unsigned short	length;
+	unsigned char	AMCC_EEPROM[128];
+	vpd_t			VPD;
+	unsigned char	rsvd[7];
+	unsigned char	POST0Version;
+	unsigned char	POST1Version;
+	unsigned char	MiniBoot0Version;
+	unsigned char	MiniBoot1Version;
+	unsigned char	OS_Name[6];
+	unsigned short	OS_Version;
+	unsigned short	CPU_Speed;
+	unsigned char	DES_level;
+	unsigned char	RSA_level;
+	unsigned char	hwreserved[2];
+	unsigned char	HardwareStatus;
+	unsigned char	AdapterID[8];
+	unsigned char	flashSize;
+	unsigned char	bbramSize;
+	unsigned long	dramSize;
+	unsigned char	reserved[2];
+} PACK_DATA sccAdapterInfo_t;
+
+long sccGetConfig (sccAdapterInfo_t *info, unsigned long *size);
+long sccClearLowBatt (void);
+
+
+/*
+ * Modular math engine.  Numbers are stored as byte strings, low
+ * order byte first when MODM_LITTLE is given.  Operand 0 is the
+ * output, 1 is the modulus, 2 and 3 are the inputs.
+ */
+
+typedef struct
+{	unsigned long		bytesize;
+	unsigned long		bitsize;
+	unsigned char		*buffer;
+} sccModMath_Int_t;
+
+#define MODM_MOD			0x01
+#define MODM_MULT			0x02
+#define MODM_EXP			0x03
+#define MODM_LITTLE			0x100
+
+long sccModMath (unsigned long cmd, unsigned long nbufs,
+	sccModMath_Int_t *bn);
+
+
+/* Data source or destination in card memory */
+typedef struct
+{	unsigned long		count;
+	unsigned char		*buffer;
+} sccInternalBuf_t;
+
+
+/*
+ * SHA-1 engine.  Long messages are hashed in pieces; all but the
+ * last piece must be a multiple of 64 bytes.  The chaining value is
+ * carried in hash_value between calls.
+ */
+
+#define SHA_INTERNAL_INPUT	0x01
+#define SHA_MSGPART_ONLY	0x00
+#define SHA_MSGPART_FIRST	0x10
+#define SHA_MSGPART_MIDDLE	0x20
+#define SHA_MSGPART_FINAL	0x30
+#define SHA_MSGPART_MASK	0x30
+
+typedef struct
+{	unsigned long		options;
+	union {
+		sccInternalBuf_t	internal;
+	}					source;
+	unsigned char		final_data[4];
+	unsigned char		hash_value[20];
+	unsigned long		running_length;
+} sccSHA_RB_t;
+
+long sccSHA1 (sccSHA_RB_t *rb);
+
+
+/*
+ * DES engine
+ */
+
+#define DES_ENCRYPT			0x00
+#define DES_DECRYPT			0x01
+#define DES_TRIPLE_DES		0x02
+#define DES_USE_KEY			0x04
+#define DES_CBC_MODE		0x08
+#define DES_INTERNAL_INPUT	0x10
+#define DES_INTERNAL_OUTPUT	0x20
+
+typedef struct
+{	unsigned long		options;
+	unsigned char		key1[8];
+	unsigned char		key2[8];
+	unsigned char		key3[8];
+	unsigned char		init_v[8];
+	union {
+		sccInternalBuf_t	internal;
+	}					source;
+	union {
+		sccInternalBuf_t	internal;
+	}					destination;
+} sccTDES_RB_t;
+
+long sccTDES (sccTDES_RB_t *rb);
+
+
+/*
+ * RSA engine.  A key token is a header followed by the key values,
+ * each big-endian, with offsets measured from the start of the token.
+ * Private keys are kept in CRT form: p, q, dp, dq, and the CRT
+ * coefficients ap = q*(q^-1 mod p) and bp = p*(p^-1 mod q).
+ * r and r1 are a blinding pair, r = b^e and r1 = b^-1 mod n.
+ */
+
+#define RSA_PUBLIC_KEY					0x00
+#define RSA_PRIVATE_CHINESE_REMAINDER	0x02
+
+typedef struct
+{	unsigned long		type;
+	unsigned long		tokenLength;
+	unsigned long		n_BitLength;
+	unsigned long		n_Length;
+	unsigned long		e_Length;
+	union {
+		unsigned long	p_Length;
+		unsigned long	d_Length;
+	}					x;
+	unsigned long		q_Length;
+	unsigned long		dpLength;
+	unsigned long		dqLength;
+	unsigned long		apLength;
+	unsigned long		bpLength;
+	unsigned long		r_Length;
+	unsigned long		r1Length;
+	unsigned long		n_Offset;
+	unsigned long		e_Offset;
+	union {
+		unsigned long	p_Offset;
+		unsigned long	d_Offset;
+	}					y;
+	unsigned long		q_Offset;
+	unsigned long		dpOffset;
+	unsigned long		dqOffset;
+	unsigned long		apOffset;
+	unsigned long		bpOffset;
+	unsigned long		r_Offset;
+	unsigned long		r1Offset;
+} sccRSAKeyToken_t;
+
+#define RSA_PUBLIC			0x01
+#define RSA_PRIVATE			0x02
+#define RSA_ENCRYPT			0x04
+#define RSA_DECRYPT			0x08
+#define RSA_DONT_BLIND		0x10
+#define RSA_BLIND_NO_UPDATE	0x20
+
+typedef struct
+{	unsigned long		options;
+	sccRSAKeyToken_t	*key_token;
+	unsigned long		key_size;
+	void				*data_in;
+	void				*data_out;
+	unsigned long		data_size;		/* in bits */
+} sccRSA_RB_t;
+
+long sccRSA (sccRSA_RB_t *rb);
+
+#define RSA_EXPONENT_65537	0x02
+
+typedef struct
+{	unsigned long		key_type;
+	unsigned long		mod_size;		/* in bits */
+	unsigned long		public_exp;
+	sccRSAKeyToken_t	*key_token;
+	unsigned long		*key_size;		/* in: room available, out: used */
+} sccRSAKeyGen_RB_t;
+
+long sccRSAKeyGenerate (sccRSAKeyGen_RB_t *rb);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * scc_oa.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *
+ *	Outbound Authentication: the card's certificate chain and the
+ *	application keys certified by it.  Certificates are laid out as
+ *	a head, a body, and a signature.  The var_t offsets are relative
+ *	to the var_t field itself.  Values are little-endian.
+ */
+
+#ifndef SCC_OA_H
+#define SCC_OA_H
+
+#include "scc_int.h"
+
+#define OA_NSEGS				3
+#define OA_IMAGE_NAME_LENGTH	80
+#define OA_HASH_LENGTH			20
+
+/* Public key algorithms */
+#define OA_RSA					0x00
+
+/* Certificate types; an "IBM root" certificate is actually a class root */
+#define OA_CKO_IBM_ROOT			0x0001
+#define OA_CKO_MB				0x0101
+#define OA_CKO_SEG2_SEG3		0x0201
+#define OA_CKO_SEG3_CONFIG		0x0301
+#define OA_CKO_SEG3_EPOCH		0x0302
+
+/* Name type of the IBM root, which has no certificate on the card */
+#define OA_IBM_ROOT				0x8000
+
+/* Certificate status */
+#define OA_CKO_ACTIVE			0x0001
+#define OA_CKO_INACTIVE			0x0002
+
+/* Structure ids */
+#define SCCOALAYERDESC_T		0x54
+#define SCCOALAYERDESC_VER		0x00
+#define SCCOA_CKO_HEAD_T		0x56
+#define SCCOA_CKO_HEAD_VER		0x00
+#define SCCOA_CKO_BODY_T		0x57
+#define SCCOA_CKO_BODY_VER		0x00
+#define SCCOASTATUS_T			0x58
+#define SCCOASTATUS_VER			0x00
+#define SCCOAGEN_RB_T			0x59
+#define SCCOAGEN_RB_VER			0x00
+
+typedef struct
+{	unsigned char		name;
+	unsigned char		version;
+} PACK_DATA sccOA_StructID_t;
+
+typedef struct
+{	unsigned long		offset;
+	unsigned long		len;
+} PACK_DATA var_t;
+
+typedef struct
+{	unsigned long		creation_boot;
+	unsigned short		name_type;
+	unsigned short		index;
+} PACK_DATA sccOA_CKO_Name_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	short				year;
+	char				month;
+	char				day;
+	char				hour;
+	char				minute;
+} PACK_DATA sccOA_Time_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	unsigned char		adapterID[8];
+	sccOA_Time_t		when_certified;
+} PACK_DATA sccOADeviceName_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	unsigned long		epoch_start;
+	unsigned long		config_start;
+	unsigned long		config_count;
+} PACK_DATA sccOALayerName_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbyte;
+	unsigned char		layer_number;
+	unsigned long		ownerID;
+	unsigned char		image_name[OA_IMAGE_NAME_LENGTH];
+	unsigned long		image_revision;
+	unsigned char		image_hash[OA_HASH_LENGTH];
+	sccOALayerName_t	layer_name;
+} PACK_DATA sccOALayerDesc_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	unsigned long		tData;
+	var_t				vData;
+	var_t				vSig;
+	unsigned long		tSig;
+	sccOA_CKO_Name_t	cko_name;
+	unsigned long		cko_type;
+	unsigned long		cko_status;
+	sccOA_CKO_Name_t	parent_name;
+} PACK_DATA sccOA_CKO_Head_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	unsigned long		tPublic;
+	var_t				vPublic;
+	var_t				vDescA;
+	var_t				vDescB;
+	sccOADeviceName_t	device_name;
+	sccOA_CKO_Name_t	cko_name;
+	unsigned long		cko_type;
+	sccOA_CKO_Name_t	parent_name;
+} PACK_DATA sccOA_CKO_Body_t;
+
+typedef struct
+{	unsigned long		cko_status;
+	unsigned long		cko_type;
+	sccOA_CKO_Name_t	cko_name;
+} PACK_DATA sccOA_DirItem_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned short		pic_version;
+	unsigned short		rom_version;
+	unsigned char		page1_certified;
+	unsigned short		boot_count_left;
+	unsigned long		boot_count_right;
+	unsigned char		adapterID[8];
+	unsigned char		vpd[256];
+	unsigned char		init_state;
+	unsigned char		seg2_state;
+	unsigned char		seg3_state;
+	unsigned short		owner2;
+	unsigned short		owner3;
+	unsigned char		active_seg1;
+} PACK_DATA sccOA_RomStatus_t;
+
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	sccOA_RomStatus_t	rom_status;
+	var_t				vSeg_ids[OA_NSEGS];
+	long				free_space[OA_NSEGS];
+	sccOALayerName_t	layer_names[OA_NSEGS];
+	sccOADeviceName_t	device_name;
+} PACK_DATA sccOAStatus_t;
+
+/* Request to generate a new certified key; vSeg3Field data follows */
+typedef struct
+{	sccOA_StructID_t	struct_id;
+	unsigned char		padbytes[2];
+	unsigned long		algorithm;
+	unsigned long		cko_type;
+	var_t				vSeg3Field;
+	sccOA_CKO_Name_t	*pCKO_name;
+} PACK_DATA sccOAGen_RB_t;
+
+long sccOAGetDir (unsigned long *count, sccOA_DirItem_t *dir,
+	unsigned long *len);
+long sccOAGetCert (sccOA_CKO_Name_t *name, void *buf, unsigned long *len);
+long sccOAGenerate (sccOAGen_RB_t *rb, unsigned long rblen,
+	void *keyrb, unsigned long keyrblen);
+long sccOADelete (sccOA_CKO_Name_t *name);
+long sccOAPrivOp (sccOA_CKO_Name_t *name, sccRSA_RB_t *rb,
+	unsigned long rblen);
+long sccOAVerify (void *parentcert, unsigned long parentlen,
+	void *cert, unsigned long certlen);
+long sccOAStatus (void *buf, unsigned long *len);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * sccemu.c
+ *	Run the RPOW card program on an emulated 4758
+ *
+ *	Usage: sccemu [-d dir] [-r] cardnum
+ *
+ *	dir holds the card sockets and state, default $SCCEMU_DIR or
+ *	/tmp/sccemu.  -r acts as a software reload, erasing the card
+ *	program's OA keys just as loading a new image onto a real card
+ *	would.  The same happens automatically when the sccemu binary
+ *	itself changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include "sccemu.h"
+
+/* The card's main, renamed when we compile rpow.c */
+int rpowmain (int argc, char *argv[]);
+
+/* The application image hash is that of our own executable */
+static int
+apphash (unsigned char *md)
+{
+	SHA_CTX			ctx;
+	unsigned char	buf[8192];
+	int				fd;
+	int				n;
+
+	if ((fd = open ("/proc/self/exe", O_RDONLY)) < 0)
+		return -1;
+	SHA1_Init (&ctx);
+	while ((n = read (fd, buf, sizeof(buf))) > 0)
+		SHA1_Update (&ctx, buf, n);
+	close (fd);
+	if (n < 0)
+		return -1;
+	SHA1_Final (md, &ctx);
+	return 0;
+}
+
+static void
+usage (char *pname)
+{
+	fprintf (stderr, "Usage: %s [-d dir] [-r] cardnum\n", pname);
+	exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+	unsigned char	md[SHA_DIGEST_LENGTH];
+	char			*basedir = emu_basedir ();
+	char			*pname = argv[0];
+	int				reload = 0;
+	int				cardnum;
+
+	while (argc > 1 && argv[1][0] == '-')
+	{
+		if (strcmp (argv[1], "-d") == 0 && argc > 2)
+		{
+			basedir = argv[2];
+			argc -= 2; argv += 2;
+		} else if (strcmp (argv[1], "-r") == 0) {
+			reload = 1;
+			argc--; argv++;
+		} else
+			usage (pname);
+	}
+	if (argc != 2)
+		usage (pname);
+	cardnum = atoi (argv[1]);
+
+	if (emu_cardinit (basedir, cardnum) < 0)
+	{
+		fprintf (stderr, "Unable to initialize card %d in %s\n",
+				cardnum, basedir);
+		exit (1);
+	}
+	if (apphash (md) < 0 || emu_oainit (basedir, md, reload) < 0)
+	{
+		fprintf (stderr, "Unable to initialize card %d certificates\n",
+				cardnum);
+		exit (1);
+	}
+
+	return rpowmain (argc, argv);
+}
@@ -0,0 +1,80 @@
+/*
+ * sccemu.h
+ *	Internal definitions for the software 4758 card emulator
+ *
+ *	The emulator runs each card as its own process, sccemu, which
+ *	links the unmodified card program from ../scc against OpenSSL
+ *	versions of the card's OS and crypto calls.  The host program
+ *	links libsccemu.a in place of the IBM host library, and reaches
+ *	the card over a Unix socket.  All card state (persistent data,
+ *	OA certificates and keys, boot count) lives under a directory
+ *	per card, so cards survive being stopped and restarted just as
+ *	real ones survive a power cycle.
+ */
+
+#ifndef SCCEMU_H
+#define SCCEMU_H
+
+#include <stdint.h>
+#include "scc_int.h"
+
+/* Where the sockets and card directories live */
+#define SCCEMU_DIRENV		"SCCEMU_DIR"
+#define SCCEMU_DEFDIR		"/tmp/sccemu"
+#define SCCEMU_SOCKNAME		"card%d.sock"
+#define SCCEMU_CARDNAME		"card%d"
+
+/* Largest single buffer we pass in either direction */
+#define SCCEMU_MAXBUF		(1<<24)
+
+/*
+ * Wire format between host and card.  On connect the card sends a
+ * 32 bit status, 0 or HDDDeviceBusy.  Each request is an emureq
+ * followed by the out buffers; the card answers with an emureply
+ * followed by the in buffers.  Fields are in host byte order.
+ */
+struct emureq {
+	uint32_t	userdefined;
+	uint32_t	outlen[SCC_NBUFS];
+	uint32_t	inlen[SCC_NBUFS];
+};
+
+struct emureply {
+	int32_t		status;
+	uint32_t	inlen[SCC_NBUFS];
+};
+
+/* Card side error codes */
+#define SCCEMU_ERR_PARM		0x80410001L
+#define SCCEMU_ERR_NOTFOUND	0x80410002L
+#define SCCEMU_ERR_IO		0x80410003L
+#define SCCEMU_ERR_SPACE	0x80410004L
+#define SCCEMU_ERR_CRYPTO	0x80410005L
+#define SCCEMU_ERR_NOMEM	0x80410006L
+
+/* emuio.c */
+int emu_readall (int fd, void *buf, unsigned long len);
+int emu_writeall (int fd, void *buf, unsigned long len);
+char * emu_basedir (void);
+
+/* cardemu.c */
+extern char emu_carddir[];
+extern unsigned long emu_bootcount;
+extern unsigned char emu_adapterid[8];
+int emu_cardinit (char *basedir, int cardnum);
+unsigned short emu_nextindex (void);
+
+/* cryptemu.c */
+int emu_rsakeygen (sccRSAKeyToken_t *key, unsigned long *keylen,
+	unsigned long bits);
+int emu_rsapubtoken (sccRSAKeyToken_t *pub, unsigned long *publen,
+	sccRSAKeyToken_t *priv);
+int emu_rsaprivate (sccRSAKeyToken_t *key, unsigned char *out,
+	unsigned char *in, unsigned long options);
+int emu_rsapublic (sccRSAKeyToken_t *key, unsigned char *out,
+	unsigned char *in);
+
+/* oaemu.c */
+int emu_oainit (char *basedir, unsigned char *apphash, int reload);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * scctypes.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *
+ *	This is part of the software card emulator, which lets the RPOW
+ *	card and host programs build and run on an ordinary Linux machine
+ *	with no 4758 and no IBM toolkit.  Only the types and constants
+ *	which the RPOW sources actually use are provided.
+ */
+
+#ifndef SCCTYPES_H
+#define SCCTYPES_H
+
+#define PACK_DATA __attribute__ ((__packed__))
+
+typedef unsigned char	uchar;
+typedef unsigned short	ushort;
+typedef unsigned long	ulong;
+
+/* Calling convention marker used by the host library */
+#define SCC_CALL
+
+/* Identifies the program talking to the card */
+typedef struct
+{	unsigned char		OwnerID[2];
+	unsigned char		Name[16];
+	unsigned char		Version[2];
+	unsigned char		Reserved1[2];
+	unsigned char		Reserved2[2];
+} sccAgentID_t;
+
+/* Number of data buffers which travel with each request */
+#define SCC_NBUFS		4
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * signtest.c
+ *	Smoke test for the emulator: one sign round trip through rpowsrv
+ *
+ *	Usage: signtest host port
+ *
+ *	Acts as a minimal RPOW client.  It fetches the cert chain from the
+ *	server, takes the card's comm and signing keys and cardid from the
+ *	buffer the card embeds in it, mints a value 20 POW for the card's
+ *	resource, and exchanges it for one value 20 signature.  The reply
+ *	must decrypt, carry an OK status, and raise to the signing key's
+ *	exponent to the value we sent.  The chain itself is not validated;
+ *	an emulated card's chain does not lead to the IBM root anyway.
+ *
+ *	Only the original request framing is used, with a connection per
+ *	request, so this needs nothing from the client package.
+ */
+
+#define OPENSSL_API_COMPAT	0x10100000L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include "rpow.h"
+#include "commands.h"
+#include "sccemu.h"
+
+#define CHAINSIZE		20000
+#define SIGNVALUE		RPOW_VALUE_MIN
+
+/* Channel sizes, as in cryptchan.h */
+#define TDESBYTES		8
+#define TDESKEYBYTES	24
+#define RSAKEYBYTES		128
+#define SHABYTES		20
+#define SEQNOBYTES		8
+#define MASTERBYTES		64
+
+struct chan {
+	unsigned char tdeskeyin[TDESKEYBYTES];
+	unsigned char tdeskeyout[TDESKEYBYTES];
+	unsigned char hmackeyin[SHABYTES];
+	unsigned char hmackeyout[SHABYTES];
+	unsigned char enckey[RSAKEYBYTES];
+};
+
+static char *target;
+static int port;
+
+
+static void
+fail (char *msg)
+{
+	fprintf (stderr, "signtest: %s\n", msg);
+	exit (1);
+}
+
+static unsigned
+getle32 (unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static unsigned
+getbe32 (unsigned char *p)
+{
+	return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+putbe32 (unsigned char *p, unsigned x)
+{
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+/* Append a bignum with its 4 byte length, as bnwrite does */
+static unsigned char *
+putbn (unsigned char *p, BIGNUM *bn)
+{
+	putbe32 (p, BN_num_bytes (bn));
+	return p + 4 + BN_bn2bin (bn, p + 4);
+}
+
+/*
+ * Send one request in the original framing and read everything up to
+ * the server's close.  The server has had several tries to come up.
+ */
+static unsigned char *
+exchange (unsigned char cmd, unsigned char *req, unsigned reqlen,
+	unsigned *replylen)
+{
+	static unsigned char	reply[CHAINSIZE];
+	struct addrinfo			hints, *ai;
+	unsigned char			hdr[3];
+	char					portstr[16];
+	unsigned				len = 0;
+	int						s = -1;
+	int						tries;
+	int						nr;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf (portstr, "%d", port);
+	if (getaddrinfo (target, portstr, &hints, &ai) != 0)
+		fail ("unknown host");
+	for (tries=0; tries<50; tries++)
+	{
+		if ((s = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+			fail ("no socket");
+		if (connect (s, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close (s);
+		s = -1;
+		usleep (100000);
+	}
+	freeaddrinfo (ai);
+	if (s < 0)
+		fail ("unable to connect to server");
+
+	hdr[0] = cmd;
+	hdr[1] = reqlen >> 8;
+	hdr[2] = reqlen;
+	if (emu_writeall (s, hdr, sizeof(hdr)) < 0
+			|| emu_writeall (s, req, reqlen) < 0)
+		fail ("unable to send request");
+	while ((nr = recv (s, reply + len, sizeof(reply) - len, 0)) > 0)
+		len += nr;
+	close (s);
+	*replylen = len;
+	return reply;
+}
+
+/*
+ * Find the nth (n, e) pair in the key buffer the card embeds in its
+ * cert chain; each bignum is preceded by its 4 byte length.
+ */
+static unsigned char *
+keyptr (unsigned *klen, unsigned char *buf, unsigned buflen, int index)
+{
+	unsigned	len;
+	int			i;
+
+	while (index-- > 0)
+	{
+		for (i=0; i<2; i++)
+		{
+			if (buflen < 4 || (len = getbe32 (buf)) > buflen - 4)
+				return NULL;
+			buf += 4 + len;
+			buflen -= 4 + len;
+		}
+	}
+	*klen = buflen;
+	return buf;
+}
+
+static RSA *
+keyfrombuf (unsigned char *buf, unsigned buflen, int index)
+{
+	BIGNUM		*bn[2];
+	RSA			*rsa;
+	unsigned	len;
+	int			i;
+
+	if ((buf = keyptr (&buflen, buf, buflen, index)) == NULL)
+		return NULL;
+	for (i=0; i<2; i++)
+	{
+		if (buflen < 4 || (len = getbe32 (buf)) > buflen - 4)
+			return NULL;
+		bn[i] = BN_bin2bn (buf + 4, len, NULL);
+		buf += 4 + len;
+		buflen -= 4 + len;
+	}
+	rsa = RSA_new ();
+	RSA_set0_key (rsa, bn[0], bn[1], NULL);
+	return rsa;
+}
+
+/* Our keyid for a signing key, as pk_to_keyid makes it */
+static void
+keyid (unsigned char *id, RSA *rsa)
+{
+	const BIGNUM	*n, *e;
+	unsigned char	buf[8 + 2*RSAKEYBYTES];
+	unsigned char	*p = buf;
+
+	RSA_get0_key (rsa, &n, &e, NULL);
+	p = putbn (p, (BIGNUM *)n);
+	p = putbn (p, (BIGNUM *)e);
+	SHA1 (buf, p - buf, id);
+}
+
+/* Mint a hashcash version 1 stamp for the card's resource */
+static char *
+mint (int value, unsigned char *cardid)
+{
+	static char		stamp[256];
+	unsigned char	md[SHA_DIGEST_LENGTH];
+	unsigned char	rnd[8];
+	char			resource[2*CARDID_LENGTH + 3 + sizeof(POW_RESOURCE_TAIL)];
+	time_t			now = time (0);
+	struct tm		*tm = localtime (&now);
+	unsigned long	counter;
+	int				len;
+	int				i;
+
+	resource[0] = '\0';
+	for (i=0; i<CARDID_LENGTH; i++)
+	{
+		if (i == 8 || i == 12)
+			strcat (resource, "-");
+		sprintf (resource + strlen(resource), "%02x", cardid[i]);
+	}
+	strcat (resource, POW_RESOURCE_TAIL);
+
+	RAND_bytes (rnd, sizeof(rnd));
+	len = sprintf (stamp, "1:%d:%02d%02d%02d:%s::", value,
+			tm->tm_year % 100, tm->tm_mon + 1, tm->tm_mday, resource);
+	for (i=0; i<sizeof(rnd); i++)
+		len += sprintf (stamp + len, "%02x", rnd[i]);
+	stamp[len++] = ':';
+
+	for (counter=0; ; counter++)
+	{
+		sprintf (stamp + len, "%lx", counter);
+		SHA1 ((unsigned char *)stamp, strlen(stamp), md);
+		/* The same test as rpow_valid_pow on the card */
+		for (i=0; (i+1)*8<value; i++)
+			if (md[i] != 0)
+				break;
+		if ((i+1)*8 >= value && (md[i] & ~(0xff >> (value&7))) == 0)
+			return stamp;
+	}
+}
+
+static void
+hmac (unsigned char *mac, unsigned char *key, char *label)
+{
+	HMAC (EVP_sha1(), key, MASTERBYTES, (unsigned char *)label, 4,
+			mac, NULL);
+}
+
+/* Make the master secret and derive the channel keys, as encryptmaster */
+static void
+chanopen (struct chan *ch, RSA *commkey)
+{
+	unsigned char	master[MASTERBYTES];
+	unsigned char	mac[SHABYTES];
+
+	if (RSA_size (commkey) != RSAKEYBYTES)
+		fail ("unexpected comm key size");
+	RAND_bytes (master, sizeof(master));
+	if (RSA_public_encrypt (sizeof(master), master, ch->enckey, commkey,
+			RSA_PKCS1_OAEP_PADDING) != RSAKEYBYTES)
+		fail ("RSA encryption failed");
+	hmac (mac, master, "EKI1");
+	memcpy (ch->tdeskeyin, mac, SHABYTES);
+	hmac (mac, master, "EKI2");
+	memcpy (ch->tdeskeyin+SHABYTES, mac, TDESKEYBYTES-SHABYTES);
+	hmac (mac, master, "EKO1");
+	memcpy (ch->tdeskeyout, mac, SHABYTES);
+	hmac (mac, master, "EKO2");
+	memcpy (ch->tdeskeyout+SHABYTES, mac, TDESKEYBYTES-SHABYTES);
+	hmac (ch->hmackeyin, master, "MKI1");
+	hmac (ch->hmackeyout, master, "MKO1");
+}
+
+/* HMAC over the first sequence number, zero, and the data */
+static void
+chanmac (unsigned char *mac, unsigned char *key, unsigned char *buf,
+	unsigned len)
+{
+	unsigned char	*tmp = calloc (1, SEQNOBYTES + len);
+
+	memcpy (tmp + SEQNOBYTES, buf, len);
+	HMAC (EVP_sha1(), key, SHABYTES, tmp, SEQNOBYTES + len, mac, NULL);
+	free (tmp);
+}
+
+/* TDES encrypt and MAC buf into out, which needs 2*TDESBYTES+SHABYTES more */
+static unsigned
+chanseal (struct chan *ch, unsigned char *out, unsigned char *buf,
+	unsigned len)
+{
+	EVP_CIPHER_CTX	*ctx = EVP_CIPHER_CTX_new ();
+	int				outl, outl2;
+
+	RAND_bytes (out, TDESBYTES);
+	if (!EVP_EncryptInit_ex (ctx, EVP_des_ede3_cbc(), NULL, ch->tdeskeyout,
+				out)
+			|| !EVP_EncryptUpdate (ctx, out + TDESBYTES, &outl, buf, len)
+			|| !EVP_EncryptFinal_ex (ctx, out + TDESBYTES + outl, &outl2))
+		fail ("TDES encryption failed");
+	EVP_CIPHER_CTX_free (ctx);
+	len = TDESBYTES + outl + outl2;
+	chanmac (out + len, ch->hmackeyout, out, len);
+	return len + SHABYTES;
+}
+
+/* Check the MAC and decrypt the card's reply in place */
+static unsigned
+chanopenreply (struct chan *ch, unsigned char *buf, unsigned len)
+{
+	EVP_CIPHER_CTX	*ctx;
+	unsigned char	mac[SHABYTES];
+	unsigned char	*clr;
+	int				outl, outl2;
+
+	if (len < 2*TDESBYTES + SHABYTES)
+		fail ("short reply from card");
+	len -= SHABYTES;
+	chanmac (mac, ch->hmackeyin, buf, len);
+	if (memcmp (mac, buf + len, SHABYTES) != 0)
+		fail ("invalid MAC on reply from card");
+	clr = malloc (len);
+	ctx = EVP_CIPHER_CTX_new ();
+	if (!EVP_DecryptInit_ex (ctx, EVP_des_ede3_cbc(), NULL, ch->tdeskeyin,
+				buf)
+			|| !EVP_DecryptUpdate (ctx, clr, &outl, buf + TDESBYTES,
+				len - TDESBYTES)
+			|| !EVP_DecryptFinal_ex (ctx, clr + outl, &outl2))
+		fail ("bad format on decrypted reply from card");
+	EVP_CIPHER_CTX_free (ctx);
+	memcpy (buf, clr, outl + outl2);
+	free (clr);
+	return outl + outl2;
+}
+
+int
+main (int argc, char *argv[])
+{
+	unsigned char	chain[CHAINSIZE];
+	unsigned char	req[4096];
+	unsigned char	msg[2048];
+	unsigned char	signkeyid[SHA_DIGEST_LENGTH];
+	unsigned char	*reply, *body, *keybuf, *cardid, *p;
+	unsigned		replylen, chainlen, keybuflen, cardidlen, len;
+	const BIGNUM	*n, *e;
+	BIGNUM			*m, *sig, *check;
+	BN_CTX			*bnctx = BN_CTX_new ();
+	RSA				*commkey, *signkey;
+	struct chan		ch;
+	char			*stamp;
+
+	if (argc != 3)
+	{
+		fprintf (stderr, "Usage: %s host port\n", argv[0]);
+		exit (1);
+	}
+	target = argv[1];
+	port = atoi (argv[2]);
+
+	/* Chain comes back as a 2 byte length and the chain */
+	reply = exchange (CMD_GETCHAIN, NULL, 0, &replylen);
+	if (replylen < 2 || (chainlen = (reply[0] << 8) | reply[1]) + 2 > replylen
+			|| chainlen < 64)
+		fail ("bad cert chain from server");
+	memcpy (chain, reply + 2, chainlen);
+
+	/* Leaf cert is first; its body's vDescB holds the card's keys */
+	body = chain + 8 + getle32 (chain + 8);
+	if (body + 32 > chain + chainlen)
+		fail ("bad cert in chain");
+	keybuf = body + 24 + getle32 (body + 24);
+	keybuflen = getle32 (body + 28);
+	if (keybuf < chain || keybuf + keybuflen > chain + chainlen)
+		fail ("bad key buffer in cert");
+	commkey = keyfrombuf (keybuf, keybuflen, 0);
+	signkey = keyfrombuf (keybuf, keybuflen, 1);
+	cardid = keyptr (&cardidlen, keybuf, keybuflen, 2);
+	if (commkey == NULL || signkey == NULL || cardid == NULL
+			|| cardidlen != CARDID_LENGTH)
+		fail ("bad keys embedded in cert chain");
+	RSA_get0_key (signkey, &n, &e, NULL);
+	keyid (signkeyid, signkey);
+
+	/* Value to sign; the smallest value's exponent is the key's own */
+	m = BN_new ();
+	BN_rand_range (m, n);
+
+	/* Key ID, one POW in, one value of the same size out */
+	stamp = mint (SIGNVALUE, cardid);
+	p = msg;
+	memcpy (p, signkeyid, sizeof(signkeyid));
+	p += sizeof(signkeyid);
+	putbe32 (p, 1);
+	p += 4;
+	*p++ = RPOW_TYPE_HASHCASH;
+	putbe32 (p, SIGNVALUE);
+	putbe32 (p + 4, strlen (stamp));
+	memcpy (p + 8, stamp, strlen (stamp));
+	p += 8 + strlen (stamp);
+	putbe32 (p, 1);
+	putbe32 (p + 4, SIGNVALUE);
+	p = putbn (p + 8, m);
+
+	/* Request is the cardid, session key, and encrypted message */
+	chanopen (&ch, commkey);
+	memcpy (req, cardid, CARDID_LENGTH);
+	memcpy (req + CARDID_LENGTH, ch.enckey, RSAKEYBYTES);
+	len = CARDID_LENGTH + RSAKEYBYTES;
+	len += chanseal (&ch, req + len, msg, p - msg);
+
+	reply = exchange (CMD_SIGN, req, len, &replylen);
+	if (replylen < 4)
+		fail ("server closed connection");
+	if (getbe32 (reply) != 0)
+	{
+		fprintf (stderr, "signtest: server reports error %d\n",
+				(int)getbe32 (reply));
+		exit (1);
+	}
+	len = chanopenreply (&ch, reply + 4, replylen - 4);
+	p = reply + 4;
+	if (len < 1 || p[0] != RPOW_STAT_OK)
+	{
+		fprintf (stderr, "signtest: card refused the exchange, status %d\n",
+				len < 1 ? -1 : p[0]);
+		exit (1);
+	}
+	if (len < 5 || getbe32 (p + 1) != len - 5)
+		fail ("bad signature in reply");
+
+	sig = BN_bin2bn (p + 5, len - 5, NULL);
+	check = BN_new ();
+	BN_mod_exp (check, sig, e, n, bnctx);
+	if (BN_cmp (check, m) != 0)
+		fail ("signature does not verify");
+
+	printf ("Sign round trip OK\n");
+	return 0;
+}
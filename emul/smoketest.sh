@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# smoketest.sh
+#	One sign round trip through an emulated card
+#
+#	Starts a fresh sccemu, has rpowsrv initialize it and listen for
+#	it, and runs signtest against the server.  Everything lives in a
+#	scratch directory which is removed afterwards.  Set SMOKEPORT to
+#	use another port than 18090.
+#
+
+cd `dirname $0`
+dir=`mktemp -d /tmp/rpowsmoke.XXXXXX` || exit 1
+port=${SMOKEPORT:-18090}
+cardpid=
+srvpid=
+SCCEMU_DIR=$dir/emu
+export SCCEMU_DIR
+
+cleanup ()
+{
+	[ -n "$srvpid" ] && kill $srvpid 2>/dev/null
+	[ -n "$cardpid" ] && kill $cardpid 2>/dev/null
+	wait 2>/dev/null
+	rm -rf $dir
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail ()
+{
+	echo "smoketest: $1" >&2
+	for f in $dir/*.log
+	do
+		echo "--- $f" >&2
+		tail -20 $f >&2
+	done
+	exit 1
+}
+
+mkdir $dir/emu $dir/srv
+
+./sccemu 0 > $dir/card.log 2>&1 &
+cardpid=$!
+n=0
+while [ ! -S $dir/emu/card0.sock ]
+do
+	n=`expr $n + 1`
+	[ $n -gt 50 ] && fail "card did not come up"
+	sleep 0.1
+done
+
+./rpowsrv -d $dir/srv initialize > $dir/init.log 2>&1 \
+	|| fail "unable to initialize card"
+
+./rpowsrv -d $dir/srv listen $port > $dir/srv.log 2>&1 &
+srvpid=$!
+
+./signtest localhost $port || fail "sign round trip failed"
+exit 0
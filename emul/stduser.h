@@ -0,0 +1,23 @@
+/*
+ * stduser.h
+ *	Stand-in for the IBM 4758 toolkit header of the same name.
+ *	Basic definitions for card programs.
+ */
+
+#ifndef STDUSER_H
+#define STDUSER_H
+
+#include "scctypes.h"
+
+#ifndef NULL
+#define NULL	0
+#endif
+
+#ifndef MIN
+#define MIN(a,b)	((a)<(b)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b)	((a)>(b)?(a):(b))
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 #include <qsvccnst.h>
 #include <rslbswap.h>
 #include "rpowscc.h"
+#include "dbkey.h"
 
 #ifndef UP4
 #define UP4(n)	((((n)+3)/4)*4)
@@ -27,8 +28,23 @@ typedef unsigned long ulong;
  * We start up with 1 top node with 1 child, 1 empty leaf node.
  */
 
-/* Number of keys per node, must be even */
+/* Number of keys per node, must be even.  Must match the host. */
+#ifndef NODEKEYS
 #define NODEKEYS	100
+#endif
+
+/* Number of items in the Merkle tree of a node, at least 2*NODEKEYS+1 */
+/* and a power of 2.  Must match the host. */
+#ifndef MERKLEWIDTH
+#define MERKLEWIDTH	256
+#endif
+#if MERKLEWIDTH < 2*NODEKEYS+1
+#error MERKLEWIDTH is too small for NODEKEYS
+#endif
+
+/* How a DB hashes its nodes, see dbproof.h on the host */
+#define DBFORMAT_FLAT		0
+#define DBFORMAT_MERKLE		1
 
 #define NONLEAF		0
 #define ISLEAF		1
@@ -102,12 +118,64 @@ static ppd_name_t dbname = {
 	'd', 'b', 'd', 'a', 't', 'a', ' ', ' '
 };
 
+/*
+ * The DBFORMAT of each DB.  This is kept in BBRAM apart from the dbdata,
+ * so a card from before there was a choice of format still finds its
+ * dbdata as it was.  It has no dbformat and all its DBs are flat.
+ */
+static int *dbformat;
+static int ndbformat;
+
+static ppd_name_t dbformatname = {
+	'd', 'b', 'f', 'o', 'r', 'm', 'a', 't'
+};
+
 
 
 static int dbvalidate (int *found, void *buf, unsigned long bufsize, uchar *hash, int fileid);
+static void initroot (uchar *hash, int format);
+struct pnode;
+static struct pnode *pnode_read (uchar **pp, uchar *end, uchar *hash,
+	int depth, int maxdepth, int format);
+static int pnode_topinsert (struct pnode **proot, int *maxdepth,
+	uchar *newhash);
+static void pnode_rehash (struct pnode *pn, uchar *hash, int depth,
+	int maxdepth, int format);
+static void pnode_free (struct pnode *pn);
 static int newdb_prefix (sccOA_CKO_Name_t *certname, int fileid);
 
 
+/* Return the DBFORMAT of a DB */
+static int
+getdbformat (int fileid)
+{
+	if (fileid < ndbformat)
+		return dbformat[fileid];
+	return DBFORMAT_FLAT;
+}
+
+/* Set the DBFORMAT of a DB, in DRAM and BBRAM */
+static int
+setdbformat (int fileid, int format)
+{
+	int *newformat;
+
+	if (fileid >= ndbformat)
+	{
+		if ((newformat = realloc (dbformat, (fileid+1)*sizeof(int))) == NULL)
+			return ERR_NOMEM;
+		dbformat = newformat;
+		while (ndbformat <= fileid)
+			dbformat[ndbformat++] = DBFORMAT_FLAT;
+	}
+	dbformat[fileid] = format;
+	if (sccCreate4UpdatePPD (dbformatname, dbformat,
+			ndbformat*sizeof(int)) != 0)
+		return ERR_FAILEDPPD;
+	return 0;
+}
+
+
 /* Return 0 on successful operation and set *found flag */
 int
 testdbandset (int *found, sccRequestHeader_t *req, uchar *data,
@@ -118,6 +186,11 @@ testdbandset (int *found, sccRequestHeader_t *req, uchar *data,
 	uchar				newhash[SHA1_DIGEST_LENGTH];
 	uchar				*buf;
 	gbig_sha1ctx		sha1;
+	unsigned int		ufileid = fileid;
+
+	/* Single key proofs are flat, Merkle DBs always use multi-key ones */
+	if (getdbformat (fileid) == DBFORMAT_MERKLE)
+		return testdbandsetbatch (found, req, &data, &datalen, &ufileid, 1);
 
 	/* Compute the hash of the data */
 	gbig_sha1_init (&sha1);
@@ -163,6 +236,193 @@ testdbandset (int *found, sccRequestHeader_t *req, uchar *data,
 	return 0;
 }
 
+/*
+ * Like testdbandset, for n items at once, in order, setting found[i]
+ * for each.  As with one testdbandset call per item, we stop at the
+ * first item found: those before it are inserted, it and those after
+ * it are not, and found[] is 0 for the ones after.  All the hashes go
+ * to the host in a single query.  It answers with a multi-key proof
+ * for each DB involved, in the order the fileids first appear, each
+ * preceded by its 4 byte length.  The persistent data is written once
+ * at the end.
+ */
+int
+testdbandsetbatch (int *found, sccRequestHeader_t *req, uchar **data,
+	unsigned long *datalen, unsigned int *fileid, int n)
+{
+	long				rc;
+	unsigned long		buflen;
+	unsigned long		len;
+	uchar				md[SHA1_DIGEST_LENGTH];
+	uchar				newhash[DBBATCHMAX][HASHSIZE];
+	uchar				roothash[DBBATCHMAX][HASHSIZE];
+	struct pnode		*root[DBBATCHMAX];	/* Partial tree of each DB */
+	int					depth[DBBATCHMAX];
+	int					dbitem[DBBATCHMAX];	/* First item in each DB */
+	int					itemdb[DBBATCHMAX];	/* Index into root[] of each item */
+	int					inserted[DBBATCHMAX];	/* -1 if a proof was bad */
+	uchar				*buf;
+	uchar				*p;
+	uchar				*q;
+	gbig_sha1ctx		sha1;
+	int					changed = 0;
+	int					ndb = 0;
+	int					rslt;
+	int					i, j;
+
+	/* Larger batches go as several queries, none after an item is found */
+	if (n > DBBATCHMAX)
+	{
+		if ((rc = testdbandsetbatch (found, req, data, datalen, fileid,
+				DBBATCHMAX)) != 0)
+			return rc;
+		for (i=0; i<DBBATCHMAX; i++)
+		{
+			if (found[i])
+			{
+				memset (found+DBBATCHMAX, 0, (n-DBBATCHMAX)*sizeof(int));
+				return 0;
+			}
+		}
+		return testdbandsetbatch (found+DBBATCHMAX, req, data+DBBATCHMAX,
+				datalen+DBBATCHMAX, fileid+DBBATCHMAX, n-DBBATCHMAX);
+	}
+
+	/* Compute the hashes of the data, and note our hash roots */
+	for (i=0; i<n; i++)
+	{
+		if (fileid[i] >= tdata->nfiles)
+			return ERR_INVALID;
+		gbig_sha1_init (&sha1);
+		gbig_sha1_update (&sha1, pdata->prefix+fileid[i]*PREFIXSIZE,
+				PREFIXSIZE);
+		gbig_sha1_update (&sha1, data[i], datalen[i]);
+		gbig_sha1_final (md, &sha1);
+		memcpy (newhash[i], md, HASHSIZE);
+		memcpy (roothash[i], tdata->dbdata[fileid[i]].hashroot, HASHSIZE);
+		found[i] = 0;
+	}
+
+	/* Send hashes, hash roots and fileids to the host */
+	if ((rc = sccPutBufferData (req->RequestID, 0, newhash, n*HASHSIZE)) != 0)
+		return ERR_FAILEDPUTBUFFER;
+	if ((rc = sccPutBufferData (req->RequestID, 1, roothash,
+				n*HASHSIZE)) != 0)
+		return ERR_FAILEDPUTBUFFER;
+	if ((rc = sccEndRequest (req->RequestID, 2, fileid, n*sizeof(fileid[0]),
+				-ERR_DBBATCHQUERY)) != 0)
+		return ERR_FAILEDOTHER;
+
+	/* Get response from host */
+	if ((rc = sccGetNextHeader(req, 0, SVCWAITFOREVER)) != 0)
+	  return ERR_FAILEDOTHER;
+
+	if (req->UserDefined != CMD_DBAUTH)
+		return ERR_INVALID;
+
+	/* Read validation data */
+	if ((rc = sccGetBufferData (req->RequestID, 0, &buflen,
+		sizeof(buflen))) != 0)
+		return ERR_FAILEDGETBUFFER;
+
+	if ((buf = malloc(UP4(buflen))) == NULL)
+		return ERR_NOMEM;
+
+	if ((rc = sccGetBufferData (req->RequestID, 1, buf, UP4(buflen))) != 0)
+	{
+		free (buf);
+		return ERR_FAILEDGETBUFFER;
+	}
+
+	/* Rebuild the partial tree of each DB from its proof */
+	rc = 0;
+	p = buf;
+	for (i=0; i<n; i++)
+	{
+		for (j=0; j<ndb; j++)
+			if (fileid[dbitem[j]] == fileid[i])
+				break;
+		itemdb[i] = j;
+		if (j < ndb)
+			continue;			/* Already have this DB */
+		dbitem[ndb] = i;
+		depth[ndb] = tdata->dbdata[fileid[i]].depth;
+		inserted[ndb] = -1;
+		root[ndb] = NULL;
+		ndb++;
+
+		if (buflen - (p - buf) < sizeof(ulong))
+		{
+			rc = ERR_DBFAILED;
+			break;
+		}
+		len = ntohl (*(ulong *)p);
+		p += sizeof(ulong);
+		if (UP4(len) > buflen - (p - buf))
+		{
+			rc = ERR_DBFAILED;
+			break;
+		}
+		q = p;
+		root[j] = pnode_read (&q, p+len, tdata->dbdata[fileid[i]].hashroot,
+				0, depth[j], getdbformat (fileid[i]));
+		if (root[j] == NULL || q != p+len)
+		{
+			rc = ERR_DBFAILED;
+			break;
+		}
+		inserted[j] = 0;
+		p += UP4(len);
+	}
+	if (rc == 0 && p != buf + buflen)
+		rc = ERR_DBFAILED;
+	free (buf);
+
+	/* Do the inserts in order, up to the first item found or bad proof */
+	for (i=0; i<n; i++)
+	{
+		j = itemdb[i];
+		if (inserted[j] < 0)
+			break;
+		rslt = pnode_topinsert (&root[j], &depth[j], newhash[i]);
+		if (rslt < 0)
+		{
+			inserted[j] = -1;
+			rc = (rslt == -1) ? ERR_DBFAILED : ERR_NOMEM;
+			break;
+		}
+		if (rslt)
+		{
+			found[i] = 1;
+			break;
+		}
+		inserted[j] = 1;
+	}
+
+	/* Save the DBs we did update, even if the host then failed */
+	for (j=0; j<ndb; j++)
+	{
+		if (inserted[j] > 0)
+		{
+			i = fileid[dbitem[j]];
+			pnode_rehash (root[j], tdata->dbdata[i].hashroot, 0, depth[j],
+					getdbformat (i));
+			tdata->dbdata[i].depth = depth[j];
+			changed = 1;
+		}
+		pnode_free (root[j]);
+	}
+	if (changed)
+	{
+		if (sccUpdatePPD (dbname, tdata->dbdata,
+				tdata->nfiles * sizeof(struct dbdata),
+				sizeof(tdata->nfiles)) != 0)
+			return ERR_FAILEDPPD;
+	}
+
+	return rc;
+}
+
 /* Initialize DB persistent data.  Called when we start up on a fresh card. */
 int
 initdb ()
@@ -219,8 +479,11 @@ newdb (sccOA_CKO_Name_t *certname, int fileid)
 	tdatasize = sizeof(tdata->nfiles) +
 		tdata->nfiles * sizeof(struct dbdata);
 	tdata = realloc (tdata, tdatasize);
-	
-	memcpy (tdata->dbdata[fileid].hashroot, inithashroot, HASHSIZE);
+
+	/* The host makes new DBs in the Merkle format */
+	if ((rc = setdbformat (fileid, DBFORMAT_MERKLE)) != 0)
+		return rc;
+	initroot (tdata->dbdata[fileid].hashroot, DBFORMAT_MERKLE);
 	tdata->dbdata[fileid].depth = 2;
 	if ((rc = sccCreate4UpdatePPD (dbname, tdata, tdatasize)) != 0)
 		return ERR_FAILEDPPD;
@@ -265,6 +528,16 @@ rebootdb (sccOA_CKO_Name_t *certname)
 	tdata = malloc (tdatasize);
 	if ((rc = sccGetPPD (dbname, tdata, tdatasize)) != 0)
 		return ERR_FAILEDPPD;
+
+	/* No formats saved means all our DBs are flat */
+	ndbformat = 0;
+	if (sccGetPPDLen (dbformatname, &tdatasize) == 0)
+	{
+		dbformat = malloc (tdatasize);
+		if ((rc = sccGetPPD (dbformatname, dbformat, tdatasize)) != 0)
+			return ERR_FAILEDPPD;
+		ndbformat = tdatasize / sizeof(int);
+	}
 	return 0;
 }
 
@@ -284,6 +557,7 @@ dbresetpow (sccOA_CKO_Name_t *certname)
 	long rc;
 	time_t nowtime = time(NULL);
 	struct tm *t = localtime (&nowtime);
+	uchar hash[HASHSIZE];
 	int fileid;
 	int tdatasize;
 
@@ -291,10 +565,13 @@ dbresetpow (sccOA_CKO_Name_t *certname)
 	{
 		/* Get number of next month's POW DB, which is unused */
 		fileid = (t->tm_mon+1) % 3;
-		if (memcmp (tdata->dbdata[fileid].hashroot, inithashroot, HASHSIZE)
-				!= 0)
+		initroot (hash, getdbformat (fileid));
+		if (memcmp (tdata->dbdata[fileid].hashroot, hash, HASHSIZE) != 0)
 		{
-			memcpy (tdata->dbdata[fileid].hashroot, inithashroot, HASHSIZE);
+			/* The host makes the new DB in the Merkle format */
+			if ((rc = setdbformat (fileid, DBFORMAT_MERKLE)) != 0)
+				return rc;
+			initroot (tdata->dbdata[fileid].hashroot, DBFORMAT_MERKLE);
 			tdata->dbdata[fileid].depth = 2;
 			tdatasize = sizeof(tdata->nfiles) +
 						tdata->nfiles * sizeof(struct dbdata);
@@ -354,25 +631,166 @@ nodedatahash (uchar *hash, uchar *key, uchar *childhash, int nkeys, int isleaf)
 #endif
 }
 
-/* Return <0, 0, or >0 as key1 is <, ==, or > key2 */
-static int
-keycomp (uchar *key1, uchar *key2)
+/* Hash a pair of Merkle subtree hashes */
+static void
+merklepair (uchar *hash, uchar *left, uchar *right)
+{
+#if SHA1_DIGEST_LENGTH > HASHSIZE
+	uchar md[SHA1_DIGEST_LENGTH];
+#endif
+	gbig_sha1ctx ctx;
+
+	gbig_sha1_init (&ctx);
+	gbig_sha1_update (&ctx, left, HASHSIZE);
+	gbig_sha1_update (&ctx, right, HASHSIZE);
+#if SHA1_DIGEST_LENGTH == HASHSIZE
+	gbig_sha1_final (hash, &ctx);
+#else
+	gbig_sha1_final (md, &ctx);
+	memcpy (hash, md, HASHSIZE);
+#endif
+}
+
+/* Hash of a Merkle format node, from its nkeys and Merkle root */
+static void
+merklenodehash (uchar *hash, uchar *root, int nkeys)
+{
+#if SHA1_DIGEST_LENGTH > HASHSIZE
+	uchar md[SHA1_DIGEST_LENGTH];
+#endif
+	ulong nnkeys = htonl (nkeys);
+	gbig_sha1ctx ctx;
+
+	gbig_sha1_init (&ctx);
+	gbig_sha1_update (&ctx, &nnkeys, sizeof(nnkeys));
+	gbig_sha1_update (&ctx, root, HASHSIZE);
+#if SHA1_DIGEST_LENGTH == HASHSIZE
+	gbig_sha1_final (hash, &ctx);
+#else
+	gbig_sha1_final (md, &ctx);
+	memcpy (hash, md, HASHSIZE);
+#endif
+}
+
+/*
+ * Intra-node Merkle hashing, for DBs in DBFORMAT_MERKLE.  A node's
+ * items are its keys, interleaved with its childhashes if it is an
+ * inner node: childhash 0, key 0, childhash 1, ... key n-1, childhash n.
+ * They are the leaves of a binary Merkle tree MERKLEWIDTH wide, where
+ * subtrees past the last item hash to zeros.  The node hash is the hash
+ * of nkeys and the Merkle root.  A proof can then show a few items of
+ * a node with just the hashes of the subtrees between them.
+ */
+
+#define NITEMS(nkeys,isleaf)	((isleaf) ? (nkeys) : 2*(nkeys)+1)
+
+static uchar const zerohash[HASHSIZE];
+
+/* Point items[] at the Merkle items of a node */
+static void
+nodeitems (uchar **items, uchar (*key)[HASHSIZE], uchar (*childhash)[HASHSIZE],
+	int nkeys, int isleaf)
 {
 	int i;
-	uchar k1, k2;
 
-	for (i=0; i<HASHSIZE; i++)
+	for (i=0; i<NITEMS(nkeys,isleaf); i++)
 	{
-		k1 = key1[i];
-		k2 = key2[i];
-		if (k1 > k2)
-			return 1;
-		else if (k1 < k2)
-			return -1;
+		if (isleaf)
+			items[i] = key[i];
+		else
+			items[i] = (i & 1) ? key[i/2] : childhash[i/2];
 	}
+}
+
+/* True if any of the items from lo to lo+width-1 are known */
+static int
+anyknown (uchar *known, int nitems, int lo, int width)
+{
+	int i;
+
+	for (i=lo; i<lo+width && i<nitems; i++)
+		if (known[i])
+			return 1;
 	return 0;
 }
 
+/* Merkle hash of the items from lo to lo+width-1 */
+static void
+merkleroot (uchar *hash, uchar **items, int nitems, int lo, int width)
+{
+	uchar left[HASHSIZE];
+	uchar right[HASHSIZE];
+
+	if (lo >= nitems)
+		memcpy (hash, zerohash, HASHSIZE);
+	else if (width == 1)
+		memcpy (hash, items[lo], HASHSIZE);
+	else
+	{
+		merkleroot (left, items, nitems, lo, width/2);
+		merkleroot (right, items, nitems, lo+width/2, width/2);
+		merklepair (hash, left, right);
+	}
+}
+
+/*
+ * The same for a node where only the known items are present.  Each
+ * largest subtree with none of them known takes its hash from *stored,
+ * in order, which must not go past storedend.  Return 0 if it would.
+ */
+static int
+partialroot (uchar *hash, uchar **items, uchar *known, int nitems, int lo,
+	int width, uchar **stored, uchar *storedend)
+{
+	uchar left[HASHSIZE];
+	uchar right[HASHSIZE];
+
+	if (lo >= nitems)
+	{
+		memcpy (hash, zerohash, HASHSIZE);
+		return 1;
+	}
+	if (!anyknown (known, nitems, lo, width))
+	{
+		if (storedend - *stored < HASHSIZE)
+			return 0;
+		memcpy (hash, *stored, HASHSIZE);
+		*stored += HASHSIZE;
+		return 1;
+	}
+	if (width == 1)
+	{
+		memcpy (hash, items[lo], HASHSIZE);
+		return 1;
+	}
+	if (!partialroot (left, items, known, nitems, lo, width/2, stored,
+				storedend)
+			|| !partialroot (right, items, known, nitems, lo+width/2,
+				width/2, stored, storedend))
+		return 0;
+	merklepair (hash, left, right);
+	return 1;
+}
+
+/* Hash root of an empty DB: a root node with no keys over an empty leaf */
+static void
+initroot (uchar *hash, int format)
+{
+	uchar *items[1];
+	uchar leafhash[HASHSIZE];
+	uchar root[HASHSIZE];
+
+	if (format == DBFORMAT_FLAT)
+	{
+		memcpy (hash, inithashroot, HASHSIZE);
+		return;
+	}
+	merklenodehash (leafhash, (uchar *)zerohash, 0);
+	items[0] = leafhash;
+	merkleroot (root, items, 1, 0, MERKLEWIDTH);
+	merklenodehash (hash, root, 0);
+}
+
 
 static int
 _validate_db_node (int *found, compnode *node, int nilen, uchar *thisnodehash,
@@ -562,6 +980,352 @@ validate_db_operation (uchar *treehash, int *found, compnode *nodeinfo,
 }
 
 
+/*
+ * Multi-key proofs.  For a batch of keys in one DB the host sends
+ * just the nodes on the paths to all of them, each node once, as the
+ * tree was before any of the inserts.  They come in preorder, each as
+ *   nkeys, nchild, node data, then the indices of the nchild children
+ *   which come next
+ * with counts and indices as 4 bytes in network order.  In a flat
+ * format DB the node data is the nkeys keys and, for inner nodes, the
+ * nkeys+1 childhashes.  In a Merkle format DB it is a bitmap of which
+ * Merkle items are present, MERKLEWIDTH bits starting with the high
+ * bit of the first byte, then those items in order, then the hashes
+ * of the largest subtrees with no items present, left to right.
+ *
+ * We rebuild that part of the tree, check it against the treehash,
+ * run the inserts on it ourselves just as the host does on the whole
+ * tree, and then hash our way back up to the new treehash once.  A
+ * node which gains a key must have come with all its items.
+ */
+
+/* A node of the partial tree from a multi-key proof */
+typedef struct pnode {
+	int nkeys;
+	int dirty;
+	int full;						/* Have all keys and childhashes */
+	uchar key[NODEKEYS+1][HASHSIZE];
+	uchar childhash[NODEKEYS+2][HASHSIZE];
+	struct pnode *child[NODEKEYS+2];
+	uchar known[MERKLEWIDTH];		/* Merkle items we have, if not full */
+	uchar *stored;					/* Hashes for the rest of the tree */
+	int nstored;
+} pnode;
+
+static void
+pnode_free (pnode *pn)
+{
+	int i;
+
+	if (pn == NULL)
+		return;
+	for (i=0; i<NODEKEYS+2; i++)
+		pnode_free (pn->child[i]);
+	free (pn->stored);
+	free (pn);
+}
+
+/* Read a 4 byte network order value from the proof */
+static int
+getproofval (uchar **pp, uchar *end, unsigned *val)
+{
+	uchar *p = *pp;
+
+	if (end - p < 4)
+		return 0;
+	*val = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	*pp = p + 4;
+	return 1;
+}
+
+/* Compute the hash of a partial tree node */
+static void
+pnode_hash (uchar *hash, pnode *pn, int isleaf, int format)
+{
+	uchar *items[MERKLEWIDTH];
+	uchar root[HASHSIZE];
+	uchar *stored = pn->stored;
+
+	if (format == DBFORMAT_FLAT)
+	{
+		nodedatahash (hash, pn->key[0], pn->childhash[0], pn->nkeys, isleaf);
+		return;
+	}
+	nodeitems (items, pn->key, pn->childhash, pn->nkeys, isleaf);
+	if (pn->full)
+		merkleroot (root, items, NITEMS(pn->nkeys,isleaf), 0, MERKLEWIDTH);
+	else
+		partialroot (root, items, pn->known, NITEMS(pn->nkeys,isleaf), 0,
+				MERKLEWIDTH, &stored, pn->stored + pn->nstored*HASHSIZE);
+	merklenodehash (hash, root, pn->nkeys);
+}
+
+/* Read the node data of a Merkle format node, and check its hash */
+static int
+pnode_readmerkle (pnode *pn, uchar **pp, uchar *end, uchar *hash, int isleaf)
+{
+	uchar *items[MERKLEWIDTH];
+	uchar root[HASHSIZE];
+	uchar thishash[HASHSIZE];
+	uchar *stored;
+	int nitems = NITEMS(pn->nkeys,isleaf);
+	int i;
+
+	if (end - *pp < MERKLEWIDTH/8)
+		return 0;
+	pn->full = 1;
+	for (i=0; i<MERKLEWIDTH; i++)
+	{
+		pn->known[i] = ((*pp)[i/8] >> (7 - i%8)) & 1;
+		if (pn->known[i] && i >= nitems)
+			return 0;
+		if (!pn->known[i] && i < nitems)
+			pn->full = 0;
+	}
+	*pp += MERKLEWIDTH/8;
+
+	nodeitems (items, pn->key, pn->childhash, pn->nkeys, isleaf);
+	for (i=0; i<nitems; i++)
+	{
+		if (!pn->known[i])
+			continue;
+		if (end - *pp < HASHSIZE)
+			return 0;
+		memcpy (items[i], *pp, HASHSIZE);
+		*pp += HASHSIZE;
+	}
+
+	stored = *pp;
+	if (!partialroot (root, items, pn->known, nitems, 0, MERKLEWIDTH,
+			pp, end))
+		return 0;
+	pn->nstored = (*pp - stored) / HASHSIZE;
+	if (pn->nstored > 0)
+	{
+		if ((pn->stored = malloc (pn->nstored * HASHSIZE)) == NULL)
+			return 0;
+		memcpy (pn->stored, stored, pn->nstored * HASHSIZE);
+	}
+	merklenodehash (thishash, root, pn->nkeys);
+	return memcmp (thishash, hash, HASHSIZE) == 0;
+}
+
+/*
+ * Rebuild a node and those of its children which follow it, checking
+ * each against the hash its parent has for it.  Return NULL if invalid.
+ */
+static pnode *
+pnode_read (uchar **pp, uchar *end, uchar *hash, int depth, int maxdepth,
+	int format)
+{
+	pnode *pn;
+	uchar thishash[HASHSIZE];
+	unsigned ind[NODEKEYS+1];
+	unsigned nkeys;
+	unsigned nchild;
+	int isleaf = (depth+1 == maxdepth);
+	int i;
+
+	if (depth >= maxdepth)
+		return NULL;
+	if (!getproofval (pp, end, &nkeys) || !getproofval (pp, end, &nchild))
+		return NULL;
+	if (nkeys > NODEKEYS || nchild > (isleaf ? 0 : nkeys+1))
+		return NULL;
+	if ((pn = calloc (1, sizeof(pnode))) == NULL)
+		return NULL;
+	pn->nkeys = nkeys;
+
+	if (format == DBFORMAT_FLAT)
+	{
+		if (end - *pp < (isleaf ? nkeys : 2*nkeys+1) * HASHSIZE)
+			goto error;
+		pn->full = 1;
+		memcpy (pn->key[0], *pp, nkeys*HASHSIZE);
+		*pp += nkeys*HASHSIZE;
+		if (!isleaf)
+		{
+			memcpy (pn->childhash[0], *pp, (nkeys+1)*HASHSIZE);
+			*pp += (nkeys+1)*HASHSIZE;
+		}
+		pnode_hash (thishash, pn, isleaf, format);
+		if (memcmp (thishash, hash, HASHSIZE) != 0)
+			goto error;
+	} else if (!pnode_readmerkle (pn, pp, end, hash, isleaf))
+		goto error;
+
+	for (i=0; i<nchild; i++)
+	{
+		if (!getproofval (pp, end, &ind[i]) || ind[i] > nkeys
+				|| (i > 0 && ind[i] <= ind[i-1])
+				|| !(pn->full || pn->known[2*ind[i]]))
+			goto error;
+	}
+	for (i=0; i<nchild; i++)
+	{
+		pn->child[ind[i]] = pnode_read (pp, end, pn->childhash[ind[i]],
+				depth+1, maxdepth, format);
+		if (pn->child[ind[i]] == NULL)
+			goto error;
+	}
+	return pn;
+
+error:
+	pnode_free (pn);
+	return NULL;
+}
+
+/*
+ * Look for newhash below pn, inserting it if absent, the same way the
+ * host does.  Return 1 if found, 0 if inserted, -1 if the proof lacked
+ * something we needed, -2 if out of memory.  If pn had to split, set
+ * *newnode to its new right sibling and splitkey to the key moving up.
+ */
+static int
+pnode_insert (pnode *pn, uchar *newhash, int depth, int maxdepth,
+	pnode **newnode, uchar *splitkey)
+{
+	pnode *nn;
+	pnode *childnew;
+	int isleaf = (depth+1 == maxdepth);
+	int nkeys = pn->nkeys;
+	int keyind;
+	int comp = 1;
+	int rslt;
+
+	/* Find the first key we have which is not below newhash */
+	*newnode = NULL;
+	if (pn->full)
+		comp = !keysearch (pn->key, nkeys, newhash, &keyind);
+	else
+	{
+		for (keyind=0; keyind<nkeys; keyind++)
+		{
+			if (!pn->known[isleaf ? keyind : 2*keyind+1])
+				continue;
+			if ((comp = keycomp (newhash, pn->key[keyind])) <= 0)
+				break;
+		}
+	}
+	if (comp == 0)
+		return 1;
+
+	/* Unless we have the key before, it might belong further down */
+	if (!pn->full && keyind > 0
+			&& !pn->known[isleaf ? keyind-1 : 2*keyind-1])
+		return -1;
+
+	if (isleaf)
+	{
+		if (!pn->full)
+			return -1;
+		memmove (pn->key[keyind+1], pn->key[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (pn->key[keyind], newhash, HASHSIZE);
+	} else {
+		if (pn->child[keyind] == NULL)
+			return -1;
+		rslt = pnode_insert (pn->child[keyind], newhash, depth+1, maxdepth,
+				&childnew, splitkey);
+		if (rslt != 0)
+			return rslt;
+		pn->dirty = 1;
+		if (childnew == NULL)
+			return 0;
+
+		/* Child did a split, new node is to right of old one */
+		if (!pn->full)
+			return -1;
+		memmove (pn->key[keyind+1], pn->key[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (pn->key[keyind], splitkey, HASHSIZE);
+		memmove (pn->childhash[keyind+2], pn->childhash[keyind+1],
+				(nkeys-keyind)*HASHSIZE);
+		memmove (pn->child+keyind+2, pn->child+keyind+1,
+				(nkeys-keyind)*sizeof(pn->child[0]));
+		pn->child[keyind+1] = childnew;
+	}
+	pn->nkeys = ++nkeys;
+	pn->dirty = 1;
+
+	/* Split the same way as the host, new node gets the higher keys */
+	if (nkeys > NODEKEYS)
+	{
+		if ((nn = calloc (1, sizeof(pnode))) == NULL)
+			return -2;
+		memcpy (splitkey, pn->key[NODEKEYS/2], HASHSIZE);
+		memcpy (nn->key[0], pn->key[NODEKEYS/2+1], (NODEKEYS/2)*HASHSIZE);
+		if (!isleaf)
+		{
+			memcpy (nn->childhash[0], pn->childhash[NODEKEYS/2+1],
+				(NODEKEYS/2+1) * HASHSIZE);
+			memcpy (nn->child, pn->child+NODEKEYS/2+1,
+				(NODEKEYS/2+1) * sizeof(pn->child[0]));
+			memset (pn->child+NODEKEYS/2+1, 0,
+				(NODEKEYS/2+1) * sizeof(pn->child[0]));
+		}
+		pn->nkeys = nn->nkeys = NODEKEYS/2;
+		nn->full = 1;
+		nn->dirty = 1;
+		*newnode = nn;
+	}
+	return 0;
+}
+
+/* Recompute the hashes of changed nodes, from the bottom up */
+static void
+pnode_rehash (pnode *pn, uchar *hash, int depth, int maxdepth, int format)
+{
+	int isleaf = (depth+1 == maxdepth);
+	int i;
+
+	if (!isleaf)
+	{
+		for (i=0; i<=pn->nkeys; i++)
+		{
+			if (pn->child[i] != NULL && pn->child[i]->dirty)
+				pnode_rehash (pn->child[i], pn->childhash[i], depth+1,
+						maxdepth, format);
+		}
+	}
+	pnode_hash (hash, pn, isleaf, format);
+	pn->dirty = 0;
+}
+
+/*
+ * Insert newhash in the partial tree *proot of depth *maxdepth, making
+ * a new top node if the old one splits.  Return as pnode_insert.
+ */
+static int
+pnode_topinsert (pnode **proot, int *maxdepth, uchar *newhash)
+{
+	pnode *nn;
+	pnode *top;
+	uchar splitkey[HASHSIZE];
+	int rslt;
+
+	rslt = pnode_insert (*proot, newhash, 0, *maxdepth, &nn, splitkey);
+	if (rslt < 0 || nn == NULL)
+		return rslt;
+
+	/* Top node split, make a new one over it and the new node */
+	if ((top = calloc (1, sizeof(pnode))) == NULL)
+	{
+		pnode_free (nn);
+		return -2;
+	}
+	top->nkeys = 1;
+	memcpy (top->key[0], splitkey, HASHSIZE);
+	top->child[0] = *proot;
+	top->child[1] = nn;
+	top->full = 1;
+	top->dirty = 1;
+	*proot = top;
+	++(*maxdepth);
+	return 0;
+}
+
+
 static int
 dbvalidate (int *found, void *buf, unsigned long bufsize, uchar *hash, int fileid)
 {
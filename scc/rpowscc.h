@@ -177,6 +177,8 @@ int rebootdb (sccOA_CKO_Name_t *certname);
 int dbresetpow (sccOA_CKO_Name_t *certname);
 int testdbandset (int *found, sccRequestHeader_t *req, unsigned char *data,
 	unsigned long datalen, int fileid);
+int testdbandsetbatch (int *found, sccRequestHeader_t *req,
+	unsigned char **data, unsigned long *datalen, unsigned int *fileid, int n);
 
 /* certvalid.c */
 int certvalidate ( unsigned char **innerbuf, unsigned long *innerbuflen,
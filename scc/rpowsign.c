@@ -29,7 +29,10 @@ dosign (sccRequestHeader_t *req, sccOA_CKO_Name_t *certname,
 	gbignum outvalue;
 	int rpicount, rpocount;
 	int i;
-	int found;
+	int found[MAXCOUNT];
+	unsigned char *dbdata[MAXCOUNT];
+	unsigned long dblen[MAXCOUNT];
+	unsigned int dbfileid[MAXCOUNT];
 	unsigned char stat;
 	unsigned char *buf = NULL;
 	unsigned long buflen;
@@ -86,22 +89,32 @@ dosign (sccRequestHeader_t *req, sccOA_CKO_Name_t *certname,
 		if (rp[i] == NULL)
 			goto input_error;
 		stat = rpow_validate (rp[i]);
-		if (stat == RPOW_STAT_OK)
-		{
-			/* Check the seen-rpow database */
-			if ((rc = testdbandset (&found, req, rp[i]->id, rp[i]->idlen,
-					rp[i]->fileid)) != 0)
-				return rc;			/* host lied, should not happen */
-			if (found)
-				stat = RPOW_STAT_REUSED;
-		}
-
 		if (stat != RPOW_STAT_OK)
 			goto input_error;
 		stat = RPOW_STAT_BADFORMAT;
 		gbig_from_word (&tmp1, 0);
 		gbig_set_bit (&tmp1, rp[i]->value);
 		gbig_add (&invalue, &invalue, &tmp1);
+		dbdata[i] = rp[i]->id;
+		dblen[i] = rp[i]->idlen;
+		dbfileid[i] = rp[i]->fileid;
+	}
+
+	/*
+	 * Check them all against the seen-rpow database in one query.  As
+	 * when they were checked one at a time, a reused rpow leaves those
+	 * ahead of it marked spent and those after it unspent.
+	 */
+	if ((rc = testdbandsetbatch (found, req, dbdata, dblen, dbfileid,
+			rpicount)) != 0)
+		return rc;			/* host lied, should not happen */
+	for (i=0; i<rpicount; i++)
+	{
+		if (found[i])
+		{
+			stat = RPOW_STAT_REUSED;
+			goto input_error;
+		}
 	}
 	if (rp_read (rpio, &rpocount, sizeof(rpocount)) != sizeof(rpocount))
 		goto input_error;
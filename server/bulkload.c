@@ -0,0 +1,91 @@
+/*
+ * bulkload.c
+ *	Build a spent list DB in one go from a file of hashes
+ *
+ *	The hashes are read as raw HASHSIZE byte values, in any order.
+ *	The root hash and depth printed at the end are what a card
+ *	taking over the DB should be told, and what testvalid checks
+ *	proofs from it against.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbproof.h"
+
+/* Default bytes of hashes to sort in memory at a time */
+#define RUNMB		64
+
+void dumpbuf (unsigned char *buf, int len);
+
+static void
+userr (char *pname)
+{
+	fprintf (stderr, "Usage: %s [-f fill] [-t threads] [-m runmb] "
+				"dbname [hashfile]\n"
+				"  Reads hashes from hashfile, or stdin if none.\n"
+				"  -f fills nodes fill percent full, 50 to 100 (default 100).\n"
+				"  -t hashes nodes on that many threads (default one per CPU).\n"
+				"  -m sorts runmb megabytes at a time (default %d).\n"
+				, pname, RUNMB);
+	exit (1);
+}
+
+int
+main (int ac, char **av)
+{
+	char *pname = av[0];
+	int fill = 100;
+	int nthreads = 0;
+	long runmb = RUNMB;
+	FILE *in = stdin;
+	unsigned char treehash[HASHSIZE];
+	int depth;
+	long nkeys;
+
+	while (ac > 2 && av[1][0] == '-')
+	{
+		if (strcmp (av[1], "-f") == 0)
+			fill = atoi (av[2]);
+		else if (strcmp (av[1], "-t") == 0)
+			nthreads = atoi (av[2]);
+		else if (strcmp (av[1], "-m") == 0)
+			runmb = atol (av[2]);
+		else
+			userr (pname);
+		ac -= 2;
+		av += 2;
+	}
+	if (ac < 2 || ac > 3 || av[1][0] == '-' || fill < 50 || fill > 100
+			|| runmb <= 0)
+		userr (pname);
+
+	if (ac == 3 && (in = fopen (av[2], "rb")) == NULL)
+	{
+		fprintf (stderr, "Unable to open %s\n", av[2]);
+		exit (1);
+	}
+
+	nkeys = bulkloaddb (av[1], in, fill, nthreads, runmb*1024*1024,
+				treehash, &depth);
+	if (nkeys < 0)
+	{
+		fprintf (stderr, "Unable to build DB %s\n", av[1]);
+		exit (1);
+	}
+	printf ("Loaded %ld hashes into %s\n", nkeys, av[1]);
+	printf ("DB root hash:  ");
+	dumpbuf (treehash, HASHSIZE);
+	printf ("DB depth:      %d\n", depth);
+	exit (0);
+}
+
+void
+dumpbuf (unsigned char *buf, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++)
+		printf ("%02x ", buf[i]);
+	printf ("\n");
+}
@@ -0,0 +1,97 @@
+/*
+ * dbcheck.c
+ *	Check a spent list DB from end to end
+ *
+ *	Every checksum, key, child pointer and child hash is checked and
+ *	the root hash recomputed, which should match what the card holds.
+ *	The DB is only read; one with a write-ahead log still to apply should
+ *	be opened by rpowsrv -s first, or it is checked as of before the log.
+ *	A copy-on-write DB is checked as of its last published root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbproof.h"
+
+void dumpbuf (unsigned char *buf, int len);
+
+static void
+userr (char *pname)
+{
+	fprintf (stderr, "Usage: %s [-t threads] dbname\n"
+				"  -t checks on that many threads (default one per CPU).\n"
+				, pname);
+	exit (1);
+}
+
+int
+main (int ac, char **av)
+{
+	char *pname = av[0];
+	int nthreads = 0;
+	struct dbcheck chk;
+	int rslt;
+	int i;
+
+	while (ac > 2 && av[1][0] == '-')
+	{
+		if (strcmp (av[1], "-t") == 0)
+			nthreads = atoi (av[2]);
+		else
+			userr (pname);
+		ac -= 2;
+		av += 2;
+	}
+	if (ac != 2 || av[1][0] == '-')
+		userr (pname);
+
+	if ((rslt = checkdbfile (av[1], nthreads, &chk)) < 0)
+	{
+		fprintf (stderr, "Unable to read DB %s\n", av[1]);
+		exit (2);
+	}
+	if (chk.walbytes > 0)
+		printf ("Warning: %ld bytes of log not yet applied\n", chk.walbytes);
+	if (rslt > 0)
+	{
+		printf ("Error at depth %d node %ld", chk.errdepth, chk.errnode);
+		if (chk.errindex >= 0)
+			printf (" index %d", chk.errindex);
+		printf (": %s\n", chk.err);
+		exit (1);
+	}
+
+	printf ("DB root hash:  ");
+	dumpbuf (chk.treehash, HASHSIZE);
+	printf ("DB depth:      %d\n", chk.depth);
+	if (chk.generation > 0)
+		printf ("Generation:    %ld\n", chk.generation);
+	printf ("DB format:     %s\n",
+			(chk.format == DBFORMAT_MERKLE) ? "Merkle" : "flat");
+	printf ("Keys:          %lu\n", chk.nkeys);
+	printf ("Nodes:         %lu inner, %lu leaves\n", chk.nnodes[0],
+			chk.nnodes[1]);
+	printf ("Unused nodes:  %lu inner, %lu leaves\n", chk.unused[0],
+			chk.unused[1]);
+	printf ("Fill          inner     leaves\n");
+	for (i=0; i<DBCHECKFILLS; i++)
+	{
+		if (i < DBCHECKFILLS-1)
+			printf ("  %3d-%3d%%  ", i*10, i*10+9);
+		else
+			printf ("     100%%  ");
+		printf ("%9lu  %9lu\n", chk.fill[0][i], chk.fill[1][i]);
+	}
+	exit (0);
+}
+
+void
+dumpbuf (unsigned char *buf, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++)
+		printf ("%02x ", buf[i]);
+	printf ("\n");
+}
@@ -0,0 +1,65 @@
+/*
+ * dbconvert.c
+ *	Convert a spent list DB to the version 2 node layout
+ *
+ *	The old DB is only read, and must have been written on a 32 bit
+ *	host, as only those wrote DBs the card could use; one written with
+ *	8 byte longs is turned away.  Apply any log first by opening it
+ *	with an older rpowsrv -s.  The new DB is checked once
+ *	it is written; its root hash is the same as the old one's, so the
+ *	card needs nothing new.  Move it into place of the old one after.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dbproof.h"
+
+void dumpbuf (unsigned char *buf, int len);
+
+static void
+userr (char *pname)
+{
+	fprintf (stderr, "Usage: %s olddbname newdbname\n", pname);
+	exit (1);
+}
+
+int
+main (int ac, char **av)
+{
+	struct dbcheck chk;
+	long nnodes;
+
+	if (ac != 3 || av[1][0] == '-' || av[2][0] == '-')
+		userr (av[0]);
+
+	if ((nnodes = convertdb (av[1], av[2])) < 0)
+	{
+		fprintf (stderr, "Unable to convert DB %s to %s\n", av[1], av[2]);
+		exit (1);
+	}
+	printf ("Converted %ld nodes from %s into %s\n", nnodes, av[1], av[2]);
+
+	if (checkdbfile (av[2], 0, &chk) != 0)
+	{
+		fprintf (stderr, "Converted DB %s does not check out: %s\n", av[2],
+				chk.err ? chk.err : "unable to read it");
+		exit (1);
+	}
+	printf ("DB root hash:  ");
+	dumpbuf (chk.treehash, HASHSIZE);
+	printf ("DB depth:      %d\n", chk.depth);
+	if (chk.generation > 0)
+		printf ("Generation:    %ld\n", chk.generation);
+	exit (0);
+}
+
+void
+dumpbuf (unsigned char *buf, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++)
+		printf ("%02x ", buf[i]);
+	printf ("\n");
+}
@@ -8,14 +8,26 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/types.h>
 #include <fcntl.h>
 #if !defined(_WIN32)
 #include <unistd.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRCSSE42
+#include <immintrin.h>
 #endif
 #include "dbproof.h"
+#include "dbkey.h"
 #include "sha.h"
 
 #if defined(_WIN32)
@@ -45,87 +57,361 @@ DB is being maintained consistently.
 
 */
 
-/* Number of keys per node, must be even */
+/*
+ * Number of keys per node, must be even.  Must match the card, so it is
+ * changed for both with -DNODEKEYS=n.  Nodes are padded out to whole
+ * pages, see innernode, and at 100 4K leaves and 8K inner nodes are
+ * about half empty.  184 about fills both; with 16K pages 742 does.
+ */
+#ifndef NODEKEYS
 #define NODEKEYS	100
+#endif
 
 #define MAXDEPTH	6
 
+/* Number of items in the Merkle tree of a node, at least 2*NODEKEYS+1 */
+/* and a power of 2.  Must match the card. */
+#ifndef MERKLEWIDTH
+#define MERKLEWIDTH	256
+#endif
+#if MERKLEWIDTH < 2*NODEKEYS+1
+#error MERKLEWIDTH is too small for NODEKEYS
+#endif
+
+/* The node files are laid out in pages of this many bytes, a power of 2 */
+#ifndef DBPAGESIZE
+#define DBPAGESIZE	4096
+#endif
+
+/* Most leaves to keep in the buffer pool, see dbnodeget */
+#define DBCACHELEAVES	16384
+
+/* Memory mapped node files grow their mappings in steps of this many bytes */
+#define DBMAPEXTENT		(64*1024*1024)
+
+/* Checkpoint once the write-ahead log gets this long */
+#define DBWALMAX		(16*1024*1024)
+
+/* Starts each transaction in the write-ahead log */
+#define DBWALMAGIC		0x5250574c
+
+/* Starts each record in the roots file of a copy-on-write DB */
+#define DBROOTMAGIC		0x52505254
+
+/* Bytes in a roots file record: six numbers, root hash, SHA1 check */
+#define DBROOTSIZE		(24 + HASHSIZE + SHA1_DIGEST_LENGTH)
+
+/* Nodes bulkloaddb builds, hashes and writes at a time */
+#define BULKBATCH		1024
+
+/* Most threads bulkloaddb and checkdbfile use */
+#define DBMAXTHREADS	64
+
+/* Leaves checkdbfile reads at a time, 4MB with 4K leaves */
+#define CHECKCHUNK		1024
+
+/* checkdbfile splits the tree into about this many subtrees per thread */
+#define CHECKTASKS		8
+
+/* Starts block 0 of the inner node file, see dbfilehdr */
+#define DBFILEMAGIC		0x52505744
+
+/* Version of the node file layout which DBFILEMAGIC starts */
+#define DBVERSION		2
+
+/* Marks a version 1 block 0 which says which format the DB is in */
+#define DBFORMATMAGIC	0x52504f57
+
+/* Nodes convertdb reads and writes at a time */
+#define CONVERTCHUNK	256
+
 #define NONLEAF		0
 #define ISLEAF		1
 
 #define INODESIZE	(sizeof(innernode))
 #define LNODESIZE	(sizeof(leafnode))
 
+/* Bytes of a node before it is padded out to whole pages */
+#define INODEDATA	(8 + (2*NODEKEYS+3)*HASHSIZE + 4*(NODEKEYS+2))
+#define LNODEDATA	(8 + (NODEKEYS+1)*HASHSIZE)
+#define DBPAGES(n)	(((n) + DBPAGESIZE-1) / DBPAGESIZE * DBPAGESIZE)
+
 /* Compressed nodes have variable-sized array */
 #define CNODESIZE(nkeys,isleaf)	(sizeof(compnode) + \
 			((isleaf) ? (((nkeys)-1)*HASHSIZE) : (2*(nkeys)*HASHSIZE)))
 
 
-#if defined(_WIN32)
-typedef unsigned long ulong;
-#endif
 typedef unsigned char uchar;
 
+#ifndef UP4
+#define UP4(n)	((((n)+3)/4)*4)
+#endif
+
+/*
+ * Nodes are kept in memory as they are on disk.  Numbers are 4 bytes in
+ * network order, so the files are the same on every host, and each node
+ * is padded with zeros to a whole number of pages, so none straddles a
+ * page boundary.  An even NODEKEYS never fills its pages exactly, so
+ * there is always some pad.  crc is set as a node is written and checked
+ * as it is read from its file, see nodecrc.
+ */
+
 /* We allow NODEKEYS+1 keys in a node temporarily but will split it */
 typedef struct innernode {
 									/* leafnode must prefix innernode */
-	ulong nkeys;					/* Number of keys in node */
+	unsigned nkeys;					/* Number of keys in node */
+	unsigned crc;
 	uchar key[NODEKEYS+1][HASHSIZE];	/* Keys are kept sorted */
 	uchar childhash[NODEKEYS+2][HASHSIZE];
-	ulong child[NODEKEYS+2];		/* Node number in file of children */
+	unsigned child[NODEKEYS+2];		/* Node number in file of children */
+	uchar pad[DBPAGES(INODEDATA) - INODEDATA];
 } innernode;
 
 typedef struct leafnode {
-	ulong nkeys;					/* Number of keys in node */
+	unsigned nkeys;					/* Number of keys in node */
+	unsigned crc;
 	uchar key[NODEKEYS+1][HASHSIZE];	/* Keys are kept sorted */
+	uchar pad[DBPAGES(LNODEDATA) - LNODEDATA];
 } leafnode;
 
+/*
+ * Block 0 of the inner node file is not a node but this header, padded
+ * with zeros to a node.  crc is where a node's is and covers the block
+ * the same way.  A DB from before there were versions has no magic; see
+ * convertdb.  Block 0 of the leaf file is not used.
+ */
+typedef struct dbfilehdr {
+	unsigned magic;					/* DBFILEMAGIC */
+	unsigned crc;
+	unsigned version;				/* DBVERSION */
+	unsigned pagesize;				/* DBPAGESIZE */
+	unsigned nodekeys;				/* NODEKEYS */
+	unsigned format;				/* DBFORMAT_FLAT or DBFORMAT_MERKLE */
+	unsigned rootnode;				/* Root node number */
+	unsigned depth;
+} dbfilehdr;
+
 /* Compressed nodes are what are put into the nodeinfo array */
 typedef struct compnode {
-	ulong nkeys;
-	ulong keyind;
+	unsigned nkeys;
+	unsigned keyind;
 	uchar hashdata[1][HASHSIZE];	/* Actually 2*nkeys+1 hashes */
 									/* First, nkeys key hashes, then */
 									/* if non-leaf, nkeys+1 childhashes */
 } compnode;
 
 
+/* A node in the buffer pool */
+typedef struct nodebuf {
+	struct nodebuf *hnext;		/* Hash chain */
+	struct nodebuf *lrunext;	/* Leaves, toward least recently used */
+	struct nodebuf *lruprev;
+	int nodepos;				/* Node number in its file */
+	int isleaf;
+	int dirty;					/* Changed since the last dbflush */
+	innernode n;				/* Just LNODESIZE of it for leaves */
+} nodebuf;
+
 struct dbproof {
 	int fdi;		/* inner nodes */
 	int fdl;		/* leaf nodes */
 	int depth;		/* Depth of tree */
 	int rootnode;	/* Root node number in fdi file */
+	int format;		/* DBFORMAT_FLAT or DBFORMAT_MERKLE */
 	innernode newnode;	/* Used and re-used for adding nodes to the tree */
 						/* Remainder is used for proof of validity */
 	uchar nodeinfo[CNODESIZE(NODEKEYS,NONLEAF) * MAXDEPTH];
 	compnode *nodeptr;
-	uchar treehash[HASHSIZE];	/* for testing */
+	uchar treehash[HASHSIZE];	/* Root hash, after initdb or an insert */
 	int treedepth;				/* for testing */
+						/* Buffer pool, indexed by isleaf where paired */
+	nodebuf **buckets;			/* Hash table of nodes in the pool */
+	int nbuckets;
+	int ncached[2];
+	nodebuf *lruhead;			/* Most recently used leaf */
+	nodebuf *lrutail;
+	nodebuf **dirty;			/* Nodes to write at the next dbflush */
+	int ndirty;
+	int maxdirty;
+	off_t nnodes[2];			/* Nodes in each file */
+	off_t pos[2];				/* Node the next read or write is at */
+	struct dbcachestats stats;
+						/* Memory mapped files, used in place of the pool */
+	int mmapped;				/* Node files are mapped */
+	uchar *map[2];
+	size_t mapsize[2];			/* Bytes mapped, a multiple of DBMAPEXTENT */
+	off_t maplo[2];				/* Range of nodes written since dbflush */
+	off_t maphi[2];
+						/* Write-ahead log */
+	int fdw;					/* -1 if not logging */
+	off_t walsize;
+	uchar *walbuf;				/* Transaction being written */
+	size_t walbufsize;
+						/* Copy-on-write */
+	int cow;					/* Published nodes are never changed */
+	int readonly;				/* A snapshot, from opensnap */
+	int fdr;					/* Roots file, -1 if not copy-on-write */
+	int durable;				/* Sync the nodes before publishing */
+	long generation;			/* Of the last root published */
+	off_t cowbase[2];			/* Nodes from here on are not published */
+	int unpublished;			/* Changed since the last root was */
+	uchar *proofbuf;			/* For testdbandsetbatch and testdbprove */
+	unsigned proofbufsize;
 };
 
-static void nodehash (uchar *hash, innernode *n, int nkeys, int isleaf);
-static int _testdbandmaybeset_node (dbproof *db, int nodepos,
+/* Whether opendb maps the node files, see dbsetmmap */
+static int usemmap;
+
+/* Whether opendb uses a write-ahead log, see dbsetwal */
+static int usewal;
+
+/* Whether opendb makes DBs copy-on-write, see dbsetcow */
+static int usecow;
+
+static void nodehash (dbproof *db, uchar *hash, uchar (*key)[HASHSIZE],
+	uchar (*childhash)[HASHSIZE], int nkeys, int isleaf);
+static uchar *putproofval (uchar *p, unsigned val);
+static int getproofval (uchar **pp, uchar *end, unsigned *val);
+static int _testdbandmaybeset_node (dbproof *db, int *pnodepos,
 	uchar *thisnodehash, uchar *newhash, int set, int depth,
 	int *pnewnodenum, uchar *splitkey, uchar *newnodehash);
+#if !defined(_WIN32)
+static int dbpublish (dbproof *db);
+#endif
 
-static int
-keycomp (uchar *key1, uchar *key2)
+/* Hash a pair of Merkle subtree hashes */
+static void
+merklepair (uchar *hash, uchar *left, uchar *right)
+{
+	uchar md[SHA1_DIGEST_LENGTH];
+	SHA_CTX ctx;
+
+	SHA1_Init (&ctx);
+	SHA1_Update (&ctx, left, HASHSIZE);
+	SHA1_Update (&ctx, right, HASHSIZE);
+	SHA1_Final (md, &ctx);
+	memcpy (hash, md, HASHSIZE);
+}
+
+/* Hash of a Merkle format node, from its nkeys and Merkle root */
+static void
+merklenodehash (uchar *hash, uchar *root, int nkeys)
+{
+	uchar md[SHA1_DIGEST_LENGTH];
+	uchar nnkeys[4];
+	SHA_CTX ctx;
+
+	nnkeys[0] = nkeys >> 24;
+	nnkeys[1] = nkeys >> 16;
+	nnkeys[2] = nkeys >> 8;
+	nnkeys[3] = nkeys;
+	SHA1_Init (&ctx);
+	SHA1_Update (&ctx, nnkeys, sizeof(nnkeys));
+	SHA1_Update (&ctx, root, HASHSIZE);
+	SHA1_Final (md, &ctx);
+	memcpy (hash, md, HASHSIZE);
+}
+
+/*
+ * Intra-node Merkle hashing, for DBs in DBFORMAT_MERKLE.  A node's
+ * items are its keys, interleaved with its childhashes if it is an
+ * inner node: childhash 0, key 0, childhash 1, ... key n-1, childhash n.
+ * They are the leaves of a binary Merkle tree MERKLEWIDTH wide, where
+ * subtrees past the last item hash to zeros.  The node hash is the hash
+ * of nkeys and the Merkle root.  A proof can then show a few items of
+ * a node with just the hashes of the subtrees between them.
+ */
+
+#define NITEMS(nkeys,isleaf)	((isleaf) ? (nkeys) : 2*(nkeys)+1)
+
+static uchar const zerohash[HASHSIZE];
+
+/* Point items[] at the Merkle items of a node */
+static void
+nodeitems (uchar **items, uchar (*key)[HASHSIZE], uchar (*childhash)[HASHSIZE],
+	int nkeys, int isleaf)
 {
 	int i;
-	uchar k1, k2;
 
-	for (i=0; i<HASHSIZE; i++)
+	for (i=0; i<NITEMS(nkeys,isleaf); i++)
 	{
-		k1 = key1[i];
-		k2 = key2[i];
-		if (k1 > k2)
-			return 1;
-		else if (k1 < k2)
-			return -1;
+		if (isleaf)
+			items[i] = key[i];
+		else
+			items[i] = (i & 1) ? key[i/2] : childhash[i/2];
 	}
+}
+
+/* True if any of the items from lo to lo+width-1 are known */
+static int
+anyknown (uchar *known, int nitems, int lo, int width)
+{
+	int i;
+
+	for (i=lo; i<lo+width && i<nitems; i++)
+		if (known[i])
+			return 1;
 	return 0;
 }
 
+/* Merkle hash of the items from lo to lo+width-1 */
+static void
+merkleroot (uchar *hash, uchar **items, int nitems, int lo, int width)
+{
+	uchar left[HASHSIZE];
+	uchar right[HASHSIZE];
+
+	if (lo >= nitems)
+		memcpy (hash, zerohash, HASHSIZE);
+	else if (width == 1)
+		memcpy (hash, items[lo], HASHSIZE);
+	else
+	{
+		merkleroot (left, items, nitems, lo, width/2);
+		merkleroot (right, items, nitems, lo+width/2, width/2);
+		merklepair (hash, left, right);
+	}
+}
+
+/*
+ * The same for a node where only the known items are present.  Each
+ * largest subtree with none of them known takes its hash from *stored,
+ * in order, which must not go past storedend.  Return 0 if it would.
+ */
+static int
+partialroot (uchar *hash, uchar **items, uchar *known, int nitems, int lo,
+	int width, uchar **stored, uchar *storedend)
+{
+	uchar left[HASHSIZE];
+	uchar right[HASHSIZE];
+
+	if (lo >= nitems)
+	{
+		memcpy (hash, zerohash, HASHSIZE);
+		return 1;
+	}
+	if (!anyknown (known, nitems, lo, width))
+	{
+		if (storedend - *stored < HASHSIZE)
+			return 0;
+		memcpy (hash, *stored, HASHSIZE);
+		*stored += HASHSIZE;
+		return 1;
+	}
+	if (width == 1)
+	{
+		memcpy (hash, items[lo], HASHSIZE);
+		return 1;
+	}
+	if (!partialroot (left, items, known, nitems, lo, width/2, stored,
+				storedend)
+			|| !partialroot (right, items, known, nitems, lo+width/2,
+				width/2, stored, storedend))
+		return 0;
+	merklepair (hash, left, right);
+	return 1;
+}
+
 /*
  * See if a key is in a node.  Return true if it is, and set *keyind to the
  * index number of the key (0 to NODEKEYS-1).  Return false if it is not,
@@ -135,772 +421,3992 @@ keycomp (uchar *key1, uchar *key2)
 static int
 nodefindkey (leafnode *n, uchar *key, int *keyind)
 {
-	int i;
-	int m, l, h;
-	int comp;
-	int nkeys = ntohl (n->nkeys);
+	return keysearch (n->key, ntohl (n->nkeys), key, keyind);
+}
+
+
+/*
+ * Node checksums are CRC32C, done with the SSE4.2 instruction where the
+ * CPU has it and by table where not.  crcinit picks one and must be
+ * called before any threads are started.
+ */
+
+static unsigned crctable[256];
+static unsigned (*crcfn) (unsigned crc, uchar *p, size_t len);
 
-	/* Binary search */
-	l = 0; h = nkeys-1;
-	i = 0;
-	while (l <= h)
+static unsigned
+crc32c_table (unsigned crc, uchar *p, size_t len)
+{
+	while (len--)
+		crc = crctable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(CRCSSE42)
+static unsigned __attribute__ ((target ("sse4.2")))
+crc32c_sse42 (unsigned crc, uchar *p, size_t len)
+{
+#if defined(__x86_64__)
+	unsigned long long crc64 = crc;
+	unsigned long long w;
+
+	for ( ; len >= 8; p += 8, len -= 8)
 	{
-		m = (l+h)/2;
-		comp = keycomp (n->key[m], key);
-		if (comp == 0)
-		{
-			*keyind = m;
-			return 1;
-		} else if (comp > 0) {
-			h = m-1;
-		} else {
-			l = m+1;
-			if (m+1 > i)
-				i = m+1;
-		}
+		memcpy (&w, p, 8);
+		crc64 = _mm_crc32_u64 (crc64, w);
 	}
-	*keyind = i;
-	return 0;
+	crc = crc64;
+#endif
+	while (len--)
+		crc = _mm_crc32_u8 (crc, *p++);
+	return crc;
 }
+#endif
 
+static void
+crcinit (void)
+{
+	unsigned crc;
+	int i, j;
 
-/* Functions to seek to, read from and write to a node */
+	if (crcfn)
+		return;
+	for (i=0; i<256; i++)
+	{
+		crc = i;
+		for (j=0; j<8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+		crctable[i] = crc;
+	}
+	crcfn = crc32c_table;
+#if defined(CRCSSE42)
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2"))
+		crcfn = crc32c_sse42;
+#endif
+}
 
-static off_t
-dbnodeseek (dbproof *db, off_t off, int whence, int isleaf)
+/* Return the checksum for a node, all of it but the crc word */
+static unsigned
+nodecrc (innernode *n, int isleaf)
 {
-	off_t err;
+	unsigned crc = 0xffffffff;
 
-	if (isleaf)
-		err = lseek (db->fdl, off*LNODESIZE, whence);
-	else
-		err = lseek (db->fdi, off*INODESIZE, whence);
-	if (err < 0)
-		return err;
-	return err / (isleaf ? LNODESIZE : INODESIZE);
+	crc = crcfn (crc, (uchar *)&n->nkeys, sizeof(n->nkeys));
+	crc = crcfn (crc, n->key[0],
+			(isleaf ? LNODESIZE : INODESIZE) - offsetof(innernode, key));
+	return htonl (~crc);
 }
 
-static ssize_t
-dbnoderead (dbproof *db, innernode *n, int isleaf)
+
+/* Fill in block 0 of the inner node file */
+static void
+dbheader (dbproof *db, innernode *n)
 {
-	ssize_t err;
+	dbfilehdr *h = (dbfilehdr *)n;
+
+	memset (n, 0, INODESIZE);
+	h->magic = htonl (DBFILEMAGIC);
+	h->version = htonl (DBVERSION);
+	h->pagesize = htonl (DBPAGESIZE);
+	h->nodekeys = htonl (NODEKEYS);
+	h->format = htonl (db->format);
+	h->rootnode = htonl (db->rootnode);
+	h->depth = htonl (db->depth);
+	n->crc = nodecrc (n, NONLEAF);
+}
 
-	if (isleaf)
-		err = read (db->fdl, n, LNODESIZE);
-	else
-		err = read (db->fdi, n, INODESIZE);
-	if (err < 0)
-		return err;
-	return err / (isleaf ? LNODESIZE : INODESIZE);
+/*
+ * Take the root, depth and format from block 0.  Return -1 if it is not
+ * a header for nodes laid out as ours are; the checksum is left to the
+ * caller.
+ */
+static int
+dbreadheader (dbproof *db, innernode *n)
+{
+	dbfilehdr *h = (dbfilehdr *)n;
+
+	if (ntohl (h->magic) != DBFILEMAGIC || ntohl (h->version) != DBVERSION
+			|| ntohl (h->pagesize) != DBPAGESIZE
+			|| ntohl (h->nodekeys) != NODEKEYS)
+		return -1;
+	db->format = ntohl (h->format);
+	db->rootnode = ntohl (h->rootnode);
+	db->depth = ntohl (h->depth);
+	return 0;
 }
 
-static ssize_t
-dbnodewrite (dbproof *db, innernode *n, int isleaf)
+
+/*
+ * Buffer pool.  Nodes are read through a pool in memory rather than from
+ * the files on every access.  Inner nodes stay in the pool once read;
+ * there are only about one for every NODEKEYS/2 leaves and every query
+ * goes through the upper levels.  Leaves are kept on an LRU list and the
+ * least recently used clean ones are dropped to keep the count down to
+ * DBCACHELEAVES.  Writes only change the pool and mark the node dirty.
+ * dbflush writes the dirty nodes back, and is called when each query or
+ * batch is done, so the files are up to date whenever we return to our
+ * caller.
+ *
+ * dbnodeseek, dbnoderead and dbnodewrite keep their file-like behavior,
+ * with a current node number per file in place of the file offset.
+ */
+
+static void
+lruremove (dbproof *db, nodebuf *nb)
 {
-	ssize_t err;
+	if (nb->lruprev)
+		nb->lruprev->lrunext = nb->lrunext;
+	else
+		db->lruhead = nb->lrunext;
+	if (nb->lrunext)
+		nb->lrunext->lruprev = nb->lruprev;
+	else
+		db->lrutail = nb->lruprev;
+	nb->lrunext = nb->lruprev = NULL;
+}
 
-	if (isleaf)
-		err = write (db->fdl, n, LNODESIZE);
+static void
+lrufront (dbproof *db, nodebuf *nb)
+{
+	nb->lruprev = NULL;
+	nb->lrunext = db->lruhead;
+	if (db->lruhead)
+		db->lruhead->lruprev = nb;
 	else
-		err = write (db->fdi, n, INODESIZE);
-	if (err < 0)
-		return err;
-	return err / (isleaf ? LNODESIZE : INODESIZE);
+		db->lrutail = nb;
+	db->lruhead = nb;
 }
 
+#define NODEBUCKET(db,nodepos,isleaf)	\
+			((((unsigned)(nodepos) << 1) | (isleaf)) & ((db)->nbuckets - 1))
 
-#if PROFILE
-/* Debugging */
-/* Was having some weird timing problems when rapidly filling the db */
-static struct timeval pt;
+static nodebuf *
+dbnodefind (dbproof *db, int nodepos, int isleaf)
+{
+	nodebuf *nb;
+
+	if (db->nbuckets == 0)
+		return NULL;
+	for (nb = db->buckets[NODEBUCKET(db,nodepos,isleaf)]; nb; nb = nb->hnext)
+		if (nb->nodepos == nodepos && nb->isleaf == isleaf)
+			return nb;
+	return NULL;
+}
+
+/* Take a node out of the pool */
 static void
-ttime (struct timeval *tm, char *msg)
+dbnodedrop (dbproof *db, nodebuf *nb)
 {
-	struct timeval ct;
+	nodebuf **pnb = &db->buckets[NODEBUCKET(db,nb->nodepos,nb->isleaf)];
+
+	while (*pnb != nb)
+		pnb = &(*pnb)->hnext;
+	*pnb = nb->hnext;
+	if (nb->isleaf)
+		lruremove (db, nb);
+	--db->ncached[nb->isleaf];
+	free (nb);
+}
 
-	gettimeofday (&ct, NULL);
-	tm->tv_usec = ct.tv_usec - tm->tv_usec;
-	tm->tv_sec = ct.tv_sec - tm->tv_sec;
-	if (tm->tv_usec < 0)
+/* Double the hash table when it gets crowded */
+static int
+dbcachegrow (dbproof *db)
+{
+	nodebuf **oldbuckets = db->buckets;
+	int oldnbuckets = db->nbuckets;
+	nodebuf *nb;
+	int i;
+
+	db->nbuckets = oldnbuckets ? 2*oldnbuckets : 1024;
+	if ((db->buckets = calloc (db->nbuckets, sizeof(nodebuf *))) == NULL)
 	{
-		tm->tv_usec += 1000000;
-		tm->tv_sec -= 1;
+		db->buckets = oldbuckets;
+		db->nbuckets = oldnbuckets;
+		return -1;
 	}
-	if (tm->tv_sec > 2)
-		printf ("Took %d.%03d seconds: %s\n", tm->tv_sec, tm->tv_usec/1000,msg);
-	*tm = ct;
+	for (i=0; i<oldnbuckets; i++)
+	{
+		while ((nb = oldbuckets[i]) != NULL)
+		{
+			oldbuckets[i] = nb->hnext;
+			nb->hnext = db->buckets[NODEBUCKET(db,nb->nodepos,nb->isleaf)];
+			db->buckets[NODEBUCKET(db,nb->nodepos,nb->isleaf)] = nb;
+		}
+	}
+	free (oldbuckets);
+	return 0;
 }
+
+/* Read or write a node straight from or to its file */
+static ssize_t
+dbnodeio (dbproof *db, int nodepos, innernode *n, int isleaf, int wr)
+{
+	int fd = isleaf ? db->fdl : db->fdi;
+	size_t size = isleaf ? LNODESIZE : INODESIZE;
+
+#if defined(_WIN32)
+	if (lseek (fd, (off_t)nodepos*size, SEEK_SET) < 0)
+		return -1;
+	return wr ? write (fd, n, size) : read (fd, n, size);
 #else
-#define ttime(a,b)
+	if (wr)
+		return pwrite (fd, n, size, (off_t)nodepos*size);
+	return pread (fd, n, size, (off_t)nodepos*size);
 #endif
+}
+
+/* Read a node from its file and check it.  Return -1 if we can't */
+static int
+dbnodeload (dbproof *db, int nodepos, innernode *n, int isleaf)
+{
+	size_t size = isleaf ? LNODESIZE : INODESIZE;
+
+	if (dbnodeio (db, nodepos, n, isleaf, 0) != size)
+		return -1;
+	if (n->crc != nodecrc (n, isleaf))
+	{
+		fprintf (stderr, "Bad checksum on DB %s node %d\n",
+				isleaf ? "leaf" : "inner", nodepos);
+		return -1;
+	}
+	return 0;
+}
 
 /*
- * Return 1 if present, 0 if was absent.  If set is true, add it if absent.
- * Also return *proof and *prooflen as a buffer (within proofdb) which proves
- * our correctness.
+ * Return the node from the pool, bringing it in if need be.  If load is
+ * false the caller is about to overwrite all of it, so don't read it.
+ * Return NULL if out of memory.
  */
-int
-testdbandmaybeset (dbproof *db, unsigned char **proof, unsigned *prooflen,
-	unsigned char *hash, int set)
+static nodebuf *
+dbnodeget (dbproof *db, int nodepos, int isleaf, int load)
 {
-	innernode n;
-	uchar splitkey[HASHSIZE];
-	uchar newnodehash[HASHSIZE];
-	uchar treehash[HASHSIZE];
-	int found;
-	int newnodenum;
-	int newtopnodenum;
+	nodebuf *nb;
+	nodebuf *prev;
+	size_t size = isleaf ? LNODESIZE : INODESIZE;
 
-#if PROFILE
-timerclear(&pt);
-gettimeofday(&pt,NULL);
-#endif
+	if ((nb = dbnodefind (db, nodepos, isleaf)) != NULL)
+	{
+		++db->stats.hits;
+		if (isleaf)
+		{
+			lruremove (db, nb);
+			lrufront (db, nb);
+		}
+		return nb;
+	}
 
-	/* Set things up for validity proof */
-	db->treedepth = db->depth;
-	db->nodeptr = (compnode *)db->nodeinfo;
+	/* Make room, passing over leaves waiting to be written */
+	for (nb = db->lrutail; isleaf && nb != NULL
+			&& db->ncached[ISLEAF] >= DBCACHELEAVES; nb = prev)
+	{
+		prev = nb->lruprev;
+		if (!nb->dirty)
+		{
+			dbnodedrop (db, nb);
+			++db->stats.evictions;
+		}
+	}
 
-	/* Do the recursive search */
-	found = _testdbandmaybeset_node (db, db->rootnode, treehash, hash, set,
-			0, &newnodenum, splitkey, newnodehash);
-	if (!set || found || (newnodenum==0))
+	if (db->ncached[NONLEAF] + db->ncached[ISLEAF] >= 2*db->nbuckets
+			&& dbcachegrow (db) < 0 && db->nbuckets == 0)
+		return NULL;
+	if ((nb = malloc (isleaf ? offsetof(nodebuf, n) + size
+			: sizeof(nodebuf))) == NULL)
+		return NULL;
+	nb->nodepos = nodepos;
+	nb->isleaf = isleaf;
+	nb->dirty = 0;
+	if (!load)
+		memset (&nb->n, 0, size);
+	else
 	{
-		if (proof)
-			*proof = db->nodeinfo;
-		if (prooflen)
-			*prooflen = (uchar *)db->nodeptr - db->nodeinfo;
-printf ("New DB root hash:         "); dumpbuf (treehash, HASHSIZE);
-		return found;
+		++db->stats.misses;
+		if (dbnodeload (db, nodepos, &nb->n, isleaf) < 0)
+		{
+			free (nb);
+			return NULL;
+		}
 	}
+	nb->hnext = db->buckets[NODEBUCKET(db,nodepos,isleaf)];
+	db->buckets[NODEBUCKET(db,nodepos,isleaf)] = nb;
+	nb->lrunext = nb->lruprev = NULL;
+	if (isleaf)
+		lrufront (db, nb);
+	++db->ncached[isleaf];
+	return nb;
+}
 
-	/* Must create new top node because old top filled up and split */
-	memset (&db->newnode, 0, INODESIZE);
-	memcpy (db->newnode.key[0], splitkey, HASHSIZE);
-	db->newnode.nkeys = htonl(1);
-	db->newnode.child[0] = htonl (db->rootnode);
-	db->newnode.child[1] = htonl (newnodenum);
-	memcpy (db->newnode.childhash[0], treehash, HASHSIZE);
-	memcpy (db->newnode.childhash[1], newnodehash, HASHSIZE);
-	++db->depth;
-	assert (db->depth <= MAXDEPTH);
-printf ("Splitting top node, increasing DB depth to %d\n", db->depth);
+static int
+nodebufcmp (const void *a, const void *b)
+{
+	const nodebuf *na = *(const nodebuf **)a;
+	const nodebuf *nb = *(const nodebuf **)b;
 
-	/* Write out new top node */
-	newtopnodenum = dbnodeseek (db, 0, SEEK_END, NONLEAF);
-ttime(&pt, "seek to end");
-	dbnodewrite (db, &db->newnode, NONLEAF);
-ttime(&pt, "write new node");
+	if (na->isleaf != nb->isleaf)
+		return na->isleaf - nb->isleaf;
+	return na->nodepos - nb->nodepos;
+}
 
-	/* Put its position in block 0 */
-	n.child[0] = htonl (newtopnodenum);
-	n.child[1] = htonl (db->depth);
-	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
-	dbnodewrite (db, &n, NONLEAF);
+/*
+ * Write all dirty nodes in the pool back to the files.
+ * Return 0 if OK, -1 on a write error.
+ */
+static int
+dbpoolflush (dbproof *db)
+{
+	nodebuf *nb;
+	size_t size;
+	int err = 0;
+	int i;
 
-	db->rootnode = newtopnodenum;
+	for (i=0; i<db->ndirty; i++)
+	{
+		nb = db->dirty[i];
+		size = nb->isleaf ? LNODESIZE : INODESIZE;
+		if (dbnodeio (db, nb->nodepos, &nb->n, nb->isleaf, 1) != size)
+			err = -1;
+		nb->dirty = 0;
+		++db->stats.writebacks;
+	}
+	db->ndirty = 0;
+	return err;
+}
 
-	if (proof)
-		*proof = db->nodeinfo;
-	if (prooflen)
-		*prooflen = (uchar *)db->nodeptr - db->nodeinfo;
+/* Drop every node from the pool, after a dbflush */
+static void
+dbcachefree (dbproof *db)
+{
+	nodebuf *nb;
+	int i;
 
-	return 0;
+	for (i=0; i<db->nbuckets; i++)
+	{
+		while ((nb = db->buckets[i]) != NULL)
+		{
+			db->buckets[i] = nb->hnext;
+			free (nb);
+		}
+	}
+	free (db->buckets);
+	free (db->dirty);
 }
 
+
 /*
- * Search the tree starting at the node with number nodepos.  Return 1
- * if newhash is found, 0 if it was not found.  If it was not found and
- * set is true, insert it in the tree.  Insertion may require node
- * splitting.  If that happens, we set *pnewnodenum to the number of the
- * new node (which will be the right sibling of the existing node).
- * We set splitkey to be the key at which we split, the middle key, which
- * is supposed to move up into the parent node.  And we set newnodehash
- * to be the hash of the new node.  Also if we made a change to the
- * existing node, we set thisnodehash to the new hash of the node.
+ * Memory mapped node files.  With dbsetmmap, opendb maps both node files
+ * and nodes are used in place there instead of through the buffer pool.
+ * The mappings run past the end of the files, a DBMAPEXTENT at a time,
+ * so appending a node just means extending the file until we run off the
+ * end of the mapping.  If we can't map a file we drop back to the pool
+ * for the rest of the time the DB is open.
  */
+
+#if !defined(_WIN32)
+/* Map enough of a node file for nnodes nodes */
 static int
-_testdbandmaybeset_node (dbproof *db, int nodepos, uchar *thisnodehash, 
-	uchar *newhash, int set, int depth, int *pnewnodenum, uchar *splitkey,
-	uchar *newnodehash)
+dbmapgrow (dbproof *db, int isleaf, off_t nnodes)
 {
-	innernode n;
-	int childpos;
-	int keyind;
-	int nkeys;
-	int found;
-	int isleaf = (depth+1 == db->depth);
+	size_t size = isleaf ? LNODESIZE : INODESIZE;
+	size_t need = nnodes * size;
+	size_t newsize;
+	void *p;
 
-	dbnodeseek (db, nodepos, SEEK_SET, isleaf);
-ttime(&pt, "first lseek");
-	dbnoderead (db, &n, isleaf);
-ttime(&pt, "first read");
+	if (need <= db->mapsize[isleaf])
+		return 0;
+	newsize = ((need + DBMAPEXTENT - 1) / DBMAPEXTENT) * DBMAPEXTENT;
+	p = mmap (NULL, newsize, PROT_READ|PROT_WRITE, MAP_SHARED,
+			isleaf ? db->fdl : db->fdi, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	if (db->map[isleaf])
+		munmap (db->map[isleaf], db->mapsize[isleaf]);
+	db->map[isleaf] = p;
+	db->mapsize[isleaf] = newsize;
+	return 0;
+}
+#endif
 
-	nkeys = ntohl(n.nkeys);
-	found = nodefindkey ((leafnode *)&n, newhash, &keyind);
+/* Hand nodes written to the mappings since last time to the OS */
+static int
+dbmapsync (dbproof *db)
+{
+	int err = 0;
+#if !defined(_WIN32)
+	size_t size;
+	size_t pagesize = getpagesize ();
+	size_t lo, hi;
+	int isleaf;
 
-	/* Save data in nodeinfo chain for later proof of correctness */
-	db->nodeptr->nkeys = htonl(nkeys);
-	db->nodeptr->keyind = htonl(keyind);
-	memcpy (db->nodeptr->hashdata[0], n.key[0], nkeys*HASHSIZE);
-	if (!isleaf)
+	for (isleaf=0; isleaf<2; isleaf++)
 	{
-		memcpy (db->nodeptr->hashdata[nkeys], n.childhash[0],
-					(nkeys+1)*HASHSIZE);
+		if (db->maphi[isleaf] <= db->maplo[isleaf])
+			continue;
+		size = isleaf ? LNODESIZE : INODESIZE;
+		lo = (db->maplo[isleaf] * size) / pagesize * pagesize;
+		hi = db->maphi[isleaf] * size;
+		if (msync (db->map[isleaf] + lo, hi - lo, MS_ASYNC) != 0)
+			err = -1;
+		db->maplo[isleaf] = db->maphi[isleaf] = 0;
 	}
-	db->nodeptr = (compnode *)((uchar *)db->nodeptr + CNODESIZE(nkeys,isleaf));
+#endif
+	return err;
+}
 
-	if (found)
+/* Stop using the mappings, after a dbflush */
+static void
+dbunmap (dbproof *db)
+{
+#if !defined(_WIN32)
+	int isleaf;
+
+	for (isleaf=0; isleaf<2; isleaf++)
 	{
-		return 1;
+		if (db->map[isleaf])
+			munmap (db->map[isleaf], db->mapsize[isleaf]);
+		db->map[isleaf] = NULL;
+		db->mapsize[isleaf] = 0;
 	}
+#endif
+	db->mmapped = 0;
+}
 
-	if (isleaf)
-	{
-		/* Done, unfound, if not inserting */
-		if (!set)
-			return 0;
+/* Return node nodepos in the mapping, or NULL if it is not there */
+#define DBMAPPTR(db,nodepos,isleaf)	\
+	(((nodepos)+1) * ((isleaf) ? LNODESIZE : INODESIZE) \
+			<= (db)->mapsize[isleaf] ? \
+		(innernode *)((db)->map[isleaf] + \
+			(nodepos) * ((isleaf) ? LNODESIZE : INODESIZE)) : NULL)
 
-		/* Leaf node, just add data */
-		memmove (n.key[keyind+1], n.key[keyind], (nkeys-keyind)*HASHSIZE);
-		memcpy (n.key[keyind], newhash, HASHSIZE);
-		++nkeys;
-	} else {
-		/* Traverse the tree */
-		childpos = ntohl (n.child[keyind]);
-		assert (childpos != 0);
-		*pnewnodenum = 0;
-		found = _testdbandmaybeset_node (db, childpos, n.childhash[keyind],
-			newhash, set, depth+1, pnewnodenum, splitkey, newnodehash);
+/* Note a node written in the mapping, for dbmapsync */
+static void
+dbmaptouch (dbproof *db, int nodepos, int isleaf)
+{
+	if (db->maphi[isleaf] <= db->maplo[isleaf])
+	{
+		db->maplo[isleaf] = nodepos;
+		db->maphi[isleaf] = nodepos + 1;
+	}
+	if (nodepos < db->maplo[isleaf])
+		db->maplo[isleaf] = nodepos;
+	if (nodepos >= db->maphi[isleaf])
+		db->maphi[isleaf] = nodepos + 1;
+}
 
-		if (!set || found)
-			return found;
+/*
+ * With a write-ahead log, nodes written while mapped wait in the pool
+ * until they are in the log, as the OS could write the mapping out at
+ * any time.  Then copy them into the mapping and drop them.
+ */
+static int
+dbmapapply (dbproof *db)
+{
+	innernode *np;
+	nodebuf *nb;
+	size_t size;
+	int err = 0;
+	int i;
 
-		if (*pnewnodenum == 0)
+	for (i=0; i<db->ndirty; i++)
+	{
+		nb = db->dirty[i];
+		size = nb->isleaf ? LNODESIZE : INODESIZE;
+		if ((np = DBMAPPTR(db, nb->nodepos, nb->isleaf)) != NULL)
 		{
-			/* No split below us, just write out with our updated hash */
-			dbnodeseek (db, nodepos, SEEK_SET, isleaf);
-	ttime(&pt, "lseek for hash propagate");
-			dbnodewrite (db, &n, isleaf);
-	ttime(&pt, "write for hash propagate");
-
-			/* And update our parent's hash */
-			nodehash (thisnodehash, &n, nkeys, isleaf);
-			return 0;
+			memcpy (np, &nb->n, size);
+			dbmaptouch (db, nb->nodepos, nb->isleaf);
 		}
-
-		/* Child did a split, newnode is to the right of the old one */
-		memmove (n.key[keyind+1], n.key[keyind], (nkeys-keyind)*HASHSIZE);
-		memcpy (n.key[keyind], splitkey, HASHSIZE);
-		memmove (n.childhash[keyind+2], n.childhash[keyind+1],
-				(nkeys-keyind)*HASHSIZE);
-		memcpy (n.childhash[keyind+1], newnodehash, HASHSIZE);
-		memmove (n.child+keyind+2, n.child+keyind+1,
-				(nkeys-keyind)*sizeof(n.child[0]));
-		n.child[keyind+1] = htonl(*pnewnodenum);
-		++nkeys;
+		else if (dbnodeio (db, nb->nodepos, &nb->n, nb->isleaf, 1) != size)
+			err = -1;
+		++db->stats.writebacks;
+		dbnodedrop (db, nb);
 	}
+	db->ndirty = 0;
+	return err;
+}
 
-	/* Now split our node if it is too full */
-	/* We move one key up (to splitkey) and put NODEKEYS/2 in this one and */
-	/* the new one.  The new node gets the higher value keys and is the */
-	/* right sibling of the existing node. */
-	if (nkeys > NODEKEYS)
-	{
-		assert (nkeys == NODEKEYS+1);
-		memset (&db->newnode, 0, INODESIZE);
-		memcpy (splitkey, n.key[NODEKEYS/2], HASHSIZE);
-		memcpy (db->newnode.key[0], n.key[NODEKEYS/2+1], (NODEKEYS/2)*HASHSIZE);
-		memset (n.key[NODEKEYS/2], 0, (NODEKEYS/2+1)*HASHSIZE);
-		if (!isleaf)
-		{
-			memcpy (db->newnode.childhash[0], n.childhash[NODEKEYS/2+1],
-				(NODEKEYS/2+1) * HASHSIZE);
-			memcpy (db->newnode.child, n.child+NODEKEYS/2+1,
-				(NODEKEYS/2+1) * sizeof(n.child[0]));
-			memset (n.childhash[NODEKEYS/2+1], 0, (NODEKEYS/2+1)*HASHSIZE);
-			memset (n.child+NODEKEYS/2+1, 0,
-				(NODEKEYS/2+1)*sizeof(n.child[0]));
-		}
-		db->newnode.nkeys = n.nkeys = htonl(NODEKEYS/2);
 
-		/* Write the old node first, then the new one */
-		dbnodeseek (db, nodepos, SEEK_SET, isleaf);
-ttime(&pt, "lseek for rewrite");
-		dbnodewrite (db, &n, isleaf);
-ttime(&pt, "rewrite");
-		*pnewnodenum = dbnodeseek (db, 0, SEEK_END, isleaf);
-ttime(&pt, "seek to end");
-		dbnodewrite (db, &db->newnode, isleaf);
-ttime(&pt, "write new node");
+/*
+ * Write-ahead log.  With dbsetwal, changes reach the disk through a log
+ * before going into the node files.  dbflush appends every node changed
+ * since the last one to the log as a single transaction and does one
+ * fdatasync on it; only then are the nodes written to the node files,
+ * or copied into their mappings.  So a query or batch of queries costs
+ * one sync however many nodes it changed.  Once the log passes DBWALMAX
+ * we checkpoint: sync the node files and empty the log.  If we crash,
+ * opendb redoes the complete transactions in the log, so the node files
+ * come back as of the last dbflush, matching what the card was told.
+ *
+ * A transaction is a header of DBWALMAGIC, the number of nodes and the
+ * length of their records, then for each node isleaf, its node number
+ * and its contents, then a SHA1 hash of all that.  Numbers are 4 bytes
+ * in network order.
+ */
 
-		/* And update parent's hashes */
-		nodehash (thisnodehash, &n, NODEKEYS/2, isleaf);
-		nodehash (newnodehash, &db->newnode, NODEKEYS/2, isleaf);
-	}
-	else
+#if !defined(_WIN32)
+/* Append the dirty nodes to the log and sync it */
+static int
+dbwalcommit (dbproof *db)
+{
+	uchar md[SHA1_DIGEST_LENGTH];
+	uchar *newbuf;
+	uchar *p;
+	nodebuf *nb;
+	size_t need = 12 + SHA1_DIGEST_LENGTH;
+	size_t size;
+	SHA_CTX ctx;
+	int i;
+
+	for (i=0; i<db->ndirty; i++)
+		need += 8 + (db->dirty[i]->isleaf ? LNODESIZE : INODESIZE);
+	if (need > db->walbufsize)
 	{
-		/* No split needed, just write the old node */
-		*pnewnodenum = 0;		/* Flag that no splits were done here */
-		n.nkeys = htonl(nkeys);
-		dbnodeseek (db, nodepos, SEEK_SET, isleaf);
-ttime(&pt, "lseek for rewrite");
-		dbnodewrite (db, &n, isleaf);
-ttime(&pt, "rewrite");
+		if ((newbuf = realloc (db->walbuf, need)) == NULL)
+			return -1;
+		db->walbuf = newbuf;
+		db->walbufsize = need;
+	}
 
-		/* And update parent hash */
-		nodehash (thisnodehash, &n, nkeys, isleaf);
+	p = putproofval (db->walbuf, DBWALMAGIC);
+	p = putproofval (p, db->ndirty);
+	p = putproofval (p, need - 12 - SHA1_DIGEST_LENGTH);
+	for (i=0; i<db->ndirty; i++)
+	{
+		nb = db->dirty[i];
+		size = nb->isleaf ? LNODESIZE : INODESIZE;
+		p = putproofval (p, nb->isleaf);
+		p = putproofval (p, nb->nodepos);
+		memcpy (p, &nb->n, size);
+		p += size;
 	}
+	SHA1_Init (&ctx);
+	SHA1_Update (&ctx, db->walbuf, p - db->walbuf);
+	SHA1_Final (md, &ctx);
+	memcpy (p, md, SHA1_DIGEST_LENGTH);
 
+	if (pwrite (db->fdw, db->walbuf, need, db->walsize) != need
+			|| fdatasync (db->fdw) < 0)
+		return -1;
+	db->walsize += need;
 	return 0;
 }
 
+/* Get the node files onto the disk, after which the log can be emptied */
+static int
+dbcheckpoint (dbproof *db)
+{
+	int isleaf;
 
-/* Hash the given node key and childhash data (if nonleaf) and return result */
-static void
-nodedatahash (uchar *hash, uchar *key, uchar *childhash, int nkeys, int isleaf)
+	for (isleaf=0; isleaf<2; isleaf++)
+	{
+		if (db->map[isleaf]
+				&& msync (db->map[isleaf], db->mapsize[isleaf], MS_SYNC) != 0)
+			return -1;
+	}
+	if (fdatasync (db->fdi) < 0 || fdatasync (db->fdl) < 0
+			|| ftruncate (db->fdw, 0) < 0)
+		return -1;
+	db->walsize = 0;
+	return 0;
+}
+
+/*
+ * Redo the complete transactions in the log, straight into the node
+ * files, then checkpoint.  Anything after the first incomplete or
+ * damaged transaction was never committed.
+ */
+static int
+dbrecover (dbproof *db)
 {
 	uchar md[SHA1_DIGEST_LENGTH];
-	ulong nnkeys = htonl (nkeys);
+	uchar hdr[12];
+	uchar *buf;
+	uchar *p;
+	uchar *end;
+	unsigned nrec, len, isleaf, nodepos;
+	off_t off = 0;
 	SHA_CTX ctx;
+	size_t size;
 
-	SHA1_Init (&ctx);
-	SHA1_Update (&ctx, (unsigned char *)&nnkeys, sizeof(nnkeys));
-	SHA1_Update (&ctx, key, nkeys*HASHSIZE);
-	if (!isleaf)
-		SHA1_Update (&ctx, childhash, (1+nkeys)*HASHSIZE);
-	SHA1_Final (md, &ctx);
-	memcpy (hash, md, HASHSIZE);
-}
+	while (pread (db->fdw, hdr, sizeof(hdr), off) == sizeof(hdr))
+	{
+		p = hdr;
+		getproofval (&p, hdr+12, &len);
+		if (len != DBWALMAGIC)
+			break;
+		getproofval (&p, hdr+12, &nrec);
+		getproofval (&p, hdr+12, &len);
+		if (nrec > 0x100000 || len > nrec * (8 + INODESIZE)
+				|| (buf = malloc (12 + len + SHA1_DIGEST_LENGTH)) == NULL)
+			break;
+		memcpy (buf, hdr, 12);
+		if (pread (db->fdw, buf+12, len + SHA1_DIGEST_LENGTH, off+12)
+				!= len + SHA1_DIGEST_LENGTH)
+		{
+			free (buf);
+			break;
+		}
+		SHA1_Init (&ctx);
+		SHA1_Update (&ctx, buf, 12 + len);
+		SHA1_Final (md, &ctx);
+		if (memcmp (md, buf + 12 + len, SHA1_DIGEST_LENGTH) != 0)
+		{
+			free (buf);
+			break;
+		}
 
-/* Compute 128 bit hash of node keys and their subtrees */
-static void
-nodehash (uchar *hash, innernode *n, int nkeys, int isleaf)
-{
-	nodedatahash (hash, n->key[0], n->childhash[0], nkeys, isleaf);
+		p = buf + 12;
+		end = p + len;
+		while (nrec-- > 0 && getproofval (&p, end, &isleaf)
+				&& getproofval (&p, end, &nodepos))
+		{
+			size = isleaf ? LNODESIZE : INODESIZE;
+			if (end - p < size)
+				break;
+			dbnodeio (db, nodepos, (innernode *)p, isleaf != 0, 1);
+			p += size;
+		}
+		free (buf);
+		off += 12 + len + SHA1_DIGEST_LENGTH;
+	}
+	return dbcheckpoint (db);
 }
 
+/* Open the log, and recover from it unless we are making a new DB */
+static int
+dbwalopen (dbproof *db, char *name, int create)
+{
+	char *walname;
 
-
-/*****************************  VALIDATE  *******************************/
+	db->fdw = -1;
+	if (!usewal)
+		return 0;
+	if ((walname = malloc (strlen(name) + 10)) == NULL)
+		return -1;
+	strcpy (walname, name);
+	strcat (walname, ".wal");
+	db->fdw = open (walname, O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0666);
+	free (walname);
+	if (db->fdw < 0)
+		return -1;
+	if (!create && lseek (db->fdw, 0, SEEK_END) > 0)
+		return dbrecover (db);
+	return 0;
+}
+#else
+#define dbwalcommit(db)				(-1)
+#define dbcheckpoint(db)			(-1)
+#define dbwalopen(db,name,create)	((db)->fdw = -1, 0)
+#endif
 
 
 /*
+ * Write all changes back to the files, in file order.  This is the
+ * commit point, with a write-ahead log this is when they become durable.
+ */
+static int
+dbflush (dbproof *db)
+{
+	int err = 0;
 
-The idea here is that an untrusted system can maintain the DB, and provide
-evidence to a second system as to whether any given item is found or not
-(and added if missing).  The second system maintains a hash over the
-whole DB, following the btree structure.  It checks the returned evidence
-data against the hash to make sure it matches, verifies that the evidence
-does in fact prove presence or absence, and if adding, independently
-calculates the updated hash, using an algorithm that mirrors that done on
-the untrusted system.
+	if (db->ndirty > 0)
+	{
+		qsort (db->dirty, db->ndirty, sizeof(nodebuf *), nodebufcmp);
+		if (db->fdw >= 0 && dbwalcommit (db) < 0)
+		{
+			fprintf (stderr, "Unable to write DB log\n");
+			err = -1;
+		}
+		if ((db->mmapped ? dbmapapply (db) : dbpoolflush (db)) < 0)
+			err = -1;
+	}
+	if (db->mmapped && dbmapsync (db) < 0)
+		err = -1;
+#if !defined(_WIN32)
+	if (db->unpublished && err == 0 && dbpublish (db) < 0)
+		err = -1;
+#endif
+	if (db->fdw >= 0 && db->walsize > DBWALMAX && dbcheckpoint (db) < 0)
+		err = -1;
+	return err;
+}
 
-*/
 
+/* Functions to seek to, read from and write to a node */
 
-/* Arrays to give room to expand our nodes */
-static uchar growkey[NODEKEYS+1][HASHSIZE];
-static uchar growchild[NODEKEYS+2][HASHSIZE];
+static off_t
+dbnodeseek (dbproof *db, off_t off, int whence, int isleaf)
+{
+	if (whence == SEEK_END)
+		off += db->nnodes[isleaf];
+	else if (whence == SEEK_CUR)
+		off += db->pos[isleaf];
+	if (off < 0)
+		return -1;
+	db->pos[isleaf] = off;
+	return off;
+}
 
 /*
- * Return true if valid, false if not.  Return *found as true if we found
- * the data item (if we are returning valid).
- * Update treehash if set is true and not found (and valid).
+ * Return a pointer to node nodepos, to look at in place in the mapping
+ * or the pool.  It is good until the next dbnodewrite, and for a leaf
+ * until the next access to another leaf.  If we can't do that, read the
+ * node into buf and return that.  Return NULL if there is no such node.
  */
-int
-validate_db_operation (uchar *treehash, int *found, compnode *nodeinfo,
-	int nilen, int *maxdepth, uchar *newhash, int set)
+static innernode *
+dbnodeptr (dbproof *db, int nodepos, int isleaf, innernode *buf)
 {
-	int valid;
-	int splitflag;
-	uchar splitkey[HASHSIZE];
-	uchar newnodehash[HASHSIZE];
+	innernode *n;
+	nodebuf *nb;
 
-/*
+	if (nodepos >= db->nnodes[isleaf])
+		return NULL;
+	if (db->mmapped && db->ndirty > 0
+			&& (nb = dbnodefind (db, nodepos, isleaf)) != NULL)
+		n = &nb->n;
+	else if (db->mmapped)
+		n = DBMAPPTR(db, nodepos, isleaf);
+	else
+		n = (nb = dbnodeget (db, nodepos, isleaf, 1)) ? &nb->n : NULL;
+	if (n == NULL)
+	{
+		if (dbnodeload (db, nodepos, buf, isleaf) < 0)
+			return NULL;
+		n = buf;
+	}
+	return n;
+}
+
+static ssize_t
+dbnoderead (dbproof *db, innernode *n, int isleaf)
+{
+	innernode *np;
+
+	if ((np = dbnodeptr (db, db->pos[isleaf], isleaf, n)) == NULL)
+		return 0;
+	++db->pos[isleaf];
+	if (np != n)
+		memcpy (n, np, isleaf ? LNODESIZE : INODESIZE);
+	return 1;
+}
+
+/* Return the number of keys in a node, without copying it */
+static int
+dbnodenkeys (dbproof *db, int nodepos, int isleaf)
+{
+	innernode buf;
+	innernode *np;
+
+	if ((np = dbnodeptr (db, nodepos, isleaf, &buf)) == NULL)
+		return 0;
+	return ntohl (np->nkeys);
+}
+
+static ssize_t
+dbnodewrite (dbproof *db, innernode *n, int isleaf)
+{
+	innernode *np;
+	nodebuf *nb;
+	nodebuf **newdirty;
+	int nodepos = db->pos[isleaf];
+
+	n->crc = nodecrc (n, isleaf);
+	++db->pos[isleaf];
+	if (db->cow)
+		db->unpublished = 1;
+	if (db->mmapped)
+	{
+#if !defined(_WIN32)
+		/* Extend the file first, the mapping past its end is unusable */
+		if (nodepos >= db->nnodes[isleaf])
+		{
+			if (ftruncate (isleaf ? db->fdl : db->fdi,
+					(off_t)(nodepos+1) * (isleaf ? LNODESIZE : INODESIZE)) < 0)
+				return -1;
+			db->nnodes[isleaf] = nodepos + 1;
+			if (dbmapgrow (db, isleaf, nodepos+1) < 0)
+			{
+				dbflush (db);
+				dbunmap (db);
+			}
+		}
+#endif
+		if (db->mmapped && db->fdw < 0)
+		{
+			if ((np = DBMAPPTR(db, nodepos, isleaf)) == NULL)
+				return dbnodeio (db, nodepos, n, isleaf, 1) < 0 ? -1 : 1;
+			memcpy (np, n, isleaf ? LNODESIZE : INODESIZE);
+			dbmaptouch (db, nodepos, isleaf);
+			return 1;
+		}
+	}
+	if (nodepos >= db->nnodes[isleaf])
+		db->nnodes[isleaf] = nodepos + 1;
+
+	if ((nb = dbnodeget (db, nodepos, isleaf, 0)) == NULL)
+		return dbnodeio (db, nodepos, n, isleaf, 1) < 0 ? -1 : 1;
+	if (!nb->dirty)
+	{
+		if (db->ndirty == db->maxdirty)
+		{
+			newdirty = realloc (db->dirty,
+					(2*db->maxdirty + 16) * sizeof(nodebuf *));
+			if (newdirty == NULL)
+			{
+				memcpy (&nb->n, n, isleaf ? LNODESIZE : INODESIZE);
+				return dbnodeio (db, nodepos, n, isleaf, 1) < 0 ? -1 : 1;
+			}
+			db->dirty = newdirty;
+			db->maxdirty = 2*db->maxdirty + 16;
+		}
+		db->dirty[db->ndirty++] = nb;
+		nb->dirty = 1;
+	}
+	memcpy (&nb->n, n, isleaf ? LNODESIZE : INODESIZE);
+	return 1;
+}
+
+
+/*
+ * Copy-on-write.  With dbsetcow a DB never changes a node once a root
+ * which reaches it has been published.  An insert writes the nodes on
+ * its path, which are all the nodes it changes, to new places at the
+ * ends of the files, and each parent points at its child's new place.
+ * Nodes written since the last publish are not reachable by anyone
+ * else yet, so a batch of inserts reuses them in place.  dbflush then
+ * publishes the new root by appending a record to the roots file, name
+ * plus ".roots".  Node numbers are not part of the node hashes, so the
+ * card sees the same tree either way.
+ *
+ * A record is DBROOTMAGIC, the generation (counting from 1, and the
+ * record's place in the file), the root node number, the depth, the
+ * number of inner nodes and of leaves, the root hash, and a SHA1 hash
+ * of all that.  Numbers are 4 bytes in network order.
+ *
+ * Readers open a snapshot with opensnap, which takes the latest record
+ * with a good hash, or any earlier one they ask for.  Everything it
+ * reaches stays as it was, so they need no locking against the writer
+ * or each other.  On a crash the nodes after the last good record are
+ * simply written over, so a copy-on-write DB needs no log; dbsetwal
+ * just has the nodes synced before each root is published, and the
+ * root after.  Old nodes are not reclaimed; a fresh DB made with
+ * bulkloaddb is compact again.
+ */
+
+#if !defined(_WIN32)
+/*
+ * Seek to where node nodepos, about to be changed, should be written:
+ * in place, or if it has been published, to a new node at the end.
+ */
+static int
+dbnodeplace (dbproof *db, int nodepos, int isleaf)
+{
+	nodebuf *nb;
+
+	if (!db->cow || nodepos >= db->cowbase[isleaf])
+		return dbnodeseek (db, nodepos, SEEK_SET, isleaf);
+	/* Nobody will look at the old one through this handle again */
+	if (!db->mmapped && (nb = dbnodefind (db, nodepos, isleaf)) != NULL
+			&& !nb->dirty)
+		dbnodedrop (db, nb);
+	return dbnodeseek (db, 0, SEEK_END, isleaf);
+}
+
+/* Read root record gen, or the last good one if gen <= 0 */
+static int
+dbreadroot (dbproof *db, int fdr, long gen)
+{
+	uchar rec[DBROOTSIZE];
+	uchar md[SHA1_DIGEST_LENGTH];
+	unsigned val[6];
+	uchar *p;
+	SHA_CTX ctx;
+	long last = lseek (fdr, 0, SEEK_END) / DBROOTSIZE;
+	long g;
+	int i;
+
+	if (gen > last)
+		return -1;
+	for (g = (gen > 0) ? gen : last; g > 0; g--)
+	{
+		if (pread (fdr, rec, DBROOTSIZE, (off_t)(g-1)*DBROOTSIZE)
+				!= DBROOTSIZE)
+			return -1;
+		SHA1_Init (&ctx);
+		SHA1_Update (&ctx, rec, DBROOTSIZE - SHA1_DIGEST_LENGTH);
+		SHA1_Final (md, &ctx);
+		p = rec;
+		for (i=0; i<6; i++)
+			getproofval (&p, rec+24, &val[i]);
+		if (memcmp (md, rec + DBROOTSIZE - SHA1_DIGEST_LENGTH,
+				SHA1_DIGEST_LENGTH) == 0
+				&& val[0] == DBROOTMAGIC && val[1] == g)
+		{
+			db->generation = g;
+			db->rootnode = val[2];
+			db->depth = val[3];
+			db->nnodes[NONLEAF] = val[4];
+			db->nnodes[ISLEAF] = val[5];
+			memcpy (db->treehash, rec+24, HASHSIZE);
+			return 0;
+		}
+		if (gen > 0)
+			break;
+	}
+	return -1;
+}
+
+/*
+ * Make what has been written since the last publish the current tree.
+ * The header in block 0 is updated too, for tools which read only that.
+ */
+static int
+dbpublish (dbproof *db)
+{
+	uchar rec[DBROOTSIZE];
+	innernode n;
+	uchar *p;
+	SHA_CTX ctx;
+	int err = 0;
+
+	dbheader (db, &n);
+	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
+	dbnodewrite (db, &n, NONLEAF);
+	if ((db->mmapped ? dbmapapply (db) : dbpoolflush (db)) < 0)
+		return -1;
+#if !defined(_WIN32)
+	if (db->durable && (fdatasync (db->fdi) < 0 || fdatasync (db->fdl) < 0))
+		return -1;
+#endif
+
+	p = putproofval (rec, DBROOTMAGIC);
+	p = putproofval (p, db->generation + 1);
+	p = putproofval (p, db->rootnode);
+	p = putproofval (p, db->depth);
+	p = putproofval (p, db->nnodes[NONLEAF]);
+	p = putproofval (p, db->nnodes[ISLEAF]);
+	memcpy (p, db->treehash, HASHSIZE);
+	SHA1_Init (&ctx);
+	SHA1_Update (&ctx, rec, DBROOTSIZE - SHA1_DIGEST_LENGTH);
+	SHA1_Final (rec + DBROOTSIZE - SHA1_DIGEST_LENGTH, &ctx);
+	if (pwrite (db->fdr, rec, DBROOTSIZE, (off_t)db->generation*DBROOTSIZE)
+			!= DBROOTSIZE)
+		return -1;
+#if !defined(_WIN32)
+	if (db->durable && fdatasync (db->fdr) < 0)
+		err = -1;
+#endif
+
+	++db->generation;
+	db->cowbase[NONLEAF] = db->nnodes[NONLEAF];
+	db->cowbase[ISLEAF] = db->nnodes[ISLEAF];
+	db->unpublished = 0;
+	return err;
+}
+
+/* Open the roots file, if there is one or we are to create it */
+static int
+dbcowopen (dbproof *db, char *name, int create)
+{
+	char *rootsname;
+
+	db->fdr = -1;
+	if ((rootsname = malloc (strlen(name) + 10)) == NULL)
+		return -1;
+	strcpy (rootsname, name);
+	strcat (rootsname, ".roots");
+	db->fdr = open (rootsname, O_RDWR | (create ? O_CREAT|O_TRUNC : 0), 0666);
+	free (rootsname);
+	if (db->fdr < 0)
+		return create ? -1 : 0;
+	db->cow = 1;
+	db->durable = usewal;
+	return 0;
+}
+
+/*
+ * Take up the last root published.  If there is none, the DB has just
+ * become copy-on-write, or its first root never made it out; publish
+ * the tree as it is.
+ */
+static int
+dbcowload (dbproof *db)
+{
+	innernode buf;
+	innernode *np;
+
+	if (dbreadroot (db, db->fdr, 0) == 0)
+	{
+		db->cowbase[NONLEAF] = db->nnodes[NONLEAF];
+		db->cowbase[ISLEAF] = db->nnodes[ISLEAF];
+		return 0;
+	}
+	if ((np = dbnodeptr (db, db->rootnode, NONLEAF, &buf)) == NULL)
+		return -1;
+	nodehash (db, db->treehash, np->key, np->childhash, ntohl (np->nkeys),
+		NONLEAF);
+	db->unpublished = 1;
+	return dbflush (db);
+}
+#else
+#define dbnodeplace(db,nodepos,isleaf)	\
+			dbnodeseek (db, nodepos, SEEK_SET, isleaf)
+#define dbreadroot(db,fdr,gen)		(-1)
+#define dbcowopen(db,name,create)	((db)->fdr = -1, 0)
+#define dbcowload(db)				(-1)
+#endif
+
+
+#if PROFILE
+/* Debugging */
+/* Was having some weird timing problems when rapidly filling the db */
+static struct timeval pt;
+static void
+ttime (struct timeval *tm, char *msg)
+{
+	struct timeval ct;
+
+	gettimeofday (&ct, NULL);
+	tm->tv_usec = ct.tv_usec - tm->tv_usec;
+	tm->tv_sec = ct.tv_sec - tm->tv_sec;
+	if (tm->tv_usec < 0)
+	{
+		tm->tv_usec += 1000000;
+		tm->tv_sec -= 1;
+	}
+	if (tm->tv_sec > 2)
+		printf ("Took %d.%03d seconds: %s\n", tm->tv_sec, tm->tv_usec/1000,msg);
+	*tm = ct;
+}
+#else
+#define ttime(a,b)
+#endif
+
+/*
+ * Return 1 if present, 0 if was absent.  If set is true, add it if absent.
+ * Also return *proof and *prooflen as a buffer (within proofdb) which proves
+ * our correctness.  Changes are left in the buffer pool.
+ */
+static int
+_testdbandmaybeset (dbproof *db, unsigned char **proof, unsigned *prooflen,
+	unsigned char *hash, int set)
+{
+	innernode n;
+	uchar splitkey[HASHSIZE];
+	uchar newnodehash[HASHSIZE];
+	uchar treehash[HASHSIZE];
+	int found;
+	int rootpos = db->rootnode;
+	int newnodenum;
+	int newtopnodenum;
+
+#if PROFILE
+timerclear(&pt);
+gettimeofday(&pt,NULL);
+#endif
+
+	/* Set things up for validity proof */
+	db->treedepth = db->depth;
+	db->nodeptr = (compnode *)db->nodeinfo;
+
+	/* Do the recursive search */
+	found = _testdbandmaybeset_node (db, &rootpos, treehash, hash, set,
+			0, &newnodenum, splitkey, newnodehash);
+	if (set && !found)
+	{
+		/* The root may have moved, if copy-on-write */
+		db->rootnode = rootpos;
+		memcpy (db->treehash, treehash, HASHSIZE);
+	}
+	if (!set || found || (newnodenum==0))
+	{
+		if (proof)
+			*proof = db->nodeinfo;
+		if (prooflen)
+			*prooflen = (uchar *)db->nodeptr - db->nodeinfo;
+		return found;
+	}
+
+	/* Must create new top node because old top filled up and split */
+	memset (&db->newnode, 0, INODESIZE);
+	memcpy (db->newnode.key[0], splitkey, HASHSIZE);
+	db->newnode.nkeys = htonl(1);
+	db->newnode.child[0] = htonl (db->rootnode);
+	db->newnode.child[1] = htonl (newnodenum);
+	memcpy (db->newnode.childhash[0], treehash, HASHSIZE);
+	memcpy (db->newnode.childhash[1], newnodehash, HASHSIZE);
+	++db->depth;
+	assert (db->depth <= MAXDEPTH);
+printf ("Splitting top node, increasing DB depth to %d\n", db->depth);
+
+	/* Write out new top node */
+	newtopnodenum = dbnodeseek (db, 0, SEEK_END, NONLEAF);
+ttime(&pt, "seek to end");
+	dbnodewrite (db, &db->newnode, NONLEAF);
+ttime(&pt, "write new node");
+	nodehash (db, db->treehash, db->newnode.key, db->newnode.childhash, 1,
+		NONLEAF);
+
+	/* Put its position in block 0, which publishing does if copy-on-write */
+	db->rootnode = newtopnodenum;
+	if (!db->cow)
+	{
+		dbheader (db, &n);
+		dbnodeseek (db, 0, SEEK_SET, NONLEAF);
+		dbnodewrite (db, &n, NONLEAF);
+	}
+
+	if (proof)
+		*proof = db->nodeinfo;
+	if (prooflen)
+		*prooflen = (uchar *)db->nodeptr - db->nodeinfo;
+
+	return 0;
+}
+
+/* The same, writing any changes back to the files */
+int
+testdbandmaybeset (dbproof *db, unsigned char **proof, unsigned *prooflen,
+	unsigned char *hash, int set)
+{
+	int found;
+
+	if (set && db->readonly)
+		return -1;
+	found = _testdbandmaybeset (db, proof, prooflen, hash, set);
+	dbflush (db);
+	return found;
+}
+
+/* Largest node record in a multi-key proof */
+#define MNODESIZE	(2*sizeof(unsigned) + MERKLEWIDTH/8 + \
+						(2*NODEKEYS+1)*HASHSIZE + (NODEKEYS+1)*sizeof(unsigned))
+
+/* Put a 4 byte network order value into a multi-key proof */
+static uchar *
+putproofval (uchar *p, unsigned val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+	return p + 4;
+}
+
+/*
+ * Put in out the hashes of the largest subtrees from lo to lo+width-1
+ * with none of the known items, left to right, as partialroot takes
+ * them.  Return how many there are; with out NULL just count them.
+ */
+static int
+merklestored (uchar *out, uchar **items, uchar *known, int nitems, int lo,
+	int width)
+{
+	int nleft;
+
+	if (lo >= nitems)
+		return 0;
+	if (!anyknown (known, nitems, lo, width))
+	{
+		if (out)
+			merkleroot (out, items, nitems, lo, width);
+		return 1;
+	}
+	if (width == 1)
+		return 0;
+	nleft = merklestored (out, items, known, nitems, lo, width/2);
+	return nleft + merklestored (out ? out+nleft*HASHSIZE : NULL, items,
+			known, nitems, lo+width/2, width/2);
+}
+
+/*
+ * Write the node data of a Merkle format node for a multi-key proof,
+ * with just the known items unless full is set or they and the subtree
+ * hashes would come to as much as all the items.
+ */
+static uchar *
+merkleproof_data (uchar *p, innernode *n, int nkeys, int isleaf,
+	uchar *known, int full)
+{
+	uchar *items[MERKLEWIDTH];
+	int nitems = NITEMS(nkeys,isleaf);
+	int nknown = 0;
+	int i;
+
+	nodeitems (items, n->key, n->childhash, nkeys, isleaf);
+	for (i=0; i<nitems; i++)
+		nknown += known[i];
+	if (full || nknown + merklestored (NULL, items, known, nitems, 0,
+			MERKLEWIDTH) >= nitems)
+		memset (known, 1, nitems);
+
+	memset (p, 0, MERKLEWIDTH/8);
+	for (i=0; i<nitems; i++)
+		if (known[i])
+			p[i/8] |= 0x80 >> (i%8);
+	p += MERKLEWIDTH/8;
+	for (i=0; i<nitems; i++)
+	{
+		if (known[i])
+		{
+			memcpy (p, items[i], HASHSIZE);
+			p += HASHSIZE;
+		}
+	}
+	return p + merklestored (p, items, known, nitems, 0, MERKLEWIDTH)*HASHSIZE;
+}
+
+/*
+ * Write the multi-key proof records for node nodepos and those of its
+ * children on the paths to the nk keys.  Return the new end of the
+ * proof, or NULL if out of memory or a node claims more than NODEKEYS
+ * keys.
+ *
+ * In a Merkle format DB a node only needs the keys around where each
+ * key goes and the childhash it follows.  But the card must have all
+ * of a node which gains a key, as that moves the items after it: any
+ * leaf which gets an insert, and any inner node with a child which
+ * could split.
+ */
+static uchar *
+multiproof_node (dbproof *db, int nodepos, int depth, uchar **keys, int nk,
+	uchar *p)
+{
+	innernode n;
+	innernode *np;
+	uchar known[MERKLEWIDTH];
+	uchar **sub;
+	uchar *pnchild;
+	int *keyind;
+	int isleaf = (depth+1 == db->depth);
+	int full = 0;
+	int nkeys;
+	int nchild = 0;
+	int nsub;
+	int c, i;
+
+	if ((keyind = malloc (nk * sizeof(int))) == NULL)
+		return NULL;
+	if ((sub = malloc (nk * sizeof(uchar *))) == NULL)
+	{
+		free (keyind);
+		return NULL;
+	}
+
+	np = dbnodeptr (db, nodepos, isleaf, &n);
+	assert (np != NULL);
+	if (ntohl(np->nkeys) > NODEKEYS)
+	{
+		free (sub);
+		free (keyind);
+		return NULL;
+	}
+	nkeys = ntohl(np->nkeys);
+
+	/* Find which child each key goes on to, or -1 if it stops here, */
+	/* and which items of this node show that */
+	memset (known, 0, sizeof(known));
+	for (i=0; i<nk; i++)
+	{
+		if (nodefindkey ((leafnode *)np, keys[i], &keyind[i]))
+		{
+			known[isleaf ? keyind[i] : 2*keyind[i]+1] = 1;
+			keyind[i] = -1;
+		} else if (isleaf) {
+			full = 1;
+			keyind[i] = -1;
+		} else {
+			if (keyind[i] > 0)
+				known[2*keyind[i]-1] = 1;
+			if (keyind[i] < nkeys)
+				known[2*keyind[i]+1] = 1;
+			known[2*keyind[i]] = 1;
+		}
+	}
+	for (c=0; db->format!=DBFORMAT_FLAT && !full && !isleaf && c<=nkeys; c++)
+	{
+		nsub = 0;
+		for (i=0; i<nk; i++)
+			if (keyind[i] == c)
+				nsub++;
+		if (nsub > 0 && dbnodenkeys (db, ntohl (np->child[c]),
+				depth+2 == db->depth) + nsub > NODEKEYS)
+			full = 1;
+	}
+
+	p = putproofval (p, nkeys);
+	pnchild = p;
+	p += 4;
+	if (db->format == DBFORMAT_FLAT)
+	{
+		memcpy (p, np->key[0], nkeys*HASHSIZE);
+		p += nkeys*HASHSIZE;
+		if (!isleaf)
+		{
+			memcpy (p, np->childhash[0], (nkeys+1)*HASHSIZE);
+			p += (nkeys+1)*HASHSIZE;
+		}
+	} else
+		p = merkleproof_data (p, np, nkeys, isleaf, known, full);
+	for (c=0; !isleaf && c<=nkeys; c++)
+	{
+		for (i=0; i<nk; i++)
+			if (keyind[i] == c)
+				break;
+		if (i < nk)
+		{
+			p = putproofval (p, c);
+			nchild++;
+		}
+	}
+	putproofval (pnchild, nchild);
+
+	/* Then the children, each with the keys which go to it */
+	for (c=0; p!=NULL && nchild>0 && c<=nkeys; c++)
+	{
+		nsub = 0;
+		for (i=0; i<nk; i++)
+			if (keyind[i] == c)
+				sub[nsub++] = keys[i];
+		if (nsub > 0)
+			p = multiproof_node (db, ntohl (np->child[c]), depth+1, sub, nsub, p);
+	}
+
+	free (sub);
+	free (keyind);
+	return p;
+}
+
+/*
+ * Test and set n hashes in turn, the ith one in dbs[i].  Like that many
+ * testdbandset calls from a card which gives up on finding one, we stop
+ * at the first hash present and leave those after it out.  The proof
+ * has a multi-key proof for each DB in the order they first appear,
+ * each preceded by its length as 4 bytes in network order and padded
+ * to a multiple of 4.  A multi-key proof holds each node on the paths
+ * to that DB's keys just once, as it was before the inserts; see
+ * validate_db_multi for the format.  The proof buffer belongs to
+ * dbs[0], so threads with DBs of their own can do this at once.
+ * Return 1 if a hash was present, 0 if not, or -1 if we can't get
+ * memory for the proof or a node is bad.
+ */
+int
+testdbandsetbatch (dbproof **dbs, int n, unsigned char **proof,
+	unsigned *prooflen, unsigned char *hashes)
+{
+	unsigned need = n * (sizeof(unsigned) + MAXDEPTH*MNODESIZE);
+	uchar **keys;
+	uchar *p;
+	uchar *q;
+	uchar *newbuf;
+	int nfound = 0;
+	int nk;
+	int i, j;
+
+	for (i=0; i<n; i++)
+		if (dbs[i]->readonly)
+			return -1;
+	if (need > dbs[0]->proofbufsize)
+	{
+		if ((newbuf = realloc (dbs[0]->proofbuf, need)) == NULL)
+			return -1;
+		dbs[0]->proofbuf = newbuf;
+		dbs[0]->proofbufsize = need;
+	}
+	if ((keys = malloc (n * sizeof(uchar *))) == NULL)
+		return -1;
+
+	/* First the proofs, from the DBs as they are now */
+	p = dbs[0]->proofbuf;
+	for (i=0; i<n; i++)
+	{
+		for (j=0; j<i; j++)
+			if (dbs[j] == dbs[i])
+				break;
+		if (j < i)
+			continue;
+		nk = 0;
+		for (j=i; j<n; j++)
+			if (dbs[j] == dbs[i])
+				keys[nk++] = hashes+j*HASHSIZE;
+		q = multiproof_node (dbs[i], dbs[i]->rootnode, 0, keys, nk, p+4);
+		if (q == NULL)
+		{
+			free (keys);
+			return -1;
+		}
+		putproofval (p, q - (p+4));
+		while ((q - dbs[0]->proofbuf) % 4 != 0)
+			*q++ = 0;
+		p = q;
+	}
+	free (keys);
+
+	/* Then do the inserts in order, writing each DB back once */
+	for (i=0; i<n && nfound==0; i++)
+		nfound += _testdbandmaybeset (dbs[i], NULL, NULL,
+				hashes+i*HASHSIZE, 1);
+	for (i=0; i<n; i++)
+		dbflush (dbs[i]);
+
+	*proof = dbs[0]->proofbuf;
+	*prooflen = p - dbs[0]->proofbuf;
+	return nfound;
+}
+
+/* Return true if key is in the DB */
+static int
+dblookup (dbproof *db, uchar *key)
+{
+	innernode buf;
+	innernode *np;
+	int nodepos = db->rootnode;
+	int keyind;
+	int depth;
+
+	for (depth=0; depth<db->depth; depth++)
+	{
+		np = dbnodeptr (db, nodepos, depth+1 == db->depth, &buf);
+		assert (np != NULL);
+		if (nodefindkey ((leafnode *)np, key, &keyind))
+			return 1;
+		if (depth+1 < db->depth)
+			nodepos = ntohl (np->child[keyind]);
+	}
+	return 0;
+}
+
+/*
+ * Look up n hashes without changing anything, setting found[i] for
+ * each, and return a multi-key proof of that from the DB as it is, in
+ * the form of one DB's part of a testdbandsetbatch proof.  The proof
+ * buffer belongs to db, so threads with their own snapshots can do
+ * this at once.  Return the number found, -1 if out of memory or a
+ * node is bad.
+ */
+int
+testdbprove (dbproof *db, int n, unsigned char **proof, unsigned *prooflen,
+	unsigned char *hashes, int *found)
+{
+	unsigned need = 4 + n * MAXDEPTH*MNODESIZE + 4;
+	uchar **keys;
+	uchar *newbuf;
+	uchar *q;
+	int nfound = 0;
+	int i;
+
+	if (need > db->proofbufsize)
+	{
+		if ((newbuf = realloc (db->proofbuf, need)) == NULL)
+			return -1;
+		db->proofbuf = newbuf;
+		db->proofbufsize = need;
+	}
+	if ((keys = malloc (n * sizeof(uchar *))) == NULL)
+		return -1;
+	for (i=0; i<n; i++)
+		keys[i] = hashes + i*HASHSIZE;
+	q = multiproof_node (db, db->rootnode, 0, keys, n, db->proofbuf+4);
+	free (keys);
+	if (q == NULL)
+		return -1;
+	putproofval (db->proofbuf, q - (db->proofbuf+4));
+	while ((q - db->proofbuf) % 4 != 0)
+		*q++ = 0;
+	for (i=0; i<n; i++)
+		nfound += (found[i] = dblookup (db, hashes + i*HASHSIZE));
+	*proof = db->proofbuf;
+	*prooflen = q - db->proofbuf;
+	return nfound;
+}
+
+/*
+ * Search the tree starting at the node with number nodepos.  Return 1
+ * if newhash is found, 0 if it was not found.  If it was not found and
+ * set is true, insert it in the tree.  Insertion may require node
+ * splitting.  If that happens, we set *pnewnodenum to the number of the
+ * new node (which will be the right sibling of the existing node).
+ * We set splitkey to be the key at which we split, the middle key, which
+ * is supposed to move up into the parent node.  And we set newnodehash
+ * to be the hash of the new node.  Also if we made a change to the
+ * existing node, we set thisnodehash to the new hash of the node.
+ */
+static int
+_testdbandmaybeset_node (dbproof *db, int *pnodepos, uchar *thisnodehash, 
+	uchar *newhash, int set, int depth, int *pnewnodenum, uchar *splitkey,
+	uchar *newnodehash)
+{
+	innernode n;
+	innernode *np;
+	int nodepos = *pnodepos;
+	int childpos;
+	int keyind;
+	int nkeys;
+	int found;
+	int isleaf = (depth+1 == db->depth);
+
+	/* Look at the node in place, and copy it only if we may change it */
+	np = dbnodeptr (db, nodepos, isleaf, &n);
+	assert (np != NULL);
+ttime(&pt, "first read");
+
+	nkeys = ntohl(np->nkeys);
+	found = nodefindkey ((leafnode *)np, newhash, &keyind);
+
+	/* Save data in nodeinfo chain for later proof of correctness */
+	db->nodeptr->nkeys = htonl(nkeys);
+	db->nodeptr->keyind = htonl(keyind);
+	memcpy (db->nodeptr->hashdata[0], np->key[0], nkeys*HASHSIZE);
+	if (!isleaf)
+	{
+		memcpy (db->nodeptr->hashdata[nkeys], np->childhash[0],
+					(nkeys+1)*HASHSIZE);
+	}
+	db->nodeptr = (compnode *)((uchar *)db->nodeptr + CNODESIZE(nkeys,isleaf));
+
+	if (found)
+	{
+		return 1;
+	}
+	if (set && np != &n)
+		memcpy (&n, np, isleaf ? LNODESIZE : INODESIZE);
+
+	if (isleaf)
+	{
+		/* Done, unfound, if not inserting */
+		if (!set)
+			return 0;
+
+		/* Leaf node, just add data */
+		memmove (n.key[keyind+1], n.key[keyind], (nkeys-keyind)*HASHSIZE);
+		memcpy (n.key[keyind], newhash, HASHSIZE);
+		++nkeys;
+	} else {
+		/* Traverse the tree */
+		childpos = ntohl (np->child[keyind]);
+		assert (childpos != 0);
+		*pnewnodenum = 0;
+		found = _testdbandmaybeset_node (db, &childpos, n.childhash[keyind],
+			newhash, set, depth+1, pnewnodenum, splitkey, newnodehash);
+
+		if (!set || found)
+			return found;
+
+		/* The child may have moved, if copy-on-write */
+		n.child[keyind] = htonl (childpos);
+
+		if (*pnewnodenum == 0)
+		{
+			/* No split below us, just write out with our updated hash */
+			*pnodepos = dbnodeplace (db, nodepos, isleaf);
+	ttime(&pt, "lseek for hash propagate");
+			dbnodewrite (db, &n, isleaf);
+	ttime(&pt, "write for hash propagate");
+
+			/* And update our parent's hash */
+			nodehash (db, thisnodehash, n.key, isleaf ? NULL : n.childhash,
+				nkeys, isleaf);
+			return 0;
+		}
+
+		/* Child did a split, newnode is to the right of the old one */
+		memmove (n.key[keyind+1], n.key[keyind], (nkeys-keyind)*HASHSIZE);
+		memcpy (n.key[keyind], splitkey, HASHSIZE);
+		memmove (n.childhash[keyind+2], n.childhash[keyind+1],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (n.childhash[keyind+1], newnodehash, HASHSIZE);
+		memmove (n.child+keyind+2, n.child+keyind+1,
+				(nkeys-keyind)*sizeof(n.child[0]));
+		n.child[keyind+1] = htonl(*pnewnodenum);
+		++nkeys;
+	}
+
+	/* Now split our node if it is too full */
+	/* We move one key up (to splitkey) and put NODEKEYS/2 in this one and */
+	/* the new one.  The new node gets the higher value keys and is the */
+	/* right sibling of the existing node. */
+	if (nkeys > NODEKEYS)
+	{
+		assert (nkeys == NODEKEYS+1);
+		memset (&db->newnode, 0, INODESIZE);
+		memcpy (splitkey, n.key[NODEKEYS/2], HASHSIZE);
+		memcpy (db->newnode.key[0], n.key[NODEKEYS/2+1], (NODEKEYS/2)*HASHSIZE);
+		memset (n.key[NODEKEYS/2], 0, (NODEKEYS/2+1)*HASHSIZE);
+		if (!isleaf)
+		{
+			memcpy (db->newnode.childhash[0], n.childhash[NODEKEYS/2+1],
+				(NODEKEYS/2+1) * HASHSIZE);
+			memcpy (db->newnode.child, n.child+NODEKEYS/2+1,
+				(NODEKEYS/2+1) * sizeof(n.child[0]));
+			memset (n.childhash[NODEKEYS/2+1], 0, (NODEKEYS/2+1)*HASHSIZE);
+			memset (n.child+NODEKEYS/2+1, 0,
+				(NODEKEYS/2+1)*sizeof(n.child[0]));
+		}
+		db->newnode.nkeys = n.nkeys = htonl(NODEKEYS/2);
+
+		/* Write the old node first, then the new one */
+		*pnodepos = dbnodeplace (db, nodepos, isleaf);
+ttime(&pt, "lseek for rewrite");
+		dbnodewrite (db, &n, isleaf);
+ttime(&pt, "rewrite");
+		*pnewnodenum = dbnodeseek (db, 0, SEEK_END, isleaf);
+ttime(&pt, "seek to end");
+		dbnodewrite (db, &db->newnode, isleaf);
+ttime(&pt, "write new node");
+
+		/* And update parent's hashes */
+		nodehash (db, thisnodehash, n.key, isleaf ? NULL : n.childhash,
+			NODEKEYS/2, isleaf);
+		nodehash (db, newnodehash, db->newnode.key,
+			isleaf ? NULL : db->newnode.childhash, NODEKEYS/2, isleaf);
+	}
+	else
+	{
+		/* No split needed, just write the old node */
+		*pnewnodenum = 0;		/* Flag that no splits were done here */
+		n.nkeys = htonl(nkeys);
+		*pnodepos = dbnodeplace (db, nodepos, isleaf);
+ttime(&pt, "lseek for rewrite");
+		dbnodewrite (db, &n, isleaf);
+ttime(&pt, "rewrite");
+
+		/* And update parent hash */
+		nodehash (db, thisnodehash, n.key, isleaf ? NULL : n.childhash,
+			nkeys, isleaf);
+	}
+
+	return 0;
+}
+
+
+/* Hash the given node key and childhash data (if nonleaf) and return result */
+static void
+nodedatahash (uchar *hash, uchar *key, uchar *childhash, int nkeys, int isleaf)
+{
+	uchar md[SHA1_DIGEST_LENGTH];
+	uchar nnkeys[4];
+	SHA_CTX ctx;
+
+	nnkeys[0] = nkeys >> 24;
+	nnkeys[1] = nkeys >> 16;
+	nnkeys[2] = nkeys >> 8;
+	nnkeys[3] = nkeys;
+	SHA1_Init (&ctx);
+	SHA1_Update (&ctx, nnkeys, sizeof(nnkeys));
+	SHA1_Update (&ctx, key, nkeys*HASHSIZE);
+	if (!isleaf)
+		SHA1_Update (&ctx, childhash, (1+nkeys)*HASHSIZE);
+	SHA1_Final (md, &ctx);
+	memcpy (hash, md, HASHSIZE);
+}
+
+/*
+ * Compute 128 bit hash of node keys and their subtrees.  Leaves have no
+ * childhashes, and pass NULL for them.
+ */
+static void
+nodehash (dbproof *db, uchar *hash, uchar (*key)[HASHSIZE],
+	uchar (*childhash)[HASHSIZE], int nkeys, int isleaf)
+{
+	uchar *items[MERKLEWIDTH];
+	uchar root[HASHSIZE];
+
+	if (db->format == DBFORMAT_FLAT)
+	{
+		nodedatahash (hash, key[0], isleaf ? NULL : childhash[0], nkeys,
+			isleaf);
+		return;
+	}
+	nodeitems (items, key, childhash, nkeys, isleaf);
+	merkleroot (root, items, NITEMS(nkeys,isleaf), 0, MERKLEWIDTH);
+	merklenodehash (hash, root, nkeys);
+}
+
+
+
+/*****************************  VALIDATE  *******************************/
+
+
+/*
+
+The idea here is that an untrusted system can maintain the DB, and provide
+evidence to a second system as to whether any given item is found or not
+(and added if missing).  The second system maintains a hash over the
+whole DB, following the btree structure.  It checks the returned evidence
+data against the hash to make sure it matches, verifies that the evidence
+does in fact prove presence or absence, and if adding, independently
+calculates the updated hash, using an algorithm that mirrors that done on
+the untrusted system.
+
+*/
+
+
+int _validate_db_node (int *found, compnode *node, int nilen,
+	uchar *thisnodehash, uchar *newhash, int depth, int maxdepth, int set,
+	int *splitflag, uchar *splitkey, uchar *newnodehash);
+
+/*
+ * Return true if valid, false if not.  Return *found as true if we found
+ * the data item (if we are returning valid).
+ * Update treehash if set is true and not found (and valid).
+ */
+int
+validate_db_operation (uchar *treehash, int *found, compnode *nodeinfo,
+	int nilen, int *maxdepth, uchar *newhash, int set)
+{
+	int valid;
+	int splitflag;
+	uchar splitkey[HASHSIZE];
+	uchar newnodehash[HASHSIZE];
+	uchar topchild[2][HASHSIZE];
+
+/*
 	First test: that each node either matches newhash on key[keyind] (in which
 	case it is found) or else newhash is between key[keyind] and key[keyind+1]
 	(or if keyind == nkeys-1 then newhash is above key[keyind]).
 
-	Second test: that hashing each node produces the parent childhash field.
+	Second test: that hashing each node produces the parent childhash field.
+
+	Third test: that hashing the root node produces our saved treehash.
+
+	Given all these three tests, we validate the presence/absence of the
+	item.  If found, or if set is false, we are done.
+
+	Otherwise we have to do updates and ultimately we are updating treehash.
+	To do the updates we insert the new node data where it should go, and
+	split the node if necessary.
+
+	For recursive testing, first check the tree hash at the top level.
+	Then at each level first test the keyind value, then test the childhash
+	of the next level (if recursing).  I.e. before recursing check the
+	childhash to make sure it is as expected.  Thus we validate each data
+	before trusting it.
+*/
+
+	*found = 0;
+	splitflag = 0;
+
+	valid = _validate_db_node (found, nodeinfo, nilen, treehash, newhash, 0,
+		*maxdepth, set, &splitflag, splitkey, newnodehash);
+
+	if (!valid)
+		return 0;
+
+	if (!set || *found || (splitflag==0))
+		return 1;
+
+	/* Must create new top node because old top filled up and split */
+	/* Top node has only one item, the splitkey, and two hashes */
+	/* We only need to update the treehash from it */
+	memcpy (topchild[0], treehash, HASHSIZE);
+	memcpy (topchild[1], newnodehash, HASHSIZE);
+	nodedatahash (treehash, splitkey, topchild[0], 1, NONLEAF);
+
+	++(*maxdepth);
+
+	return 1;
+}
+
+int
+_validate_db_node (int *found, compnode *node, int nilen, uchar *thisnodehash,
+	uchar *newhash, int depth, int maxdepth, int set, int *splitflag,
+	uchar *splitkey, uchar *newnodehash)
+{
+	uchar hash[HASHSIZE];
+	uchar growkey[NODEKEYS+1][HASHSIZE];	/* Room to expand our node */
+	uchar growchild[NODEKEYS+2][HASHSIZE];
+	uchar *childnodehash;
+	compnode *childnode;
+	int valid;
+	int comp;
+	int nkeys;
+	int keyind;
+	int nodesize;
+	int isleaf = (depth+1 == maxdepth);
+
+	/* Pick up values from compnode */
+	if (nilen < sizeof(int))
+		return 0;
+	nkeys = ntohl (node->nkeys);
+	if (nkeys < 0 || nkeys > NODEKEYS)
+		return 0;
+	nodesize = CNODESIZE(nkeys, isleaf);
+	if (nilen < nodesize || (isleaf && (nilen != nodesize)))
+		return 0;
+	keyind = ntohl (node->keyind);
+	if (keyind < 0 || keyind > nkeys)
+		return 0;
+
+	/* Verify that this node's data matches expected hash */
+	nodedatahash (hash, node->hashdata[0], node->hashdata[nkeys],
+			nkeys, isleaf);
+	if (memcmp (hash, thisnodehash, HASHSIZE) != 0)
+		return 0;
+
+	/* Validate that keyind is correct */
+	if (keyind < nkeys)
+	{
+		comp = keycomp (newhash, node->hashdata[keyind]);
+		if (comp == 0)
+		{
+			*found = 1;
+			return 1;
+		}
+		if (comp > 0)
+			return 0;
+	}
+	if (keyind > 0)
+	{
+		comp = keycomp (newhash, node->hashdata[keyind-1]);
+		if (comp <= 0)
+			return 0;
+	}
+
+	if (isleaf)
+	{
+		/* Done, unfound, if not inserting */
+		if (!set)
+		{
+			*found = 0;
+			return 1;
+		}
+
+		/* Leaf node, just add the data */
+		memcpy (growkey[0], node->hashdata[0], keyind*HASHSIZE);
+		memcpy (growkey[keyind], newhash, HASHSIZE);
+		memcpy (growkey[keyind+1], node->hashdata[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		++nkeys;
+	} else {
+		/* Recurse */
+		*splitflag = 0;
+		childnode = (compnode *)((uchar *)node + nodesize);
+		childnodehash = node->hashdata[nkeys+keyind];	/* childhash field */
+		valid = _validate_db_node (found, childnode, nilen-nodesize,
+			childnodehash, newhash, depth+1, maxdepth, set, splitflag,
+			splitkey, newnodehash);
+
+		if (!valid)
+			return 0;
+
+		if (!set || *found)
+			return 1;
+
+		if (*splitflag == 0)
+		{
+			/* No split below us, just update our changed hash upwards */
+			nodedatahash (thisnodehash, node->hashdata[0],
+				node->hashdata[nkeys], nkeys, isleaf);
+			return 1;
+		}
+
+		/* Child did a split, new node is to right of old one */
+		memcpy (growkey[0], node->hashdata[0], keyind*HASHSIZE);
+		memcpy (growkey[keyind], splitkey, HASHSIZE);
+		memcpy (growkey[keyind+1], node->hashdata[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (growchild[0], node->hashdata[nkeys+0], (keyind+1)*HASHSIZE);
+		memcpy (growchild[keyind+1], newnodehash, HASHSIZE);
+		memcpy (growchild[keyind+2], node->hashdata[nkeys+keyind+1],
+					(nkeys-keyind)*HASHSIZE);
+		++nkeys;
+	}
+
+	/* Now split our node if it is too full */
+	/* We move one key up (to splitkey) and put NODEKEYS/2 in this one and */
+	/* the new one.  The new node gets the higher value keys and is the */
+	/* right sibling of the existing node. */
+	if (nkeys > NODEKEYS)
+	{
+		assert (nkeys == NODEKEYS+1);
+		memcpy (splitkey, growkey[NODEKEYS/2], HASHSIZE);
+		nkeys = NODEKEYS/2;
+		*splitflag = 1;
+
+		/* Now hash the split data into the two parent fields */
+		nodedatahash (thisnodehash, growkey[0], growchild[0], nkeys, isleaf);
+		nodedatahash (newnodehash, growkey[nkeys+1], growchild[nkeys+1],
+				nkeys, isleaf);
+	} else {
+		/* No split was done, just update parent hash */
+		*splitflag = 0;
+		nodedatahash (thisnodehash, growkey[0], growchild[0], nkeys, isleaf);
+	}
+
+	return 1;
+}
+
+/*
+ * Multi-key proofs.  For a batch of keys in one DB the host sends
+ * just the nodes on the paths to all of them, each node once, as the
+ * tree was before any of the inserts.  They come in preorder, each as
+ *   nkeys, nchild, node data, then the indices of the nchild children
+ *   which come next
+ * with counts and indices as 4 bytes in network order.  In a flat
+ * format DB the node data is the nkeys keys and, for inner nodes, the
+ * nkeys+1 childhashes.  In a Merkle format DB it is a bitmap of which
+ * Merkle items are present, MERKLEWIDTH bits starting with the high
+ * bit of the first byte, then those items in order, then the hashes
+ * of the largest subtrees with no items present, left to right.
+ *
+ * We rebuild that part of the tree, check it against the treehash,
+ * run the inserts on it ourselves just as the host does on the whole
+ * tree, and then hash our way back up to the new treehash once.  A
+ * node which gains a key must have come with all its items.
+ */
+
+/* A node of the partial tree from a multi-key proof */
+typedef struct pnode {
+	int nkeys;
+	int dirty;
+	int full;						/* Have all keys and childhashes */
+	uchar key[NODEKEYS+1][HASHSIZE];
+	uchar childhash[NODEKEYS+2][HASHSIZE];
+	struct pnode *child[NODEKEYS+2];
+	uchar known[MERKLEWIDTH];		/* Merkle items we have, if not full */
+	uchar *stored;					/* Hashes for the rest of the tree */
+	int nstored;
+} pnode;
+
+static void
+pnode_free (pnode *pn)
+{
+	int i;
+
+	if (pn == NULL)
+		return;
+	for (i=0; i<NODEKEYS+2; i++)
+		pnode_free (pn->child[i]);
+	free (pn->stored);
+	free (pn);
+}
+
+/* Read a 4 byte network order value from the proof */
+static int
+getproofval (uchar **pp, uchar *end, unsigned *val)
+{
+	uchar *p = *pp;
+
+	if (end - p < 4)
+		return 0;
+	*val = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	*pp = p + 4;
+	return 1;
+}
+
+/* Compute the hash of a partial tree node */
+static void
+pnode_hash (uchar *hash, pnode *pn, int isleaf, int format)
+{
+	uchar *items[MERKLEWIDTH];
+	uchar root[HASHSIZE];
+	uchar *stored = pn->stored;
+
+	if (format == DBFORMAT_FLAT)
+	{
+		nodedatahash (hash, pn->key[0], pn->childhash[0], pn->nkeys, isleaf);
+		return;
+	}
+	nodeitems (items, pn->key, pn->childhash, pn->nkeys, isleaf);
+	if (pn->full)
+		merkleroot (root, items, NITEMS(pn->nkeys,isleaf), 0, MERKLEWIDTH);
+	else
+		partialroot (root, items, pn->known, NITEMS(pn->nkeys,isleaf), 0,
+				MERKLEWIDTH, &stored, pn->stored + pn->nstored*HASHSIZE);
+	merklenodehash (hash, root, pn->nkeys);
+}
+
+/* Read the node data of a Merkle format node, and check its hash */
+static int
+pnode_readmerkle (pnode *pn, uchar **pp, uchar *end, uchar *hash, int isleaf)
+{
+	uchar *items[MERKLEWIDTH];
+	uchar root[HASHSIZE];
+	uchar thishash[HASHSIZE];
+	uchar *stored;
+	int nitems = NITEMS(pn->nkeys,isleaf);
+	int i;
+
+	if (end - *pp < MERKLEWIDTH/8)
+		return 0;
+	pn->full = 1;
+	for (i=0; i<MERKLEWIDTH; i++)
+	{
+		pn->known[i] = ((*pp)[i/8] >> (7 - i%8)) & 1;
+		if (pn->known[i] && i >= nitems)
+			return 0;
+		if (!pn->known[i] && i < nitems)
+			pn->full = 0;
+	}
+	*pp += MERKLEWIDTH/8;
+
+	nodeitems (items, pn->key, pn->childhash, pn->nkeys, isleaf);
+	for (i=0; i<nitems; i++)
+	{
+		if (!pn->known[i])
+			continue;
+		if (end - *pp < HASHSIZE)
+			return 0;
+		memcpy (items[i], *pp, HASHSIZE);
+		*pp += HASHSIZE;
+	}
+
+	stored = *pp;
+	if (!partialroot (root, items, pn->known, nitems, 0, MERKLEWIDTH,
+			pp, end))
+		return 0;
+	pn->nstored = (*pp - stored) / HASHSIZE;
+	if (pn->nstored > 0)
+	{
+		if ((pn->stored = malloc (pn->nstored * HASHSIZE)) == NULL)
+			return 0;
+		memcpy (pn->stored, stored, pn->nstored * HASHSIZE);
+	}
+	merklenodehash (thishash, root, pn->nkeys);
+	return memcmp (thishash, hash, HASHSIZE) == 0;
+}
+
+/*
+ * Rebuild a node and those of its children which follow it, checking
+ * each against the hash its parent has for it.  Return NULL if invalid.
+ */
+static pnode *
+pnode_read (uchar **pp, uchar *end, uchar *hash, int depth, int maxdepth,
+	int format)
+{
+	pnode *pn;
+	uchar thishash[HASHSIZE];
+	unsigned ind[NODEKEYS+1];
+	unsigned nkeys;
+	unsigned nchild;
+	int isleaf = (depth+1 == maxdepth);
+	int i;
+
+	if (depth >= maxdepth)
+		return NULL;
+	if (!getproofval (pp, end, &nkeys) || !getproofval (pp, end, &nchild))
+		return NULL;
+	if (nkeys > NODEKEYS || nchild > (isleaf ? 0 : nkeys+1))
+		return NULL;
+	if ((pn = calloc (1, sizeof(pnode))) == NULL)
+		return NULL;
+	pn->nkeys = nkeys;
+
+	if (format == DBFORMAT_FLAT)
+	{
+		if (end - *pp < (isleaf ? nkeys : 2*nkeys+1) * HASHSIZE)
+			goto error;
+		pn->full = 1;
+		memcpy (pn->key[0], *pp, nkeys*HASHSIZE);
+		*pp += nkeys*HASHSIZE;
+		if (!isleaf)
+		{
+			memcpy (pn->childhash[0], *pp, (nkeys+1)*HASHSIZE);
+			*pp += (nkeys+1)*HASHSIZE;
+		}
+		pnode_hash (thishash, pn, isleaf, format);
+		if (memcmp (thishash, hash, HASHSIZE) != 0)
+			goto error;
+	} else if (!pnode_readmerkle (pn, pp, end, hash, isleaf))
+		goto error;
+
+	for (i=0; i<nchild; i++)
+	{
+		if (!getproofval (pp, end, &ind[i]) || ind[i] > nkeys
+				|| (i > 0 && ind[i] <= ind[i-1])
+				|| !(pn->full || pn->known[2*ind[i]]))
+			goto error;
+	}
+	for (i=0; i<nchild; i++)
+	{
+		pn->child[ind[i]] = pnode_read (pp, end, pn->childhash[ind[i]],
+				depth+1, maxdepth, format);
+		if (pn->child[ind[i]] == NULL)
+			goto error;
+	}
+	return pn;
+
+error:
+	pnode_free (pn);
+	return NULL;
+}
+
+/*
+ * Look for newhash below pn, inserting it if absent, the same way the
+ * host does.  Return 1 if found, 0 if inserted, -1 if the proof lacked
+ * something we needed, -2 if out of memory.  If pn had to split, set
+ * *newnode to its new right sibling and splitkey to the key moving up.
+ */
+static int
+pnode_insert (pnode *pn, uchar *newhash, int depth, int maxdepth,
+	pnode **newnode, uchar *splitkey)
+{
+	pnode *nn;
+	pnode *childnew;
+	int isleaf = (depth+1 == maxdepth);
+	int nkeys = pn->nkeys;
+	int keyind;
+	int comp = 1;
+	int rslt;
+
+	/* Find the first key we have which is not below newhash */
+	*newnode = NULL;
+	if (pn->full)
+		comp = !keysearch (pn->key, nkeys, newhash, &keyind);
+	else
+	{
+		for (keyind=0; keyind<nkeys; keyind++)
+		{
+			if (!pn->known[isleaf ? keyind : 2*keyind+1])
+				continue;
+			if ((comp = keycomp (newhash, pn->key[keyind])) <= 0)
+				break;
+		}
+	}
+	if (comp == 0)
+		return 1;
+
+	/* Unless we have the key before, it might belong further down */
+	if (!pn->full && keyind > 0
+			&& !pn->known[isleaf ? keyind-1 : 2*keyind-1])
+		return -1;
+
+	if (isleaf)
+	{
+		if (!pn->full)
+			return -1;
+		memmove (pn->key[keyind+1], pn->key[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (pn->key[keyind], newhash, HASHSIZE);
+	} else {
+		if (pn->child[keyind] == NULL)
+			return -1;
+		rslt = pnode_insert (pn->child[keyind], newhash, depth+1, maxdepth,
+				&childnew, splitkey);
+		if (rslt != 0)
+			return rslt;
+		pn->dirty = 1;
+		if (childnew == NULL)
+			return 0;
+
+		/* Child did a split, new node is to right of old one */
+		if (!pn->full)
+			return -1;
+		memmove (pn->key[keyind+1], pn->key[keyind],
+				(nkeys-keyind)*HASHSIZE);
+		memcpy (pn->key[keyind], splitkey, HASHSIZE);
+		memmove (pn->childhash[keyind+2], pn->childhash[keyind+1],
+				(nkeys-keyind)*HASHSIZE);
+		memmove (pn->child+keyind+2, pn->child+keyind+1,
+				(nkeys-keyind)*sizeof(pn->child[0]));
+		pn->child[keyind+1] = childnew;
+	}
+	pn->nkeys = ++nkeys;
+	pn->dirty = 1;
+
+	/* Split the same way as the host, new node gets the higher keys */
+	if (nkeys > NODEKEYS)
+	{
+		if ((nn = calloc (1, sizeof(pnode))) == NULL)
+			return -2;
+		memcpy (splitkey, pn->key[NODEKEYS/2], HASHSIZE);
+		memcpy (nn->key[0], pn->key[NODEKEYS/2+1], (NODEKEYS/2)*HASHSIZE);
+		if (!isleaf)
+		{
+			memcpy (nn->childhash[0], pn->childhash[NODEKEYS/2+1],
+				(NODEKEYS/2+1) * HASHSIZE);
+			memcpy (nn->child, pn->child+NODEKEYS/2+1,
+				(NODEKEYS/2+1) * sizeof(pn->child[0]));
+			memset (pn->child+NODEKEYS/2+1, 0,
+				(NODEKEYS/2+1) * sizeof(pn->child[0]));
+		}
+		pn->nkeys = nn->nkeys = NODEKEYS/2;
+		nn->full = 1;
+		nn->dirty = 1;
+		*newnode = nn;
+	}
+	return 0;
+}
+
+/* Recompute the hashes of changed nodes, from the bottom up */
+static void
+pnode_rehash (pnode *pn, uchar *hash, int depth, int maxdepth, int format)
+{
+	int isleaf = (depth+1 == maxdepth);
+	int i;
+
+	if (!isleaf)
+	{
+		for (i=0; i<=pn->nkeys; i++)
+		{
+			if (pn->child[i] != NULL && pn->child[i]->dirty)
+				pnode_rehash (pn->child[i], pn->childhash[i], depth+1,
+						maxdepth, format);
+		}
+	}
+	pnode_hash (hash, pn, isleaf, format);
+	pn->dirty = 0;
+}
+
+/*
+ * Check a multi-key proof for the n keys in newhash[] and do their
+ * inserts, in order up to the first key found.  Return 1 if valid,
+ * setting found[i] for each key, 0 after the first found, and
+ * updating treehash and maxdepth.  Return 0 if invalid, -1 if out of
+ * memory, leaving treehash and maxdepth alone.
+ */
+static int
+validate_db_multi (uchar *treehash, int *found, uchar *proof, int prooflen,
+	int *maxdepth, uchar **newhash, int n, int format)
+{
+	pnode *root;
+	pnode *nn;
+	pnode *top;
+	uchar *p = proof;
+	uchar splitkey[HASHSIZE];
+	int depth = *maxdepth;
+	int valid = 1;
+	int rslt;
+	int i;
+
+	root = pnode_read (&p, proof+prooflen, treehash, 0, depth, format);
+	if (root == NULL)
+		return 0;
+	if (p != proof+prooflen)
+		valid = 0;
+
+	for (i=0; i<n; i++)
+		found[i] = 0;
+	for (i=0; valid==1 && i<n; i++)
+	{
+		rslt = pnode_insert (root, newhash[i], 0, depth, &nn, splitkey);
+		if (rslt < 0)
+		{
+			valid = (rslt == -1) ? 0 : -1;
+			break;
+		}
+		found[i] = rslt;
+		if (rslt)
+			break;			/* No inserts after the first found */
+		if (nn == NULL)
+			continue;
+
+		/* Top node split, make a new one over it and the new node */
+		if ((top = calloc (1, sizeof(pnode))) == NULL)
+		{
+			pnode_free (nn);
+			valid = -1;
+			break;
+		}
+		top->nkeys = 1;
+		memcpy (top->key[0], splitkey, HASHSIZE);
+		top->child[0] = root;
+		top->child[1] = nn;
+		top->full = 1;
+		top->dirty = 1;
+		root = top;
+		depth++;
+	}
+
+	if (valid == 1 && root->dirty)
+	{
+		pnode_rehash (root, treehash, 0, depth, format);
+		*maxdepth = depth;
+	}
+	pnode_free (root);
+	return valid;
+}
+
+
+/*
+ * Local test of a batch proof from testdbandsetbatch, for n hashes
+ * all in one DB of the given format.  Updates treehash and maxdepth as the remote host
+ * should, and sets found[i] for each hash.
+ */
+void
+testvalidbatch (void *proof, unsigned prooflen, uchar *treehash,
+		int *maxdepth, uchar *hashes, int n, int *found, int format)
+{
+	uchar **keys;
+	uchar *p = proof;
+	unsigned len;
+	int i;
+
+	keys = malloc (n * sizeof(uchar *));
+	for (i=0; i<n; i++)
+		keys[i] = hashes + i*HASHSIZE;
+	if (!getproofval (&p, (uchar *)proof+prooflen, &len)
+			|| UP4(len) != prooflen - 4
+			|| validate_db_multi (treehash, found, p, len, maxdepth,
+					keys, n, format) != 1)
+	{
+		fprintf (stderr, "Invalid validation\n");
+		exit (1);
+	}
+	free (keys);
+}
+
+/*
+ * Local test of the validity verification.
+ * Resets treehash and maxdepth just as the remote host should.
+ */
+void
+testvalid (void *proof, unsigned prooflen, uchar *treehash,
+		int *maxdepth, uchar *hash, int shouldbefound, int set)
+{
+	int valid;
+	int found;
+
+	valid = validate_db_operation (treehash, &found,
+		(compnode *)proof, prooflen, maxdepth, hash, set);
+
+	if (!valid)
+	{
+		fprintf (stderr, "Invalid validation\n");
+		exit (1);
+	}
+	if (found != shouldbefound)
+	{
+		fprintf (stderr, "Invalid foundness\n");
+		exit (1);
+	}
+}
+
+
+
+
+/*****************************  DEBUG  *******************************/
+
+/* For debugging */
+static void
+printnode (dbproof *db, int num, FILE *f, int depth)
+{
+	innernode n;
+	int i, j;
+	int isleaf = (depth+1 == db->depth);
+
+	memset (&n, 0, INODESIZE);
+	dbnodeseek (db, num, SEEK_SET, isleaf);
+	dbnoderead (db, &n, isleaf);
+	if (depth+1 == db->depth)
+	for (i=0; i<NODEKEYS; i++)
+	{
+		if (!isleaf)
+			printnode (db, ntohl(n.child[i]), f, depth+1);
+//		for (j=0; j<depth; j++)
+//			fprintf (f, " ");
+		for (j=0; j<HASHSIZE; j++)
+			fprintf (f, "%02x ", n.key[i][j]);
+		fprintf (f, "\n");
+	}
+	if (!isleaf)
+		printnode (db, ntohl(n.child[i]), f, depth+1);
+}
+
+void
+printdb (dbproof *db, FILE *f)
+{
+	innernode n;
+	uchar hash[HASHSIZE];
+	int rootpos;
+
+	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
+	dbnoderead (db, &n, NONLEAF);
+	dbreadheader (db, &n);
+	rootpos = db->rootnode;
+	printnode (db, rootpos, f, 0);
+}
+
+static int
+checknode (dbproof *db, uchar *hash, int nodenum, int depth)
+{
+	innernode n;
+	int i;
+	int isleaf = (depth+1 == db->depth);
+
+	memset (&n, 0, INODESIZE);
+	dbnodeseek (db, nodenum, SEEK_SET, isleaf);
+	dbnoderead (db, &n, isleaf);
+
+	for (i=0; i<=ntohl(n.nkeys); i++)
+	{
+		if (!isleaf)
+		{
+			if (n.child[i] == 0)
+				return -1;
+			if (checknode (db, hash, ntohl(n.child[i]), depth+1) < 0)
+				return -1;
+			if (memcmp (hash, n.childhash[i], HASHSIZE) != 0)
+				return -1;
+		}
+		if (i < ntohl(n.nkeys)-1)
+			if (keycomp (n.key[i], n.key[i+1]) >= 0)
+				return -1;
+	}
+
+	nodehash (db, hash, n.key, isleaf ? NULL : n.childhash, ntohl(n.nkeys),
+		isleaf);
+	return 0;
+}
+
+int
+checkdb (dbproof *db)
+{
+	innernode n;
+	uchar hash[HASHSIZE];
+	int rootpos;
+
+	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
+	dbnoderead (db, &n, NONLEAF);
+	dbreadheader (db, &n);
+	rootpos = db->rootnode;
+	return checknode (db, hash, rootpos, 0);
+}
+
+int
+testdb_depth (dbproof *db)
+{
+	return db->depth;
+}
+
+int
+testdb_format (dbproof *db)
+{
+	return db->format;
+}
+
+void
+dbsetmmap (int on)
+{
+#if !defined(_WIN32)
+	usemmap = on;
+#endif
+}
+
+void
+dbsetwal (int on)
+{
+#if !defined(_WIN32)
+	usewal = on;
+#endif
+}
+
+void
+dbsetcow (int on)
+{
+#if !defined(_WIN32)
+	usecow = on;
+#endif
+}
+
+long
+testdb_generation (dbproof *db, unsigned char *treehash)
+{
+	if (treehash)
+		memcpy (treehash, db->treehash, HASHSIZE);
+	return db->generation;
+}
+
+void
+testdb_cachestats (dbproof *db, struct dbcachestats *stats)
+{
+	*stats = db->stats;
+	stats->inner = db->ncached[NONLEAF];
+	stats->leaves = db->ncached[ISLEAF];
+}
+
+
+/*****************************  INIT  *******************************/
+
+
+static void
+initdb (dbproof *db)
+{
+	innernode ni;
+	leafnode nl;
+
+	/* First leaf node block is unused */
+	memset (&nl, 0, LNODESIZE);
+	dbnodewrite (db, (innernode *)&nl, ISLEAF);
+	/* First leaf node starts off empty */
+	dbnodewrite (db, (innernode *)&nl, ISLEAF);
+
+	/* Top inner node just points at root inner node */
+	/* And encodes depth in child[1] */
+	db->depth = 2;
+	db->rootnode = 1;
+	dbheader (db, &ni);
+	dbnodewrite (db, &ni, NONLEAF);
+	/* Root node will start pointing at leaf */
+	memset (&ni, 0, INODESIZE);
+	ni.child[0] = htonl (1);
+	nodehash (db, ni.childhash[0], nl.key, NULL, 0, ISLEAF);
+	dbnodewrite (db, &ni, NONLEAF);
+
+	/* Set top level hash for testing validation */
+	nodehash (db, db->treehash, ni.key, ni.childhash, 0, NONLEAF);
+	dbflush (db);
+}
+
+/* Map the node files if we were asked to */
+static void
+dbmapopen (dbproof *db)
+{
+#if !defined(_WIN32)
+	if (!usemmap)
+		return;
+	db->mmapped = 1;
+	if (dbmapgrow (db, NONLEAF, db->nnodes[NONLEAF]) < 0
+			|| dbmapgrow (db, ISLEAF, db->nnodes[ISLEAF]) < 0)
+		dbunmap (db);
+#endif
+}
+
+/*
+ * Open the database file of the specified name.
+ * Create it if it doesn't exist.
+ */
+dbproof *
+opendb (char *name, int *created)
+{
+	dbproof *db = (dbproof *)calloc (1, sizeof (dbproof));
+	char *leafname = (char *)malloc (strlen(name) + 10);
+	int flags = O_RDWR;
+
+	crcinit ();
+	db->fdw = db->fdr = -1;
+
+#if defined(_WIN32)
+	flags |= O_BINARY;
+#endif
+
+	strcpy (leafname, name);
+	strcat (leafname, ".vals");
+
+	if ((db->fdi = open (name, flags, 0)) >= 0 &&
+		(db->fdl = open (leafname, flags, 0)) >= 0)
+	{
+		innernode n;
+		free (leafname);
+		if (created)
+			*created = 0;
+		/* Don't touch nodes laid out other than as ours are */
+		if (dbnodeio (db, 0, &n, NONLEAF, 0) != INODESIZE
+				|| dbreadheader (db, &n) < 0)
+		{
+			fprintf (stderr, "DB %s is not a version %d DB with %d keys "
+					"per node; see dbconvert\n", name, DBVERSION, NODEKEYS);
+			close (db->fdl);
+			close (db->fdi);
+			free (db);
+			return NULL;
+		}
+		if (dbcowopen (db, name, 0) < 0)
+			fprintf (stderr, "Unable to open roots of DB %s\n", name);
+		if (!db->cow && dbwalopen (db, name, 0) < 0)
+			fprintf (stderr, "Unable to recover DB %s from its log\n", name);
+		db->nnodes[NONLEAF] = lseek (db->fdi, 0, SEEK_END) / INODESIZE;
+		db->nnodes[ISLEAF] = lseek (db->fdl, 0, SEEK_END) / LNODESIZE;
+		dbmapopen (db);
+		/* The log may have changed the header */
+		dbnodeseek (db, 0, SEEK_SET, NONLEAF);
+		if (dbnoderead (db, &n, NONLEAF))
+			dbreadheader (db, &n);
+		/* Any log has been applied, so we can leave it behind */
+		if (!db->cow && usecow && db->fdw >= 0)
+		{
+			close (db->fdw);
+			db->fdw = -1;
+		}
+		if (!db->cow && usecow && dbcowopen (db, name, 1) < 0)
+			fprintf (stderr, "Unable to create roots of DB %s\n", name);
+		if (db->cow && dbcowload (db) < 0)
+			fprintf (stderr, "Unable to publish root of DB %s\n", name);
+		return db;
+	}
+	/* Failed to open DB, try creating it */
+	flags |= O_CREAT;
+	if ((db->fdi = open (name, flags, 0666)) < 0 ||
+		(db->fdl = open (leafname, flags, 0666)) < 0)
+	{
+		close (db->fdi);
+		close (db->fdl);
+		free (leafname);
+		free (db);
+		return NULL;
+	}
+	db->format = DBFORMAT_MERKLE;
+	if (usecow && dbcowopen (db, name, 1) < 0)
+		fprintf (stderr, "Unable to create roots of DB %s\n", name);
+	if (!db->cow && dbwalopen (db, name, 1) < 0)
+		fprintf (stderr, "Unable to create log for DB %s\n", name);
+	dbmapopen (db);
+	initdb(db);
+	free (leafname);
+	if (created)
+		*created = 1;
+	return db;
+}
+
+void
+freedb (dbproof *db)
+{
+	dbflush (db);
+	if (db->fdw >= 0)
+	{
+		dbcheckpoint (db);
+		close (db->fdw);
+	}
+	dbcachefree (db);
+	dbunmap (db);
+	free (db->walbuf);
+	free (db->proofbuf);
+	if (db->fdr >= 0)
+		close (db->fdr);
+	close (db->fdl);
+	close (db->fdi);
+	free (db);
+}
+
+/*
+ * Open a read-only view of a copy-on-write DB as of generation gen, or
+ * the latest if gen is 0.
+ */
+dbproof *
+opensnap (char *name, long gen)
+{
+	dbproof *db = (dbproof *)calloc (1, sizeof (dbproof));
+	char *othername = (char *)malloc (strlen(name) + 10);
+	int flags = O_RDONLY;
+	innernode n;
 
-	Third test: that hashing the root node produces our saved treehash.
+#if defined(_WIN32)
+	flags |= O_BINARY;
+#endif
+	crcinit ();
+	if (db == NULL || othername == NULL)
+		goto fail;
+	db->fdi = db->fdl = db->fdw = db->fdr = -1;
+	db->cow = db->readonly = 1;
+	if ((db->fdi = open (name, flags, 0)) < 0)
+		goto fail;
+	strcpy (othername, name);
+	strcat (othername, ".vals");
+	if ((db->fdl = open (othername, flags, 0)) < 0)
+		goto fail;
+	strcpy (othername, name);
+	strcat (othername, ".roots");
+	if ((db->fdr = open (othername, flags, 0)) < 0)
+		goto fail;
+	if (dbnodeio (db, 0, &n, NONLEAF, 0) != INODESIZE
+			|| dbreadheader (db, &n) < 0
+			|| dbreadroot (db, db->fdr, gen) < 0)
+		goto fail;
+	db->cowbase[NONLEAF] = db->nnodes[NONLEAF];
+	db->cowbase[ISLEAF] = db->nnodes[ISLEAF];
+	free (othername);
+	return db;
+fail:
+	if (db)
+	{
+		if (db->fdr >= 0)
+			close (db->fdr);
+		if (db->fdl >= 0)
+			close (db->fdl);
+		if (db->fdi >= 0)
+			close (db->fdi);
+	}
+	free (othername);
+	free (db);
+	return NULL;
+}
 
-	Given all these three tests, we validate the presence/absence of the
-	item.  If found, or if set is false, we are done.
 
-	Otherwise we have to do updates and ultimately we are updating treehash.
-	To do the updates we insert the new node data where it should go, and
-	split the node if necessary.
+/*****************************  THREADS  *******************************/
 
-	For recursive testing, first check the tree hash at the top level.
-	Then at each level first test the keyind value, then test the childhash
-	of the next level (if recursing).  I.e. before recursing check the
-	childhash to make sure it is as expected.  Thus we validate each data
-	before trusting it.
-*/
+/*
+ * bulkloaddb and checkdbfile split their work over threads.  Each
+ * thread is given its number and the count, and takes its share.
+ */
 
-	*found = 0;
-	splitflag = 0;
+typedef struct dbthread {
+	void *job;
+	int num;
+	int nthreads;
+#if !defined(_WIN32)
+	pthread_t tid;
+#endif
+} dbthread;
 
-	valid = _validate_db_node (found, nodeinfo, nilen, treehash, newhash, 0,
-		*maxdepth, set, &splitflag, splitkey, newnodehash);
+/* How many threads to use when asked for nthreads, 0 meaning one per CPU */
+static int
+dbthreadcount (int nthreads)
+{
+#if !defined(_WIN32)
+	if (nthreads <= 0)
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > DBMAXTHREADS)
+		nthreads = DBMAXTHREADS;
+	return nthreads;
+}
 
-	if (!valid)
-		return 0;
+/* Run worker on nthreads threads and wait for them all */
+static void
+dbrun (void *(*worker)(void *), void *job, int nthreads)
+{
+	dbthread dt[DBMAXTHREADS];
+	int nstarted;
+	int i;
 
-	if (!set || *found || (splitflag==0))
-		return 1;
+	for (i=0; i<nthreads; i++)
+	{
+		dt[i].job = job;
+		dt[i].num = i;
+		dt[i].nthreads = nthreads;
+	}
+#if !defined(_WIN32)
+	for (nstarted=1; nstarted<nthreads; nstarted++)
+		if (pthread_create (&dt[nstarted].tid, NULL, worker,
+				&dt[nstarted]) != 0)
+			break;
+#else
+	nstarted = 1;
+#endif
+	/* We do the first share, and any we could not start a thread for */
+	worker (&dt[0]);
+	for (i=nstarted; i<nthreads; i++)
+		worker (&dt[i]);
+#if !defined(_WIN32)
+	for (i=1; i<nstarted; i++)
+		pthread_join (dt[i].tid, NULL);
+#endif
+}
 
-	/* Must create new top node because old top filled up and split */
-	/* Top node has only one item, the splitkey, and two hashes */
-	/* We only need to update the treehash from it */
-	memcpy (growchild[0], treehash, HASHSIZE);
-	memcpy (growchild[1], newnodehash, HASHSIZE);
-	nodedatahash (treehash, splitkey, growchild[0], 1, NONLEAF);
 
-	++(*maxdepth);
+/*****************************  BULK LOAD  *******************************/
 
-	return 1;
+/*
+ * Building a big DB one testdbandset at a time rewrites every leaf many
+ * times over and leaves the nodes scattered about the files.  bulkloaddb
+ * instead sorts the hashes first and packs the tree from the bottom up,
+ * one level at a time, writing each node once and in file order.
+ */
+
+/* A batch of nodes of one level to hash, spread over threads */
+typedef struct bulkjob {
+	dbproof *db;
+	uchar *nodes;				/* nnodes nodes of nodesize bytes */
+	size_t nodesize;
+	int nnodes;
+	int isleaf;
+	uchar (*hash)[HASHSIZE];	/* Where their hashes go */
+	int nthreads;
+} bulkjob;
+
+/* Where the keys for a level come from: the sorted file for the leaves, */
+/* the separators passed up from the level below for the others */
+typedef struct bulksrc {
+	FILE *f;
+	uchar *keys;
+	long next;
+} bulksrc;
+
+/* Hash every nthreads'th node of the batch */
+static void *
+bulkworker (void *arg)
+{
+	dbthread *dt = arg;
+	bulkjob *job = dt->job;
+	innernode *n;
+	int i;
+
+	for (i=dt->num; i<job->nnodes; i+=dt->nthreads)
+	{
+		n = (innernode *)(job->nodes + i*job->nodesize);
+		nodehash (job->db, job->hash[i], n->key,
+			job->isleaf ? NULL : n->childhash, ntohl(n->nkeys), job->isleaf);
+		n->crc = nodecrc (n, job->isleaf);
+	}
+	return NULL;
 }
 
-int
-_validate_db_node (int *found, compnode *node, int nilen, uchar *thisnodehash,
-	uchar *newhash, int depth, int maxdepth, int set, int *splitflag,
-	uchar *splitkey, uchar *newnodehash)
+static int
+bulkkey (bulksrc *src, uchar *key)
 {
-	uchar hash[HASHSIZE];
-	uchar *childnodehash;
-	compnode *childnode;
-	int valid;
-	int comp;
-	int nkeys;
-	int keyind;
-	int nodesize;
-	int isleaf = (depth+1 == maxdepth);
+	if (src->f)
+		return (fread (key, HASHSIZE, 1, src->f) == 1) ? 0 : -1;
+	memcpy (key, src->keys + src->next++*HASHSIZE, HASHSIZE);
+	return 0;
+}
 
-	/* Pick up values from compnode */
-	if (nilen < sizeof(int))
-		return 0;
-	nkeys = ntohl (node->nkeys);
-	if (nkeys < 0 || nkeys > NODEKEYS)
-		return 0;
-	nodesize = CNODESIZE(nkeys, isleaf);
-	if (nilen < nodesize || (isleaf && (nilen != nodesize)))
-		return 0;
-	keyind = ntohl (node->keyind);
-	if (keyind < 0 || keyind > nkeys)
-		return 0;
+static int
+bulkcomp (const void *a, const void *b)
+{
+	return keycomp ((uchar *)a, (uchar *)b);
+}
 
-	/* Verify that this node's data matches expected hash */
-	nodedatahash (hash, node->hashdata[0], node->hashdata[nkeys],
-			nkeys, isleaf);
-	if (memcmp (hash, thisnodehash, HASHSIZE) != 0)
-		return 0;
+/* Write the sorted keys to f leaving out repeats, return how many */
+static long
+bulkrun (FILE *f, uchar *keys, long n)
+{
+	long i;
+	long count = 0;
 
-	/* Validate that keyind is correct */
-	if (keyind < nkeys)
+	for (i=0; i<n; i++)
 	{
-		comp = keycomp (newhash, node->hashdata[keyind]);
-		if (comp == 0)
-		{
-			*found = 1;
-			return 1;
-		}
-		if (comp > 0)
-			return 0;
+		if (i > 0 && keycomp (keys+i*HASHSIZE, keys+(i-1)*HASHSIZE) == 0)
+			continue;
+		if (fwrite (keys+i*HASHSIZE, HASHSIZE, 1, f) != 1)
+			return -1;
+		count++;
 	}
-	if (keyind > 0)
+	return count;
+}
+
+/*
+ * Sort the hashes from in into a temporary file, leaving out repeats.
+ * Runs of runbytes are sorted in memory and then merged through a heap
+ * of the head of each run.  Return the file rewound and the number of
+ * hashes in *count, NULL on failure.
+ */
+static FILE *
+bulksort (FILE *in, size_t runbytes, long *count)
+{
+	long runkeys = runbytes / HASHSIZE;
+	uchar *keys;
+	FILE **runs = NULL;
+	FILE *out = NULL;
+	int *heap = NULL;
+	int nruns = 0;
+	int nheap;
+	int i, j, c;
+	long n;
+	uchar last[HASHSIZE];
+	int havelast = 0;
+
+	*count = 0;
+	if (runkeys < BULKBATCH)
+		runkeys = BULKBATCH;
+	if ((keys = malloc (runkeys * HASHSIZE)) == NULL)
+		return NULL;
+	while ((n = fread (keys, HASHSIZE, runkeys, in)) > 0)
 	{
-		comp = keycomp (newhash, node->hashdata[keyind-1]);
-		if (comp <= 0)
-			return 0;
+		FILE **nruns2 = realloc (runs, (nruns+1) * sizeof(FILE *));
+		if (nruns2 == NULL)
+			goto done;
+		runs = nruns2;
+		if ((runs[nruns] = tmpfile ()) == NULL)
+			goto done;
+		nruns++;
+		qsort (keys, n, HASHSIZE, bulkcomp);
+		if ((n = bulkrun (runs[nruns-1], keys, n)) < 0)
+			goto done;
+		*count = n;
+	}
+	if (ferror (in))
+		goto done;
+	if (nruns <= 1)
+	{
+		/* Already sorted, or nothing to sort */
+		out = (nruns == 1) ? runs[0] : tmpfile ();
+		nruns = 0;
+		if (out)
+			rewind (out);
+		goto done;
 	}
 
-	if (isleaf)
+	/* Merge, keeping the run with the smallest head at heap[0] */
+	*count = 0;
+	if (nruns > runkeys)
 	{
-		/* Done, unfound, if not inserting */
-		if (!set)
+		uchar *nkeys = realloc (keys, nruns * HASHSIZE);
+		if (nkeys == NULL)
+			goto done;
+		keys = nkeys;
+	}
+	if ((out = tmpfile ()) == NULL
+			|| (heap = malloc (nruns * sizeof(int))) == NULL)
+		goto fail;
+	nheap = 0;
+	for (i=0; i<nruns; i++)
+	{
+		rewind (runs[i]);
+		if (fread (keys+i*HASHSIZE, HASHSIZE, 1, runs[i]) != 1)
+			continue;
+		/* Sift up */
+		for (j=nheap++; j>0 && keycomp (keys+i*HASHSIZE,
+				keys+heap[(j-1)/2]*HASHSIZE) < 0; j=(j-1)/2)
+			heap[j] = heap[(j-1)/2];
+		heap[j] = i;
+	}
+	while (nheap > 0)
+	{
+		i = heap[0];
+		if (!havelast || keycomp (keys+i*HASHSIZE, last) != 0)
 		{
-			*found = 0;
-			return 1;
+			memcpy (last, keys+i*HASHSIZE, HASHSIZE);
+			havelast = 1;
+			if (fwrite (last, HASHSIZE, 1, out) != 1)
+				goto fail;
+			++*count;
 		}
+		/* Replace the head with the run's next key, or drop the run */
+		if (fread (keys+i*HASHSIZE, HASHSIZE, 1, runs[i]) != 1)
+			i = heap[--nheap];
+		/* Sift down */
+		for (j=0; (c=2*j+1) < nheap; j=c)
+		{
+			if (c+1 < nheap && keycomp (keys+heap[c+1]*HASHSIZE,
+					keys+heap[c]*HASHSIZE) < 0)
+				c++;
+			if (keycomp (keys+heap[c]*HASHSIZE, keys+i*HASHSIZE) >= 0)
+				break;
+			heap[j] = heap[c];
+		}
+		heap[j] = i;
+	}
+	rewind (out);
+	goto done;
+fail:
+	if (out)
+		fclose (out);
+	out = NULL;
+done:
+	for (i=0; i<nruns; i++)
+		fclose (runs[i]);
+	free (runs);
+	free (heap);
+	free (keys);
+	return out;
+}
 
-		/* Leaf node, just add the data */
-		memcpy (growkey[0], node->hashdata[0], keyind*HASHSIZE);
-		memcpy (growkey[keyind], newhash, HASHSIZE);
-		memcpy (growkey[keyind+1], node->hashdata[keyind],
-				(nkeys-keyind)*HASHSIZE);
-		++nkeys;
+/* Hash the nodes built so far and write them out, at the end of fd */
+static int
+bulkflush (bulkjob *job, int fd, uchar (*hash)[HASHSIZE])
+{
+	size_t len = job->nnodes * job->nodesize;
+
+	if (job->nnodes == 0)
+		return 0;
+	job->hash = hash;
+	dbrun (bulkworker, job, job->nthreads);
+	if (write (fd, job->nodes, len) != (ssize_t)len)
+		return -1;
+	job->nnodes = 0;
+	return 0;
+}
+
+/*
+ * Build one level of the tree from nitems keys (for the leaves) or
+ * children (for the rest), with at most cap keys to a node and the
+ * items spread evenly among the nodes.  Each node after the first takes
+ * a key from src to separate it from the one before, and those are
+ * returned in *seps for the level above.  Inner nodes point at children
+ * numbered from firstchild, with hashes in childhash.  The nodes are
+ * appended to fd and their hashes returned in *hashes, their number in
+ * *nnodes.
+ */
+static int
+bulklevel (bulkjob *job, int fd, int isleaf, long nitems, bulksrc *src,
+	uchar (*childhash)[HASHSIZE], long firstchild, int cap,
+	long *nnodes, uchar **seps, uchar (**hashes)[HASHSIZE])
+{
+	long nn, node, child;
+	long per, extra;
+	long i, nin;
+	innernode *n;
+	uchar (*hash)[HASHSIZE];
+
+	/* The leaves hold their keys and the separators between them; */
+	/* inner nodes hold one fewer key than children */
+	if (isleaf)
+	{
+		nn = (nitems + 1 + cap) / (cap + 1);
+		per = (nitems - (nn-1)) / nn;
+		extra = (nitems - (nn-1)) % nn;
 	} else {
-		/* Recurse */
-		*splitflag = 0;
-		childnode = (compnode *)((uchar *)node + nodesize);
-		childnodehash = node->hashdata[nkeys+keyind];	/* childhash field */
-		valid = _validate_db_node (found, childnode, nilen-nodesize,
-			childnodehash, newhash, depth+1, maxdepth, set, splitflag,
-			splitkey, newnodehash);
+		nn = (nitems + cap) / (cap + 1);
+		per = nitems / nn;
+		extra = nitems % nn;
+	}
+	*seps = malloc ((nn > 1 ? nn-1 : 1) * HASHSIZE);
+	*hashes = hash = malloc (nn * HASHSIZE);
+	if (*seps == NULL || hash == NULL)
+		return -1;
+
+	job->isleaf = isleaf;
+	job->nodesize = isleaf ? LNODESIZE : INODESIZE;
+	job->nnodes = 0;
+	child = 0;
+	for (node=0; node<nn; node++)
+	{
+		if (node > 0 && bulkkey (src, *seps + (node-1)*HASHSIZE) < 0)
+			return -1;
+		nin = per + (node < extra);
+		n = (innernode *)(job->nodes + job->nnodes * job->nodesize);
+		memset (n, 0, job->nodesize);
+		if (isleaf)
+		{
+			n->nkeys = htonl (nin);
+			for (i=0; i<nin; i++)
+				if (bulkkey (src, n->key[i]) < 0)
+					return -1;
+		} else {
+			n->nkeys = htonl (nin-1);
+			for (i=0; i<nin; i++)
+			{
+				if (i > 0 && bulkkey (src, n->key[i-1]) < 0)
+					return -1;
+				n->child[i] = htonl (firstchild + child);
+				memcpy (n->childhash[i], childhash[child], HASHSIZE);
+				child++;
+			}
+		}
+		if (++job->nnodes == BULKBATCH
+				&& bulkflush (job, fd, hash + node+1-BULKBATCH) < 0)
+			return -1;
+	}
+	if (bulkflush (job, fd, hash + nn - job->nnodes) < 0)
+		return -1;
+	*nnodes = nn;
+	return 0;
+}
 
-		if (!valid)
-			return 0;
+/* Create a node file which must not already exist */
+static int
+bulkcreate (char *name)
+{
+	int flags = O_RDWR | O_CREAT | O_EXCL;
 
-		if (!set || *found)
-			return 1;
+#if defined(_WIN32)
+	flags |= O_BINARY;
+#endif
+	return open (name, flags, 0666);
+}
 
-		if (*splitflag == 0)
+long
+bulkloaddb (char *name, FILE *in, int fill, int nthreads, size_t runbytes,
+	unsigned char *treehash, int *depth)
+{
+	dbproof *db = NULL;
+	FILE *sorted = NULL;
+	bulkjob job;
+	bulksrc src;
+	char *leafname = NULL;
+	uchar *seps = NULL, *nseps = NULL;
+	uchar (*hashes)[HASHSIZE] = NULL, (*nhashes)[HASHSIZE] = NULL;
+	innernode hdr;
+	long nkeys, nitems, nnodes;
+	long firstchild, nextinner;
+	int cap;
+	long rslt = -1;
+
+	crcinit ();
+	memset (&job, 0, sizeof(job));
+	cap = (NODEKEYS * fill) / 100;
+	if (cap < NODEKEYS/2)
+		cap = NODEKEYS/2;
+	if (cap > NODEKEYS)
+		cap = NODEKEYS;
+	nthreads = dbthreadcount (nthreads);
+
+	if ((sorted = bulksort (in, runbytes, &nkeys)) == NULL)
+		return -1;
+
+	db = calloc (1, sizeof (dbproof));
+	leafname = malloc (strlen(name) + 10);
+	job.nodes = malloc (BULKBATCH * INODESIZE);
+	if (db == NULL || leafname == NULL || job.nodes == NULL)
+		goto done;
+	db->fdi = db->fdl = db->fdw = -1;
+	db->format = DBFORMAT_MERKLE;
+	job.db = db;
+	job.nthreads = nthreads;
+
+	/* A log left over from an older DB of this name would be replayed */
+	strcpy (leafname, name);
+	strcat (leafname, ".wal");
+	unlink (leafname);
+	strcpy (leafname, name);
+	strcat (leafname, ".vals");
+	if ((db->fdi = bulkcreate (name)) < 0)
+		goto done;
+	if ((db->fdl = bulkcreate (leafname)) < 0)
+		goto done;
+
+	/* Node 0 of each file is not a node; the header is filled in last */
+	memset (&hdr, 0, INODESIZE);
+	hdr.crc = nodecrc (&hdr, ISLEAF);
+	if (write (db->fdl, &hdr, LNODESIZE) != LNODESIZE
+			|| write (db->fdi, &hdr, INODESIZE) != INODESIZE)
+		goto done;
+
+	/* Leaves */
+	memset (&src, 0, sizeof(src));
+	src.f = sorted;
+	if (bulklevel (&job, db->fdl, ISLEAF, nkeys, &src, NULL, 0, cap,
+			&nnodes, &seps, &hashes) < 0)
+		goto done;
+	db->depth = 1;
+	firstchild = 1;
+	nextinner = 1;
+
+	/* Then inner levels until one node holds it all; there is always */
+	/* at least one, so that the root is an inner node */
+	do {
+		nitems = nnodes;
+		src.f = NULL;
+		src.keys = seps;
+		src.next = 0;
+		if (++db->depth > MAXDEPTH)
+			goto done;
+		if (bulklevel (&job, db->fdi, NONLEAF, nitems, &src, hashes,
+				firstchild, cap, &nnodes, &nseps, &nhashes) < 0)
 		{
-			/* No split below us, just update our changed hash upwards */
-			nodedatahash (thisnodehash, node->hashdata[0],
-				node->hashdata[nkeys], nkeys, isleaf);
-			return 1;
+			free (nseps);
+			free (nhashes);
+			goto done;
 		}
-
-		/* Child did a split, new node is to right of old one */
-		memcpy (growkey[0], node->hashdata[0], keyind*HASHSIZE);
-		memcpy (growkey[keyind], splitkey, HASHSIZE);
-		memcpy (growkey[keyind+1], node->hashdata[keyind],
-				(nkeys-keyind)*HASHSIZE);
-		memcpy (growchild[0], node->hashdata[nkeys+0], (keyind+1)*HASHSIZE);
-		memcpy (growchild[keyind+1], newnodehash, HASHSIZE);
-		memcpy (growchild[keyind+2], node->hashdata[nkeys+keyind+1],
-					(nkeys-keyind)*HASHSIZE);
-		++nkeys;
+		free (seps);
+		free (hashes);
+		seps = nseps;
+		hashes = nhashes;
+		firstchild = nextinner;
+		nextinner += nnodes;
+	} while (nnodes > 1);
+
+	db->rootnode = firstchild;
+	dbheader (db, &hdr);
+	if (lseek (db->fdi, 0, SEEK_SET) != 0
+			|| write (db->fdi, &hdr, INODESIZE) != INODESIZE)
+		goto done;
+#if !defined(_WIN32)
+	if (fsync (db->fdi) < 0 || fsync (db->fdl) < 0)
+		goto done;
+#endif
+	memcpy (treehash, hashes[0], HASHSIZE);
+	*depth = db->depth;
+	rslt = nkeys;
+done:
+	if (db)
+	{
+		if (db->fdi >= 0)
+			close (db->fdi);
+		if (db->fdl >= 0)
+			close (db->fdl);
+		/* Don't leave a half built DB for opendb to find */
+		if (rslt < 0 && db->fdi >= 0)
+			unlink (name);
+		if (rslt < 0 && db->fdl >= 0)
+			unlink (leafname);
 	}
+	free (seps);
+	free (hashes);
+	free (job.nodes);
+	free (leafname);
+	free (db);
+	fclose (sorted);
+	return rslt;
+}
 
-	/* Now split our node if it is too full */
-	/* We move one key up (to splitkey) and put NODEKEYS/2 in this one and */
-	/* the new one.  The new node gets the higher value keys and is the */
-	/* right sibling of the existing node. */
-	if (nkeys > NODEKEYS)
-	{
-		assert (nkeys == NODEKEYS+1);
-		memcpy (splitkey, growkey[NODEKEYS/2], HASHSIZE);
-		nkeys = NODEKEYS/2;
-		*splitflag = 1;
 
-		/* Now hash the split data into the two parent fields */
-		nodedatahash (thisnodehash, growkey[0], growchild[0], nkeys, isleaf);
-		nodedatahash (newnodehash, growkey[nkeys+1], growchild[nkeys+1],
-				nkeys, isleaf);
-	} else {
-		/* No split was done, just update parent hash */
-		*splitflag = 0;
-		nodedatahash (thisnodehash, growkey[0], growchild[0], nkeys, isleaf);
-	}
 
-	return 1;
-}
+/*****************************  CHECK  *******************************/
 
 /*
- * Local test of the validity verification.
- * Resets treehash and maxdepth just as the remote host should.
+ * checkdb walks the tree one node at a time, each a seek and a read,
+ * which takes hours on a big DB.  checkdbfile reads the inner node file
+ * into memory in one go; it is small next to the leaves.  Then threads
+ * read the leaf file in large chunks, taking them in file order with the
+ * next one hinted to the kernel, and summarize and hash each leaf.
+ * Last the tree is split into subtrees, which threads walk checking
+ * the inner nodes against each other and against the leaf summaries.
+ * The files are only read, so a DB can be checked as a crash left it.
  */
-void
-testvalid (void *proof, unsigned prooflen, uchar *treehash,
-		int *maxdepth, uchar *hash, int shouldbefound, int set)
+
+/* What checkdbfile needs to know about a leaf from reading it */
+typedef struct leafsum {
+	uchar hash[HASHSIZE];
+	uchar lo[HASHSIZE];			/* Smallest key */
+	uchar hi[HASHSIZE];			/* Largest key */
+	unsigned short nkeys;
+	uchar bad;					/* Index into leafbad if not a good leaf */
+	uchar seen;					/* Reached from the tree */
+} leafsum;
+
+static char *leafbad[] = {
+	NULL,
+	"leaf has too many keys",
+	"leaf keys out of order",
+	"leaf could not be read",
+	"leaf checksum does not match",
+};
+
+/* A subtree walked on its own thread */
+typedef struct checktask {
+	long node;
+	uchar *lo;					/* Bounds on its keys, NULL for none */
+	uchar *hi;
+	uchar hash[HASHSIZE];
+	struct dbcheck chk;			/* What is in it */
+	int rslt;
+} checktask;
+
+typedef struct checkjob {
+	dbproof *db;				/* Just for its format */
+	int depth;
+	int fdl;
+	innernode *inner;			/* The whole inner node file */
+	uchar *innerseen;
+	long ninner;
+	leafsum *leaves;
+	long nleaves;
+	long nextleaf;				/* First leaf of the next chunk to read */
+	checktask *tasks;
+	int ntasks;
+	int splitdepth;				/* Depth of the task subtrees */
+	int nexttask;				/* Next one for checkwalk to use */
+	int claimtask;				/* Next one for a thread to walk */
+#if !defined(_WIN32)
+	pthread_mutex_t lock;		/* For nextleaf, claimtask and seen flags */
+#endif
+} checkjob;
+
+static void
+checklock (checkjob *job)
+{
+#if !defined(_WIN32)
+	pthread_mutex_lock (&job->lock);
+#endif
+}
+
+static void
+checkunlock (checkjob *job)
+{
+#if !defined(_WIN32)
+	pthread_mutex_unlock (&job->lock);
+#endif
+}
+
+/* Mark a node as reached, and say whether it already was */
+static int
+checkseen (checkjob *job, uchar *seen)
 {
-	int valid;
-	int found;
+	int was;
 
-	valid = validate_db_operation (treehash, &found,
-		(compnode *)proof, prooflen, maxdepth, hash, set);
+	checklock (job);
+	was = *seen;
+	*seen = 1;
+	checkunlock (job);
+	return was;
+}
 
-	if (!valid)
+static void
+leafsummary (checkjob *job, leafsum *sum, leafnode *n)
+{
+	int nkeys = ntohl (n->nkeys);
+	int i;
+
+	if (n->crc != nodecrc ((innernode *)n, ISLEAF))
 	{
-		fprintf (stderr, "Invalid validation\n");
-		exit (1);
+		sum->bad = 4;
+		return;
 	}
-	if (found != shouldbefound)
+	if (nkeys > NODEKEYS)
 	{
-		fprintf (stderr, "Invalid foundness\n");
-		exit (1);
+		sum->bad = 1;
+		return;
+	}
+	for (i=1; i<nkeys; i++)
+		if (keycomp (n->key[i-1], n->key[i]) >= 0)
+		{
+			sum->bad = 2;
+			return;
+		}
+	nodehash (job->db, sum->hash, n->key, NULL, nkeys, ISLEAF);
+	if (nkeys > 0)
+	{
+		memcpy (sum->lo, n->key[0], HASHSIZE);
+		memcpy (sum->hi, n->key[nkeys-1], HASHSIZE);
 	}
+	sum->nkeys = nkeys;
+	sum->bad = 0;
 }
 
+/* Read and summarize chunks of leaves until there are none left */
+static void *
+checkleafworker (void *arg)
+{
+	dbthread *dt = arg;
+	checkjob *job = dt->job;
+	leafnode *buf;
+	long first, n, i;
+	ssize_t got;
 
+	if ((buf = malloc (CHECKCHUNK * LNODESIZE)) == NULL)
+		return NULL;
+	for ( ; ; )
+	{
+		checklock (job);
+		first = job->nextleaf;
+		job->nextleaf += CHECKCHUNK;
+		checkunlock (job);
+		if (first >= job->nleaves)
+			break;
+		n = job->nleaves - first;
+		if (n > CHECKCHUNK)
+			n = CHECKCHUNK;
+#if !defined(_WIN32)
+		/* Start on the chunk after those being read now */
+		posix_fadvise (job->fdl, (first + dt->nthreads*CHECKCHUNK)
+				* (off_t)LNODESIZE, CHECKCHUNK * LNODESIZE,
+				POSIX_FADV_WILLNEED);
+		got = pread (job->fdl, buf, n * LNODESIZE, first * (off_t)LNODESIZE);
+#else
+		lseek (job->fdl, first * (off_t)LNODESIZE, SEEK_SET);
+		got = read (job->fdl, buf, n * LNODESIZE);
+#endif
+		if (got < 0)
+			got = 0;
+		n = got / LNODESIZE;
+		for (i=0; i<n; i++)
+			leafsummary (job, &job->leaves[first+i], &buf[i]);
+	}
+	free (buf);
+	return NULL;
+}
 
+static void
+checkfill (struct dbcheck *chk, int isleaf, int nkeys)
+{
+	chk->nnodes[isleaf]++;
+	chk->fill[isleaf][nkeys * (DBCHECKFILLS-1) / NODEKEYS]++;
+	chk->nkeys += nkeys;
+}
 
-/*****************************  DEBUG  *******************************/
-
-/* For debugging */
+/* Add what is in a subtree to chk, and its error if chk has none yet */
 static void
-printnode (dbproof *db, int num, FILE *f, int depth)
+checkadd (struct dbcheck *chk, struct dbcheck *sub)
 {
-	innernode n;
 	int i, j;
-	int isleaf = (depth+1 == db->depth);
 
-	memset (&n, 0, INODESIZE);
-	dbnodeseek (db, num, SEEK_SET, isleaf);
-	dbnoderead (db, &n, isleaf);
-	if (depth+1 == db->depth)
-	for (i=0; i<NODEKEYS; i++)
+	chk->nkeys += sub->nkeys;
+	for (i=0; i<2; i++)
 	{
-		if (!isleaf)
-			printnode (db, ntohl(n.child[i]), f, depth+1);
-//		for (j=0; j<depth; j++)
-//			fprintf (f, " ");
-		for (j=0; j<HASHSIZE; j++)
-			fprintf (f, "%02x ", n.key[i][j]);
-		fprintf (f, "\n");
+		chk->nnodes[i] += sub->nnodes[i];
+		for (j=0; j<DBCHECKFILLS; j++)
+			chk->fill[i][j] += sub->fill[i][j];
+	}
+	if (sub->err && !chk->err)
+	{
+		chk->err = sub->err;
+		chk->errdepth = sub->errdepth;
+		chk->errnode = sub->errnode;
+		chk->errindex = sub->errindex;
 	}
-	if (!isleaf)
-		printnode (db, ntohl(n.child[i]), f, depth+1);
 }
 
-void
-printdb (dbproof *db, FILE *f)
+static int
+checkfail (struct dbcheck *chk, char *err, int depth, long node, int index)
 {
-	innernode n;
-	uchar hash[HASHSIZE];
-	int rootpos;
-
-	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
-	dbnoderead (db, &n, NONLEAF);
-	rootpos = ntohl (n.child[0]);
-	db->depth = ntohl (n.child[1]);
-	printnode (db, rootpos, f, 0);
+	chk->err = err;
+	chk->errdepth = depth;
+	chk->errnode = node;
+	chk->errindex = index;
+	return -1;
 }
 
+/*
+ * Check the subtree at inner node node, whose keys must lie between lo
+ * and hi, and return its hash.  The caller has checked that node is in
+ * range.  At the top, subtrees at splitdepth have been walked already
+ * by the threads, in the same order as we meet them, and we just take
+ * their results.  Stop at the first problem, and return -1.
+ */
 static int
-checknode (dbproof *db, uchar *hash, int nodenum, int depth)
+checkwalk (checkjob *job, struct dbcheck *chk, uchar *hash, long node,
+	int depth, uchar *lo, uchar *hi, int top)
 {
-	innernode n;
+	innernode *n = &job->inner[node];
+	int nkeys = ntohl (n->nkeys);
+	uchar childhash[HASHSIZE];
+	uchar *clo, *chi;
+	leafsum *l;
+	checktask *t;
+	long child;
 	int i;
-	int isleaf = (depth+1 == db->depth);
-
-	memset (&n, 0, INODESIZE);
-	dbnodeseek (db, nodenum, SEEK_SET, isleaf);
-	dbnoderead (db, &n, isleaf);
 
-	for (i=0; i<=ntohl(n.nkeys); i++)
+	if (top && depth == job->splitdepth)
 	{
-		if (!isleaf)
+		t = &job->tasks[job->nexttask++];
+		checkadd (chk, &t->chk);
+		memcpy (hash, t->hash, HASHSIZE);
+		return t->rslt;
+	}
+	if (checkseen (job, &job->innerseen[node]))
+		return checkfail (chk, "inner node reached twice", depth, node, -1);
+	if (n->crc != nodecrc (n, NONLEAF))
+		return checkfail (chk, "inner node checksum does not match",
+				depth, node, -1);
+	if (nkeys > NODEKEYS)
+		return checkfail (chk, "inner node has too many keys", depth, node, -1);
+	checkfill (chk, NONLEAF, nkeys);
+	for (i=0; i<=nkeys; i++)
+	{
+		clo = (i > 0) ? n->key[i-1] : lo;
+		chi = (i < nkeys) ? n->key[i] : hi;
+		if (i < nkeys && clo && keycomp (clo, chi) >= 0)
+			return checkfail (chk, "inner keys out of order", depth, node, i);
+		if (i == nkeys && nkeys > 0 && hi && keycomp (clo, hi) >= 0)
+			return checkfail (chk, "inner keys out of order", depth, node, i);
+		child = ntohl (n->child[i]);
+		if (depth+2 == job->depth)
 		{
-			if (n.child[i] == 0)
-				return -1;
-			if (checknode (db, hash, ntohl(n.child[i]), depth+1) < 0)
-				return -1;
-			if (memcmp (hash, n.childhash[i], HASHSIZE) != 0)
+			if (child <= 0 || child >= job->nleaves)
+				return checkfail (chk, "leaf number out of range",
+						depth, node, i);
+			l = &job->leaves[child];
+			if (checkseen (job, &l->seen))
+				return checkfail (chk, "leaf reached twice", depth+1,
+						child, -1);
+			if (l->bad)
+				return checkfail (chk, leafbad[l->bad], depth+1, child, -1);
+			if (l->nkeys > 0 && ((clo && keycomp (clo, l->lo) >= 0)
+					|| (chi && keycomp (l->hi, chi) >= 0)))
+				return checkfail (chk, "leaf keys outside parent's bounds",
+						depth+1, child, -1);
+			checkfill (chk, ISLEAF, l->nkeys);
+			memcpy (childhash, l->hash, HASHSIZE);
+		} else {
+			if (child <= 0 || child >= job->ninner)
+				return checkfail (chk, "inner node number out of range",
+						depth, node, i);
+			if (checkwalk (job, chk, childhash, child, depth+1, clo, chi,
+					top) < 0)
 				return -1;
 		}
-		if (i < ntohl(n.nkeys)-1)
-			if (keycomp (n.key[i], n.key[i+1]) >= 0)
-				return -1;
+		if (memcmp (childhash, n->childhash[i], HASHSIZE) != 0)
+			return checkfail (chk, "childhash does not match child",
+					depth, node, i);
+	}
+	nodehash (job->db, hash, n->key, n->childhash, nkeys, NONLEAF);
+	return 0;
+}
+
+/* Walk the task subtrees until there are none left */
+static void *
+checktaskworker (void *arg)
+{
+	dbthread *dt = arg;
+	checkjob *job = dt->job;
+	checktask *t;
+
+	for ( ; ; )
+	{
+		checklock (job);
+		t = (job->claimtask < job->ntasks) ? &job->tasks[job->claimtask++]
+				: NULL;
+		checkunlock (job);
+		if (t == NULL)
+			break;
+		t->rslt = checkwalk (job, &t->chk, t->hash, t->node,
+				job->splitdepth, t->lo, t->hi, 0);
 	}
+	return NULL;
+}
 
-	nodehash (hash, &n, ntohl(n.nkeys), isleaf);
+/*
+ * Split the tree into subtrees for the threads, going down a level at a
+ * time until there are enough or the next level is leaves.  A level
+ * with a node we can't follow stays whole for checkwalk to report.
+ */
+static int
+checksplit (checkjob *job, long root, int nthreads)
+{
+	checktask *tasks, *next;
+	innernode *n;
+	int ntasks, nnext;
+	int i, j, nkeys;
+	long child;
+
+	if ((tasks = calloc (1, sizeof(checktask))) == NULL)
+		return -1;
+	tasks[0].node = root;
+	ntasks = 1;
+	job->splitdepth = 0;
+	while (job->splitdepth+2 < job->depth && ntasks < CHECKTASKS*nthreads)
+	{
+		nnext = 0;
+		for (i=0; i<ntasks; i++)
+		{
+			n = &job->inner[tasks[i].node];
+			nkeys = ntohl (n->nkeys);
+			if (nkeys > NODEKEYS)
+				break;
+			for (j=0; j<=nkeys; j++)
+			{
+				child = ntohl (n->child[j]);
+				if (child <= 0 || child >= job->ninner)
+					break;
+			}
+			if (j <= nkeys)
+				break;
+			nnext += nkeys + 1;
+		}
+		if (i < ntasks || (next = calloc (nnext, sizeof(checktask))) == NULL)
+			break;
+		nnext = 0;
+		for (i=0; i<ntasks; i++)
+		{
+			n = &job->inner[tasks[i].node];
+			nkeys = ntohl (n->nkeys);
+			for (j=0; j<=nkeys; j++)
+			{
+				next[nnext].node = ntohl (n->child[j]);
+				next[nnext].lo = (j > 0) ? n->key[j-1] : tasks[i].lo;
+				next[nnext].hi = (j < nkeys) ? n->key[j] : tasks[i].hi;
+				nnext++;
+			}
+		}
+		free (tasks);
+		tasks = next;
+		ntasks = nnext;
+		job->splitdepth++;
+	}
+	job->tasks = tasks;
+	job->ntasks = ntasks;
 	return 0;
 }
 
-int
-checkdb (dbproof *db)
+/* Read len bytes from the current position of fd */
+static int
+checkread (int fd, void *buf, size_t len)
 {
-	innernode n;
-	uchar hash[HASHSIZE];
-	int rootpos;
+	uchar *p = buf;
+	ssize_t got;
 
-	dbnodeseek (db, 0, SEEK_SET, NONLEAF);
-	dbnoderead (db, &n, NONLEAF);
-	rootpos = ntohl (n.child[0]);
-	db->depth = ntohl (n.child[1]);
-	return checknode (db, hash, rootpos, 0);
+	while (len > 0)
+	{
+		got = read (fd, p, (len < CHECKCHUNK*LNODESIZE) ? len
+				: CHECKCHUNK*LNODESIZE);
+		if (got <= 0)
+			return -1;
+		p += got;
+		len -= got;
+	}
+	return 0;
 }
 
 int
-testdb_depth (dbproof *db)
+checkdbfile (char *name, int nthreads, struct dbcheck *chk)
 {
-	return db->depth;
+	checkjob job;
+	dbproof *db;
+	char *othername;
+	int fdi, fdw;
+	long root;
+	long i;
+	int rslt = -1;
+
+	crcinit ();
+	memset (chk, 0, sizeof(*chk));
+	memset (&job, 0, sizeof(job));
+	fdi = job.fdl = -1;
+	db = calloc (1, sizeof (dbproof));
+	othername = malloc (strlen(name) + 10);
+	if (db == NULL || othername == NULL)
+		goto done;
+	job.db = db;
+
+	strcpy (othername, name);
+	strcat (othername, ".wal");
+	if ((fdw = open (othername, O_RDONLY, 0)) >= 0)
+	{
+		chk->walbytes = lseek (fdw, 0, SEEK_END);
+		close (fdw);
+	}
+	strcpy (othername, name);
+	strcat (othername, ".vals");
+	if ((fdi = open (name, O_RDONLY, 0)) < 0
+			|| (job.fdl = open (othername, O_RDONLY, 0)) < 0)
+		goto done;
+	job.ninner = lseek (fdi, 0, SEEK_END) / INODESIZE;
+	job.nleaves = lseek (job.fdl, 0, SEEK_END) / LNODESIZE;
+	if (job.ninner < 2)
+	{
+		rslt = checkfail (chk, "inner node file too short", 0, 0, -1);
+		goto done;
+	}
+
+	/* The inner nodes, in one pass through the file */
+	job.inner = malloc (job.ninner * INODESIZE);
+	job.innerseen = calloc (job.ninner, 1);
+	job.leaves = malloc ((job.nleaves + 1) * sizeof(leafsum));
+	if (job.inner == NULL || job.innerseen == NULL || job.leaves == NULL
+			|| lseek (fdi, 0, SEEK_SET) != 0
+			|| checkread (fdi, job.inner, job.ninner * INODESIZE) < 0)
+		goto done;
+
+	if (dbreadheader (db, &job.inner[0]) < 0)
+	{
+		rslt = checkfail (chk, "header is not for this version and "
+				"node size", 0, 0, -1);
+		goto done;
+	}
+	if (job.inner[0].crc != nodecrc (&job.inner[0], NONLEAF))
+	{
+		rslt = checkfail (chk, "header checksum does not match", 0, 0, -1);
+		goto done;
+	}
+	root = db->rootnode;
+	job.depth = chk->depth = db->depth;
+	chk->format = db->format;
+
+	/* A copy-on-write DB is checked as of its last published root */
+	strcpy (othername, name);
+	strcat (othername, ".roots");
+	if ((fdw = open (othername, O_RDONLY, 0)) >= 0)
+	{
+		if (dbreadroot (db, fdw, 0) == 0)
+		{
+			root = db->rootnode;
+			job.depth = chk->depth = db->depth;
+			chk->generation = db->generation;
+			if (db->nnodes[NONLEAF] < job.ninner)
+				job.ninner = db->nnodes[NONLEAF];
+			if (db->nnodes[ISLEAF] < job.nleaves)
+				job.nleaves = db->nnodes[ISLEAF];
+		}
+		close (fdw);
+	}
+	if (job.depth < 2 || job.depth > MAXDEPTH)
+	{
+		rslt = checkfail (chk, "bad depth in header", 0, 0, 1);
+		goto done;
+	}
+	if (root <= 0 || root >= job.ninner)
+	{
+		rslt = checkfail (chk, "root node number out of range", 0, 0, 0);
+		goto done;
+	}
+
+	/* Then the leaves, each marked unread until a thread gets to it */
+	nthreads = dbthreadcount (nthreads);
+	memset (job.leaves, 0, job.nleaves * sizeof(leafsum));
+	for (i=0; i<job.nleaves; i++)
+		job.leaves[i].bad = 3;
+#if !defined(_WIN32)
+	pthread_mutex_init (&job.lock, NULL);
+	posix_fadvise (job.fdl, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	dbrun (checkleafworker, &job, nthreads);
+
+	/* And the tree */
+	if (checksplit (&job, root, nthreads) == 0)
+	{
+		dbrun (checktaskworker, &job, nthreads);
+		rslt = checkwalk (&job, chk, chk->treehash, root, 0, NULL, NULL, 1);
+	}
+#if !defined(_WIN32)
+	pthread_mutex_destroy (&job.lock);
+#endif
+
+	/* Nodes left out of the tree, once we know we went through it all */
+	if (rslt == 0)
+	{
+		for (i=1; i<job.ninner; i++)
+			chk->unused[NONLEAF] += !job.innerseen[i];
+		for (i=1; i<job.nleaves; i++)
+			chk->unused[ISLEAF] += !job.leaves[i].seen;
+	}
+done:
+	if (rslt < 0 && chk->err)
+		rslt = 1;
+	if (fdi >= 0)
+		close (fdi);
+	if (job.fdl >= 0)
+		close (job.fdl);
+	free (job.tasks);
+	free (job.inner);
+	free (job.innerseen);
+	free (job.leaves);
+	free (othername);
+	free (db);
+	return rslt;
 }
 
 
-/*****************************  INIT  *******************************/
 
+/*****************************  CONVERT  *******************************/
 
-static void
-initdb (dbproof *db)
-{
-	innernode ni;
-	leafnode nl;
+/*
+ * Before version 2 the node files held these structs as the host laid
+ * them out, with no padding or checksums and the header in child[] of
+ * block 0.  Their numbers were longs, which only ever made a DB the
+ * card could verify on 32 bit hosts, so we read them as 4 bytes and
+ * turn away DBs from 64 bit hosts.  Only
+ * the layout has changed, so node numbers, hashes and root records all
+ * carry over, and the card sees the same tree.
+ */
 
-	/* First leaf node block is unused */
-	memset (&nl, 0, LNODESIZE);
-	dbnodewrite (db, (innernode *)&nl, ISLEAF);
-	/* First leaf node starts off empty */
-	dbnodewrite (db, (innernode *)&nl, ISLEAF);
+#define V1NODEKEYS	100
 
-	/* Top inner node just points at root inner node */
-	/* And encodes depth in child[1] */
-	memset (&ni, 0, INODESIZE);
-	ni.child[0] = htonl (1);
-	ni.child[1] = htonl (2);
-	dbnodewrite (db, &ni, NONLEAF);
-	/* Root node will start pointing at leaf */
-	memset (&ni, 0, INODESIZE);
-	ni.child[0] = htonl (1);
-	nodehash (ni.childhash[0], (innernode *)&nl, 0, ISLEAF);
-	dbnodewrite (db, &ni, NONLEAF);
+typedef struct v1innernode {
+	unsigned nkeys;
+	uchar key[V1NODEKEYS+1][HASHSIZE];
+	uchar childhash[V1NODEKEYS+2][HASHSIZE];
+	unsigned child[V1NODEKEYS+2];
+} v1innernode;
 
-	/* Set top level hash for testing validation */
-	nodehash (db->treehash, &ni, 0, NONLEAF);
+typedef struct v1leafnode {
+	unsigned nkeys;
+	uchar key[V1NODEKEYS+1][HASHSIZE];
+} v1leafnode;
 
-	db->depth = 2;
-	db->rootnode = 1;
-}
+/* Where a 64 bit host put child[] and how big it made an inner node */
+#define V1CHILD8	((8 + (2*V1NODEKEYS+3)*HASHSIZE + 7) / 8 * 8)
+#define V1INODE8	(V1CHILD8 + 8*(V1NODEKEYS+2))
 
 /*
- * Open the database file of the specified name.
- * Create it if it doesn't exist.
+ * Check that the inner node file of oldname has the 4 byte layout,
+ * saying what is wrong if not.  The header is the one thing we can
+ * check, and a DB written with 8 byte longs has it at V1CHILD8, in
+ * whichever half of each 8 bytes the host kept the low word.
  */
-dbproof *
-opendb (char *name, int *created)
+static int
+convertcheck (char *oldname)
 {
-	dbproof *db = (dbproof *)malloc (sizeof (dbproof));
-	char *leafname = (char *)malloc (strlen(name) + 10);
-	int flags = O_RDWR;
-
-#if defined(_WIN32)
-	flags |= O_BINARY;
-#endif
+	uchar buf[V1INODE8];
+	unsigned *hdr;
+	off_t size;
+	int fd, i;
+	int rslt = -1;
 
-	strcpy (leafname, name);
-	strcat (leafname, ".vals");
+	if ((fd = open (oldname, O_RDONLY, 0)) < 0)
+	{
+		fprintf (stderr, "Unable to open DB %s\n", oldname);
+		return -1;
+	}
+	size = lseek (fd, 0, SEEK_END);
+	memset (buf, 0, sizeof(buf));
+	if (size < 0 || lseek (fd, 0, SEEK_SET) != 0
+			|| read (fd, buf, sizeof(buf)) < (ssize_t)sizeof(v1innernode))
+	{
+		fprintf (stderr, "DB %s is too short to convert\n", oldname);
+		goto done;
+	}
+	hdr = ((v1innernode *)buf)->child;
+	if (size % sizeof(v1innernode) == 0 && ntohl (hdr[1]) >= 2
+			&& ntohl (hdr[1]) <= MAXDEPTH)
+	{
+		rslt = 0;
+		goto done;
+	}
+	if (size % V1INODE8 == 0)
+	{
+		hdr = (unsigned *)(buf + V1CHILD8);
+		for (i=0; i<2; i++)
+		{
+			if (ntohl (hdr[2+i]) >= 2 && ntohl (hdr[2+i]) <= MAXDEPTH
+					&& hdr[3-i] == 0)
+			{
+				fprintf (stderr, "DB %s was written with 8 byte longs; "
+					"only DBs from 32 bit hosts can be converted\n", oldname);
+				goto done;
+			}
+		}
+	}
+	fprintf (stderr, "DB %s is not in the version 1 layout\n", oldname);
+done:
+	close (fd);
+	return rslt;
+}
 
-	if ((db->fdi = open (name, flags, 0)) >= 0 &&
-		(db->fdl = open (leafname, flags, 0)) >= 0)
+/* Convert one node file, and the header if it is the inner one */
+static long
+convertfile (dbproof *db, int fdold, int fdnew, int isleaf)
+{
+	size_t oldsize = isleaf ? sizeof(v1leafnode) : sizeof(v1innernode);
+	size_t newsize = isleaf ? LNODESIZE : INODESIZE;
+	uchar *oldbuf = malloc (CONVERTCHUNK * oldsize);
+	uchar *newbuf = malloc (CONVERTCHUNK * newsize);
+	v1innernode *o;
+	innernode *n;
+	long nnodes, node;
+	long nchunk, i;
+	int j;
+	long rslt = -1;
+
+	nnodes = lseek (fdold, 0, SEEK_END) / oldsize;
+	if (oldbuf == NULL || newbuf == NULL || lseek (fdold, 0, SEEK_SET) != 0)
+		goto done;
+	for (node=0; node<nnodes; node+=nchunk)
 	{
-		innernode n;
-		free (leafname);
-		/* First entry is dummy and just holds top node pointer and depth */
-		dbnodeseek (db, 0, SEEK_SET, NONLEAF);
-		dbnoderead (db, &n, NONLEAF);
-		db->rootnode = ntohl(n.child[0]);
-		db->depth = ntohl(n.child[1]);
-		if (created)
-			*created = 0;
-		return db;
+		nchunk = nnodes - node;
+		if (nchunk > CONVERTCHUNK)
+			nchunk = CONVERTCHUNK;
+		if (checkread (fdold, oldbuf, nchunk * oldsize) < 0)
+			goto done;
+		memset (newbuf, 0, nchunk * newsize);
+		for (i=0; i<nchunk; i++)
+		{
+			/* A v1leafnode is a prefix of a v1innernode */
+			o = (v1innernode *)(oldbuf + i*oldsize);
+			n = (innernode *)(newbuf + i*newsize);
+			if (!isleaf && node+i == 0)
+			{
+				db->rootnode = ntohl (o->child[0]);
+				db->depth = ntohl (o->child[1]);
+				db->format = DBFORMAT_FLAT;
+				if (ntohl (o->child[2]) == DBFORMATMAGIC)
+					db->format = ntohl (o->child[3]);
+				dbheader (db, n);
+				continue;
+			}
+			/* The numbers were stored in network order already */
+			n->nkeys = o->nkeys;
+			memcpy (n->key, o->key, sizeof(o->key));
+			if (!isleaf)
+			{
+				memcpy (n->childhash, o->childhash, sizeof(o->childhash));
+				for (j=0; j<V1NODEKEYS+2; j++)
+					n->child[j] = o->child[j];
+			}
+			n->crc = nodecrc (n, isleaf);
+		}
+		if (write (fdnew, newbuf, nchunk * newsize)
+				!= (ssize_t)(nchunk * newsize))
+			goto done;
 	}
-	/* Failed to open DB, try creating it */
-	flags |= O_CREAT;
-	if ((db->fdi = open (name, flags, 0666)) < 0 ||
-		(db->fdl = open (leafname, flags, 0666)) < 0)
+	rslt = nnodes;
+done:
+	free (oldbuf);
+	free (newbuf);
+	return rslt;
+}
+
+/* Copy the roots file of a copy-on-write DB, if it has one */
+static int
+convertroots (char *oldname, char *newname)
+{
+	uchar buf[64*DBROOTSIZE];
+	int fdold, fdnew;
+	ssize_t got;
+	int rslt = -1;
+
+	if ((fdold = open (oldname, O_RDONLY, 0)) < 0)
+		return 0;
+	if ((fdnew = bulkcreate (newname)) >= 0)
 	{
-		close (db->fdi);
-		close (db->fdl);
-		free (leafname);
-		free (db);
-		return NULL;
+		while ((got = read (fdold, buf, sizeof(buf))) > 0)
+			if (write (fdnew, buf, got) != got)
+				break;
+		if (got == 0)
+			rslt = 0;
+#if !defined(_WIN32)
+		if (rslt == 0 && fsync (fdnew) < 0)
+			rslt = -1;
+#endif
+		close (fdnew);
+		if (rslt < 0)
+			unlink (newname);
 	}
-	initdb(db);
-	free (leafname);
-	if (created)
-		*created = 1;
-	return db;
+	close (fdold);
+	return rslt;
 }
 
-void
-freedb (dbproof *db)
+long
+convertdb (char *oldname, char *newname)
 {
-	close (db->fdl);
-	close (db->fdi);
+	dbproof *db;
+	char *oldother, *newother;
+	int fdold = -1, fdnew = -1;
+	int made[2] = {0, 0};
+	int isleaf;
+	long nnodes, n;
+	long rslt = -1;
+
+	crcinit ();
+	if (NODEKEYS != V1NODEKEYS)
+	{
+		fprintf (stderr, "Old DBs have %d keys per node, not %d; "
+				"rebuild it with bulkload\n", V1NODEKEYS, NODEKEYS);
+		return -1;
+	}
+	db = calloc (1, sizeof (dbproof));
+	oldother = malloc (strlen(oldname) + 10);
+	newother = malloc (strlen(newname) + 10);
+	if (db == NULL || oldother == NULL || newother == NULL)
+		goto done;
+
+	/* What the log would do to the nodes is in the old layout */
+	strcpy (oldother, oldname);
+	strcat (oldother, ".wal");
+	if ((fdold = open (oldother, O_RDONLY, 0)) >= 0)
+	{
+		n = lseek (fdold, 0, SEEK_END);
+		close (fdold);
+		fdold = -1;
+		if (n > 0)
+		{
+			fprintf (stderr, "DB %s has a log still to apply\n", oldname);
+			goto done;
+		}
+	}
+	if (convertcheck (oldname) < 0)
+		goto done;
+
+	nnodes = 0;
+	for (isleaf=0; isleaf<2; isleaf++)
+	{
+		strcpy (oldother, oldname);
+		strcpy (newother, newname);
+		if (isleaf)
+		{
+			strcat (oldother, ".vals");
+			strcat (newother, ".vals");
+		}
+		if ((fdold = open (oldother, O_RDONLY, 0)) < 0
+				|| (fdnew = bulkcreate (newother)) < 0)
+			goto done;
+		made[isleaf] = 1;
+		if ((n = convertfile (db, fdold, fdnew, isleaf)) < 0)
+			goto done;
+#if !defined(_WIN32)
+		if (fsync (fdnew) < 0)
+			goto done;
+#endif
+		nnodes += n;
+		close (fdold);
+		close (fdnew);
+		fdold = fdnew = -1;
+	}
+	strcpy (oldother, oldname);
+	strcat (oldother, ".roots");
+	strcpy (newother, newname);
+	strcat (newother, ".roots");
+	if (convertroots (oldother, newother) < 0)
+		goto done;
+	rslt = nnodes;
+done:
+	if (fdold >= 0)
+		close (fdold);
+	if (fdnew >= 0)
+		close (fdnew);
+	/* Don't leave half a DB for opendb to find */
+	if (rslt < 0 && made[NONLEAF])
+		unlink (newname);
+	if (rslt < 0 && made[ISLEAF])
+	{
+		strcpy (newother, newname);
+		strcat (newother, ".vals");
+		unlink (newother);
+	}
+	free (oldother);
+	free (newother);
 	free (db);
+	return rslt;
 }
@@ -13,11 +13,21 @@ typedef struct dbproof dbproof;
 /* The database holds values of size HASHSIZE */
 #define HASHSIZE	20
 
+/*
+ * How a node is hashed.  Flat hashes all its keys and childhashes in
+ * one go.  Merkle hashes them as the leaves of a Merkle tree, so that
+ * proofs can leave out most of a node.  New DBs are Merkle; DBs made
+ * before there was a choice are flat.  Must match the card.
+ */
+#define DBFORMAT_FLAT		0
+#define DBFORMAT_MERKLE		1
+
 /*
  * Return 1 if present, 0 if was absent.  If set is true, add it if absent.
  * Return *proof and *prooflen as a buffer that proves our correct operation,
  * suitable for presenting to the remote host where a verification algorithm
- * can confirm that we are operating properly.
+ * can confirm that we are operating properly.  The proof is only good
+ * for a flat format DB; for Merkle use testdbandsetbatch.
  */
 int testdbandmaybeset (dbproof *db, unsigned char **proof, unsigned *prooflen,
 	unsigned char *hash, int set);
@@ -25,9 +35,52 @@ int testdbandmaybeset (dbproof *db, unsigned char **proof, unsigned *prooflen,
 #define testdbandset(db,p,pl,h)		testdbandmaybeset(db,p,pl,h,1)
 #define testdb(db,p,pl,h)			testdbandmaybeset(db,p,pl,h,0)
 
+/*
+ * Test and set n hashes, hashes[i*HASHSIZE] in dbs[i], in order, up to
+ * the first one present; those after it are not set.  Return one
+ * *proof buffer holding a multi-key proof for each DB, preceded by its
+ * 4 byte length, which covers all that DB's hashes with each node sent
+ * once, good until the next call on dbs[0].  Return 1 if a hash was
+ * present, 0 if not, -1 on failure.
+ */
+int testdbandsetbatch (dbproof **dbs, int n, unsigned char **proof,
+	unsigned *prooflen, unsigned char *hashes);
+
 /* Return the depth of the DB btree */
 int testdb_depth (dbproof *db);
 
+/* Return the DBFORMAT of the DB */
+int testdb_format (dbproof *db);
+
+/*
+ * Look up n hashes in db without setting them, setting found[i] for
+ * each.  Return in *proof the part of a testdbandsetbatch proof for
+ * this DB, its 4 byte length and then a multi-key proof of the lookups,
+ * good until the next call on db.  Return the number found, -1 on
+ * failure.  This is how a snapshot from opensnap is read.
+ */
+int testdbprove (dbproof *db, int n, unsigned char **proof,
+	unsigned *prooflen, unsigned char *hashes, int *found);
+
+/*
+ * Return the generation of a copy-on-write DB, its count of published
+ * roots, or 0 for one updated in place.  If treehash is not NULL set it
+ * to the root hash of that generation.
+ */
+long testdb_generation (dbproof *db, unsigned char *treehash);
+
+/* Buffer pool counters, for sizing it */
+struct dbcachestats {
+	unsigned long hits;			/* Node found in the pool */
+	unsigned long misses;		/* Node read from its file */
+	unsigned long evictions;	/* Leaf dropped to make room */
+	unsigned long writebacks;	/* Dirty node written to its file */
+	int inner;					/* Inner nodes now in the pool */
+	int leaves;					/* Leaves now in the pool */
+};
+
+void testdb_cachestats (dbproof *db, struct dbcachestats *stats);
+
 /*
  * Locally test the validity proof; the exact same algorithm should be
  * used by the remote host.
@@ -35,6 +88,33 @@ int testdb_depth (dbproof *db);
 void testvalid (void *proof, unsigned prooflen, unsigned char *treehash,
 		int *maxdepth, unsigned char *hash, int shouldbefound, int set);
 
+/* The same for a proof from testdbandsetbatch with all hashes in one DB */
+void testvalidbatch (void *proof, unsigned prooflen, unsigned char *treehash,
+		int *maxdepth, unsigned char *hashes, int n, int *found, int format);
+
+/*
+ * Have opendb map the DB files into memory and use the nodes in place,
+ * rather than reading them into a buffer pool.
+ */
+void dbsetmmap (int on);
+
+/*
+ * Have opendb keep a write-ahead log next to each DB, so that a crash
+ * leaves it as of the last completed query, at one sync per query.
+ */
+void dbsetwal (int on);
+
+/*
+ * Have opendb keep each DB copy-on-write.  Nodes are never overwritten
+ * once published; each query appends the nodes it changes and then
+ * publishes the new root in the .roots file.  A crash leaves the DB as
+ * of the last root published, and readers may open snapshots of any
+ * published root while the DB is being updated.  Once a DB has a .roots
+ * file it stays copy-on-write.  Replaces the write-ahead log; with
+ * dbsetwal each root is synced before the query's proof goes out.
+ */
+void dbsetcow (int on);
+
 /*
  * Open the database file of the specified name.
  * Create it if it doesn't exist.
@@ -44,4 +124,64 @@ dbproof * opendb (char *name, int *created);
 
 void freedb (dbproof *db);
 
+/*
+ * Open a read-only snapshot of the copy-on-write DB called name, as it
+ * was when generation gen was published, or at the latest if gen is 0.
+ * Only testdbprove, testdb_depth, testdb_format and testdb_generation
+ * may be used on it.  Any number may be open, in any threads, while
+ * the DB is updated.  Return NULL if there is no such generation.
+ */
+dbproof * opensnap (char *name, long gen);
+
+/*
+ * Build a new DB called name, which must not already exist, from the
+ * hashes read from in, in any order and possibly repeated.  They are
+ * sorted runbytes at a time and merged, then the tree is packed from the
+ * leaves up with nodes fill percent full, the nodes hashed on nthreads
+ * threads (0 for one per processor) and written in order.  Return the
+ * number of distinct hashes, with the root hash and depth to check
+ * against testvalid in treehash and *depth, or -1 on failure.
+ */
+long bulkloaddb (char *name, FILE *in, int fill, int nthreads,
+	size_t runbytes, unsigned char *treehash, int *depth);
+
+/*
+ * Write a copy of the DB called oldname, whose files are in the layout
+ * used before version 2, as a new DB called newname in today's.  Only
+ * DBs written with 4 byte longs, that is on 32 bit hosts, can be
+ * converted; one written with 8 byte longs fails.  newname must not
+ * already exist and oldname must have no log still to apply.  Node
+ * numbers, hashes and copy-on-write roots are unchanged.  Return the
+ * number of nodes converted, or -1 on failure.
+ */
+long convertdb (char *oldname, char *newname);
+
+/* Nodes are counted by how full they are in tenths, the last being full */
+#define DBCHECKFILLS	11
+
+/* What checkdbfile found, index [0] for inner nodes and [1] for leaves */
+struct dbcheck {
+	unsigned char treehash[HASHSIZE];	/* Root hash */
+	int depth;
+	int format;
+	unsigned long nkeys;				/* Keys in the tree */
+	unsigned long nnodes[2];			/* Nodes in the tree */
+	unsigned long fill[2][DBCHECKFILLS];	/* The same by how full */
+	unsigned long unused[2];			/* Nodes in the files but not the tree */
+	long walbytes;						/* Log not yet applied to the files */
+	long generation;					/* Root checked if copy-on-write */
+	char *err;							/* First problem, NULL if none */
+	int errdepth;						/* Where it is, the root being 0 */
+	long errnode;						/* Node number in its file */
+	int errindex;						/* Key or child, -1 for the whole node */
+};
+
+/*
+ * Check every node of the DB called name against its keys and children,
+ * on nthreads threads (0 for one per processor), without changing it or
+ * replaying its log.  Return 0 if it is sound, 1 if chk->err says what
+ * is wrong, or -1 if the files could not be read.
+ */
+int checkdbfile (char *name, int nthreads, struct dbcheck *chk);
+
 #endif /* DBPROOF_H */
@@ -0,0 +1,193 @@
+/*
+ * keybench.c
+ *	Time the node key search against the plain binary search with a
+ *	byte by byte compare which it replaced, on synthetic full nodes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dbproof.h"
+#include "dbkey.h"
+
+/* Keys in a full node, NODEKEYS in dbproof.c */
+#define BENCHKEYS		100
+
+/* Nodes and lookups to cycle through, enough to spill the L1 cache */
+#define BENCHNODES		1024
+#define BENCHLOOKUPS	4096
+
+/* Default seconds to time each search for */
+#define BENCHSECONDS	2
+
+typedef unsigned char uchar;
+
+typedef struct benchnode {
+	uchar key[BENCHKEYS][HASHSIZE];
+} benchnode;
+
+static int
+oldkeycomp (uchar *key1, uchar *key2)
+{
+	int i;
+	uchar k1, k2;
+
+	for (i=0; i<HASHSIZE; i++)
+	{
+		k1 = key1[i];
+		k2 = key2[i];
+		if (k1 > k2)
+			return 1;
+		else if (k1 < k2)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+oldsearch (uchar (*keys)[HASHSIZE], int nkeys, uchar *key, int *keyind)
+{
+	int i;
+	int m, l, h;
+	int comp;
+
+	l = 0; h = nkeys-1;
+	i = 0;
+	while (l <= h)
+	{
+		m = (l+h)/2;
+		comp = oldkeycomp (keys[m], key);
+		if (comp == 0)
+		{
+			*keyind = m;
+			return 1;
+		} else if (comp > 0) {
+			h = m-1;
+		} else {
+			l = m+1;
+			if (m+1 > i)
+				i = m+1;
+		}
+	}
+	*keyind = i;
+	return 0;
+}
+
+static int
+keysortcomp (const void *a, const void *b)
+{
+	return memcmp (a, b, HASHSIZE);
+}
+
+/* Fill a node with sorted random keys, the first nprefix bytes from a */
+/* small set so that many share their prefixes */
+static void
+makenode (benchnode *n, int nprefix)
+{
+	int i, j;
+
+	for (i=0; i<BENCHKEYS; i++)
+		for (j=0; j<HASHSIZE; j++)
+			n->key[i][j] = (j < nprefix) ? rand() % 2 : rand();
+	qsort (n->key, BENCHKEYS, HASHSIZE, keysortcomp);
+}
+
+static double
+now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Return lookups per second for search over the nodes and queries */
+static double
+timesearch (int (*search)(uchar (*)[HASHSIZE], int, uchar *, int *),
+	benchnode *nodes, uchar (*queries)[HASHSIZE], int secs, long *sum)
+{
+	double start = now ();
+	double elapsed;
+	long count = 0;
+	int keyind;
+	int i;
+
+	do {
+		for (i=0; i<BENCHLOOKUPS; i++)
+		{
+			*sum += search (nodes[i%BENCHNODES].key, BENCHKEYS, queries[i],
+					&keyind);
+			*sum += keyind;
+		}
+		count += BENCHLOOKUPS;
+	} while ((elapsed = now () - start) < secs);
+	return count / elapsed;
+}
+
+int
+main (int ac, char **av)
+{
+	int secs = (ac > 1) ? atoi (av[1]) : BENCHSECONDS;
+	benchnode *nodes;
+	uchar (*queries)[HASHSIZE];
+	double oldrate, newrate;
+	long sum = 0;
+	int f1, f2, k1, k2;
+	int i, j, nprefix;
+
+	nodes = malloc (BENCHNODES * sizeof(benchnode));
+	queries = malloc (BENCHLOOKUPS * HASHSIZE);
+	if (nodes == NULL || queries == NULL || secs <= 0)
+	{
+		fprintf (stderr, "Usage: %s [seconds]\n", av[0]);
+		exit (1);
+	}
+	srand (1);
+
+	/* Check both agree, including on nodes full of prefix ties */
+	for (nprefix=0; nprefix<=HASHSIZE; nprefix+=4)
+	{
+		makenode (&nodes[0], nprefix);
+		for (i=0; i<BENCHLOOKUPS; i++)
+		{
+			if (i & 1)
+				memcpy (queries[i], nodes[0].key[i%BENCHKEYS], HASHSIZE);
+			else
+				for (j=0; j<HASHSIZE; j++)
+					queries[i][j] = (j < nprefix) ? rand() % 2 : rand();
+			f1 = oldsearch (nodes[0].key, BENCHKEYS, queries[i], &k1);
+			f2 = keysearch (nodes[0].key, BENCHKEYS, queries[i], &k2);
+			if (f1 != f2 || k1 != k2)
+			{
+				fprintf (stderr, "Searches disagree with %d tied bytes\n",
+						nprefix);
+				exit (1);
+			}
+		}
+	}
+
+	/* Half the lookups find their key and half don't, as on insert */
+	for (i=0; i<BENCHNODES; i++)
+		makenode (&nodes[i], 0);
+	for (i=0; i<BENCHLOOKUPS; i++)
+	{
+		if (i & 1)
+			memcpy (queries[i], nodes[i%BENCHNODES].key[rand()%BENCHKEYS],
+					HASHSIZE);
+		else
+			for (j=0; j<HASHSIZE; j++)
+				queries[i][j] = rand();
+	}
+
+	oldrate = timesearch (oldsearch, nodes, queries, secs, &sum);
+	newrate = timesearch (keysearch, nodes, queries, secs, &sum);
+	printf ("Searching nodes of %d keys:\n", BENCHKEYS);
+	printf ("  bytewise binary search   %6.1f ns\n", 1e9 / oldrate);
+	printf ("  prefix search            %6.1f ns  (%.2fx)\n", 1e9 / newrate,
+			newrate / oldrate);
+	/* Keep the searches from being optimized away */
+	if (sum == 0)
+		printf ("\n");
+	exit (0);
+}
@@ -12,11 +12,17 @@
 #include <winsock.h>
 #else
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/types.h>
@@ -35,7 +41,6 @@ WSADATA ws;
 					(((x)&0xff00)<<8)|(((x)&0xff)<<24))
 #define htonl	ntohl
 #define close	closesocket
-#define alarm(n)
 #else
 typedef int SOCKET;
 #endif
@@ -59,52 +64,62 @@ DEFAGENT;
 /* Bit size of RSA key used to secure communication */
 #define KEYSIZE		1024
 
-/* For blocksigs() */
-#define BLOCK		1
-#define UNBLOCK		0
-
-/* How long to wait on incoming connections */
+/* How long a client connection may sit idle */
 #define TIMEOUTSECS	3
 
 unsigned char bigbuf[CHAINSIZE];
 unsigned char chainbuf[CHAINSIZE];
 unsigned chainlen;
 
-int interruptflag;
-int alarmflag;
+volatile sig_atomic_t interruptflag;
 
 sccAdapterHandle_t handle;
 sccRB_t            rb;
 
 void dumpbuf (unsigned char *buf, int len);
-static int nread (int fd, void *buf, unsigned count);
 long SCC_CALL _sccRequest(sccAdapterHandle_t adapter_handle, sccRB_t *request_block);
 static int dokeygen (int numdbs);
-static int dolisten (int port, int numdbs);
+static int dolisten (int port, int *cardnums, int ncardnums);
 static int dorollover (int rollfileid);
 static int doaddpub (char *chainfile, int dbnum);
 static int dochangestate (int keynum, int enable);
 static int dolowbatt (void);
-static void blocksigs(int block);
-static void alarmhandler (int signum);
+static void inthandler (int signum);
 
 static void
 userr (char *pname)
 {
-	fprintf (stderr, "Usage: %s [-d workingdirectory] command args\n"
+	fprintf (stderr, "Usage: %s [-m] [-s] [-c] [-d workingdirectory] command args\n"
 				"  Commands are:\n"
 				"    initialize [cnum]\n"
-				"    listen port [cnum]\n"
+				"    listen port [cnum ...|all]\n"
 				"    rollover [cnum]\n"
 				"    addpub chainfile [cnum]\n"
 				"    disable keynum [cnum]\n"
 				"    enable keynum [cnum]\n"
 				"    clearlowbatt [cnum]\n"
 				"    (cnum is card number, defaults to 0)\n"
+				"  To listen on several cards, keep the files for card n in\n"
+				"  subdirectory card<n> of the working directory.\n"
+				"  -m maps the DB files into memory.\n"
+				"  -s commits DB changes through a write-ahead log.\n"
+				"  -c keeps the DBs copy-on-write, for snapshots.\n"
 				, pname);
 	exit (1);
 }
 
+/* Name of a file in directory dir, or in the CWD if dir is NULL */
+static char *
+dirfile (char *dir, char *name)
+{
+	static char buf[1024];
+
+	if (dir == NULL)
+		return name;
+	snprintf (buf, sizeof(buf), "%s/%s", dir, name);
+	return buf;
+}
+
 static char *
 dbname (int n)
 {
@@ -114,24 +129,54 @@ dbname (int n)
 	return buf;
 }
 
-/* Return how many DB files (consecutively numbered from 0) are in the CWD */
+/* Return how many DB files (consecutively numbered from 0) are in dir */
 static int
-dbcount ()
+dbcount (char *dir)
 {
 	struct stat s;
 	int n = 0;
 
-	while (stat (dbname(n), &s) == 0)
+	while (stat (dirfile(dir, dbname(n)), &s) == 0)
 		n++;
 	return n;
 }
 
+/* Open the adapter, waiting if it is busy */
+static void
+openadapter (int adapterNumber, sccAdapterHandle_t *phandle)
+{
+	long				rc;
+
+	if ((rc = sccOpenAdapter(adapterNumber,phandle)) != 0)
+	{
+		if (rc != HDDDeviceBusy)
+		{
+			printf("sccOpenAdapter(%d) failed rc = 0x%x\n",adapterNumber,rc);
+			exit(1);
+		}
+		printf ("Adapter %d busy, waiting for it...\n", adapterNumber);
+		while (rc == HDDDeviceBusy)
+		{
+			sleep (3);
+			rc = sccOpenAdapter(adapterNumber, phandle);
+		};
+		if (rc != 0)
+		{
+			printf("sccOpenAdapter(%d) failed rc = 0x%x\n",adapterNumber,rc);
+			exit(1);
+		}
+		sleep (1);
+	}
+}
+
 int
 main(int ac, char **av)
 {
 	long				rc;
 	sccAdapterNumber_t	adapterCount;
 	int					adapterNumber = 0;
+	int					*listencards = &adapterNumber;
+	int					nlistencards = 1;
 	int					port;
 	int					numdbs;
 	int					rolldbnum;
@@ -141,6 +186,7 @@ main(int ac, char **av)
 	int					cmdkeygen, cmdlisten;
 	int					cmdrollover, cmdlowbatt;
 	int					cmdadd, cmdenable, cmddisable;
+	int					i;
 
 #if defined(_WIN32)
 	WSAStartup (0x0101, &ws);
@@ -149,6 +195,23 @@ main(int ac, char **av)
 	if (ac < 2)
 		userr (av[0]);
 
+	while (strcmp (av[1], "-m") == 0 || strcmp (av[1], "-s") == 0
+			|| strcmp (av[1], "-c") == 0)
+	{
+		if (av[1][1] == 'm')
+			dbsetmmap (1);
+		else if (av[1][1] == 'c')
+			dbsetcow (1);
+		else
+			dbsetwal (1);
+		/* Discard first argument */
+		av[1] = av[0];
+		av += 1;
+		ac -= 1;
+		if (ac < 2)
+			userr (av[0]);
+	}
+
 	if (strcmp (av[1], "-d") == 0)
 	{
 		if (ac < 4)
@@ -185,7 +248,7 @@ main(int ac, char **av)
 
 	if (cmdlisten)
 	{
-		if (ac < 3 || ac > 4)
+		if (ac < 3)
 			userr (av[0]);
 		port = atoi (av[2]);
 		if (port < 0 || port > 65535)
@@ -193,8 +256,14 @@ main(int ac, char **av)
 			fprintf (stderr, "Illegal port number %d\n", port);
 			exit (1);
 		}
-		if (ac == 4)
-			adapterNumber = atoi(av[3]);
+		if (ac > 4 || (ac == 4 && strcmp (av[3], "all") != 0))
+		{
+			nlistencards = ac - 3;
+			listencards = malloc (nlistencards * sizeof(int));
+			for (i=0; i<nlistencards; i++)
+				listencards[i] = atoi(av[3+i]);
+		} else if (ac == 4)
+			nlistencards = 0;		/* all, once we know the count */
 	}
 
 	if (cmdadd)
@@ -226,45 +295,42 @@ main(int ac, char **av)
 		exit(1);
 	}
 
-	if (adapterCount < adapterNumber + 1)
+	if (cmdlisten && nlistencards == 0)
 	{
-		printf("Found %d adapters in the system; "
-		   "command targeted to adapter index %d\n",
-		   adapterCount,adapterNumber);
-		exit(1);
+		if (adapterCount == 0)
+		{
+			printf ("No adapters found in the system\n");
+			exit (1);
+		}
+		nlistencards = adapterCount;
+		listencards = malloc (nlistencards * sizeof(int));
+		for (i=0; i<nlistencards; i++)
+			listencards[i] = i;
 	}
 
-	if ((rc = sccOpenAdapter(adapterNumber,&handle)) != 0)
+	for (i=0; i<nlistencards; i++)
 	{
-		if (rc != HDDDeviceBusy)
-		{
-			printf("sccOpenAdapter(%d) failed rc = 0x%x\n",adapterNumber,rc);
-			exit(1);
-		}
-		printf ("Adapter %d busy, waiting for it...\n", adapterNumber);
-		while (rc == HDDDeviceBusy)
+		if (listencards[i] < 0 || adapterCount < listencards[i] + 1)
 		{
-			sleep (3);
-			rc = sccOpenAdapter(adapterNumber, &handle);
-		};
-		if (rc != 0)
-		{
-			printf("sccOpenAdapter(%d) failed rc = 0x%x\n",adapterNumber,rc);
+			printf("Found %d adapters in the system; "
+			   "command targeted to adapter index %d\n",
+			   adapterCount,listencards[i]);
 			exit(1);
 		}
-		sleep (1);
 	}
 
+	if (cmdlisten)
+		return dolisten (port, listencards, nlistencards);
+
+	openadapter (adapterNumber, &handle);
+
 	printf ("Adapter ready!\n");
 
-	numdbs = dbcount ();
+	numdbs = dbcount (NULL);
 
 	if (cmdkeygen)
 		return dokeygen (numdbs);
 
-	if (cmdlisten)
-		return dolisten (port, numdbs);
-
 	if (cmdrollover)
 		return dorollover (numdbs);
 
@@ -535,55 +601,183 @@ dorollover (int dbnum)
 	return 0;
 }
 
+/*
+ * Network front end for the listen command.
+ *
+ * The main thread services all client sockets with epoll, never
+ * blocking on any one of them.  Once a complete request has arrived
+ * it is queued for a card thread, which runs the card exchanges
+ * (including the database query loop for CMD_SIGN) one after
+ * another.  Finished requests come back to the main thread through
+ * a pipe, and their replies are written out as the client's socket
+ * accepts them.  A slow client therefore only holds up itself, and
+ * the card stays busy as long as there is work queued.
+ *
+ * Several cards may be served at once, each with its own thread,
+ * queue, chain and DB files.  Sign requests go to the least loaded
+ * card whose cardid matches the one at the front of the request.
+ */
+
+/* A reply waiting to be written to a client */
+struct outbuf {
+	struct outbuf	*next;
+	unsigned		len;
+	unsigned		off;
+	unsigned char	data[1];
+};
+
+/* A client connection */
+struct conn {
+	SOCKET			s;
+	struct sockaddr_in addr;
+	unsigned char	*inbuf;			/* Bytes of requests not yet handled */
+	unsigned		inlen;
+	unsigned		insize;
+	struct outbuf	*outhead;		/* Replies not yet written */
+	struct outbuf	*outtail;
+	int				events;			/* Current epoll interest */
+	int				pending;		/* Requests queued or at the card */
+	int				v2;				/* Using version 2 framing */
+	int				done;			/* Read no more, close when written */
+	int				closed;			/* Socket gone, on zombielist */
+	time_t			lastio;
+	struct conn		*next;
+	struct conn		*prev;
+};
+
+/* A request for the card */
+struct job {
+	struct job		*next;
+	struct conn		*conn;
+	struct card		*card;
+	unsigned char	cmd;
+	unsigned long	reqid;
+	unsigned char	*buf;
+	unsigned		buflen;
+	long			status;
+	unsigned char	*reply;
+	unsigned		replylen;
+};
+
+/* One of the cards we are serving */
+struct card {
+	int				cnum;
+	char			*dir;			/* Where its files are, NULL for CWD */
+	sccAdapterHandle_t handle;
+	unsigned char	*chain;
+	unsigned		chainlen;
+	unsigned char	cardid[CARDID_LENGTH];
+	int				hascardid;		/* Found cardid in the chain */
+	dbproof			**db;			/* Only its card thread uses these */
+	int				numdbs;
+	pthread_t		tid;
+	pthread_cond_t	cond;
+	struct job		*jobhead;		/* Requests waiting for this card */
+	struct job		*jobtail;
+	int				load;			/* Requests given it and not yet back */
+	unsigned char	*proof;			/* Our copy of a DB proof */
+	unsigned		proofsize;
+};
+
+/* Most client connections we will handle at once */
+#define MAXCONNS	1024
+
+/* Most epoll events per wakeup */
+#define MAXEVENTS	64
+
+/* Size of an original format request header: cmd and 16 bit length */
+#define REQHDRSIZE	3
+
+/* Most requests a version 2 client may have at the card at once */
+#define MAXPIPELINE	32
+
+/* How long a version 2 connection may sit idle between requests */
+#define V2TIMEOUTSECS	120
+
+/* Granularity of connection input buffers */
+#define INBUFSIZE	4096
+
+static struct conn	*connlist;
+static struct conn	*zombielist;
+static int			nconns;
+static int			epfd;
+static int			wakefd[2];
+static int			listentag, waketag;
+
+static struct card	*cards;
+static int			ncards;
+
+/* Protects card request queues and finished ones coming back */
+static pthread_mutex_t	qlock = PTHREAD_MUTEX_INITIALIZER;
+static struct job		*donehead, *donetail;
+static int				nstopped;
+
+static void cardopen (struct card *card, int cnum, int ownsdir);
+static int chaincardid (unsigned char *cardid, unsigned char *chain,
+	unsigned chainlen);
+static struct card *pickcard (unsigned char *cardid);
+static void *cardthread (void *arg);
+static void cardstat (struct card *card, struct job *job,
+	unsigned char *cardbuf);
+static void cardsign (struct card *card, struct job *job,
+	unsigned char *cardbuf);
+static void connaccept (SOCKET s);
+static void connread (struct conn *c);
+static void connparse (struct conn *c);
+static void connwrite (struct conn *c);
+static void connclose (struct conn *c);
+static void connevents (struct conn *c);
+static int connrequest (struct conn *c, unsigned char cmd,
+	unsigned long reqid, unsigned char *buf, unsigned buflen);
+static void connreply (struct conn *c, unsigned long reqid, long status,
+	unsigned char *data, unsigned len);
+static void connqueue (struct conn *c, unsigned char *data1,
+	unsigned len1, unsigned char *data2, unsigned len2);
+static void jobsdone (void);
+
 static int
-dolisten (int port, int numdbs)
+dolisten (int port, int *cardnums, int ncardnums)
 {
-	long				rc;
-	char				*buf;
-	unsigned short		buflen;
-	unsigned long		statlen;
-	int					found;
-	unsigned char		*proof;
-	unsigned 			prooflen;
-	SOCKET				s, s1;
-	unsigned char		cmd;
-	struct sockaddr_in	sockaddr, otheraddr;
-	int					otheraddrsize = sizeof(otheraddr);
+	SOCKET				s;
+	struct sockaddr_in	sockaddr;
 	int					reuseflag = -1;
-	unsigned char		roothashbuf[HASHSIZE];
-	unsigned int		fileid;
-	FILE				*fchain;
-	dbproof				**db;
-	int					dbcreated;
-	int					i;
-	unsigned			status;
-	time_t				curtime;
-unsigned int debug3[100];
-
-	/* Read certificate chain file for responding to requests */
-	if ((fchain = fopen (CHAINFILENAME, "rb")) == NULL)
+	int					i, n;
+	struct epoll_event	ev;
+	struct epoll_event	events[MAXEVENTS];
+	struct conn			*c, *cnext;
+	sigset_t			sigs, osigs;
+	time_t				now;
+
+	/* With more than one card, each keeps its files in its own directory */
+	if ((cards = calloc (ncardnums, sizeof(struct card))) == NULL)
 	{
-		fprintf (stderr, "Unable to open chain file %s\n", CHAINFILENAME);
-		exit (1);
+		fprintf (stderr, "Out of memory\n");
+		exit (2);
 	}
-	chainlen = fread (chainbuf, 1, sizeof(bigbuf), fchain);
-	fclose (fchain);
-
-	/* Open DBs */
-	db = malloc (numdbs * sizeof(dbproof *));
-	for (i=0; i<numdbs; i++)
+	ncards = ncardnums;
+	for (i=0; i<ncards; i++)
+		cardopen (&cards[i], cardnums[i], ncards > 1);
+
+	/*
+	 * Signals go only to this thread; the card threads notice the flag
+	 * between requests, so we never stop in the middle of a DB update.
+	 */
+	signal (SIGPIPE, SIG_IGN);
+	signal (SIGINT, inthandler);
+	signal (SIGTERM, inthandler);
+	sigemptyset (&sigs);
+	sigaddset (&sigs, SIGINT);
+	sigaddset (&sigs, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &sigs, &osigs);
+	for (i=0; i<ncards; i++)
 	{
-		db[i] = opendb (dbname(i), &dbcreated);
-		if (dbcreated)
+		if (pthread_create (&cards[i].tid, NULL, cardthread, &cards[i]) != 0)
 		{
-			fprintf (stderr, "Unable to find DB file %s; delete it and run keygen\n", dbname(i));
-			exit (1);
+			fprintf (stderr, "Unable to start card thread\n");
+			exit (2);
 		}
 	}
-
-#if !defined(_WIN32)
-	signal (SIGALRM, alarmhandler);
-#endif
+	pthread_sigmask (SIG_SETMASK, &osigs, NULL);
 
 	/* Begin listening on socket */
 	s = socket(AF_INET, SOCK_STREAM, 0);
@@ -599,225 +793,935 @@ unsigned int debug3[100];
 		perror ("bind");
 		exit (2);
 	}
-	if (listen(s, 5) < 0) {
+	if (listen(s, SOMAXCONN) < 0) {
 		perror ("listen");
 		exit (2);
 	}
+	fcntl (s, F_SETFL, O_NONBLOCK);
 
-	printf ("Listening on port %d, %d rpowdb files found...\n", port, numdbs);
+	if ((epfd = epoll_create (MAXEVENTS)) < 0 || pipe (wakefd) < 0)
+	{
+		perror ("epoll");
+		exit (2);
+	}
+	fcntl (wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl (wakefd[1], F_SETFL, O_NONBLOCK);
+	memset (&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listentag;
+	epoll_ctl (epfd, EPOLL_CTL_ADD, s, &ev);
+	ev.data.ptr = &waketag;
+	epoll_ctl (epfd, EPOLL_CTL_ADD, wakefd[0], &ev);
+
+	if (ncards == 1)
+		printf ("Listening on port %d, %d rpowdb files found...\n", port,
+				cards[0].numdbs);
+	else
+		printf ("Listening on port %d with %d cards...\n", port, ncards);
+	fflush (stdout);
 
 	for ( ; ; )
 	{
-		/* Handle commands */
-		s1 = accept (s, (struct sockaddr *)&otheraddr, &otheraddrsize);
-		if (s1 < 0) {
-			perror ("accept");
-			exit (2);
-		}
-		printf ("Incoming connection from ");
-		printf ("%d.%d.%d.%d at ", otheraddr.sin_addr.s_addr&0xff,
-						(otheraddr.sin_addr.s_addr>>8)&0xff,
-						(otheraddr.sin_addr.s_addr>>16)&0xff,
-						(otheraddr.sin_addr.s_addr>>24)&0xff);
-		curtime = time(NULL);
-		printf ("%s", ctime(&curtime));
-		
-
-		if (nread (s1, &cmd, 1) < 1
-			|| nread (s1, &buflen, 2) < 2)
+		n = epoll_wait (epfd, events, MAXEVENTS, 1000);
+		if (n < 0 && errno != EINTR)
 		{
-			close (s1);
-			continue;
+			perror ("epoll_wait");
+			exit (2);
 		}
-		buflen = ntohs (buflen);
-		buf = malloc (buflen);
-		if (nread (s1, buf, buflen) < buflen)
+		if (interruptflag)
 		{
-			free (buf);
-			close (s1);
-			continue;
+			/* Wake the card threads so they can exit */
+			pthread_mutex_lock (&qlock);
+			for (i=0; i<ncards; i++)
+				pthread_cond_signal (&cards[i].cond);
+			pthread_mutex_unlock (&qlock);
 		}
 
-		switch (cmd)
+		for (i=0; i<n; i++)
 		{
-		case CMD_GETCHAIN:
-			free (buf);
-			buflen = htons ((short)chainlen);
-			send (s1, (unsigned char *)&buflen, 2, 0);
-			send (s1, chainbuf, UP4(chainlen), 0);
-			close (s1);
-			printf ("Chain query answered\n");
-			break;
-		case CMD_STAT:
-			if (buflen != KEYSIZE/8)
+			if (events[i].data.ptr == &listentag)
+				connaccept (s);
+			else if (events[i].data.ptr == &waketag)
+				jobsdone ();
+			else
 			{
-				free (buf);
-				close (s1);
-				break;
+				c = events[i].data.ptr;
+				if (!c->closed && (events[i].events & EPOLLIN))
+					connread (c);
+				if (!c->closed && (events[i].events & EPOLLOUT))
+					connwrite (c);
+				if (!c->closed && (events[i].events & (EPOLLERR|EPOLLHUP)))
+					connclose (c);
 			}
+		}
 
-			memset (&rb, 0, sizeof(rb));
-			rb.AgentID				= agentID;
-			rb.OutBufferLength[0]	= KEYSIZE / 8;
-			rb.pOutBuffer[0]		= buf;
-			rb.InBufferLength[0]	= sizeof(bigbuf);
-			rb.pInBuffer[0]			= bigbuf;
-			rb.UserDefined			= CMD_STAT;
-
-			if ((rc = _sccRequest(handle,&rb)) != 0)
+		/* Drop clients which have gone quiet */
+		now = time(NULL);
+		for (c=connlist; c!=NULL; c=cnext)
+		{
+			cnext = c->next;
+			if (c->pending == 0 && now - c->lastio >
+					(c->v2 ? V2TIMEOUTSECS : TIMEOUTSECS))
 			{
-				printf("sccRequest failed rc = 0x%x\n",rc);
-				sccCloseAdapter(handle);
-				exit(1);
+				printf ("(timed out)\n");
+				connclose (c);
 			}
-			free (buf);
-			status = htonl (rb.Status);
-			send (s1, (unsigned char *)&status, sizeof(status), 0);
+		}
 
-			if (rb.Status != 0)
-			{
-				printf ("Card reports error, code is %d\n", rb.Status);
-				close (s1);
+		/* Free closed connections the card is finished with */
+		for (c=zombielist; c!=NULL; c=cnext)
+		{
+			cnext = c->next;
+			if (c->pending != 0)
 				continue;
-			}
+			if (c->prev)
+				c->prev->next = c->next;
+			else
+				zombielist = c->next;
+			if (c->next)
+				c->next->prev = c->prev;
+			free (c);
+		}
+		fflush (stdout);
+	}
+
+	/* never gets here */
+	return 0;
+}
+
+/* Open a card for listening, and read its chain and DB files */
+static void
+cardopen (struct card *card, int cnum, int ownsdir)
+{
+	FILE			*fchain;
+	int				dbcreated;
+	int				i;
+
+	card->cnum = cnum;
+	if (ownsdir)
+	{
+		card->dir = malloc (32);
+		sprintf (card->dir, "card%d", cnum);
+	}
+	openadapter (cnum, &card->handle);
+
+	/* Read certificate chain file for responding to requests */
+	if ((card->chain = malloc (CHAINSIZE)) == NULL)
+	{
+		fprintf (stderr, "Out of memory\n");
+		exit (2);
+	}
+	if ((fchain = fopen (dirfile(card->dir, CHAINFILENAME), "rb")) == NULL)
+	{
+		fprintf (stderr, "Unable to open chain file %s\n",
+				dirfile(card->dir, CHAINFILENAME));
+		exit (1);
+	}
+	card->chainlen = fread (card->chain, 1, CHAINSIZE, fchain);
+	fclose (fchain);
+	card->hascardid = (chaincardid (card->cardid, card->chain,
+				card->chainlen) == 0);
+
+	/* Open DBs */
+	card->numdbs = dbcount (card->dir);
+	card->db = malloc (card->numdbs * sizeof(dbproof *));
+	if (card->numdbs > 0 && card->db == NULL)
+	{
+		fprintf (stderr, "Out of memory\n");
+		exit (2);
+	}
+	for (i=0; i<card->numdbs; i++)
+	{
+		card->db[i] = opendb (dirfile(card->dir, dbname(i)), &dbcreated);
+		if (card->db[i] == NULL)
+		{
+			fprintf (stderr, "Unable to open DB file %s\n",
+					dirfile(card->dir, dbname(i)));
+			exit (1);
+		}
+		if (dbcreated)
+		{
+			fprintf (stderr, "Unable to find DB file %s; delete it and run keygen\n",
+					dirfile(card->dir, dbname(i)));
+			exit (1);
+		}
+	}
+	pthread_cond_init (&card->cond, NULL);
+
+	printf ("Adapter %d ready", cnum);
+	if (ownsdir)
+		printf (", %d rpowdb files found", card->numdbs);
+	if (!card->hascardid)
+		printf (", no cardid in chain");
+	printf ("\n");
+}
 
-			/* Return reply to the client */
-			send (s1, bigbuf, rb.InBufferLength[0], 0);
+/* Little-endian 32 bit value in the card's certificate formats */
+#define GETLE32(p)	((p)[0] | ((p)[1]<<8) | ((p)[2]<<16) | ((unsigned)(p)[3]<<24))
+#define GETBE32(p)	(((unsigned)(p)[0]<<24) | ((p)[1]<<16) | ((p)[2]<<8) | (p)[3])
+
+/*
+ * Pull the cardid out of the first cert in the chain, the one the card
+ * made at keygen.  Its body's vDescB holds the comm and rpow keys as
+ * length-prefixed n and e values, then the cardid.  The card's structs
+ * have 32 bit longs, so we use their offsets rather than the structs.
+ * Return 0 if found.
+ */
+static int
+chaincardid (unsigned char *cardid, unsigned char *chain, unsigned chainlen)
+{
+	unsigned		bodyoff, keyoff, keylen;
+	unsigned		len;
+	int				i;
+
+	/* sccHead_t vData is at offset 8, sccBody_t vDescB at offset 24 */
+	if (chainlen < 16)
+		return -1;
+	bodyoff = 8 + GETLE32(chain+8);
+	if (bodyoff < 8 || bodyoff > chainlen || chainlen - bodyoff < 32)
+		return -1;
+	keyoff = bodyoff + 24 + GETLE32(chain+bodyoff+24);
+	keylen = GETLE32(chain+bodyoff+28);
+	if (keyoff < bodyoff + 24 || keyoff > chainlen
+			|| keylen > chainlen - keyoff)
+		return -1;
+
+	for (i=0; i<4; i++)
+	{
+		if (keylen < 4)
+			return -1;
+		len = GETBE32(chain+keyoff);
+		if (len > keylen - 4)
+			return -1;
+		keyoff += 4 + len;
+		keylen -= 4 + len;
+	}
+	if (keylen != CARDID_LENGTH)
+		return -1;
+	memcpy (cardid, chain+keyoff, CARDID_LENGTH);
+	return 0;
+}
+
+/*
+ * Choose the least loaded card with the given cardid.  If none has it,
+ * or cardid is NULL, use the first card; with just one card that is
+ * the old behavior, and the card reports the mismatch itself.
+ */
+static struct card *
+pickcard (unsigned char *cardid)
+{
+	struct card		*best = NULL;
+	int				i;
+
+	if (cardid == NULL)
+		return &cards[0];
+	for (i=0; i<ncards; i++)
+	{
+		if (!cards[i].hascardid
+				|| memcmp (cards[i].cardid, cardid, CARDID_LENGTH) != 0)
+			continue;
+		if (best == NULL || cards[i].load < best->load)
+			best = &cards[i];
+	}
+	return best ? best : &cards[0];
+}
+
+static void
+connaccept (SOCKET s)
+{
+	SOCKET				s1;
+	struct sockaddr_in	otheraddr;
+	socklen_t			otheraddrsize;
+	struct conn			*c;
+	struct epoll_event	ev;
+	time_t				curtime;
+
+	for ( ; ; )
+	{
+		otheraddrsize = sizeof(otheraddr);
+		s1 = accept (s, (struct sockaddr *)&otheraddr, &otheraddrsize);
+		if (s1 < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+					&& errno != ECONNABORTED)
+				perror ("accept");
+			return;
+		}
+		if (nconns >= MAXCONNS || (c = calloc (1, sizeof(*c))) == NULL)
+		{
 			close (s1);
-			printf ("Status query answered\n");
+			continue;
+		}
+		printf ("Incoming connection from ");
+		printf ("%d.%d.%d.%d at ", otheraddr.sin_addr.s_addr&0xff,
+						(otheraddr.sin_addr.s_addr>>8)&0xff,
+						(otheraddr.sin_addr.s_addr>>16)&0xff,
+						(otheraddr.sin_addr.s_addr>>24)&0xff);
+		curtime = time(NULL);
+		printf ("%s", ctime(&curtime));
+
+		fcntl (s1, F_SETFL, O_NONBLOCK);
+		c->s = s1;
+		c->addr = otheraddr;
+		c->lastio = curtime;
+		c->next = connlist;
+		if (connlist)
+			connlist->prev = c;
+		connlist = c;
+		nconns++;
+
+		memset (&ev, 0, sizeof(ev));
+		ev.events = c->events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl (epfd, EPOLL_CTL_ADD, s1, &ev);
+	}
+}
+
+/* Read what is available and act on any complete requests */
+static void
+connread (struct conn *c)
+{
+	unsigned char	*buf;
+	int				err;
+
+	if (c->done)
+		return;
+	if (c->insize - c->inlen < INBUFSIZE / 2)
+	{
+		if ((buf = realloc (c->inbuf, c->insize + INBUFSIZE)) == NULL)
+		{
+			connclose (c);
+			return;
+		}
+		c->inbuf = buf;
+		c->insize += INBUFSIZE;
+	}
+	err = recv (c->s, c->inbuf + c->inlen, c->insize - c->inlen, 0);
+	if (err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			|| errno == EINTR))
+		return;
+	if (err <= 0)
+	{
+		connclose (c);
+		return;
+	}
+	c->inlen += err;
+	c->lastio = time(NULL);
+	connparse (c);
+}
+
+/*
+ * Act on the complete requests in the input buffer.  A connection may
+ * have up to MAXPIPELINE requests outstanding; beyond that we leave
+ * the rest in the buffer until replies go out.
+ */
+static void
+connparse (struct conn *c)
+{
+	unsigned char	*p;
+	unsigned		hdrsize;
+	unsigned long	buflen;
+	unsigned long	reqid;
+	unsigned char	cmd;
+	unsigned		used = 0;
+	unsigned char	*buf;
+
+	while (!c->done && !c->closed && c->pending < MAXPIPELINE)
+	{
+		p = c->inbuf + used;
+		if (c->inlen - used < 1)
 			break;
-		case CMD_SIGN:
-			if ((buflen-CARDID_LENGTH) <= KEYSIZE/8
-					||  (buflen-CARDID_LENGTH) % 4 != 0)
-			{
-				free (buf);
-				close (s1);
+		if (p[0] == V2_FRAME)
+		{
+			hdrsize = V2_REQHDRSIZE;
+			if (c->inlen - used < hdrsize)
 				break;
-			}
-#if 0
-			msgcardid = buf;
-			if (memcmp (msgcardid, cardid, CARDID_LENGTH) != 0)
+			buflen = ((unsigned long)p[8] << 24) | (p[9] << 16)
+						| (p[10] << 8) | p[11];
+			reqid = ((unsigned long)p[4] << 24) | (p[5] << 16)
+						| (p[6] << 8) | p[7];
+			cmd = p[1];
+			if (buflen > V2_MAXDATA)
 			{
-				free (buf);
-				status = htonl (RPOW_STAT_BADCARDID);
-				send (s1, (unsigned char *)&status, sizeof(status), 0);
-				close (s1);
-				break;
+				connclose (c);
+				return;
 			}
-#endif
-			memset (&rb, 0, sizeof(rb));
-			rb.AgentID				= agentID;
-			rb.OutBufferLength[0]	= KEYSIZE / 8;
-			rb.pOutBuffer[0]		= buf + CARDID_LENGTH;
-			rb.OutBufferLength[1]	= buflen - (KEYSIZE / 8) - CARDID_LENGTH;
-			rb.pOutBuffer[1]		= buf + (KEYSIZE / 8) + CARDID_LENGTH;
-			rb.InBufferLength[0]	= sizeof(bigbuf);
-			rb.pInBuffer[0]			= bigbuf;
-			rb.InBufferLength[1]	= sizeof(roothashbuf);
-			rb.pInBuffer[1]			= roothashbuf;
-			rb.InBufferLength[2]	= sizeof(fileid);
-			rb.pInBuffer[2]			= &fileid;
-			rb.UserDefined			= CMD_SIGN;
-rb.InBufferLength[3] = sizeof(debug3);		// holds profile timing
-rb.pInBuffer[3] = (unsigned char *)debug3;
-
-			blocksigs (BLOCK);
-
-			if ((rc = _sccRequest(handle,&rb)) != 0)
+			c->v2 = 1;
+		} else {
+			/* Original format may only be the first and only request */
+			hdrsize = REQHDRSIZE;
+			if (c->v2)
 			{
-				printf("sccRequest failed rc = 0x%x\n",rc);
-				sccCloseAdapter(handle);
-				exit(1);
+				connclose (c);
+				return;
 			}
-			free (buf);
+			if (c->inlen - used < hdrsize)
+				break;
+			buflen = (p[1] << 8) | p[2];
+			reqid = 0;
+			cmd = p[0];
+		}
 
-			/* Handle database queries from card */
-			while (rb.Status == -ERR_DBQUERY)
+		if (c->inlen - used < hdrsize + buflen)
+		{
+			/* Make sure the whole request will fit */
+			if (hdrsize + buflen > c->insize)
 			{
-				/* We expect to get a hash back */
-				if (rb.InBufferLength[0] != HASHSIZE)
+				memmove (c->inbuf, p, c->inlen - used);
+				c->inlen -= used;
+				used = 0;
+				if ((buf = realloc (c->inbuf, hdrsize + buflen)) == NULL)
 				{
-					printf ("Error, answer back length is %d\n",
-							rb.InBufferLength[0]);
-					exit (2);
+					connclose (c);
+					return;
 				}
+				c->inbuf = buf;
+				c->insize = hdrsize + buflen;
+			}
+			break;
+		}
 
-				/* Now we query our database to see if the item is present */
-				if (fileid >= numdbs)
-				{
-					printf ("Error, card asked for fileid %d\n", fileid);
-					prooflen = 0;
-					proof = NULL;
-					found = 1;
-				} else {
-printf ("Host querying DB %d with hash ", fileid);
-dumpbuf (bigbuf, HASHSIZE);
-printf ("Host expects DB root hash ");
-dumpbuf (roothashbuf, HASHSIZE);
-					found = testdbandset (db[fileid], &proof, &prooflen, bigbuf);
-				}
+		if (!c->v2)
+			c->done = 1;
+		if (connrequest (c, cmd, reqid, p + hdrsize, buflen) < 0)
+		{
+			connclose (c);
+			return;
+		}
+		used += hdrsize + buflen;
+	}
 
-				/* Send the proof */
-				memset (&rb, 0, sizeof(rb));
-				rb.AgentID				= agentID;
-				rb.OutBufferLength[0]	= sizeof(prooflen);
-				rb.pOutBuffer[0]		= &prooflen;
-				rb.OutBufferLength[1]	= UP4(prooflen);
-				rb.pOutBuffer[1]		= proof;
-
-				/* Get back the card's official answer */
-				rb.InBufferLength[0]	= sizeof(bigbuf);
-				rb.pInBuffer[0]			= bigbuf;
-				rb.InBufferLength[1]	= sizeof(roothashbuf);
-				rb.pInBuffer[1]			= roothashbuf;
-				rb.InBufferLength[2]	= sizeof(fileid);
-				rb.pInBuffer[2]			= &fileid;
-rb.InBufferLength[3] = sizeof(debug3);		// holds profile timing
-rb.pInBuffer[3] = (unsigned char *)debug3;
-				rb.UserDefined			= CMD_DBAUTH;
-				
-				if ((rc = _sccRequest(handle,&rb)) != 0)
-				{
-					printf("sccRequest failed rc = 0x%x\n",rc);
-					sccCloseAdapter(handle);
-					exit(1);
-				}
-			}
+	if (c->closed)
+		return;
+	if (used)
+	{
+		memmove (c->inbuf, c->inbuf + used, c->inlen - used);
+		c->inlen -= used;
+	}
+	connevents (c);
+}
 
-			blocksigs (UNBLOCK);
+/*
+ * Handle a complete request.  Return -1 if it is malformed and the
+ * connection should be dropped.  Version 2 clients get an error
+ * reply instead, so their other requests can go ahead.
+ */
+static int
+connrequest (struct conn *c, unsigned char cmd, unsigned long reqid,
+	unsigned char *buf, unsigned buflen)
+{
+	struct job		*job;
+	struct card		*card = NULL;
+	unsigned short	chainlen16;
+	unsigned		cindex = 0;
+	long			err = 0;
 
-			/* Send card status preceding reply message if any */
-			status = htonl (rb.Status);
-			send (s1, (unsigned char *)&status, sizeof(status), 0);
+	switch (cmd)
+	{
+	case CMD_GETCHAIN:
+		/* Optional 4 byte index picks among several cards */
+		if (buflen == 4)
+			cindex = GETBE32(buf);
+		if ((buflen != 0 && buflen != 4) || cindex >= ncards)
+		{
+			err = ERR_BADINPUT;
+			break;
+		}
+		card = &cards[cindex];
+		if (c->v2)
+			connreply (c, reqid, 0, card->chain, card->chainlen);
+		else
+		{
+			chainlen16 = htons ((short)card->chainlen);
+			connqueue (c, (unsigned char *)&chainlen16, 2,
+					card->chain, UP4(card->chainlen));
+		}
+		printf ("Chain query answered\n");
+		return 0;
+	case CMD_STAT:
+		/* May be preceded by the cardid to ask a particular card */
+		if (buflen == CARDID_LENGTH + KEYSIZE/8)
+			card = pickcard (buf);
+		else if (buflen == KEYSIZE/8)
+			card = pickcard (NULL);
+		else
+			err = ERR_BADINPUT;
+		break;
+	case CMD_SIGN:
+		if (buflen < CARDID_LENGTH
+				|| (buflen-CARDID_LENGTH) <= KEYSIZE/8
+				|| (buflen-CARDID_LENGTH) % 4 != 0)
+			err = ERR_BADINPUT;
+		else
+			card = pickcard (buf);
+		break;
+	default:
+		err = ERR_UNKNOWNCMD;
+		break;
+	}
 
-			if (rb.Status != 0)
-			{
-				printf ("Card reports error, code is %d\n", rb.Status);
-				close (s1);
-				continue;
-			}
+	if (err == 0 && ((job = calloc (1, sizeof(*job))) == NULL
+			|| (job->buf = malloc (buflen)) == NULL))
+	{
+		free (job);
+		err = ERR_NOMEM;
+	}
+	if (err != 0)
+	{
+		if (!c->v2)
+			return -1;
+		connreply (c, reqid, -err, NULL, 0);
+		return 0;
+	}
 
-			/* Return reply to the client */
-			send (s1, bigbuf, rb.InBufferLength[0], 0);
-			close (s1);
+	memcpy (job->buf, buf, buflen);
+	job->buflen = buflen;
+	job->cmd = cmd;
+	job->reqid = reqid;
+	job->conn = c;
+	job->card = card;
+	c->pending++;
+	card->load++;
+
+	pthread_mutex_lock (&qlock);
+	if (card->jobtail)
+		card->jobtail->next = job;
+	else
+		card->jobhead = job;
+	card->jobtail = job;
+	pthread_cond_signal (&card->cond);
+	pthread_mutex_unlock (&qlock);
+	return 0;
+}
+
+/* Queue the status and reply data for a request */
+static void
+connreply (struct conn *c, unsigned long reqid, long status,
+	unsigned char *data, unsigned len)
+{
+	unsigned		hdr[3];
+
+	if (status != 0)
+		len = 0;
+	if (c->v2)
+	{
+		hdr[0] = htonl (reqid);
+		hdr[1] = htonl (status);
+		hdr[2] = htonl (len);
+		connqueue (c, (unsigned char *)hdr, V2_REPLYHDRSIZE, data, len);
+	} else {
+		/* Send card status preceding reply message if any */
+		hdr[0] = htonl (status);
+		connqueue (c, (unsigned char *)hdr, sizeof(hdr[0]), data, len);
+	}
+}
+
+/* Take back requests the card has finished and queue their replies */
+static void
+jobsdone ()
+{
+	struct job		*job, *jobnext;
+	struct conn		*c;
+	char			drain[64];
+
+	while (read (wakefd[0], drain, sizeof(drain)) > 0)
+		;
+	pthread_mutex_lock (&qlock);
+	job = donehead;
+	donehead = donetail = NULL;
+	pthread_mutex_unlock (&qlock);
+
+	for ( ; job != NULL; job = jobnext)
+	{
+		jobnext = job->next;
+		c = job->conn;
+		c->pending--;
+		job->card->load--;
+		if (job->status != 0)
+			printf ("Card reports error, code is %d\n", (int)job->status);
+		else if (job->cmd == CMD_STAT)
+			printf ("Status query answered\n");
+		else
 			printf ("Sign request handled\n");
+
+		if (!c->closed)
+		{
+			connreply (c, job->reqid, job->status, job->reply,
+					job->replylen);
+			connwrite (c);
+			/* May have been waiting on us to take more requests */
+			if (!c->closed)
+				connparse (c);
+		}
+		free (job->reply);
+		free (job);
+	}
+}
+
+/* Add a reply for the client, in two pieces for convenience */
+static void
+connqueue (struct conn *c, unsigned char *data1, unsigned len1,
+	unsigned char *data2, unsigned len2)
+{
+	struct outbuf	*ob;
+
+	if ((ob = malloc (sizeof(*ob) + len1 + len2)) == NULL)
+	{
+		connclose (c);
+		return;
+	}
+	ob->next = NULL;
+	ob->len = len1 + len2;
+	ob->off = 0;
+	memcpy (ob->data, data1, len1);
+	if (len2)
+		memcpy (ob->data + len1, data2, len2);
+	if (c->outtail)
+		c->outtail->next = ob;
+	else
+		c->outhead = ob;
+	c->outtail = ob;
+	connevents (c);
+}
+
+/* Write as much as the socket will take */
+static void
+connwrite (struct conn *c)
+{
+	struct outbuf	*ob;
+	int				err;
+
+	while ((ob = c->outhead) != NULL)
+	{
+		err = send (c->s, ob->data + ob->off, ob->len - ob->off, MSG_NOSIGNAL);
+		if (err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+				|| errno == EINTR))
 			break;
-		default:
-			free (buf);
-			close (s1);
-			break;
+		if (err <= 0)
+		{
+			connclose (c);
+			return;
 		}
-		fflush (stdout);
+		c->lastio = time(NULL);
+		ob->off += err;
+		if (ob->off < ob->len)
+			continue;
+		c->outhead = ob->next;
+		if (c->outhead == NULL)
+			c->outtail = NULL;
+		free (ob);
 	}
+	if (c->outhead == NULL && c->done && c->pending == 0)
+		connclose (c);
+	else
+		connevents (c);
+}
 
-	/* never gets here */
+/* Set epoll interest to match what the connection is waiting for */
+static void
+connevents (struct conn *c)
+{
+	struct epoll_event	ev;
+	int					want;
+
+	if (c->closed)
+		return;
+	want = (c->done || c->pending >= MAXPIPELINE) ? 0 : EPOLLIN;
+	if (c->outhead)
+		want |= EPOLLOUT;
+	if (want == c->events)
+		return;
+	memset (&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.ptr = c;
+	epoll_ctl (epfd, EPOLL_CTL_MOD, c->s, &ev);
+	c->events = want;
+}
 
-	if ((rc = sccCloseAdapter(handle)) != 0)
+static void
+connclose (struct conn *c)
+{
+	struct outbuf	*ob;
+
+	if (c->closed)
+		return;
+	epoll_ctl (epfd, EPOLL_CTL_DEL, c->s, NULL);
+	close (c->s);
+	c->closed = 1;
+	while ((ob = c->outhead) != NULL)
 	{
-		printf("sccCloseAdapter failed rc = 0x%x\n",rc);
+		c->outhead = ob->next;
+		free (ob);
+	}
+	c->outtail = NULL;
+	free (c->inbuf);
+	c->inbuf = NULL;
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		connlist = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	nconns--;
+
+	/*
+	 * Others may still point at it: the card if it has a request from
+	 * this client, or later events from this epoll_wait.  Free it at
+	 * the end of the main loop.
+	 */
+	c->prev = NULL;
+	c->next = zombielist;
+	if (zombielist)
+		zombielist->prev = c;
+	zombielist = c;
+}
+
+
+/* Show how the DB buffer pools did, to help size them */
+static void
+printcachestats ()
+{
+	struct dbcachestats	st;
+	struct card			*card;
+	int					i, j;
+
+	for (i=0; i<ncards; i++)
+	{
+		card = &cards[i];
+		for (j=0; j<card->numdbs; j++)
+		{
+			testdb_cachestats (card->db[j], &st);
+			printf ("Adapter %d DB %d: %lu hits, %lu misses, %lu evictions, "
+					"%lu writebacks, %d inner and %d leaf nodes cached\n",
+					card->cnum, j, st.hits, st.misses, st.evictions,
+					st.writebacks, st.inner, st.leaves);
+		}
+	}
+}
+
+/*
+ * A card thread.  Take requests for its card one at a time and run
+ * them, then hand them back to the main thread.
+ */
+static void *
+cardthread (void *arg)
+{
+	struct card		*card = arg;
+	struct job		*job;
+	unsigned char	*cardbuf;
+
+	if ((cardbuf = malloc (CHAINSIZE)) == NULL)
+	{
+		fprintf (stderr, "Out of memory\n");
+		exit (2);
+	}
+
+	for ( ; ; )
+	{
+		pthread_mutex_lock (&qlock);
+		while (card->jobhead == NULL && !interruptflag)
+			pthread_cond_wait (&card->cond, &qlock);
+		if (interruptflag)
+		{
+			/* The last card to finish its request takes us down */
+			if (++nstopped == ncards)
+			{
+				printf ("Interrupted by signal, exiting...\n");
+				printcachestats ();
+				exit (0);
+			}
+			pthread_mutex_unlock (&qlock);
+			return NULL;
+		}
+		job = card->jobhead;
+		card->jobhead = job->next;
+		if (card->jobhead == NULL)
+			card->jobtail = NULL;
+		pthread_mutex_unlock (&qlock);
+
+		job->next = NULL;
+		if (job->cmd == CMD_STAT)
+			cardstat (card, job, cardbuf);
+		else
+			cardsign (card, job, cardbuf);
+		free (job->buf);
+		job->buf = NULL;
+
+		pthread_mutex_lock (&qlock);
+		if (donetail)
+			donetail->next = job;
+		else
+			donehead = job;
+		donetail = job;
+		pthread_mutex_unlock (&qlock);
+		write (wakefd[1], "", 1);
+	}
+	return NULL;
+}
+
+/* Keep a copy of the card's reply for the client */
+static void
+savereply (struct job *job, unsigned char *cardbuf, unsigned long len)
+{
+	if (job->status != 0)
+		return;
+	if ((job->reply = malloc (len)) == NULL)
+	{
+		job->status = -ERR_NOMEM;
+		return;
+	}
+	memcpy (job->reply, cardbuf, len);
+	job->replylen = len;
+}
+
+static void
+cardstat (struct card *card, struct job *job, unsigned char *cardbuf)
+{
+	sccRB_t			rb;
+	long			rc;
+
+	memset (&rb, 0, sizeof(rb));
+	rb.AgentID				= agentID;
+	rb.OutBufferLength[0]	= KEYSIZE / 8;
+	rb.pOutBuffer[0]		= job->buf + job->buflen - KEYSIZE / 8;
+	rb.InBufferLength[0]	= CHAINSIZE;
+	rb.pInBuffer[0]			= cardbuf;
+	rb.UserDefined			= CMD_STAT;
+
+	if ((rc = _sccRequest(card->handle,&rb)) != 0)
+	{
+		printf("sccRequest failed rc = 0x%x\n",rc);
+		sccCloseAdapter(card->handle);
 		exit(1);
 	}
+	job->status = rb.Status;
+	savereply (job, cardbuf, rb.InBufferLength[0]);
+}
+
+/* Copy the DB proof so the DB lock need not be held while the card checks it */
+static int
+saveproof (struct card *card, unsigned char **proof, unsigned prooflen)
+{
+	unsigned char	*p;
 
+	if (UP4(prooflen) > card->proofsize)
+	{
+		if ((p = realloc (card->proof, UP4(prooflen))) == NULL)
+			return -1;
+		card->proof = p;
+		card->proofsize = UP4(prooflen);
+	}
+	memcpy (card->proof, *proof, prooflen);
+	*proof = card->proof;
+	return 0;
+}
+
+static void
+cardsign (struct card *card, struct job *job, unsigned char *cardbuf)
+{
+	sccRB_t			rb;
+	long			rc;
+	int				found;
+	unsigned char	*proof;
+	unsigned 		prooflen;
+	unsigned char	roothashbuf[DBBATCHMAX*HASHSIZE];
+	unsigned int	fileid[DBBATCHMAX];
+	dbproof			*dbs[DBBATCHMAX];
+	int				nhash;
+	int				i;
+	unsigned char	*buf = job->buf;
+	unsigned		buflen = job->buflen;
+
+	memset (&rb, 0, sizeof(rb));
+	rb.AgentID				= agentID;
+	rb.OutBufferLength[0]	= KEYSIZE / 8;
+	rb.pOutBuffer[0]		= buf + CARDID_LENGTH;
+	rb.OutBufferLength[1]	= buflen - (KEYSIZE / 8) - CARDID_LENGTH;
+	rb.pOutBuffer[1]		= buf + (KEYSIZE / 8) + CARDID_LENGTH;
+	rb.InBufferLength[0]	= CHAINSIZE;
+	rb.pInBuffer[0]			= cardbuf;
+	rb.InBufferLength[1]	= sizeof(roothashbuf);
+	rb.pInBuffer[1]			= roothashbuf;
+	rb.InBufferLength[2]	= sizeof(fileid);
+	rb.pInBuffer[2]			= fileid;
+	rb.UserDefined			= CMD_SIGN;
+
+	if ((rc = _sccRequest(card->handle,&rb)) != 0)
+	{
+		printf("sccRequest failed rc = 0x%x\n",rc);
+		sccCloseAdapter(card->handle);
+		exit(1);
+	}
+
+	/* Handle database queries from card, for one hash or a batch */
+	while (rb.Status == -ERR_DBQUERY || rb.Status == -ERR_DBBATCHQUERY)
+	{
+		/* We expect to get hashes and a fileid for each back */
+		nhash = rb.InBufferLength[0] / HASHSIZE;
+		if (nhash == 0 || nhash > DBBATCHMAX
+				|| rb.InBufferLength[0] != nhash * HASHSIZE
+				|| rb.InBufferLength[2] != nhash * sizeof(fileid[0])
+				|| (rb.Status == -ERR_DBQUERY && nhash != 1))
+		{
+			printf ("Error, answer back length is %d\n",
+					rb.InBufferLength[0]);
+			exit (2);
+		}
+
+		/* Now we query our database to see if the items are present */
+		for (i=0; i<nhash; i++)
+		{
+			if (fileid[i] >= card->numdbs)
+				break;
+			dbs[i] = card->db[fileid[i]];
+		}
+		if (i < nhash)
+		{
+			printf ("Error, card asked for fileid %d\n", fileid[i]);
+			prooflen = 0;
+			proof = NULL;
+			found = 1;
+		} else {
+			/* No lock, the DBs are this card's and we are its thread */
+			if (rb.Status == -ERR_DBQUERY)
+				found = testdbandset (dbs[0], &proof, &prooflen, cardbuf);
+			else
+				found = testdbandsetbatch (dbs, nhash, &proof, &prooflen,
+						cardbuf);
+			if (found < 0 || saveproof (card, &proof, prooflen) < 0)
+			{
+				printf ("Out of memory for DB proof\n");
+				exit (2);
+			}
+		}
+
+		/* Send the proof */
+		memset (&rb, 0, sizeof(rb));
+		rb.AgentID				= agentID;
+		rb.OutBufferLength[0]	= sizeof(prooflen);
+		rb.pOutBuffer[0]		= &prooflen;
+		rb.OutBufferLength[1]	= UP4(prooflen);
+		rb.pOutBuffer[1]		= proof;
+
+		/* Get back the card's official answer */
+		rb.InBufferLength[0]	= CHAINSIZE;
+		rb.pInBuffer[0]			= cardbuf;
+		rb.InBufferLength[1]	= sizeof(roothashbuf);
+		rb.pInBuffer[1]			= roothashbuf;
+		rb.InBufferLength[2]	= sizeof(fileid);
+		rb.pInBuffer[2]			= fileid;
+		rb.UserDefined			= CMD_DBAUTH;
+
+		if ((rc = _sccRequest(card->handle,&rb)) != 0)
+		{
+			printf("sccRequest failed rc = 0x%x\n",rc);
+			sccCloseAdapter(card->handle);
+			exit(1);
+		}
+	}
+
+	job->status = rb.Status;
+	savereply (job, cardbuf, rb.InBufferLength[0]);
 }
 
 
@@ -843,26 +1747,6 @@ dumpbuf (unsigned char *buf, int len)
 }
 
 
-/* Read until we reach count bytes, or error */
-static int
-nread (int fd, void *buf, unsigned count)
-{
-	unsigned char *cbuf = buf;
-	int err, nr = 0;
-
-	while (nr < count)
-	{
-		alarm (TIMEOUTSECS);
-		alarmflag = 0;
-		err = recv (fd, cbuf+nr, count-nr, 0);
-		alarm (0);
-		if (alarmflag || err <= 0)
-			return nr;
-		nr += err;
-	}
-	return nr;
-}
-
 #if 0
 static int
 dostat ()
@@ -942,29 +1826,3 @@ inthandler (int signum)
 	signal (signum, SIG_IGN);
 	interruptflag = 1;
 }
-
-static void
-alarmhandler (int signum)
-{
-	alarmflag = 1;
-	printf ("(timed out)\n");
-}
-
-/* Block or unblock signals */
-static void
-blocksigs (int blockflag)
-{
-	if (blockflag)
-	{
-		signal (SIGINT, inthandler);
-		signal (SIGTERM, inthandler);
-	} else {
-		if (interruptflag)
-		{
-			printf ("Interrupted by signal, exiting...\n");
-			exit (0);
-		}
-		signal (SIGINT, SIG_DFL);
-		signal (SIGTERM, SIG_DFL);
-	}
-}
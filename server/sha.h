@@ -37,7 +37,7 @@ extern "C" {
 #endif
 
 /* Make sure you define these types for your architecture: */
-typedef unsigned long sha1_quadbyte;     /* 4 byte type */
+typedef unsigned int sha1_quadbyte;      /* 4 byte type */
 typedef unsigned char sha1_byte;	/* single byte type */
 
 /*
@@ -45,7 +45,8 @@ typedef unsigned char sha1_byte;	/* single byte type */
  * x86 based FreeBSD box, I define LITTLE_ENDIAN and use the type
  * "unsigned long" for the quadbyte.  On FreeBSD on the Alpha, however,
  * while I still use LITTLE_ENDIAN, I must define the quadbyte type
- * as "unsigned int" instead.
+ * as "unsigned int" instead.  "unsigned int" is 4 bytes on every
+ * target we build for, including 64 bit Linux where long is not.
  */
 
 #define SHA1_BLOCK_LENGTH	64
@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "sha.h"
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -52,12 +53,18 @@ typedef union _BYTE64QUAD16 {
 	sha1_quadbyte l[16];
 } BYTE64QUAD16;
 
+/* The rounds need 32 bit words, so refuse to build with any other size */
+typedef char sha1_quadbyte_is_4_bytes[sizeof(sha1_quadbyte) == 4 ? 1 : -1];
+
 /* Hash a single 512-bit block. This is the core of the algorithm. */
 void SHA1_Transform(sha1_quadbyte state[5], sha1_byte buffer[64]) {
 	sha1_quadbyte	a, b, c, d, e;
+	BYTE64QUAD16	workspace;
 	BYTE64QUAD16	*block;
 
-	block = (BYTE64QUAD16*)buffer;
+	/* Expand in a copy, so SHA1_Update never rewrites the caller's data */
+	block = &workspace;
+	memcpy(block, buffer, 64);
 	/* Copy context->state[] to working vars */
 	a = state[0];
 	b = state[1];